@@ -0,0 +1,982 @@
+/*
+ * usbctl-bench - HTTP load generator for usbctl
+ *
+ * Build: make bench
+ *        (or: gcc -O2 -o usbctl-bench usbctl-bench.c -lpthread -Wall -Wextra)
+ * Usage: ./usbctl-bench [options] [HOST:PORT]
+ *
+ * Drives a weighted mix of requests against a running instance, either
+ * closed-loop (every connection sends its next request as soon as the
+ * previous one is answered) or at a fixed request rate, and holds a number
+ * of /events subscriptions open alongside. Prints throughput, latency
+ * percentiles, errors and the server's RSS and thread count every interval,
+ * then a per-request summary.
+ *
+ * With --check it instead runs protocol regression checks against the
+ * server and exits non-zero when one fails.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// The server's port; make bench passes the value from usbctl.c
+#ifndef DEFAULT_PORT
+#define DEFAULT_PORT 11980
+#endif
+#define MAX_CONNECTIONS 1024
+#define MAX_SUBSCRIBERS 1024
+#define MAX_BUSIDS 64
+#define LAT_BUCKETS 640
+#define RESPONSE_HEAD_SIZE 8192
+
+// Request kinds of the mix; bind requests alternate bind and unbind per
+// connection so the device ends where it started
+typedef enum {
+    OP_INDEX = 0,
+    OP_DEVICES,
+    OP_FAVICON,
+    OP_BIND,
+    OP_UNBIND,
+    OP_COUNT
+} op_t;
+
+static const char *const OP_NAMES[OP_COUNT] = {"index", "devices", "favicon", "bind", "unbind"};
+static const char *const OP_PATHS[OP_COUNT] = {"/", "/api/devices", "/favicon.ico", "/bind", "/unbind"};
+
+// Log-linear latency histogram in microseconds: exact below 16 us, then 16
+// buckets per power of two (under 7% error)
+typedef struct {
+    unsigned long long buckets[LAT_BUCKETS];
+    unsigned long long count;
+    unsigned long long max_us;
+} latency_t;
+
+// Counters of one connection; only its thread writes them, the reporter
+// reads them with relaxed loads
+typedef struct {
+    unsigned long long requests[OP_COUNT];
+    unsigned long long errors[OP_COUNT];
+    unsigned long long status[6];      // 0: connect or I/O error, 1..5: 1xx..5xx
+    unsigned long long throttled;      // 429 and 503 from admission control
+    unsigned long long reconnects;
+    latency_t latency[OP_COUNT];
+} bench_stats_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    unsigned long long period_ns;
+    unsigned long long first_ns;
+    bench_stats_t stats;
+} worker_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    volatile int connected;
+    unsigned long long events;
+    unsigned long long bytes;
+    unsigned long long reconnects;
+} subscriber_t;
+
+// Options
+static struct sockaddr_in g_addr;
+static char g_host[80] = "";
+static int g_connections = 8;
+static int g_subscribers = 0;
+static double g_rate = 0;
+static int g_duration = 10;
+static int g_interval = 1;
+static int g_server_pid = 0;
+static int g_weights[OP_COUNT] = {2, 6, 1, 1, 0};
+static int g_weight_total = 0;
+static char g_busids[MAX_BUSIDS][16];
+static int g_busid_count = 0;
+
+static volatile int g_stop = 0;
+static worker_t *g_workers = NULL;
+static subscriber_t *g_subs = NULL;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void sleep_ns(unsigned long long ns) {
+    struct timespec ts = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !g_stop) {
+    }
+}
+
+static void counter_add(unsigned long long *counter, unsigned long long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static unsigned long long counter_get(const unsigned long long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// ============================================================================
+// LATENCY HISTOGRAMS
+// ============================================================================
+
+static int latency_bucket(unsigned long long us) {
+    if (us < 16) return (int)us;
+    int e = 63 - __builtin_clzll(us);
+    int bucket = (e - 3) * 16 + (int)((us >> (e - 4)) & 15);
+    return bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1;
+}
+
+// Upper bound of a bucket, in microseconds
+static unsigned long long latency_bucket_value(int bucket) {
+    if (bucket < 16) return (unsigned long long)bucket;
+    int e = bucket / 16 + 3;
+    return ((16ULL + (unsigned long long)(bucket % 16) + 1) << (e - 4)) - 1;
+}
+
+static void latency_record(latency_t *h, unsigned long long us) {
+    counter_add(&h->buckets[latency_bucket(us)], 1);
+    counter_add(&h->count, 1);
+    if (us > h->max_us) __atomic_store_n(&h->max_us, us, __ATOMIC_RELAXED);
+}
+
+static void latency_merge(latency_t *total, const latency_t *h) {
+    for (int i = 0; i < LAT_BUCKETS; i++) total->buckets[i] += counter_get(&h->buckets[i]);
+    total->count += counter_get(&h->count);
+    unsigned long long max = counter_get(&h->max_us);
+    if (max > total->max_us) total->max_us = max;
+}
+
+// The value at quantile q (0..1), in microseconds
+static unsigned long long latency_quantile(const latency_t *h, double q) {
+    if (h->count == 0) return 0;
+    unsigned long long rank = (unsigned long long)(q * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            unsigned long long value = latency_bucket_value(i);
+            return value < h->max_us ? value : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void format_us(char *out, size_t size, unsigned long long us) {
+    if (us < 1000) {
+        snprintf(out, size, "%lluus", us);
+    } else if (us < 1000000) {
+        snprintf(out, size, "%.2fms", us / 1000.0);
+    } else {
+        snprintf(out, size, "%.2fs", us / 1000000.0);
+    }
+}
+
+// ============================================================================
+// HTTP CLIENT
+// ============================================================================
+
+static int bench_connect(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {30, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Value of a header in a response head, case-insensitively, or NULL
+static const char *header_value(const char *head, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = strstr(head, "\r\n"); p; p = strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, name, len) == 0 && p[2 + len] == ':') {
+            const char *value = p + 3 + len;
+            while (*value == ' ') value++;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// Read one response and discard its body. Returns the status code, or 0 on
+// an I/O or protocol error; *keep_alive says whether the connection is
+// still usable. Bodies are length-delimited or run to the end of the
+// connection (the server answers these routes without chunking).
+static int read_response(int fd, int *keep_alive) {
+    char head[RESPONSE_HEAD_SIZE];
+    size_t len = 0;
+    char *end = NULL;
+    *keep_alive = 0;
+    while (!end) {
+        if (len == sizeof(head) - 1) return 0;
+        ssize_t n = recv(fd, head + len, sizeof(head) - 1 - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        len += (size_t)n;
+        head[len] = '\0';
+        end = strstr(head, "\r\n\r\n");
+    }
+
+    int status = 0;
+    if (sscanf(head, "HTTP/1.%*d %d", &status) != 1) return 0;
+    size_t header_len = (size_t)(end - head) + 4;
+    size_t have = len - header_len;
+    *end = '\0';
+
+    const char *connection = header_value(head, "Connection");
+    const char *length = header_value(head, "Content-Length");
+    int close_after = connection && strncasecmp(connection, "close", 5) == 0;
+    if (!length) {
+        char scratch[16384];
+        ssize_t n;
+        while ((n = recv(fd, scratch, sizeof(scratch), 0)) > 0) {
+        }
+        return status;
+    }
+
+    size_t body = (size_t)strtoull(length, NULL, 10);
+    while (have < body) {
+        char scratch[16384];
+        size_t want = body - have < sizeof(scratch) ? body - have : sizeof(scratch);
+        ssize_t n = recv(fd, scratch, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        have += (size_t)n;
+    }
+    *keep_alive = !close_after;
+    return status;
+}
+
+// One request on a fresh connection with the whole body kept; for the
+// startup device list and /metrics sampling. Returns a malloc'd body.
+static char *http_fetch(const char *path) {
+    int fd = bench_connect();
+    if (fd < 0) return NULL;
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: usbctl-bench\r\nConnection: close\r\n\r\n",
+                       path, g_host);
+    if (!send_all(fd, request, (size_t)len)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = 65536, total = 0;
+    char *buf = malloc(size);
+    ssize_t n;
+    while (buf && (n = recv(fd, buf + total, size - 1 - total, 0)) > 0) {
+        total += (size_t)n;
+        if (total == size - 1) {
+            char *grown = realloc(buf, size * 2);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            size *= 2;
+        }
+    }
+    close(fd);
+    if (!buf) return NULL;
+    buf[total] = '\0';
+    char *body = strstr(buf, "\r\n\r\n");
+    if (!body || strncmp(buf, "HTTP/1.1 200", 12) != 0) {
+        free(buf);
+        return NULL;
+    }
+    memmove(buf, body + 4, strlen(body + 4) + 1);
+    return buf;
+}
+
+// Bus ids of the devices the server lists, for the bind requests
+static void discover_busids(void) {
+    char *devices = http_fetch("/api/devices");
+    if (!devices) return;
+    for (const char *p = devices; (p = strstr(p, "\"busid\":\"")) != NULL && g_busid_count < MAX_BUSIDS;) {
+        p += 9;
+        size_t len = strcspn(p, "\"");
+        if (len > 0 && len < sizeof(g_busids[0])) {
+            memcpy(g_busids[g_busid_count], p, len);
+            g_busids[g_busid_count++][len] = '\0';
+        }
+        p += len;
+    }
+    free(devices);
+}
+
+// ============================================================================
+// LOAD
+// ============================================================================
+
+static op_t pick_op(unsigned int *seed, int *bound) {
+    int r = (int)(rand_r(seed) % (unsigned int)g_weight_total);
+    op_t op = OP_INDEX;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (r < g_weights[i]) {
+            op = (op_t)i;
+            break;
+        }
+        r -= g_weights[i];
+    }
+    if (op == OP_BIND) {
+        op = *bound ? OP_UNBIND : OP_BIND;
+        *bound = !*bound;
+    }
+    return op;
+}
+
+static int build_request(char *out, size_t size, op_t op, const char *busid) {
+    if (op == OP_BIND || op == OP_UNBIND) {
+        char body[64];
+        int body_len = snprintf(body, sizeof(body), "{\"busid\":\"%s\"}", busid);
+        return snprintf(out, size,
+                        "POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: usbctl-bench\r\n"
+                        "Content-Type: application/json\r\nContent-Length: %d\r\n\r\n%s",
+                        OP_PATHS[op], g_host, body_len, body);
+    }
+    return snprintf(out, size, "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: usbctl-bench\r\n\r\n",
+                    OP_PATHS[op], g_host);
+}
+
+// One connection. Closed-loop it sends back to back; at a fixed rate it
+// sends on its own schedule and measures from the scheduled time, so a
+// slow server shows up as latency instead of as a lower offered rate.
+static void *worker_thread(void *arg) {
+    worker_t *w = arg;
+    bench_stats_t *s = &w->stats;
+    unsigned int seed = (unsigned int)w->id * 2654435761u + 1;
+    const char *busid = g_busid_count ? g_busids[w->id % g_busid_count] : "";
+    unsigned long long next = w->first_ns;
+    int bound = 0;
+    int fd = -1;
+    char request[512];
+
+    while (!g_stop) {
+        unsigned long long scheduled = now_ns();
+        if (w->period_ns) {
+            if (next > scheduled) sleep_ns(next - scheduled);
+            if (g_stop) break;
+            scheduled = next;
+            next += w->period_ns;
+        }
+
+        op_t op = pick_op(&seed, &bound);
+        int len = build_request(request, sizeof(request), op, busid);
+        int status = 0, keep_alive = 0;
+        if (fd < 0) {
+            fd = bench_connect();
+            if (fd >= 0 && s->requests[0] + s->requests[1] + s->requests[2] + s->requests[3] + s->requests[4]) {
+                counter_add(&s->reconnects, 1);
+            }
+        }
+        if (fd >= 0 && send_all(fd, request, (size_t)len)) {
+            status = read_response(fd, &keep_alive);
+        }
+        unsigned long long elapsed = now_ns() - scheduled;
+        if (!keep_alive && fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+
+        counter_add(&s->requests[op], 1);
+        counter_add(&s->status[status >= 100 && status < 600 ? status / 100 : 0], 1);
+        if (status == 429 || status == 503) counter_add(&s->throttled, 1);
+        if (status == 0 || status >= 500) counter_add(&s->errors[op], 1);
+        latency_record(&s->latency[op], elapsed / 1000ULL);
+
+        // Don't spin on a server that refuses connections
+        if (status == 0 && !w->period_ns) sleep_ns(10000000ULL);
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+// Held-open /events subscription counting the events it receives;
+// reconnects when the server drops it
+static void *subscriber_thread(void *arg) {
+    subscriber_t *sub = arg;
+    char request[256];
+    int len = snprintf(request, sizeof(request),
+                       "GET /events HTTP/1.1\r\nHost: %s\r\nUser-Agent: usbctl-bench\r\nAccept: text/event-stream\r\n\r\n",
+                       g_host);
+    int attempts = 0;
+
+    while (!g_stop) {
+        int fd = bench_connect();
+        if (fd >= 0 && attempts++ > 0) counter_add(&sub->reconnects, 1);
+        if (fd < 0 || !send_all(fd, request, (size_t)len)) {
+            if (fd >= 0) close(fd);
+            sleep_ns(200000000ULL);
+            continue;
+        }
+        struct timeval tv = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        sub->connected = 1;
+
+        // "event:" may straddle two reads, so the tail of each is carried over
+        char buf[8192 + 8];
+        size_t carry = 0;
+        while (!g_stop) {
+            ssize_t n = recv(fd, buf + carry, sizeof(buf) - 8 - carry, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+            if (n <= 0) break;
+            counter_add(&sub->bytes, (unsigned long long)n);
+            size_t total = carry + (size_t)n;
+            buf[total] = '\0';
+            for (char *p = buf; (p = strstr(p, "\nevent:")) != NULL; p += 7) counter_add(&sub->events, 1);
+            carry = total < 6 ? total : 6;
+            memmove(buf, buf + total - carry, carry);
+        }
+        sub->connected = 0;
+        close(fd);
+        if (!g_stop) sleep_ns(200000000ULL);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// REPORTING
+// ============================================================================
+
+// Server RSS (bytes) and threads, from /proc with --pid or else /metrics
+static int sample_server(unsigned long long *rss, int *threads) {
+    *rss = 0;
+    *threads = 0;
+    if (g_server_pid > 0) {
+        char path[64], line[256];
+        snprintf(path, sizeof(path), "/proc/%d/status", g_server_pid);
+        FILE *fp = fopen(path, "r");
+        if (!fp) return 0;
+        while (fgets(line, sizeof(line), fp)) {
+            unsigned long long kb;
+            if (sscanf(line, "VmRSS: %llu kB", &kb) == 1) *rss = kb * 1024ULL;
+            sscanf(line, "Threads: %d", threads);
+        }
+        fclose(fp);
+        return 1;
+    }
+
+    char *metrics = http_fetch("/metrics");
+    if (!metrics) return 0;
+    const char *p = strstr(metrics, "\nprocess_resident_memory_bytes ");
+    if (p) *rss = strtoull(p + 31, NULL, 10);
+    p = strstr(metrics, "\nusbctl_process_threads ");
+    if (p) *threads = atoi(p + 24);
+    free(metrics);
+    return 1;
+}
+
+static void collect(bench_stats_t *total, latency_t *all) {
+    memset(total, 0, sizeof(*total));
+    memset(all, 0, sizeof(*all));
+    for (int i = 0; i < g_connections; i++) {
+        const bench_stats_t *s = &g_workers[i].stats;
+        for (int op = 0; op < OP_COUNT; op++) {
+            total->requests[op] += counter_get(&s->requests[op]);
+            total->errors[op] += counter_get(&s->errors[op]);
+            latency_merge(&total->latency[op], &s->latency[op]);
+            latency_merge(all, &s->latency[op]);
+        }
+        for (int c = 0; c < 6; c++) total->status[c] += counter_get(&s->status[c]);
+        total->throttled += counter_get(&s->throttled);
+        total->reconnects += counter_get(&s->reconnects);
+    }
+}
+
+static unsigned long long sum_ops(const unsigned long long *v) {
+    unsigned long long sum = 0;
+    for (int op = 0; op < OP_COUNT; op++) sum += v[op];
+    return sum;
+}
+
+// One line per interval; latencies cover only that interval
+static void report_interval(double elapsed, const bench_stats_t *total, const latency_t *all,
+                            const bench_stats_t *prev, const latency_t *prev_all, double seconds) {
+    latency_t window;
+    memset(&window, 0, sizeof(window));
+    for (int i = 0; i < LAT_BUCKETS; i++) window.buckets[i] = all->buckets[i] - prev_all->buckets[i];
+    window.count = all->count - prev_all->count;
+    window.max_us = 0;
+    for (int i = LAT_BUCKETS - 1; i >= 0 && window.count; i--) {
+        if (window.buckets[i]) {
+            window.max_us = latency_bucket_value(i) < all->max_us ? latency_bucket_value(i) : all->max_us;
+            break;
+        }
+    }
+
+    unsigned long long requests = sum_ops(total->requests) - sum_ops(prev->requests);
+    unsigned long long errors = sum_ops(total->errors) - sum_ops(prev->errors);
+    unsigned long long throttled = total->throttled - prev->throttled;
+    unsigned long long events = 0;
+    int connected = 0;
+    for (int i = 0; i < g_subscribers; i++) {
+        events += counter_get(&g_subs[i].events);
+        connected += g_subs[i].connected;
+    }
+
+    char p50[16], p90[16], p99[16], max[16], server[32] = "-";
+    format_us(p50, sizeof(p50), latency_quantile(&window, 0.50));
+    format_us(p90, sizeof(p90), latency_quantile(&window, 0.90));
+    format_us(p99, sizeof(p99), latency_quantile(&window, 0.99));
+    format_us(max, sizeof(max), window.max_us);
+    unsigned long long rss;
+    int threads;
+    if (sample_server(&rss, &threads)) {
+        snprintf(server, sizeof(server), "%.1fMB/%d", rss / 1048576.0, threads);
+    }
+    printf("%6.1fs %9.1f %7llu %9llu %9s %9s %9s %9s %13s %5d %9llu\n", elapsed, requests / seconds, errors,
+           throttled, p50, p90, p99, max, server, connected, events);
+    fflush(stdout);
+}
+
+static void report_summary(const bench_stats_t *total, const latency_t *all, double seconds) {
+    unsigned long long requests = sum_ops(total->requests);
+    printf("\n%-9s %10s %8s %10s %9s %9s %9s %9s %9s\n", "request", "count", "errors", "req/s", "p50", "p90",
+           "p99", "p99.9", "max");
+    for (int op = 0; op <= OP_COUNT; op++) {
+        const latency_t *h = op < OP_COUNT ? &total->latency[op] : all;
+        unsigned long long count = op < OP_COUNT ? total->requests[op] : requests;
+        unsigned long long errors = op < OP_COUNT ? total->errors[op] : sum_ops(total->errors);
+        if (count == 0) continue;
+        char q[5][16];
+        format_us(q[0], sizeof(q[0]), latency_quantile(h, 0.50));
+        format_us(q[1], sizeof(q[1]), latency_quantile(h, 0.90));
+        format_us(q[2], sizeof(q[2]), latency_quantile(h, 0.99));
+        format_us(q[3], sizeof(q[3]), latency_quantile(h, 0.999));
+        format_us(q[4], sizeof(q[4]), h->max_us);
+        printf("%-9s %10llu %8llu %10.1f %9s %9s %9s %9s %9s\n", op < OP_COUNT ? OP_NAMES[op] : "all", count,
+               errors, count / seconds, q[0], q[1], q[2], q[3], q[4]);
+    }
+    printf("\nstatus: 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, I/O errors %llu; throttled %llu, reconnects %llu\n",
+           total->status[2], total->status[3], total->status[4], total->status[5], total->status[0],
+           total->throttled, total->reconnects);
+    if (g_subscribers > 0) {
+        unsigned long long events = 0, bytes = 0, reconnects = 0;
+        for (int i = 0; i < g_subscribers; i++) {
+            events += counter_get(&g_subs[i].events);
+            bytes += counter_get(&g_subs[i].bytes);
+            reconnects += counter_get(&g_subs[i].reconnects);
+        }
+        printf("events: %d subscribers received %llu events (%llu bytes), %llu reconnects\n", g_subscribers, events,
+               bytes, reconnects);
+    }
+}
+
+// ============================================================================
+// CHECKS
+// ============================================================================
+
+static int g_check_failures = 0;
+
+static void check_report(const char *name, int ok, const char *detail) {
+    printf("%-44s %s%s%s\n", name, ok ? "ok" : "FAIL", detail[0] ? "  " : "", detail);
+    if (!ok) g_check_failures++;
+}
+
+// One request on a fresh connection. Returns the status and the response
+// head in head; *trailing counts the bytes that followed it up to EOF.
+static int check_request(const char *method, const char *path, const char *extra, char *head, size_t size,
+                         size_t *trailing) {
+    int fd = bench_connect();
+    if (fd < 0) return 0;
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: usbctl-bench\r\n%sConnection: close\r\n\r\n",
+                       method, path, g_host, extra);
+    if (!send_all(fd, request, (size_t)len)) {
+        close(fd);
+        return 0;
+    }
+    size_t have = 0;
+    char *end = NULL;
+    ssize_t n;
+    while (!end && have < size - 1 && (n = recv(fd, head + have, size - 1 - have, 0)) > 0) {
+        have += (size_t)n;
+        head[have] = '\0';
+        end = strstr(head, "\r\n\r\n");
+    }
+    if (!end) {
+        close(fd);
+        return 0;
+    }
+    *trailing = have - (size_t)(end + 4 - head);
+    end[2] = '\0';
+    char scratch[16384];
+    while ((n = recv(fd, scratch, sizeof(scratch), 0)) > 0) *trailing += (size_t)n;
+    close(fd);
+    int status = 0;
+    sscanf(head, "HTTP/1.%*d %d", &status);
+    return status;
+}
+
+// HEAD must advertise the Content-Length GET sends, and send no body. The
+// device list can change between the two requests, so a mismatch is retried.
+static void check_head_length(const char *path, const char *extra, const char *label) {
+    char name[96], detail[128] = "";
+    snprintf(name, sizeof(name), "HEAD Content-Length %s%s", path, label);
+    int ok = 0;
+    for (int attempt = 0; attempt < 3 && !ok; attempt++) {
+        char get_head[RESPONSE_HEAD_SIZE], head_head[RESPONSE_HEAD_SIZE];
+        size_t get_body = 0, head_body = 0;
+        int get_status = check_request("GET", path, extra, get_head, sizeof(get_head), &get_body);
+        int head_status = check_request("HEAD", path, extra, head_head, sizeof(head_head), &head_body);
+        const char *get_length = header_value(get_head, "Content-Length");
+        const char *head_length = header_value(head_head, "Content-Length");
+        long long get_value = get_length ? atoll(get_length) : -1;
+        long long head_value = head_length ? atoll(head_length) : -1;
+        snprintf(detail, sizeof(detail), "GET %d length %lld, HEAD %d length %lld with %zu body bytes",
+                 get_status, get_value, head_status, head_value, head_body);
+        ok = get_status == 200 && head_status == 200 && get_value > 0 && get_value == head_value &&
+             head_body == 0;
+    }
+    check_report(name, ok, ok ? "" : detail);
+}
+
+// Open an h2c session with prior knowledge, start a batch of GET streams
+// and drop the connection while the server is still answering them
+static int h2_abort_session(int streams) {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static const char *const paths[] = {"/api/devices", "/metrics", "/"};
+    unsigned char buf[4096];
+    size_t len = sizeof(preface) - 1;
+    memcpy(buf, preface, len);
+    memset(buf + len, 0, 9);
+    buf[len + 3] = 0x4; // empty SETTINGS
+    len += 9;
+    for (int i = 0; i < streams && len + 128 < sizeof(buf); i++) {
+        const char *path = paths[i % 3];
+        size_t path_len = strlen(path), host_len = strlen(g_host);
+        unsigned char *frame = buf + len;
+        unsigned char *block = frame + 9;
+        size_t n = 0;
+        block[n++] = 0x82; // :method GET
+        block[n++] = 0x86; // :scheme http
+        block[n++] = 0x04; // :path, literal without indexing
+        block[n++] = (unsigned char)path_len;
+        memcpy(block + n, path, path_len);
+        n += path_len;
+        block[n++] = 0x01; // :authority, literal without indexing
+        block[n++] = (unsigned char)host_len;
+        memcpy(block + n, g_host, host_len);
+        n += host_len;
+        unsigned int id = 1 + 2 * (unsigned int)i;
+        frame[0] = 0;
+        frame[1] = (unsigned char)(n >> 8);
+        frame[2] = (unsigned char)n;
+        frame[3] = 0x1; // HEADERS
+        frame[4] = 0x5; // END_STREAM | END_HEADERS
+        frame[5] = (unsigned char)(id >> 24);
+        frame[6] = (unsigned char)(id >> 16);
+        frame[7] = (unsigned char)(id >> 8);
+        frame[8] = (unsigned char)id;
+        len += 9 + n;
+    }
+    int fd = bench_connect();
+    if (fd < 0) return 0;
+    int ok = send_all(fd, (const char *)buf, len);
+    close(fd);
+    return ok;
+}
+
+static void *h2_abort_thread(void *arg) {
+    int *sent = arg;
+    for (int i = 0; i < 50; i++) *sent += h2_abort_session(1 + i % 16);
+    return NULL;
+}
+
+// Connections closed with streams in flight must not take the server down
+static void check_h2_abort(void) {
+    pthread_t threads[8];
+    int sent[8] = {0}, total = 0;
+    for (int i = 0; i < 8; i++) pthread_create(&threads[i], NULL, h2_abort_thread, &sent[i]);
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        total += sent[i];
+    }
+    char head[RESPONSE_HEAD_SIZE], detail[64];
+    size_t body = 0;
+    int status = check_request("GET", "/api/devices", "", head, sizeof(head), &body);
+    snprintf(detail, sizeof(detail), "%d sessions sent, then GET /api/devices %d", total, status);
+    check_report("h2 close with streams in flight", total > 0 && status == 200, detail);
+}
+
+static int run_checks(void) {
+    printf("usbctl-bench: checking %s\n\n", g_host);
+    check_head_length("/", "", "");
+    check_head_length("/favicon.ico", "", "");
+    check_head_length("/api/devices", "", "");
+    check_head_length("/api/devices", "Accept-Encoding: gzip\r\n", " (gzip)");
+    discover_busids();
+    if (g_busid_count > 0) {
+        char path[64];
+        snprintf(path, sizeof(path), "/api/devices/%s", g_busids[0]);
+        check_head_length(path, "", "");
+    }
+
+    // Scrapes differ from one another, so only the HEAD itself is checked
+    char head[RESPONSE_HEAD_SIZE];
+    size_t body = 0;
+    int status = check_request("HEAD", "/metrics", "", head, sizeof(head), &body);
+    const char *length = status ? header_value(head, "Content-Length") : NULL;
+    check_report("HEAD Content-Length /metrics", status == 200 && length && atoll(length) > 0 && body == 0,
+                 "");
+    check_h2_abort();
+
+    printf("\n%s: %d failed\n", g_check_failures ? "FAIL" : "PASS", g_check_failures);
+    return g_check_failures ? 1 : 0;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+static void print_usage(void) {
+    printf("usbctl-bench - load generator for usbctl\n\n");
+    printf("Usage: usbctl-bench [OPTIONS] [HOST[:PORT]]   (default 127.0.0.1:%d)\n\n", DEFAULT_PORT);
+    printf("Options:\n");
+    printf("  -c, --connections N    Concurrent keep-alive connections (default: 8)\n");
+    printf("  -r, --rate RPS         Fixed total request rate; 0 runs closed-loop (default: 0)\n");
+    printf("  -d, --duration SEC     Test length (default: 10)\n");
+    printf("  -e, --events N         /events subscriptions held open (default: 0)\n");
+    printf("  -m, --mix SPEC         Request weights, e.g. devices=6,index=2,favicon=1,bind=1\n");
+    printf("                         (bind alternates POST /bind and /unbind; default bind=0)\n");
+    printf("  -b, --busid LIST       Comma-separated bus ids for bind (default: from /api/devices)\n");
+    printf("  -i, --interval SEC     Report interval (default: 1)\n");
+    printf("  -p, --pid PID          Read server RSS and threads from /proc instead of /metrics\n");
+    printf("  -k, --check            Run protocol regression checks instead of a load test\n");
+    printf("  -h, --help             Show this help\n\n");
+    printf("The server's per-client rate limits apply to the generator too; run it with\n");
+    printf("rate_cheap=0 and rate_expensive=0 in its config to measure raw capacity.\n");
+}
+
+static int parse_mix(const char *spec) {
+    int weights[OP_COUNT] = {0};
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (char *item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        if (!eq) return 0;
+        *eq = '\0';
+        int op = -1;
+        for (int i = 0; i < OP_BIND + 1; i++) {
+            if (strcmp(item, OP_NAMES[i]) == 0) op = i;
+        }
+        if (op < 0 || atoi(eq + 1) < 0) return 0;
+        weights[op] = atoi(eq + 1);
+    }
+    memcpy(g_weights, weights, sizeof(weights));
+    return 1;
+}
+
+static void parse_busids(const char *list) {
+    char copy[1024];
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char *item = strtok(copy, ","); item && g_busid_count < MAX_BUSIDS; item = strtok(NULL, ",")) {
+        snprintf(g_busids[g_busid_count++], sizeof(g_busids[0]), "%.15s", item);
+    }
+}
+
+static int parse_target(const char *target) {
+    char host[64];
+    int port = DEFAULT_PORT;
+    snprintf(host, sizeof(host), "%s", target);
+    char *colon = strrchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    if (strcmp(host, "localhost") == 0 || host[0] == '\0') snprintf(host, sizeof(host), "127.0.0.1");
+    memset(&g_addr, 0, sizeof(g_addr));
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons((unsigned short)port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, host, &g_addr.sin_addr) != 1) return 0;
+    snprintf(g_host, sizeof(g_host), "%s:%d", host, port);
+    return 1;
+}
+
+static void stop_handler(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *target = "127.0.0.1";
+    const char *busids = NULL;
+    int check = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (strcmp(arg, "-k") == 0 || strcmp(arg, "--check") == 0) {
+            check = 1;
+            continue;
+        } else if (arg[0] != '-') {
+            target = arg;
+            continue;
+        } else if (!value) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 1;
+        }
+        i++;
+        if (strcmp(arg, "-c") == 0 || strcmp(arg, "--connections") == 0) {
+            g_connections = atoi(value);
+        } else if (strcmp(arg, "-r") == 0 || strcmp(arg, "--rate") == 0) {
+            g_rate = atof(value);
+        } else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--duration") == 0) {
+            g_duration = atoi(value);
+        } else if (strcmp(arg, "-e") == 0 || strcmp(arg, "--events") == 0) {
+            g_subscribers = atoi(value);
+        } else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--mix") == 0) {
+            if (!parse_mix(value)) {
+                fprintf(stderr, "Bad mix '%s': use name=weight with index, devices, favicon, bind\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "-b") == 0 || strcmp(arg, "--busid") == 0) {
+            busids = value;
+        } else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--interval") == 0) {
+            g_interval = atoi(value);
+        } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--pid") == 0) {
+            g_server_pid = atoi(value);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 1;
+        }
+    }
+
+    if (!parse_target(target)) {
+        fprintf(stderr, "Bad target '%s': use an IPv4 HOST[:PORT]\n", target);
+        return 1;
+    }
+    if (check) {
+        signal(SIGPIPE, SIG_IGN);
+        return run_checks();
+    }
+    if (g_connections < 1 || g_connections > MAX_CONNECTIONS || g_subscribers < 0 ||
+        g_subscribers > MAX_SUBSCRIBERS || g_duration < 1 || g_interval < 1 || g_rate < 0) {
+        fprintf(stderr, "Out of range: connections 1-%d, events 0-%d, duration and interval >= 1\n",
+                MAX_CONNECTIONS, MAX_SUBSCRIBERS);
+        return 1;
+    }
+
+    if (g_weights[OP_BIND] > 0) {
+        if (busids) {
+            parse_busids(busids);
+        } else {
+            discover_busids();
+        }
+        if (g_busid_count == 0) {
+            fprintf(stderr, "No bus ids for bind requests; dropping them from the mix\n");
+            g_weights[OP_BIND] = 0;
+        }
+    }
+    for (int i = 0; i < OP_COUNT; i++) g_weight_total += g_weights[i];
+    if (g_weight_total == 0) {
+        fprintf(stderr, "The request mix is empty\n");
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    g_workers = calloc((size_t)g_connections, sizeof(worker_t));
+    g_subs = calloc((size_t)(g_subscribers ? g_subscribers : 1), sizeof(subscriber_t));
+    if (!g_workers || !g_subs) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("usbctl-bench: %s, %d connections, %s, %d s, %d event subscribers\n", g_host, g_connections,
+           g_rate > 0 ? "fixed rate" : "closed loop", g_duration, g_subscribers);
+    printf("mix:");
+    for (int i = 0; i <= OP_BIND; i++) {
+        if (g_weights[i]) printf(" %s=%d", OP_NAMES[i], g_weights[i]);
+    }
+    if (g_rate > 0) printf("; %.1f req/s", g_rate);
+    printf("\n\n%7s %9s %7s %9s %9s %9s %9s %9s %13s %5s %9s\n", "time", "req/s", "errors", "throttled", "p50",
+           "p90", "p99", "max", "server rss/thr", "subs", "events");
+
+    for (int i = 0; i < g_subscribers; i++) {
+        g_subs[i].id = i;
+        pthread_create(&g_subs[i].thread, NULL, subscriber_thread, &g_subs[i]);
+    }
+    unsigned long long start = now_ns();
+    for (int i = 0; i < g_connections; i++) {
+        worker_t *w = &g_workers[i];
+        w->id = i;
+        if (g_rate > 0) {
+            // Each connection carries an equal share, staggered across one period
+            w->period_ns = (unsigned long long)(1e9 * g_connections / g_rate);
+            w->first_ns = start + w->period_ns * (unsigned long long)i / (unsigned long long)g_connections;
+        }
+        pthread_create(&w->thread, NULL, worker_thread, w);
+    }
+
+    bench_stats_t *prev = calloc(1, sizeof(bench_stats_t));
+    bench_stats_t *total = calloc(1, sizeof(bench_stats_t));
+    latency_t *prev_all = calloc(1, sizeof(latency_t));
+    latency_t *all = calloc(1, sizeof(latency_t));
+    if (!prev || !total || !prev_all || !all) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    unsigned long long end = start + (unsigned long long)g_duration * 1000000000ULL;
+    unsigned long long last = start;
+    while (!g_stop) {
+        unsigned long long next = last + (unsigned long long)g_interval * 1000000000ULL;
+        if (next > end) next = end;
+        unsigned long long now = now_ns();
+        if (next > now) sleep_ns(next - now);
+        now = now_ns();
+        collect(total, all);
+        report_interval((now - start) / 1e9, total, all, prev, prev_all, (now - last) / 1e9);
+        memcpy(prev, total, sizeof(*total));
+        memcpy(prev_all, all, sizeof(*all));
+        last = now;
+        if (now >= end) g_stop = 1;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    for (int i = 0; i < g_connections; i++) pthread_join(g_workers[i].thread, NULL);
+    for (int i = 0; i < g_subscribers; i++) pthread_join(g_subs[i].thread, NULL);
+    collect(total, all);
+    report_summary(total, all, seconds);
+    return 0;
+}
@@ -35,6 +35,10 @@
 #endif
 typedef void (*sighandler_t)(int);
 #define signal_compat(sig, handler) signal(sig, handler)
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
 #else
 #define PLATFORM_UNIX
 #ifndef _GNU_SOURCE
@@ -43,25 +47,97 @@ typedef void (*sighandler_t)(int);
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #define signal_compat(sig, handler) signal(sig, handler)
 #endif
 
 // Common headers
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+// The sampling profiler needs glibc's backtrace() and an ELF symbol table
+#if defined(__linux__) && defined(__GLIBC__)
+#define HAVE_PROFILER
+#include <elf.h>
+#include <execinfo.h>
+#endif
+
+// Static probes for bpftrace and SystemTap (usdt:build/usbctl:usbctl:<name>).
+// Each site is a single nop plus a .note.stapsdt entry laid out as
+// <sys/sdt.h> does, written out here so no header is needed at build time.
+// Arguments are widened to long; strings are passed as pointers.
+#if defined(__linux__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__) || defined(__i386__))
+#ifdef __LP64__
+#define SDT_ADDR ".8byte "
+#else
+#define SDT_ADDR ".4byte "
+#endif
+#define SDT_NOTE(name, args)                                                    \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: " SDT_ADDR "990b\n"                                                   \
+    SDT_ADDR "_.stapsdt.base\n"                                                 \
+    SDT_ADDR "0\n"                                                              \
+    ".asciz \"usbctl\"\n"                                                       \
+    ".asciz \"" #name "\"\n"                                                    \
+    ".asciz \"" args "\"\n"                                                     \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"
+#define SDT_ARG(n) "%n[s" #n "]@%[a" #n "]"
+#define SDT_OPERAND(n, x) [s##n] "n"((int)sizeof(long)), [a##n] "nor"((long)(x))
+#define USBCTL_PROBE0(name) __asm__ __volatile__(SDT_NOTE(name, ""))
+#define USBCTL_PROBE1(name, a) \
+    __asm__ __volatile__(SDT_NOTE(name, SDT_ARG(1)) : : SDT_OPERAND(1, a))
+#define USBCTL_PROBE2(name, a, b) \
+    __asm__ __volatile__(SDT_NOTE(name, SDT_ARG(1) " " SDT_ARG(2)) : : SDT_OPERAND(1, a), SDT_OPERAND(2, b))
+#define USBCTL_PROBE3(name, a, b, c)                                                     \
+    __asm__ __volatile__(SDT_NOTE(name, SDT_ARG(1) " " SDT_ARG(2) " " SDT_ARG(3))       \
+                         : : SDT_OPERAND(1, a), SDT_OPERAND(2, b), SDT_OPERAND(3, c))
+#define USBCTL_PROBE4(name, a, b, c, d)                                                            \
+    __asm__ __volatile__(SDT_NOTE(name, SDT_ARG(1) " " SDT_ARG(2) " " SDT_ARG(3) " " SDT_ARG(4)) \
+                         : : SDT_OPERAND(1, a), SDT_OPERAND(2, b), SDT_OPERAND(3, c), SDT_OPERAND(4, d))
+#else
+// Elsewhere the probes vanish without evaluating their arguments
+#define USBCTL_PROBE0(name) ((void)0)
+#define USBCTL_PROBE1(name, a) ((void)sizeof(a))
+#define USBCTL_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define USBCTL_PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#define USBCTL_PROBE4(name, a, b, c, d) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+#endif
+
 // Pthread on Windows requires special handling
 #ifdef PLATFORM_WINDOWS
 #include <windows.h>
@@ -70,6 +146,15 @@ typedef CRITICAL_SECTION pthread_mutex_t;
 #define PTHREAD_MUTEX_INITIALIZER {0}
 #define pthread_mutex_lock(m) EnterCriticalSection(m)
 #define pthread_mutex_unlock(m) LeaveCriticalSection(m)
+#define pthread_mutex_init(m, attr) InitializeCriticalSection(m)
+#define pthread_mutex_trylock(m) (TryEnterCriticalSection(m) ? 0 : EBUSY)
+#define pthread_mutex_destroy(m) DeleteCriticalSection(m)
+typedef CONDITION_VARIABLE pthread_cond_t;
+#define pthread_cond_init(c, attr) InitializeConditionVariable(c)
+#define pthread_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define pthread_cond_broadcast(c) WakeAllConditionVariable(c)
+#define pthread_cond_signal(c) WakeConditionVariable(c)
+#define SHUT_RDWR SD_BOTH
 
 // Windows thread wrapper to match pthread signature
 typedef struct {
@@ -113,13 +198,132 @@ static inline int pthread_detach(pthread_t thread) {
 #define AUTHOR "github.com/suifei"
 #define DEFAULT_PORT 11980
 #define DEFAULT_BIND "0.0.0.0"
-#define MAX_CLIENTS 10
+#define MAX_SSE_WORKERS 16
+#define SSE_QUEUE_LIMIT 16
+#define SSE_QUEUE_BYTES (256 * 1024)
+#define SSE_REPLAY_SIZE 128
+#define WS_MAX_MESSAGE 8192
+#define WS_MAX_BATCH 16
+#define WS_MAX_PENDING 8
+#define WS_COMMAND_THREADS 2
+#define H2_MAX_STREAMS 64
+#define H2_MAX_FRAME 16384
+#define H2_FRAME_HEADER 9
+#define H2_MAX_HEADER_BLOCK 65536
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
 #define BUFFER_SIZE 8192
 #define CONFIG_PATH_SIZE 512
 #define MAX_DEVICES 32
 #define MAX_LSUSB_ENTRIES 64
 #define LOG_BUFFER_SIZE 1024
-#define JSON_BUFFER_SIZE 8192
+#define METRICS_BUFFER_SIZE 131072
+#define HTTP_HEADER_SIZE 1024
+#define HTTP_MAX_BODY_PIECES 4
+#define MAX_LISTEN_SHARDS 64
+#define RATE_TABLE_SIZE 256
+#define ROUTE_MAX_PARAMS 4
+#define JSON_MAX_DEPTH 16
+#define JSON_MAX_BODY 4096
+#define ROUTE_SEGMENT_SIZE 24
+#define ROUTE_TRIE_NODES 32
+#define ROUTE_MAX 16
+#define MAX_KEEPALIVE_REQUESTS 100
+#define EXEC_TIMEOUT_SECONDS 10
+#define TRACE_RING_SIZE 1024
+#define LOCK_CLASSES_MAX 16
+#define FLIGHT_RING_SIZE 4096  // Power of two
+#define FLIGHT_VERSION 1
+#define EXEC_INFLIGHT_SLOTS 16
+#define TRACE_MAX_SECONDS 60
+
+// Sampling profiler: stacks are captured into a buffer allocated before the
+// timer starts; the first two frames are the signal handler and trampoline
+#define PROFILE_MAX_SAMPLES 4096
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SKIP 2
+#define PROFILE_STRIDE (PROFILE_MAX_DEPTH + PROFILE_SKIP)
+#define PROFILE_MAX_SECONDS 60
+#define PROFILE_MAX_HZ 1000
+
+// Metrics: latency histograms share one set of bucket bounds (the last
+// bucket is +Inf); responses are counted per route and status slot
+#define METRIC_LATENCY_BUCKETS 14
+#define METRIC_STATUS_SLOTS 13
+#define METRIC_EXIT_SLOTS 6
+
+// Timer wheel: 4 levels of 64 slots at 100 ms per tick (~19 days of range)
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+
+// Deflate encoder parameters (window kept small so per-SSE-client streams stay cheap)
+#define DEFLATE_WSIZE 8192
+#define DEFLATE_HASH_BITS 12
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_CHAIN 32
+#define GZIP_MIN_SIZE 128
+
+// Fixed-bucket latency histogram; the count is the sum of the buckets
+typedef struct {
+    unsigned long long buckets[METRIC_LATENCY_BUCKETS];
+    unsigned long long sum_ns;
+} histogram_t;
+
+// Lock statistics (built with -DLOCK_STATS): wait and hold histograms per
+// named lock, shared by every instance with that name
+typedef struct {
+    const char *name;
+    histogram_t wait;
+    histogram_t hold;
+    unsigned long long acquisitions;
+    unsigned long long contended;
+} lock_class_t;
+
+// One lock_acquire() call site; each is a static object at its call site
+typedef struct lock_site {
+    const char *func;
+    int line;
+    volatile int registered;
+    struct lock_site *next;
+    lock_class_t *cls;
+    unsigned long long acquisitions;
+    unsigned long long contended;
+    unsigned long long wait_ns;
+    unsigned long long hold_ns;
+    unsigned long long max_hold_ns;
+} lock_site_t;
+
+// Project mutex. Without LOCK_STATS it is a bare pthread mutex and the
+// lock_* macros below are the pthread calls; with it, every acquisition is
+// timed and charged to its call site.
+typedef struct {
+    pthread_mutex_t mutex;
+#ifdef LOCK_STATS
+    const char *name;
+    lock_class_t *cls;
+    lock_site_t *holder;
+    unsigned long long acquired_ns;
+#endif
+} lock_t;
+
+#ifdef LOCK_STATS
+#define LOCK_INITIALIZER(name) {PTHREAD_MUTEX_INITIALIZER, name, NULL, NULL, 0}
+#define LOCK_SITE_AT(call) ({ static lock_site_t lock_site_ = {__func__, __LINE__, 0, NULL, NULL, 0, 0, 0, 0, 0}; call; })
+#define lock_acquire(l) LOCK_SITE_AT(lock_acquire_at((l), &lock_site_))
+#define lock_try(l) LOCK_SITE_AT(lock_try_at((l), &lock_site_))
+#define lock_cond_wait(c, l) LOCK_SITE_AT(lock_cond_wait_at((c), (l), &lock_site_))
+#define lock_release(l) lock_release_at(l)
+#else
+#define LOCK_INITIALIZER(name) {PTHREAD_MUTEX_INITIALIZER}
+#define lock_acquire(l) pthread_mutex_lock(&(l)->mutex)
+#define lock_try(l) (pthread_mutex_trylock(&(l)->mutex) == 0)
+#define lock_cond_wait(c, l) pthread_cond_wait((c), &(l)->mutex)
+#define lock_release(l) pthread_mutex_unlock(&(l)->mutex)
+#endif
 
 // Configuration structure
 typedef struct {
@@ -131,6 +335,23 @@ typedef struct {
     char log_file[256];
     char bound_devices[MAX_DEVICES][16];
     int bound_devices_count;
+    int listen_shards;
+    char unix_socket[108];
+    int unix_mode;
+    double rate_cheap;
+    double rate_cheap_burst;
+    double rate_expensive;
+    double rate_expensive_burst;
+    int max_expensive_inflight;
+    int header_timeout;
+    int body_timeout;
+    int keepalive_timeout;
+    int sse_heartbeat;
+    int sse_workers;
+    int sse_max_clients;
+    int sse_stall_timeout;
+    int sse_snapshot_interval;
+    int debug_remote;
 } config_t;
 
 // USB device structure
@@ -140,6 +361,26 @@ typedef struct {
     int bound;
 } usb_device_t;
 
+// Simulated backend (--backend sim): device models drawn by weight, and the
+// virtual devices currently plugged in
+#define SIM_MIX_MAX 16
+#define SIM_BUSES_MAX 9
+#define SIM_PORTS_MAX 15
+#define SIM_DEPTH_MAX 3
+
+typedef struct {
+    unsigned short vid;
+    unsigned short pid;
+    int weight;
+    const char *desc;
+} sim_model_t;
+
+typedef struct {
+    char busid[16];
+    int model;
+    int bound;
+} sim_device_t;
+
 #ifndef PLATFORM_WINDOWS
 // Structure to map USB VID:PID to human-readable description (Linux only)
 typedef struct {
@@ -148,37 +389,717 @@ typedef struct {
 } lsusb_entry_t;
 #endif
 
-// SSE client structure
+// Timer wheel entry, embedded in the object it times out
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    unsigned long long expires;
+    void (*callback)(struct wheel_timer *timer);
+    void *arg;
+    int armed;
+} wheel_timer_t;
+
+// Connection deadline kinds tracked by the timer wheel
+typedef enum {
+    DEADLINE_HEADER = 0,
+    DEADLINE_BODY,
+    DEADLINE_IDLE,
+    DEADLINE_HEARTBEAT,
+    DEADLINE_KIND_COUNT
+} deadline_kind_t;
+
+// Streaming deflate state (one per gzip-encoded SSE client, or per response)
+typedef struct {
+    unsigned char window[2 * DEFLATE_WSIZE];
+    int win_len;
+    int hashed;
+    short head[DEFLATE_HASH_SIZE];
+    short prev[DEFLATE_WSIZE];
+    unsigned int bitbuf;
+    int bitcount;
+    unsigned int crc;
+    unsigned int total_in;
+    int header_sent;
+} deflate_stream_t;
+
+// Kinds of SSE frames a subscriber queue can hold
+typedef enum {
+    SSE_MSG_SNAPSHOT = 0,
+    SSE_MSG_HEARTBEAT = 1,
+    SSE_MSG_DELTA = 2,
+    SSE_MSG_CONTROL = 3
+} sse_msg_kind_t;
+
+// Wire protocol of a stream subscriber
+typedef enum {
+    CLIENT_PROTO_SSE = 0,
+    CLIENT_PROTO_WS = 1
+} client_proto_t;
+
+// WebSocket commands; a batch carries a list of bind/unbind operations
+typedef enum {
+    WS_OP_BIND = 0,
+    WS_OP_UNBIND,
+    WS_OP_BATCH,
+    WS_OP_SNAPSHOT,
+    WS_OP_COUNT
+} ws_op_t;
+
+// Named SSE events; deltas carry one device, snapshots the whole list
+typedef enum {
+    SSE_EVENT_SNAPSHOT = 0,
+    SSE_EVENT_DEVICE_ADDED,
+    SSE_EVENT_DEVICE_REMOVED,
+    SSE_EVENT_DEVICE_UPDATED,
+    SSE_EVENT_TYPE_COUNT
+} sse_event_type_t;
+
+// Framed SSE event, built once and shared by every queue that holds it
+typedef struct {
+    volatile int refs;
+    int kind;
+    unsigned long long id;
+    int event;
+    char busid[16];
+    int vid;
+    int pid;
+    int bound;
+    int prev_bound;
+    int raw_ws;
+    unsigned char *volatile ws_frame;
+    size_t ws_len;
+    unsigned char *volatile ws_cbor_frame;
+    size_t ws_cbor_len;
+    unsigned char *cbor;
+    size_t cbor_len;
+    size_t len;
+    char data[];
+} sse_msg_t;
+
+// Compiled /events filter, shared by every subscriber asking for the same
+// one; a filtered snapshot is serialised once per filter and event id
+typedef struct sse_filter {
+    struct sse_filter *next;
+    int refs;
+    char key[128];
+    char busid_prefix[16];
+    size_t busid_prefix_len;
+    int vid;
+    int pid;
+    int bound;
+    unsigned int type_mask;
+    sse_msg_t *snapshot;
+} sse_filter_t;
+
+struct sse_worker;
+
+// SSE or WebSocket subscriber owned by a fan-out worker: a bounded ring of
+// shared frames drained through a non-blocking socket. WebSocket clients also
+// buffer inbound frames; queued commands hold a reference.
 typedef struct {
     int socket;
-    int is_sse;
+    int index;
+    int protocol;
+    int binary;
+    int is_local;
+    volatile int refs;
     struct sockaddr_in addr;
-    time_t last_heartbeat;
+    deflate_stream_t *gzip;
+    sse_filter_t *filter;
+    struct sse_worker *worker;
+    sse_msg_t *queue[SSE_QUEUE_LIMIT];
+    int queue_head;
+    int queue_count;
+    size_t queued_bytes;
+    sse_msg_t *out_msg;
+    unsigned char *out_encoded;
+    const unsigned char *out;
+    size_t out_len;
+    size_t out_sent;
+    unsigned long long resync_id;
+    time_t pending_since;
+    time_t last_send;
+    wheel_timer_t heartbeat;
+    int closing;
+    int close_after_flush;
+    unsigned char *in_buf;
+    size_t in_len;
+    unsigned char *msg_buf;
+    size_t msg_len;
+    int msg_fragmented;
+    time_t last_recv;
 } client_t;
 
+// WebSocket command waiting for a command thread; holds a client reference
+typedef struct ws_job {
+    struct ws_job *next;
+    client_t *client;
+    ws_op_t op;
+    char id[64];
+    int count;
+    struct {
+        int bind;
+        char busid[16];
+    } ops[WS_MAX_BATCH];
+} ws_job_t;
+
+// JSON tokens reported by json_next()
+typedef enum {
+    JSON_ERROR = 0,
+    JSON_END,
+    JSON_OBJECT_START,
+    JSON_OBJECT_END,
+    JSON_ARRAY_START,
+    JSON_ARRAY_END,
+    JSON_KEY,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL
+} json_token_type_t;
+
+// What the tokenizer accepts next
+typedef enum {
+    JSON_EXPECT_VALUE,
+    JSON_EXPECT_KEY,
+    JSON_EXPECT_KEY_OR_END,
+    JSON_EXPECT_VALUE_OR_END,
+    JSON_EXPECT_COMMA_OR_END,
+    JSON_EXPECT_EOF,
+    JSON_EXPECT_NOTHING
+} json_state_t;
+
+// Tokenizer state over a buffer that is parsed in place
+typedef struct {
+    const char *json;
+    size_t len;
+    size_t pos;
+    json_state_t state;
+    int depth;
+    unsigned int objects;       // bit per nesting level: object or array
+    json_token_type_t type;
+    const char *token;
+    size_t token_len;
+    int escaped;
+    const char *error_field;
+} json_reader_t;
+
+// How a member is bound into a request struct
+typedef enum {
+    JSON_BIND_STRING,           // decoded into char[size]
+    JSON_BIND_SCALAR,           // raw number or plain string, kept as JSON text
+    JSON_BIND_OBJECTS           // array of objects bound with fields
+} json_bind_kind_t;
+
+typedef struct json_field {
+    const char *name;
+    json_bind_kind_t kind;
+    int required;
+    size_t offset;
+    size_t size;                // buffer size, or element size for arrays
+    const struct json_field *fields;
+    int field_count;
+    size_t count_offset;
+    int max_count;
+} json_field_t;
+
+#define JSON_FIELD_SIZE(type, member) sizeof(((type *)0)->member)
+
+// POST /bind and /unbind body
+typedef struct {
+    char busid[16];
+} bind_request_t;
+
+// WebSocket command: bind/unbind carry op and busid, batches carry ops
+typedef struct {
+    char op[16];
+    char busid[16];
+} ws_device_op_t;
+
+typedef struct {
+    char id[64];
+    char op[16];
+    char busid[16];
+    ws_device_op_t ops[WS_MAX_BATCH];
+    int op_count;
+} ws_command_t;
+
+// Fan-out worker: one thread polling a share of the subscribers
+typedef struct sse_worker {
+    int id;
+    pthread_t thread;
+    lock_t lock;
+    client_t **clients;
+    int count;
+    int capacity;
+    int wake_pipe[2];
+    volatile int wake_pending;
+} sse_worker_t;
+
+// One SO_REUSEPORT listening socket with its own accept loop
+typedef struct {
+    int id;
+    int socket;
+    int cpu;
+    int is_unix;
+    pthread_t thread;
+    volatile unsigned long long connections;
+    volatile unsigned long long requests;
+} listener_shard_t;
+
+// Accepted connection handed to a client thread
+typedef struct {
+    int socket;
+    int is_local;
+    listener_shard_t *shard;
+} connection_t;
+
+// HTTP/1.1 connection served by one client thread; requests are read into
+// buffer and may be followed by pipelined bytes of the next request. An
+// HTTP/2 stream carries one of these too, with h2 pointing back at it.
+typedef struct http_conn {
+    int socket;
+    int is_local;
+    listener_shard_t *shard;
+    char buffer[BUFFER_SIZE];
+    size_t buffered;
+    size_t header_len;
+    size_t request_len;
+    int keep_alive;
+    int requests;
+    int responses;
+    int status;
+    wheel_timer_t deadline;
+    volatile int deadline_kind;
+    volatile int timed_out;
+    struct h2_stream *h2;
+} http_conn_t;
+
+// HTTP response under construction: headers are formatted into a local
+// buffer, body pieces are referenced in place and sent with one writev
+typedef struct {
+    int socket;
+    http_conn_t *conn;
+    char header[HTTP_HEADER_SIZE];
+    size_t header_len;
+    struct iovec body[HTTP_MAX_BODY_PIECES];
+    int body_count;
+    size_t body_len;
+    int stream;
+    int upgrade;
+    int head_only;
+    int overflow;
+} http_response_t;
+
+// HPACK decoder dynamic table (RFC 7541, 2.3.2); newest entry at head
+typedef struct {
+    char *names[HPACK_MAX_ENTRIES];
+    char *values[HPACK_MAX_ENTRIES];
+    int head;
+    int count;
+    size_t sizes[HPACK_MAX_ENTRIES];
+    size_t size;
+    size_t max_size;
+} hpack_table_t;
+
+// Request being assembled from a decoded header block: pseudo-headers are
+// kept apart and the rest is rendered as HTTP/1.1 header lines
+typedef struct {
+    char method[16];
+    char path[256];
+    char authority[128];
+    char lines[BUFFER_SIZE];
+    size_t lines_len;
+    int overflow;
+    int malformed;
+} h2_request_t;
+
+struct h2_session;
+
+// HTTP/2 stream. The request is rewritten as HTTP/1.1 into conn and served
+// by handle_request() on its own thread; conn->h2 routes the response back
+// here. An SSE response keeps the stream open and its fan-out worker writes
+// into a socketpair whose other end (pipe) the connection thread frames.
+typedef struct h2_stream {
+    struct h2_session *session;
+    unsigned int id;
+    int state;
+    int reset;
+    int running;
+    int streaming;
+    int too_large;
+    int pipe;
+    long long send_window;
+    http_conn_t conn;
+} h2_stream_t;
+
+// HTTP/2 connection served by one thread that reads frames and forwards SSE
+// data. lock guards the stream table, the flow-control windows and thread
+// bookkeeping; write_lock keeps frames whole on the socket.
+typedef struct h2_session {
+    int socket;
+    int is_local;
+    listener_shard_t *shard;
+    lock_t lock;
+    lock_t write_lock;
+    pthread_cond_t changed;
+    h2_stream_t *streams[H2_MAX_STREAMS];
+    int stream_count;
+    int threads;
+    unsigned int last_stream_id;
+    long long send_window;
+    long long peer_initial_window;
+    size_t peer_max_frame;
+    volatile int dead;
+    int wake_pipe[2];
+    hpack_table_t decoder;
+    h2_request_t request;
+    unsigned char *block;
+    size_t block_len;
+    unsigned int block_stream;
+    int block_end_stream;
+    unsigned char in[H2_FRAME_HEADER + H2_MAX_FRAME];
+    size_t in_len;
+} h2_session_t;
+
+// Admission classes: cheap reads versus routes that fork usbip
+typedef enum {
+    RATE_CLASS_CHEAP = 0,
+    RATE_CLASS_EXPENSIVE = 1,
+    RATE_CLASS_COUNT
+} rate_class_t;
+
+// Per-source token buckets, one per admission class
+typedef struct {
+    unsigned int addr;
+    int in_use;
+    double tokens[RATE_CLASS_COUNT];
+    unsigned long long last_ns;
+} rate_entry_t;
+
+// Methods the route table is keyed on; HEAD is served by GET routes
+typedef enum {
+    HTTP_METHOD_GET = 0,
+    HTTP_METHOD_POST = 1,
+    HTTP_METHOD_COUNT
+} http_method_t;
+
+// Parsed request line plus the path parameters of the matched route
+typedef struct {
+    char method[16];
+    char path[256];
+    char version[16];
+    const char *query;
+    int is_head;
+    int param_count;
+    struct {
+        const char *name;
+        char value[64];
+    } params[ROUTE_MAX_PARAMS];
+} http_request_t;
+
+typedef void (*route_handler_t)(http_conn_t *conn, http_request_t *req);
+
+// Route table entry: path segments in braces are parameters. Local-only
+// routes answer 403 to TCP clients unless debug_remote is set.
+typedef struct {
+    http_method_t method;
+    const char *pattern;
+    rate_class_t rate_class;
+    route_handler_t handler;
+    int local_only;
+} route_t;
+
+// Node of the path segment trie built from the route table
+typedef struct {
+    char segment[ROUTE_SEGMENT_SIZE];
+    int is_param;
+    int child;
+    int sibling;
+    int param_child;
+    int routes[HTTP_METHOD_COUNT];
+} route_node_t;
+
+// Commands run through secure_exec_command(), as labelled in /metrics
+typedef enum {
+    EXEC_LSUSB = 0,
+    EXEC_LIST,
+    EXEC_BIND,
+    EXEC_UNBIND,
+    EXEC_OTHER,
+    EXEC_KIND_COUNT
+} exec_kind_t;
+
+// Command running in a child process, as listed by /debug/state. state is
+// 0 when the slot is free, 1 while it is filled in and 2 once published.
+typedef struct {
+    volatile int state;
+    int pid;
+    unsigned long long start_ns;
+    char cmd[64];
+} exec_inflight_t;
+
+// Encoded-message caches whose hit rates /debug/state reports
+typedef enum {
+    CACHE_SNAPSHOT = 0,
+    CACHE_FILTER_SNAPSHOT,
+    CACHE_WS_FRAME,
+    CACHE_KIND_COUNT
+} cache_kind_t;
+
+// Flight recorder event kinds; the fields each one fills are listed
+typedef enum {
+    FLIGHT_ACCEPT = 1,  // text: listener, arg: socket
+    FLIGHT_ROUTE,       // text: route, arg: status, value: ns
+    FLIGHT_EXEC_SPAWN,  // text: command, arg: pid
+    FLIGHT_EXEC_EXIT,   // text: command, arg: exit code, value: ns
+    FLIGHT_POLL,        // arg: changes, value: ns
+    FLIGHT_BROADCAST,   // arg: deltas, value: devices
+    FLIGHT_LOCK_WAIT,   // text: lock, value: ns
+    FLIGHT_KIND_COUNT
+} flight_kind_t;
+
+// One flight recorder slot, a cache line. seq is the event's index + 1 and
+// is stored last, so a slot caught mid-write (seq 0 or stale) is skipped by
+// the decoder.
+typedef struct {
+    unsigned long long seq;
+    unsigned long long ts_ns;
+    unsigned long long value;
+    int arg;
+    int tid;
+    unsigned short kind;
+    char text[30];
+} flight_event_t;
+
+// Dump file header, native byte order, followed by FLIGHT_RING_SIZE events
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int event_size;
+    unsigned int capacity;
+    int signal;
+    unsigned long long head;
+    unsigned long long mono_ns;
+    unsigned long long wall_ns;
+} flight_header_t;
+
+// Completed span in a thread's trace ring
+typedef struct {
+    const char *cat;
+    const char *name;
+    unsigned long long start_ns;
+    unsigned long long dur_ns;
+    unsigned long long request;
+    int tid;
+} trace_span_t;
+
+// Hot-path metrics and trace spans of one thread. Only the owning thread writes a shard, so
+// updates are plain relaxed stores; /metrics sums every shard. A shard
+// outlives its thread and is handed to the next thread that starts, so the
+// totals never go backwards.
+typedef struct metrics_shard {
+    struct metrics_shard *next;
+    volatile int in_use;
+    unsigned long long route_responses[ROUTE_MAX + 1][METRIC_STATUS_SLOTS];
+    histogram_t route_latency[ROUTE_MAX + 1];
+    histogram_t poll_cycle;
+    unsigned long long poll_changed_cycles;
+    unsigned long long poll_changes;
+    histogram_t exec_latency[EXEC_KIND_COUNT];
+    unsigned long long exec_exits[EXEC_KIND_COUNT][METRIC_EXIT_SLOTS];
+    unsigned long long exec_timeouts[EXEC_KIND_COUNT];
+    histogram_t device_op_latency[2][2];
+    histogram_t device_lock_wait;
+    trace_span_t *trace;
+    unsigned long long trace_head;
+} metrics_shard_t;
+
+// Runtime counters exported by /metrics
+typedef struct {
+    volatile unsigned long long admitted[RATE_CLASS_COUNT];
+    volatile unsigned long long rate_limited[RATE_CLASS_COUNT];
+    volatile unsigned long long inflight_rejected;
+    volatile unsigned long long rate_evictions;
+    volatile unsigned long long deadline_expired[DEADLINE_KIND_COUNT];
+    volatile unsigned long long keepalive_reuses;
+    volatile unsigned long long sse_subscribed;
+    volatile unsigned long long sse_rejected;
+    volatile unsigned long long sse_disconnected;
+    volatile unsigned long long sse_evicted;
+    volatile unsigned long long sse_coalesced;
+    volatile unsigned long long sse_messages;
+    volatile unsigned long long sse_bytes_sent;
+    volatile unsigned long long sse_resume_replayed;
+    volatile unsigned long long sse_resume_snapshot;
+    volatile unsigned long long sse_replayed_events;
+    volatile unsigned long long sse_events[SSE_EVENT_TYPE_COUNT];
+    volatile unsigned long long sse_filtered_out;
+    volatile unsigned long long ws_connections;
+    volatile unsigned long long ws_commands[WS_OP_COUNT];
+    volatile unsigned long long ws_replies_failed;
+    volatile unsigned long long ws_protocol_errors;
+    volatile unsigned long long ws_pings_received;
+    volatile unsigned long long ws_ping_timeouts;
+    volatile unsigned long long cbor_responses;
+    volatile unsigned long long h2_connections[2];
+    volatile unsigned long long h2_streams;
+    volatile unsigned long long h2_streams_refused;
+    volatile unsigned long long h2_flow_waits;
+    volatile unsigned long long gzip_responses;
+    volatile unsigned long long gzip_stream_events;
+    volatile unsigned long long gzip_bytes_in;
+    volatile unsigned long long gzip_bytes_out;
+    volatile unsigned long long gzip_compress_ns;
+    volatile unsigned long long cache_hits[CACHE_KIND_COUNT];
+    volatile unsigned long long cache_misses[CACHE_KIND_COUNT];
+} stats_t;
+
+// Built-in settings; save_config() writes only the tunables that differ
+#define CONFIG_DEFAULTS {DEFAULT_PORT, DEFAULT_BIND, 3, "", 1, "/var/log/usbctl.log", {""}, 0, 1, "", 0660, \
+                         20.0, 40.0, 1.0, 5.0, 2, 10, 30, 15, 30, 2, 4096, 30, 300, 0}
+
 // Global variables
-static config_t g_config = {DEFAULT_PORT, DEFAULT_BIND, 3, "", 1, "/var/log/usbctl.log", {""}, 0};
+static config_t g_config = CONFIG_DEFAULTS;
+static const config_t g_config_defaults = CONFIG_DEFAULTS;
 static usb_device_t g_devices[MAX_DEVICES];
 #ifndef PLATFORM_WINDOWS
 static lsusb_entry_t g_lsusb_map[MAX_LSUSB_ENTRIES];
 static int g_lsusb_count = 0;
 #endif
 static int g_device_count = 0;
-static client_t g_clients[MAX_CLIENTS];
-static int g_client_count = 0;
-static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sse_worker_t g_sse_workers[MAX_SSE_WORKERS];
+static int g_sse_worker_count = 0;
+static volatile int g_sse_subscribers = 0;
+static sse_msg_t *g_sse_heartbeat_msg = NULL;
+static sse_msg_t *g_ws_ping_msg = NULL;
+static lock_t g_sse_ring_lock = LOCK_INITIALIZER("g_sse_ring_lock");
+static sse_msg_t *g_sse_ring[SSE_REPLAY_SIZE];
+static int g_sse_ring_head = 0;
+static int g_sse_ring_count = 0;
+static unsigned long long g_sse_last_id = 0;
+static unsigned long long g_sse_generation = 0;
+static usb_device_t g_sse_published[MAX_DEVICES];
+static int g_sse_published_count = 0;
+static sse_msg_t *g_sse_snapshot = NULL;
+static sse_filter_t *g_sse_filters = NULL;
+static int g_sse_filter_count = 0;
+static lock_t g_ws_job_lock = LOCK_INITIALIZER("g_ws_job_lock");
+static pthread_cond_t g_ws_job_cond;
+static ws_job_t *g_ws_jobs = NULL;
+static ws_job_t *g_ws_jobs_tail = NULL;
+static pthread_t g_ws_command_threads[WS_COMMAND_THREADS];
+static int g_ws_command_count = 0;
+static lock_t g_mutex = LOCK_INITIALIZER("g_mutex");
 static volatile int g_running = 1;
 static volatile int g_server_started = 0;
 static FILE *g_log_file = NULL;
 static int g_usbip_error_shown = 0;
+static stats_t g_stats;
+static char g_html_page[16384];
+static size_t g_html_page_len = 0;
+static unsigned char g_favicon[2048];
+static int g_favicon_len = 0;
+static unsigned int g_crc32_table[256];
+static listener_shard_t g_shards[MAX_LISTEN_SHARDS];
+static int g_shard_count = 0;
+static listener_shard_t g_unix_listener = {-1, -1, -1, 1, 0, 0, 0};
+static rate_entry_t g_rate_table[RATE_TABLE_SIZE];
+static int g_rate_sources = 0;
+static lock_t g_rate_mutex = LOCK_INITIALIZER("g_rate_mutex");
+static volatile int g_expensive_inflight = 0;
+static metrics_shard_t *volatile g_metrics_shards = NULL;
+static __thread metrics_shard_t *t_metrics_shard = NULL;
+static volatile int g_trace_capturing = 0;
+static volatile unsigned long long g_trace_next_request = 0;
+static __thread unsigned long long t_trace_request = 0;
+static flight_event_t g_flight[FLIGHT_RING_SIZE];
+static volatile unsigned long long g_flight_head = 0;
+static volatile int g_flight_dumping = 0;
+static char g_flight_path[272] = "";
+static exec_inflight_t g_exec_inflight[EXEC_INFLIGHT_SLOTS];
+static unsigned long long g_sse_generation_ns = 0;
+static volatile time_t g_config_saved_at = 0;
+
+// Poll scheduler progress; only the poll thread writes it
+static struct {
+    volatile unsigned long long cycles;
+    volatile unsigned long long started_ns;
+    volatile unsigned long long finished_ns;
+    volatile unsigned long long next_ns;
+    volatile int devices;
+    volatile int changes;
+    volatile int running;
+} g_poll;
+
+// Simulated backend; settings first, then the state sim_init() sets up
+static struct {
+    int devices;
+    int buses;
+    int ports;
+    int depth;
+    double churn;
+    double latency_ms;
+    double latency_sigma;
+    double fail_rate;
+    double hang_rate;
+    unsigned long long seed;
+    char mix_spec[128];
+    int enabled;
+    lock_t lock;
+    sim_model_t mix[SIM_MIX_MAX];
+    int mix_count;
+    int mix_weight;
+    sim_device_t dev[MAX_DEVICES];
+    int count;
+    unsigned long long rng;
+    unsigned long long next_event_ns;
+    unsigned long long hotplugs;
+    unsigned long long failures;
+    unsigned long long hangs;
+} g_sim = {12, 2, 4, 2, 2.0, 120.0, 0.5, 0.0, 0.0, 0, "", 0, LOCK_INITIALIZER("g_sim.lock"),
+           {{0, 0, 0, NULL}}, 0, 0, {{"", 0, 0}}, 0, 0, 0, 0, 0, 0};
+#ifdef LOCK_STATS
+static lock_class_t g_lock_classes[LOCK_CLASSES_MAX];
+static volatile int g_lock_class_count = 0;
+static volatile int g_lock_class_busy = 0;
+static lock_site_t *volatile g_lock_sites = NULL;
+#endif
+
+// Timer wheel state; one thread advances it every tick
+static struct {
+    lock_t lock;
+    pthread_cond_t idle;
+    wheel_timer_t slots[TIMER_LEVELS][TIMER_SLOTS];
+    unsigned long long current;
+    wheel_timer_t *running;
+    int armed;
+} g_wheel;
+
+#define STAT_ADD(field, n) __sync_fetch_and_add(&g_stats.field, (unsigned long long)(n))
 
 // Forward declarations
 void update_bound_devices_config(void);
 void restore_bound_devices(void);
 int bind_device(const char *busid);
 int unbind_device(const char *busid);
-void send_http_response(int client_socket, int status_code, const char *status_text, 
+static int sim_config_line(const char *line);
+static int sim_is_bound(const char *busid);
+void send_http_response(http_conn_t *conn, int status_code, const char *status_text,
                        const char *content_type, const char *body);
+static void device_vid_pid(const char *info, int *vid, int *pid);
+static int ws_msg_frame(sse_msg_t *msg, int binary, const void **frame, size_t *frame_len);
+static int ws_client_read_locked(client_t *client, time_t now);
+static void ws_client_process_locked(client_t *client);
+static int ws_send_handshake(http_conn_t *conn, const char *accept, const char *initial, size_t initial_len);
+int handle_request(http_conn_t *conn);
+static void route_metrics_append(char *buffer, size_t buffer_size, size_t *pos,
+                                 const metrics_shard_t *total);
+#ifndef PLATFORM_WINDOWS
+static int h2_response_send(http_response_t *res);
+static int h2_stream_open_pipe(http_conn_t *conn);
+#endif
 
 // ============================================================================
 // EMBEDDED WEB RESOURCES
@@ -248,13 +1169,15 @@ static const char *EMBEDDED_CSS = "*{margin:0;padding:0;box-sizing:border-box}"
                                   ".log-title{font-size:12px}"
                                   "}";
 
-const char *EMBEDDED_JS = "let eventSource,devices=[],lang='en',logEntries=[];"
+const char *EMBEDDED_JS = "let eventSource,devices=[],generation=0,lang='en',logEntries=[];"
                           "const i18n={'en':{'title':'USB/IP Manager','device':'Device Info','busid':'Bus ID','status':'Status','action':'Action','bound':'Bound','unbound':'Unbound','bind':'Bind','unbind':'Unbind','connected':'Connected','disconnected':'Disconnected','error':'Error','author':'Author','log_title':'Operation Log','clear':'Clear','bind_success':'Device {busid} bound successfully','unbind_success':'Device {busid} unbound successfully','bind_error':'Error binding device {busid}: {error}','unbind_error':'Error unbinding device {busid}: {error}'},'zh':{'title':'USB/IP 管理器','device':'设备信息','busid':'总线ID','status':'状态','action':'操作','bound':'已绑定','unbound':'未绑定','bind':'绑定','unbind':'解绑','connected':'已连接','disconnected':'已断开','error':'错误','author':'作者','log_title':'操作日志','clear':'清除','bind_success':'设备 {busid} 绑定成功','unbind_success':'设备 {busid} 解绑成功','bind_error':'绑定设备 {busid} 失败: {error}','unbind_error':'解绑设备 {busid} 失败: {error}'}};"
                           "function detectLang(){try{const stored=localStorage.getItem('usbctl_lang');if(stored&&i18n[stored])return stored;const nav=navigator.language||navigator.userLanguage||navigator.browserLanguage||'en';const langCode=nav.toLowerCase();if(langCode.startsWith('zh')||langCode.includes('chinese')||langCode.includes('cn'))return 'zh';return 'en';}catch(e){return 'en';}}"
                           "function t(k,vars){let text=i18n[lang][k]||k;if(vars){Object.keys(vars).forEach(key=>{text=text.replace(`{${key}}`,vars[key]);})}return text;}"
                           "function setLang(l){lang=l;localStorage.setItem('usbctl_lang',l);updateUI();}"
                           "function updateUI(){document.title=`usbctl - ${t('title')}`;document.querySelector('h1').textContent=t('title');document.documentElement.lang=lang==='zh'?'zh-CN':'en';const ths=document.querySelectorAll('th');if(ths.length>=4){ths[0].textContent=t('device');ths[1].textContent=t('busid');ths[2].textContent=t('status');ths[3].textContent=t('action');}document.querySelectorAll('.lang-btn').forEach(b=>b.classList.toggle('active',b.dataset.lang===lang));const logTitle=document.querySelector('.log-title');if(logTitle)logTitle.textContent=t('log_title');const clearBtn=document.querySelector('.clear-log-btn');if(clearBtn)clearBtn.textContent=t('clear');render();renderLog();}"
-                          "function connectSSE(){if(eventSource)eventSource.close();eventSource=new EventSource('/events');eventSource.onopen=()=>document.getElementById('status').textContent=t('connected');eventSource.onmessage=e=>{try{devices=JSON.parse(e.data);render();}catch(err){console.error(err);}};eventSource.onerror=()=>{document.getElementById('status').textContent=t('disconnected');setTimeout(connectSSE,3000)};}"
+                          "function connectSSE(){if(eventSource)eventSource.close();eventSource=new EventSource('/events');eventSource.onopen=()=>document.getElementById('status').textContent=t('connected');eventSource.addEventListener('snapshot',e=>applyEvent(e,m=>{devices=m.devices;}));eventSource.addEventListener('device-added',e=>applyEvent(e,m=>upsertDevice(m.device)));eventSource.addEventListener('device-updated',e=>applyEvent(e,m=>upsertDevice(m.device)));eventSource.addEventListener('device-removed',e=>applyEvent(e,m=>{devices=devices.filter(d=>d.busid!==m.busid);}));eventSource.onerror=()=>{document.getElementById('status').textContent=t('disconnected');if(eventSource.readyState===EventSource.CLOSED)setTimeout(connectSSE,3000)};}"
+                          "function applyEvent(e,apply){try{const m=JSON.parse(e.data);if(e.type!=='snapshot'&&generation&&m.generation!==generation+1)loadDevices();apply(m);generation=m.generation;render();}catch(err){console.error(err);}}"
+                          "function upsertDevice(d){const i=devices.findIndex(x=>x.busid===d.busid);if(i<0)devices.push(d);else devices[i]=d;}"
                           "function render(){const tbody=document.querySelector('tbody');tbody.innerHTML=devices.map(d=>`<tr><td>${d.info}</td><td><code>${d.busid}</code></td>`+`<td><span class=\"status ${d.bound?'bound':'unbound'}\">${t(d.bound?'bound':'unbound')}</span></td>`+`<td><button class=\"${d.bound?'btn-unbind':'btn-bind'}\" onclick=\"toggle('${d.busid}')\">`+`${t(d.bound?'unbind':'bind')}</button></td></tr>`).join('');}"
                           "function addLog(type,message){const timestamp=new Date().toLocaleTimeString();const entry={type,message,timestamp};logEntries.unshift(entry);if(logEntries.length>100)logEntries.pop();renderLog();}"
                           "function renderLog(){const logContent=document.getElementById('logContent');if(!logContent)return;logContent.innerHTML=logEntries.map(entry=>`<div class=\"log-entry log-${entry.type}\">`+`<span class=\"log-timestamp\">[${entry.timestamp}]</span> ${entry.message}`+`</div>`).join('');logContent.scrollTop=0;}"
@@ -299,6 +1222,419 @@ static size_t safe_strnlen(const char *s, size_t maxlen) {
     return p - s;
 }
 
+// Monotonic clock in nanoseconds
+static unsigned long long monotonic_ns(void) {
+#ifdef PLATFORM_WINDOWS
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000000ULL +
+           (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+// Histogram bucket bounds in microseconds, shared by every latency metric
+static const unsigned int METRIC_LATENCY_BOUNDS_US[METRIC_LATENCY_BUCKETS - 1] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000};
+
+// Status codes counted per route; anything else lands in the last slot
+static const int METRIC_STATUS_CODES[METRIC_STATUS_SLOTS - 1] = {
+    101, 200, 400, 404, 405, 411, 413, 426, 429, 431, 500, 503};
+
+// Exit codes counted per command; the last two slots are any other code
+// and a command that could not be run at all
+static const int METRIC_EXIT_CODES[METRIC_EXIT_SLOTS - 2] = {0, 1, 2, 127};
+
+// The calling thread's metrics shard: a released one is reused, otherwise
+// a new one is pushed onto the list. Returns NULL only when out of memory.
+static metrics_shard_t *metrics_shard(void) {
+    metrics_shard_t *shard = t_metrics_shard;
+    if (shard) return shard;
+
+    for (shard = g_metrics_shards; shard; shard = shard->next) {
+        if (!shard->in_use && __sync_bool_compare_and_swap(&shard->in_use, 0, 1)) break;
+    }
+    if (!shard) {
+        shard = calloc(1, sizeof(metrics_shard_t));
+        if (!shard) return NULL;
+        shard->in_use = 1;
+        do {
+            shard->next = g_metrics_shards;
+        } while (!__sync_bool_compare_and_swap(&g_metrics_shards, shard->next, shard));
+    }
+    t_metrics_shard = shard;
+    return shard;
+}
+
+// Hand the calling thread's shard back before the thread exits
+static void metrics_thread_exit(void) {
+    if (!t_metrics_shard) return;
+    __sync_lock_release(&t_metrics_shard->in_use);
+    t_metrics_shard = NULL;
+}
+
+// Single-writer add: no locked instruction, but never a torn value for the
+// scraper, even on 32-bit targets
+static void metric_add(unsigned long long *counter, unsigned long long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void histogram_observe(histogram_t *h, unsigned long long ns) {
+    int bucket = 0;
+    while (bucket < METRIC_LATENCY_BUCKETS - 1 && ns > METRIC_LATENCY_BOUNDS_US[bucket] * 1000ULL) {
+        bucket++;
+    }
+    metric_add(&h->buckets[bucket], 1);
+    metric_add(&h->sum_ns, ns);
+}
+
+// Fold a histogram into a scrape total
+static void histogram_merge(histogram_t *total, const histogram_t *h) {
+    for (int b = 0; b < METRIC_LATENCY_BUCKETS; b++) {
+        total->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    }
+    total->sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+}
+
+// OS thread id for trace and flight recorder events
+static int trace_thread_id(void) {
+    static __thread int tid = 0;
+    if (!tid) {
+#ifdef PLATFORM_WINDOWS
+        tid = (int)GetCurrentThreadId();
+#elif defined(__linux__)
+        tid = (int)syscall(SYS_gettid);
+#else
+        static volatile int next_tid = 0;
+        tid = __sync_add_and_fetch(&next_tid, 1);
+#endif
+    }
+    return tid;
+}
+
+// Append an event to the flight recorder. Writers claim slots with one
+// atomic add and never wait, so this is safe from any thread.
+static void flight_record(flight_kind_t kind, const char *text, int arg, unsigned long long value) {
+    unsigned long long index = __sync_fetch_and_add(&g_flight_head, 1ULL);
+    flight_event_t *e = &g_flight[index & (FLIGHT_RING_SIZE - 1)];
+    __atomic_store_n(&e->seq, 0ULL, __ATOMIC_RELAXED);
+    e->ts_ns = monotonic_ns();
+    e->value = value;
+    e->arg = arg;
+    e->tid = trace_thread_id();
+    e->kind = (unsigned short)kind;
+    size_t i = 0;
+    if (text) {
+        for (; i < sizeof(e->text) - 1 && text[i]; i++) e->text[i] = text[i];
+    }
+    e->text[i] = '\0';
+    __atomic_store_n(&e->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+typedef char flight_event_is_a_cache_line[sizeof(flight_event_t) == 64 ? 1 : -1];
+
+static void lock_init(lock_t *l, const char *name) {
+    pthread_mutex_init(&l->mutex, NULL);
+#ifdef LOCK_STATS
+    l->name = name;
+    l->cls = NULL;
+    l->holder = NULL;
+    l->acquired_ns = 0;
+#else
+    (void)name;
+#endif
+}
+
+#ifndef PLATFORM_WINDOWS
+static void lock_destroy(lock_t *l) {
+    pthread_mutex_destroy(&l->mutex);
+}
+#endif
+
+#ifdef LOCK_STATS
+// Several threads may update one lock name at once (holders of different
+// instances), so these histograms take atomic adds
+static void histogram_observe_shared(histogram_t *h, unsigned long long ns) {
+    int bucket = 0;
+    while (bucket < METRIC_LATENCY_BUCKETS - 1 && ns > METRIC_LATENCY_BOUNDS_US[bucket] * 1000ULL) {
+        bucket++;
+    }
+    __sync_fetch_and_add(&h->buckets[bucket], 1ULL);
+    __sync_fetch_and_add(&h->sum_ns, ns);
+}
+
+// Statistics slot for a lock's name, claimed on its first acquisition
+static lock_class_t *lock_class_of(lock_t *l) {
+    lock_class_t *cls = __atomic_load_n(&l->cls, __ATOMIC_ACQUIRE);
+    if (cls) return cls;
+
+    while (__sync_lock_test_and_set(&g_lock_class_busy, 1)) {
+    }
+    for (int i = 0; i < g_lock_class_count && !cls; i++) {
+        if (strcmp(g_lock_classes[i].name, l->name) == 0) cls = &g_lock_classes[i];
+    }
+    if (!cls && g_lock_class_count < LOCK_CLASSES_MAX) {
+        cls = &g_lock_classes[g_lock_class_count];
+        cls->name = l->name;
+        __atomic_store_n(&g_lock_class_count, g_lock_class_count + 1, __ATOMIC_RELEASE);
+    }
+    __sync_lock_release(&g_lock_class_busy);
+    if (cls) __atomic_store_n(&l->cls, cls, __ATOMIC_RELEASE);
+    return cls;
+}
+
+// The lock is now held from site: start its hold clock there
+static void lock_hold_begin(lock_t *l, lock_site_t *site) {
+    if (!site->registered && __sync_bool_compare_and_swap(&site->registered, 0, 1)) {
+        do {
+            site->next = g_lock_sites;
+        } while (!__sync_bool_compare_and_swap(&g_lock_sites, site->next, site));
+    }
+    site->cls = lock_class_of(l);
+    l->holder = site;
+    l->acquired_ns = monotonic_ns();
+}
+
+static void lock_hold_end(lock_t *l) {
+    unsigned long long held = monotonic_ns() - l->acquired_ns;
+    lock_site_t *site = l->holder;
+    if (site) {
+        __sync_fetch_and_add(&site->hold_ns, held);
+        unsigned long long max = site->max_hold_ns;
+        while (held > max && !__sync_bool_compare_and_swap(&site->max_hold_ns, max, held)) {
+            max = site->max_hold_ns;
+        }
+    }
+    if (l->cls) histogram_observe_shared(&l->cls->hold, held);
+    l->holder = NULL;
+}
+
+static void lock_acquired(lock_t *l, lock_site_t *site, unsigned long long waited, int contended) {
+    lock_hold_begin(l, site);
+    __sync_fetch_and_add(&site->acquisitions, 1ULL);
+    if (contended) {
+        __sync_fetch_and_add(&site->contended, 1ULL);
+        __sync_fetch_and_add(&site->wait_ns, waited);
+    }
+    if (contended) flight_record(FLIGHT_LOCK_WAIT, l->name, 0, waited);
+    if (l->cls) {
+        __sync_fetch_and_add(&l->cls->acquisitions, 1ULL);
+        if (contended) __sync_fetch_and_add(&l->cls->contended, 1ULL);
+        histogram_observe_shared(&l->cls->wait, waited);
+    }
+}
+
+static void lock_acquire_at(lock_t *l, lock_site_t *site) {
+    if (pthread_mutex_trylock(&l->mutex) == 0) {
+        lock_acquired(l, site, 0, 0);
+        return;
+    }
+    unsigned long long start = monotonic_ns();
+    pthread_mutex_lock(&l->mutex);
+    lock_acquired(l, site, monotonic_ns() - start, 1);
+}
+
+static int lock_try_at(lock_t *l, lock_site_t *site) {
+    if (pthread_mutex_trylock(&l->mutex) != 0) return 0;
+    lock_acquired(l, site, 0, 0);
+    return 1;
+}
+
+static void lock_release_at(lock_t *l) {
+    lock_hold_end(l);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+// The wait releases the lock, so the hold ends here and restarts on wakeup
+static void lock_cond_wait_at(pthread_cond_t *cond, lock_t *l, lock_site_t *site) {
+    lock_hold_end(l);
+    pthread_cond_wait(cond, &l->mutex);
+    lock_hold_begin(l, site);
+}
+#endif
+
+// g_mutex guards the device list; only contended acquisitions read the clock
+static void devices_lock(void) {
+    unsigned long long waited = 0;
+    if (!lock_try(&g_mutex)) {
+        unsigned long long start = monotonic_ns();
+        lock_acquire(&g_mutex);
+        waited = monotonic_ns() - start;
+#ifndef LOCK_STATS
+        flight_record(FLIGHT_LOCK_WAIT, "g_mutex", 0, waited);
+#endif
+    }
+    metrics_shard_t *shard = metrics_shard();
+    if (shard) histogram_observe(&shard->device_lock_wait, waited);
+}
+
+static void devices_unlock(void) {
+    lock_release(&g_mutex);
+}
+
+// Give the work the calling thread starts now a fresh request id for its
+// spans (0, and no spans, unless a /debug/trace capture is open)
+static void trace_request_begin(void) {
+    t_trace_request = g_trace_capturing ? __sync_add_and_fetch(&g_trace_next_request, 1ULL) : 0;
+}
+
+// Open a span; returns 0 when no capture is running
+static unsigned long long trace_begin(void) {
+    return g_trace_capturing ? monotonic_ns() : 0;
+}
+
+// Close a span opened by trace_begin() into the calling thread's ring. The
+// slot is filled before the head moves past it, so a reader that sees the
+// new head sees the whole span.
+static void trace_end(const char *cat, const char *name, unsigned long long start) {
+    if (!start) return;
+    metrics_shard_t *shard = metrics_shard();
+    if (!shard) return;
+    if (!shard->trace) {
+        trace_span_t *ring = calloc(TRACE_RING_SIZE, sizeof(trace_span_t));
+        if (!ring) return;
+        __atomic_store_n(&shard->trace, ring, __ATOMIC_RELEASE);
+    }
+    unsigned long long head = shard->trace_head;
+    trace_span_t *span = &shard->trace[head % TRACE_RING_SIZE];
+    span->cat = cat;
+    span->name = name;
+    span->start_ns = start;
+    span->dur_ns = monotonic_ns() - start;
+    span->request = t_trace_request;
+    span->tid = trace_thread_id();
+    __atomic_store_n(&shard->trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Case-insensitive prefix compare
+static int strncasecmp_compat(const char *a, const char *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int ca = (unsigned char)a[i], cb = (unsigned char)b[i];
+        if (ca >= 'A' && ca <= 'Z') ca += 32;
+        if (cb >= 'A' && cb <= 'Z') cb += 32;
+        if (ca != cb) return ca - cb;
+        if (ca == 0) return 0;
+    }
+    return 0;
+}
+
+// Find an HTTP request header value (case-insensitive name match)
+static int http_get_header(const char *request, const char *name, char *value, size_t value_size) {
+    if (!request || !name || !value || value_size == 0) return 0;
+
+    size_t name_len = strlen(name);
+    const char *line = strstr(request, "\r\n");
+    while (line) {
+        line += 2;
+        if (line[0] == '\r' || line[0] == '\0') break;
+
+        if (strncasecmp_compat(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            size_t len = strcspn(v, "\r\n");
+            if (len >= value_size) len = value_size - 1;
+            memcpy(value, v, len);
+            value[len] = '\0';
+            return 1;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return 0;
+}
+
+// Parse a Content-Length value: digits with optional trailing whitespace.
+// Returns 0 when malformed; values above limit are clamped to limit + 1
+// so the caller can reject them without overflowing.
+static int http_parse_content_length(const char *value, size_t limit, size_t *length) {
+    size_t n = 0;
+    const char *p = value;
+    if (!isdigit((unsigned char)*p)) return 0;
+    for (; isdigit((unsigned char)*p); p++) {
+        if (n <= limit) n = n * 10 + (size_t)(*p - '0');
+    }
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p) return 0;
+    *length = n > limit ? limit + 1 : n;
+    return 1;
+}
+
+// Check whether a comma-separated request header lists a token with a
+// non-zero quality (used for Accept-Encoding and Accept)
+static int http_header_accepts(const char *request, const char *header, const char *token) {
+    char value[256];
+    size_t token_len = strlen(token);
+    if (!http_get_header(request, header, value, sizeof(value))) return 0;
+
+    for (char *tok = value; *tok;) {
+        while (*tok == ' ' || *tok == ',') tok++;
+        size_t len = strcspn(tok, ",");
+        if (len >= token_len && strncasecmp_compat(tok, token, token_len) == 0 &&
+            strchr(",; ", tok[token_len])) {
+            const char *q = strstr(tok, "q=");
+            if (q && q < tok + len && atof(q + 2) <= 0.0) return 0;
+            return 1;
+        }
+        tok += len;
+    }
+    return 0;
+}
+
+static int http_accepts_gzip(const char *request) {
+    return http_header_accepts(request, "Accept-Encoding", "gzip");
+}
+
+// Check whether the client asks for the CBOR device encoding
+static int http_accepts_cbor(const char *request) {
+    return http_header_accepts(request, "Accept", "application/cbor");
+}
+
+// URL-decode len bytes of in into out; plus_as_space applies the form
+// encoding of query strings. Returns 0 when the result was truncated.
+static int http_url_decode(const char *in, size_t len, int plus_as_space, char *out, size_t out_size) {
+    size_t k = 0;
+    for (const char *v = in; v < in + len; v++) {
+        if (k >= out_size - 1) {
+            out[k] = '\0';
+            return 0;
+        }
+        if (*v == '+' && plus_as_space) {
+            out[k++] = ' ';
+        } else if (*v == '%' && v + 2 < in + len && isxdigit((unsigned char)v[1]) &&
+                   isxdigit((unsigned char)v[2])) {
+            char hex[3] = {v[1], v[2], '\0'};
+            out[k++] = (char)strtol(hex, NULL, 16);
+            v += 2;
+        } else {
+            out[k++] = *v;
+        }
+    }
+    out[k] = '\0';
+    return 1;
+}
+
+// Find a query-string parameter and URL-decode its value. query points just
+// past the '?' (or is NULL). Returns 1 when the parameter is present.
+static int http_query_param(const char *query, const char *name, char *value, size_t value_size) {
+    if (!query || !name || !value || value_size == 0) return 0;
+
+    size_t name_len = strlen(name);
+    for (const char *p = query; *p;) {
+        size_t len = strcspn(p, "&");
+        if (strncmp(p, name, name_len) == 0 && (p[name_len] == '=' || name_len == len)) {
+            const char *v = p[name_len] == '=' ? p + name_len + 1 : p + name_len;
+            http_url_decode(v, (size_t)(p + len - v), 1, value, value_size);
+            return 1;
+        }
+        p += len;
+        if (*p == '&') p++;
+    }
+    return 0;
+}
+
 // Initialize logging system
 int init_logging(void) {
     if (!g_config.verbose_logging) {
@@ -363,6 +1699,28 @@ static int validate_busid(const char *busid) {
     return 1;
 }
 
+// List a running child in g_exec_inflight; returns its slot, or -1 when
+// every slot is taken and the command just goes unlisted
+static int exec_inflight_begin(const char *cmd, int pid) {
+    for (int i = 0; i < EXEC_INFLIGHT_SLOTS; i++) {
+        exec_inflight_t *slot = &g_exec_inflight[i];
+        if (slot->state == 0 && __sync_bool_compare_and_swap(&slot->state, 0, 1)) {
+            slot->pid = pid;
+            slot->start_ns = monotonic_ns();
+            size_t len = safe_strnlen(cmd, sizeof(slot->cmd) - 1);
+            memcpy(slot->cmd, cmd, len);
+            slot->cmd[len] = '\0';
+            __atomic_store_n(&slot->state, 2, __ATOMIC_RELEASE);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void exec_inflight_end(int slot) {
+    if (slot >= 0) __atomic_store_n(&g_exec_inflight[slot].state, 0, __ATOMIC_RELEASE);
+}
+
 // Validate command for allowed list
 static int validate_command(const char *cmd) {
     if (!cmd) return 0;
@@ -391,8 +1749,9 @@ static int validate_command(const char *cmd) {
     return 0;
 }
 
-// Secure command execution
-static int secure_exec_command(const char *cmd, char *output, size_t output_size) {
+// Run an allowed command and capture its output. Returns the exit code, or
+// -1 when it could not be run or was killed after EXEC_TIMEOUT_SECONDS.
+static int exec_command_run(const char *cmd, char *output, size_t output_size, int *timed_out) {
     if (!cmd || !output || output_size == 0) {
         log_message("ERROR", "Invalid arguments");
         return -1;
@@ -439,6 +1798,7 @@ static int secure_exec_command(const char *cmd, char *output, size_t output_size
     }
     
     CloseHandle(hWrite);
+    int inflight = exec_inflight_begin(cmd, (int)pi.dwProcessId);
     
     DWORD bytesRead;
     size_t totalRead = 0;
@@ -453,9 +1813,15 @@ static int secure_exec_command(const char *cmd, char *output, size_t output_size
     }
     output[totalRead] = '\0';
     
-    WaitForSingleObject(pi.hProcess, 5000);
-    DWORD exitCode;
-    GetExitCodeProcess(pi.hProcess, &exitCode);
+    DWORD exitCode = (DWORD)-1;
+    if (WaitForSingleObject(pi.hProcess, EXEC_TIMEOUT_SECONDS * 1000) == WAIT_TIMEOUT) {
+        TerminateProcess(pi.hProcess, 1);
+        *timed_out = 1;
+        log_message("WARN", "Command timed out: %s", cmd);
+    } else {
+        GetExitCodeProcess(pi.hProcess, &exitCode);
+    }
+    exec_inflight_end(inflight);
     
     CloseHandle(hRead);
     CloseHandle(pi.hProcess);
@@ -470,7 +1836,15 @@ static int secure_exec_command(const char *cmd, char *output, size_t output_size
         return -1;
     }
     
+    unsigned long long span = trace_begin();
     pid_t pid = fork();
+    if (pid != 0) trace_end("exec", "fork", span);
+    int inflight = -1;
+    if (pid > 0) {
+        USBCTL_PROBE2(exec__spawn, cmd, pid);
+        flight_record(FLIGHT_EXEC_SPAWN, cmd, pid, 0);
+        inflight = exec_inflight_begin(cmd, pid);
+    }
     if (pid == -1) {
         close(pipefd[0]);
         close(pipefd[1]);
@@ -510,8 +1884,17 @@ static int secure_exec_command(const char *cmd, char *output, size_t output_size
     size_t total = 0;
     char buffer[256];
     ssize_t bytesRead;
+    unsigned long long deadline = monotonic_ns() + EXEC_TIMEOUT_SECONDS * 1000000000ULL;
+    struct pollfd pfd = {pipefd[0], POLLIN, 0};
     
-    while ((bytesRead = read(pipefd[0], buffer, sizeof(buffer) - 1)) > 0) {
+    while (1) {
+        unsigned long long now = monotonic_ns();
+        int ready = now < deadline ? poll(&pfd, 1, (int)((deadline - now) / 1000000ULL) + 1) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready == 0) *timed_out = 1;
+        if (ready <= 0) break;
+        bytesRead = read(pipefd[0], buffer, sizeof(buffer) - 1);
+        if (bytesRead <= 0) break;
         if (total + (size_t)bytesRead < output_size - 1) {
             memcpy(output + total, buffer, bytesRead);
             total += bytesRead;
@@ -523,19 +1906,66 @@ static int secure_exec_command(const char *cmd, char *output, size_t output_size
     
     close(pipefd[0]);
     
+    if (*timed_out) {
+        kill(pid, SIGKILL);
+        log_message("WARN", "Command timed out: %s", cmd);
+    }
     int status;
     waitpid(pid, &status, 0);
+    exec_inflight_end(inflight);
     
-    return WEXITSTATUS(status);
+    return *timed_out ? -1 : WEXITSTATUS(status);
 #endif
 }
 
+static const char *const EXEC_KIND_NAMES[EXEC_KIND_COUNT] = {"lsusb", "list", "bind", "unbind", "other"};
+
+static exec_kind_t exec_kind(const char *cmd) {
+    if (strncmp(cmd, "lsusb", 5) == 0) return EXEC_LSUSB;
+    if (strstr(cmd, " unbind ") || strstr(cmd, " detach ")) return EXEC_UNBIND;
+    if (strstr(cmd, " bind ") || strstr(cmd, " attach ")) return EXEC_BIND;
+    if (strstr(cmd, " list")) return EXEC_LIST;
+    return EXEC_OTHER;
+}
+
+// Secure command execution, timed and counted per command and exit code
+static int secure_exec_command(const char *cmd, char *output, size_t output_size) {
+    unsigned long long start = monotonic_ns();
+    unsigned long long span = trace_begin();
+    int timed_out = 0;
+    int code = exec_command_run(cmd, output, output_size, &timed_out);
+    unsigned long long elapsed = monotonic_ns() - start;
+    USBCTL_PROBE4(exec__exit, cmd, code, elapsed, timed_out);
+    flight_record(FLIGHT_EXEC_EXIT, cmd, code, elapsed);
+
+    metrics_shard_t *shard = metrics_shard();
+    if (shard && cmd) {
+        exec_kind_t kind = exec_kind(cmd);
+        trace_end("exec", EXEC_KIND_NAMES[kind], span);
+        histogram_observe(&shard->exec_latency[kind], elapsed);
+        if (timed_out) {
+            metric_add(&shard->exec_timeouts[kind], 1);
+        } else {
+            int slot = code < 0 ? METRIC_EXIT_SLOTS - 1 : METRIC_EXIT_SLOTS - 2;
+            for (int i = 0; i < METRIC_EXIT_SLOTS - 2; i++) {
+                if (code == METRIC_EXIT_CODES[i]) slot = i;
+            }
+            metric_add(&shard->exec_exits[kind][slot], 1);
+        }
+    }
+    return code;
+}
+
 // Check if device is bound
 int is_device_bound(const char *busid) {
     if (!validate_busid(busid)) {
         return 0;
     }
     
+    if (g_sim.enabled) {
+        return sim_is_bound(busid);
+    }
+
 #ifdef PLATFORM_WINDOWS
     // On Windows, we need to check via usbipd command
     // For now, return 0 (not bound by default)
@@ -678,6 +2108,42 @@ int load_config(void) {
             size_t len = safe_strnlen(line + 9, sizeof(g_config.log_file) - 1);
             memcpy(g_config.log_file, line + 9, len);
             g_config.log_file[len] = '\0';
+        } else if (strncmp(line, "shards=", 7) == 0) {
+            g_config.listen_shards = atoi(line + 7);
+        } else if (strncmp(line, "unix_socket=", 12) == 0) {
+            size_t len = safe_strnlen(line + 12, sizeof(g_config.unix_socket) - 1);
+            memcpy(g_config.unix_socket, line + 12, len);
+            g_config.unix_socket[len] = '\0';
+        } else if (strncmp(line, "unix_mode=", 10) == 0) {
+            g_config.unix_mode = (int)strtol(line + 10, NULL, 8);
+        } else if (strncmp(line, "rate_cheap=", 11) == 0) {
+            g_config.rate_cheap = atof(line + 11);
+        } else if (strncmp(line, "rate_cheap_burst=", 17) == 0) {
+            g_config.rate_cheap_burst = atof(line + 17);
+        } else if (strncmp(line, "rate_expensive=", 15) == 0) {
+            g_config.rate_expensive = atof(line + 15);
+        } else if (strncmp(line, "rate_expensive_burst=", 21) == 0) {
+            g_config.rate_expensive_burst = atof(line + 21);
+        } else if (strncmp(line, "max_expensive_inflight=", 23) == 0) {
+            g_config.max_expensive_inflight = atoi(line + 23);
+        } else if (strncmp(line, "header_timeout=", 15) == 0) {
+            g_config.header_timeout = atoi(line + 15);
+        } else if (strncmp(line, "body_timeout=", 13) == 0) {
+            g_config.body_timeout = atoi(line + 13);
+        } else if (strncmp(line, "keepalive_timeout=", 18) == 0) {
+            g_config.keepalive_timeout = atoi(line + 18);
+        } else if (strncmp(line, "sse_heartbeat=", 14) == 0) {
+            g_config.sse_heartbeat = atoi(line + 14);
+        } else if (strncmp(line, "sse_workers=", 12) == 0) {
+            g_config.sse_workers = atoi(line + 12);
+        } else if (strncmp(line, "sse_max_clients=", 16) == 0) {
+            g_config.sse_max_clients = atoi(line + 16);
+        } else if (strncmp(line, "sse_stall_timeout=", 18) == 0) {
+            g_config.sse_stall_timeout = atoi(line + 18);
+        } else if (strncmp(line, "sse_snapshot_interval=", 22) == 0) {
+            g_config.sse_snapshot_interval = atoi(line + 22);
+        } else if (strncmp(line, "debug_remote=", 13) == 0) {
+            g_config.debug_remote = atoi(line + 13);
         } else if (strncmp(line, "bound_device=", 13) == 0 && 
                    g_config.bound_devices_count < MAX_DEVICES) {
             size_t len = safe_strnlen(line + 13, 15);
@@ -690,8 +2156,12 @@ int load_config(void) {
     return 1;
 }
 
-// Save configuration
+// Save configuration; a simulated run never writes it, so neither the
+// backend nor simulated bound devices leak into the real config file
 int save_config(void) {
+    if (g_sim.enabled) return 1;
+
+    unsigned long long span = trace_begin();
     char dir_path[512];
     int ret = snprintf(dir_path, sizeof(dir_path), "%s", g_config.config_path);
     if (ret < 0 || ret >= (int)sizeof(dir_path)) return 0;
@@ -703,11 +2173,39 @@ int save_config(void) {
     }
 
     FILE *fp = fopen(g_config.config_path, "w");
-    if (!fp) return 0;
+    if (!fp) {
+        USBCTL_PROBE2(config__save, g_config.config_path, 0);
+        trace_end("config", "save_config", span);
+        return 0;
+    }
 
     fprintf(fp, "port=%d\n", g_config.port);
     fprintf(fp, "bind=%s\n", g_config.bind_address);
     fprintf(fp, "poll_interval=%d\n", g_config.poll_interval);
+    if (g_config.listen_shards > 1) {
+        fprintf(fp, "shards=%d\n", g_config.listen_shards);
+    }
+    if (g_config.unix_socket[0]) {
+        fprintf(fp, "unix_socket=%s\n", g_config.unix_socket);
+        fprintf(fp, "unix_mode=%04o\n", g_config.unix_mode);
+    }
+#define SAVE_CHANGED(key, fmt, field) \
+    if (g_config.field != g_config_defaults.field) fprintf(fp, key "=" fmt "\n", g_config.field)
+    SAVE_CHANGED("rate_cheap", "%g", rate_cheap);
+    SAVE_CHANGED("rate_cheap_burst", "%g", rate_cheap_burst);
+    SAVE_CHANGED("rate_expensive", "%g", rate_expensive);
+    SAVE_CHANGED("rate_expensive_burst", "%g", rate_expensive_burst);
+    SAVE_CHANGED("max_expensive_inflight", "%d", max_expensive_inflight);
+    SAVE_CHANGED("header_timeout", "%d", header_timeout);
+    SAVE_CHANGED("body_timeout", "%d", body_timeout);
+    SAVE_CHANGED("keepalive_timeout", "%d", keepalive_timeout);
+    SAVE_CHANGED("sse_heartbeat", "%d", sse_heartbeat);
+    SAVE_CHANGED("sse_workers", "%d", sse_workers);
+    SAVE_CHANGED("sse_max_clients", "%d", sse_max_clients);
+    SAVE_CHANGED("sse_stall_timeout", "%d", sse_stall_timeout);
+    SAVE_CHANGED("sse_snapshot_interval", "%d", sse_snapshot_interval);
+    SAVE_CHANGED("debug_remote", "%d", debug_remote);
+#undef SAVE_CHANGED
 
     update_bound_devices_config();
     for (int i = 0; i < g_config.bound_devices_count; i++) {
@@ -717,44 +2215,855 @@ int save_config(void) {
     }
 
     fclose(fp);
+    g_config_saved_at = time(NULL);
+    USBCTL_PROBE2(config__save, g_config.config_path, 1);
+    trace_end("config", "save_config", span);
     return 1;
 }
 
 // ============================================================================
-// USB/IP BACKEND FUNCTIONS
+// JSON TOKENIZER
 // ============================================================================
 
-// Update bound devices configuration
-void update_bound_devices_config(void) {
-    g_config.bound_devices_count = 0;
-    for (int i = 0; i < g_device_count; i++) {
-        if (g_devices[i].bound && g_config.bound_devices_count < MAX_DEVICES) {
-            size_t len = safe_strnlen(g_devices[i].busid, 15);
-            memcpy(g_config.bound_devices[g_config.bound_devices_count], 
-                   g_devices[i].busid, len);
-            g_config.bound_devices[g_config.bound_devices_count][len] = '\0';
-            g_config.bound_devices_count++;
-        }
-    }
+// Pull-style tokenizer over a request body, parsed in place. Each call to
+// json_next() validates the grammar up to one token; the token points into
+// the input (strings without their quotes) and nothing is allocated.
+
+static void json_reader_init(json_reader_t *r, const char *json, size_t len) {
+    memset(r, 0, sizeof(*r));
+    r->json = json;
+    r->len = len;
+    r->state = JSON_EXPECT_VALUE;
 }
 
-// Restore bound devices
-void restore_bound_devices(void) {
-    log_message("INFO", "Restoring bound devices");
+static json_token_type_t json_fail(json_reader_t *r) {
+    r->state = JSON_EXPECT_NOTHING;
+    r->type = JSON_ERROR;
+    return JSON_ERROR;
+}
 
-    for (int i = 0; i < g_config.bound_devices_count; i++) {
-        if (strlen(g_config.bound_devices[i]) > 0) {
-            if (bind_device(g_config.bound_devices[i])) {
-                log_message("INFO", "Restored: %s", g_config.bound_devices[i]);
+// A value just ended: the enclosing container decides what may follow
+static void json_value_done(json_reader_t *r) {
+    r->state = r->depth > 0 ? JSON_EXPECT_COMMA_OR_END : JSON_EXPECT_EOF;
+}
+
+static int json_in_object(const json_reader_t *r) {
+    return r->depth > 0 && (r->objects >> (r->depth - 1)) & 1;
+}
+
+static json_token_type_t json_close(json_reader_t *r, char c) {
+    r->pos++;
+    r->depth--;
+    json_value_done(r);
+    return r->type = c == '}' ? JSON_OBJECT_END : JSON_ARRAY_END;
+}
+
+static void json_skip_space(json_reader_t *r) {
+    while (r->pos < r->len && (r->json[r->pos] == ' ' || r->json[r->pos] == '\t' ||
+                               r->json[r->pos] == '\n' || r->json[r->pos] == '\r')) {
+        r->pos++;
+    }
+}
+
+// Scan a string starting at the opening quote. Control characters and
+// malformed escapes are rejected; escapes are decoded later on demand.
+static int json_scan_string(json_reader_t *r) {
+    size_t pos = r->pos + 1;
+    r->escaped = 0;
+    while (pos < r->len) {
+        unsigned char c = (unsigned char)r->json[pos];
+        if (c == '"') {
+            r->token = r->json + r->pos + 1;
+            r->token_len = pos - r->pos - 1;
+            r->pos = pos + 1;
+            return 1;
+        }
+        if (c < 0x20) return 0;
+        if (c == '\\') {
+            if (++pos >= r->len) return 0;
+            char e = r->json[pos];
+            if (e == 'u') {
+                for (int i = 1; i <= 4; i++) {
+                    if (pos + i >= r->len || !isxdigit((unsigned char)r->json[pos + i])) return 0;
+                }
+                pos += 4;
+            } else if (!strchr("\"\\/bfnrt", e) || e == '\0') {
+                return 0;
             }
+            r->escaped = 1;
         }
+        pos++;
     }
+    return 0;
 }
 
-#ifndef PLATFORM_WINDOWS
-// Parse lsusb output (Linux only)
-static void parse_lsusb(const char *output) {
-    g_lsusb_count = 0;
+// Scan a number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static int json_scan_number(json_reader_t *r) {
+    const char *s = r->json;
+    size_t pos = r->pos, len = r->len;
+    if (pos < len && s[pos] == '-') pos++;
+    if (pos < len && s[pos] == '0') {
+        pos++;
+    } else if (pos < len && s[pos] >= '1' && s[pos] <= '9') {
+        while (pos < len && isdigit((unsigned char)s[pos])) pos++;
+    } else {
+        return 0;
+    }
+    if (pos < len && s[pos] == '.') {
+        if (++pos >= len || !isdigit((unsigned char)s[pos])) return 0;
+        while (pos < len && isdigit((unsigned char)s[pos])) pos++;
+    }
+    if (pos < len && (s[pos] == 'e' || s[pos] == 'E')) {
+        pos++;
+        if (pos < len && (s[pos] == '+' || s[pos] == '-')) pos++;
+        if (pos >= len || !isdigit((unsigned char)s[pos])) return 0;
+        while (pos < len && isdigit((unsigned char)s[pos])) pos++;
+    }
+    r->token = s + r->pos;
+    r->token_len = pos - r->pos;
+    r->pos = pos;
+    return 1;
+}
+
+// Read the next token. JSON_END follows the one top-level value; any
+// grammar error makes every later call return JSON_ERROR as well.
+static json_token_type_t json_next(json_reader_t *r) {
+    const char *s = r->json;
+    for (;;) {
+        json_skip_space(r);
+        if (r->state == JSON_EXPECT_NOTHING) return json_fail(r);
+        if (r->pos >= r->len) {
+            if (r->state != JSON_EXPECT_EOF) return json_fail(r);
+            r->state = JSON_EXPECT_NOTHING;
+            return r->type = JSON_END;
+        }
+        char c = s[r->pos];
+        r->token = s + r->pos;
+        r->token_len = 1;
+
+        switch (r->state) {
+        case JSON_EXPECT_COMMA_OR_END:
+            if (c == ',') {
+                r->pos++;
+                r->state = json_in_object(r) ? JSON_EXPECT_KEY : JSON_EXPECT_VALUE;
+                continue;
+            }
+            if (c == (json_in_object(r) ? '}' : ']')) return json_close(r, c);
+            return json_fail(r);
+        case JSON_EXPECT_KEY_OR_END:
+            if (c == '}') return json_close(r, c);
+            r->state = JSON_EXPECT_KEY;
+            continue;
+        case JSON_EXPECT_VALUE_OR_END:
+            if (c == ']') return json_close(r, c);
+            r->state = JSON_EXPECT_VALUE;
+            continue;
+        case JSON_EXPECT_KEY:
+            if (c != '"' || !json_scan_string(r)) return json_fail(r);
+            json_skip_space(r);
+            if (r->pos >= r->len || s[r->pos] != ':') return json_fail(r);
+            r->pos++;
+            r->state = JSON_EXPECT_VALUE;
+            return r->type = JSON_KEY;
+        case JSON_EXPECT_VALUE:
+            if (c == '{' || c == '[') {
+                if (r->depth >= JSON_MAX_DEPTH) return json_fail(r);
+                if (c == '{') {
+                    r->objects |= 1U << r->depth;
+                } else {
+                    r->objects &= ~(1U << r->depth);
+                }
+                r->depth++;
+                r->pos++;
+                r->state = c == '{' ? JSON_EXPECT_KEY_OR_END : JSON_EXPECT_VALUE_OR_END;
+                return r->type = c == '{' ? JSON_OBJECT_START : JSON_ARRAY_START;
+            }
+            if (c == '"') {
+                if (!json_scan_string(r)) return json_fail(r);
+                r->type = JSON_STRING;
+            } else if (c == '-' || isdigit((unsigned char)c)) {
+                if (!json_scan_number(r)) return json_fail(r);
+                r->type = JSON_NUMBER;
+            } else if (r->len - r->pos >= 4 && memcmp(s + r->pos, "true", 4) == 0) {
+                r->token_len = 4;
+                r->type = JSON_TRUE;
+            } else if (r->len - r->pos >= 5 && memcmp(s + r->pos, "false", 5) == 0) {
+                r->token_len = 5;
+                r->type = JSON_FALSE;
+            } else if (r->len - r->pos >= 4 && memcmp(s + r->pos, "null", 4) == 0) {
+                r->token_len = 4;
+                r->type = JSON_NULL;
+            } else {
+                return json_fail(r);
+            }
+            if (r->type == JSON_TRUE || r->type == JSON_FALSE || r->type == JSON_NULL) {
+                r->pos += r->token_len;
+            }
+            json_value_done(r);
+            return r->type;
+        default:
+            return json_fail(r);
+        }
+    }
+}
+
+// Skip the rest of a value whose first token was just read
+static int json_skip_value(json_reader_t *r) {
+    if (r->type != JSON_OBJECT_START && r->type != JSON_ARRAY_START) return r->type != JSON_ERROR;
+    int depth = r->depth;
+    while (r->depth >= depth) {
+        if (json_next(r) == JSON_ERROR) return 0;
+    }
+    return 1;
+}
+
+static unsigned int json_hex4(const char *s) {
+    unsigned int value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+        value = value << 4 | (unsigned int)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    return value;
+}
+
+static void json_put_utf8(char *out, size_t *k, unsigned int cp) {
+    if (cp < 0x80) {
+        out[(*k)++] = (char)cp;
+    } else if (cp < 0x800) {
+        out[(*k)++] = (char)(0xc0 | (cp >> 6));
+        out[(*k)++] = (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out[(*k)++] = (char)(0xe0 | (cp >> 12));
+        out[(*k)++] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[(*k)++] = (char)(0x80 | (cp & 0x3f));
+    } else {
+        out[(*k)++] = (char)(0xf0 | (cp >> 18));
+        out[(*k)++] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        out[(*k)++] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[(*k)++] = (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+// Decode the current string or key token into out. Fails when it does not
+// fit, or holds NUL or a lone surrogate, rather than truncating.
+static int json_string_copy(const json_reader_t *r, char *out, size_t out_size) {
+    const char *s = r->token;
+    size_t k = 0;
+    for (size_t i = 0; i < r->token_len; i++) {
+        char c = s[i];
+        if (c != '\\') {
+            if (k + 1 >= out_size) return 0;
+            out[k++] = c;
+            continue;
+        }
+        c = s[++i];
+        if (c == 'u') {
+            unsigned int cp = json_hex4(s + i + 1);
+            i += 4;
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                // High surrogate: must be followed by \u and a low one
+                if (i + 6 >= r->token_len || s[i + 1] != '\\' || s[i + 2] != 'u') return 0;
+                unsigned int lo = json_hex4(s + i + 3);
+                if (lo < 0xdc00 || lo >= 0xe000) return 0;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                i += 6;
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                return 0;
+            }
+            if (cp == 0) return 0;
+            size_t need = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+            if (k + need >= out_size) return 0;
+            json_put_utf8(out, &k, cp);
+            continue;
+        }
+        if (k + 1 >= out_size) return 0;
+        switch (c) {
+        case 'b': out[k++] = '\b'; break;
+        case 'f': out[k++] = '\f'; break;
+        case 'n': out[k++] = '\n'; break;
+        case 'r': out[k++] = '\r'; break;
+        case 't': out[k++] = '\t'; break;
+        default: out[k++] = c; break;
+        }
+    }
+    out[k] = '\0';
+    return 1;
+}
+
+static int json_bind_object(json_reader_t *r, const json_field_t *fields, int field_count, void *base);
+
+// Bind the value following a key into its field
+static int json_bind_field(json_reader_t *r, const json_field_t *field, void *base) {
+    char *dst = (char *)base + field->offset;
+    json_token_type_t type = json_next(r);
+
+    switch (field->kind) {
+    case JSON_BIND_STRING:
+        return type == JSON_STRING && json_string_copy(r, dst, field->size);
+    case JSON_BIND_SCALAR:
+        // Kept as raw JSON text to be echoed back: a number or a string
+        // without escapes, quotes included
+        if (type == JSON_STRING && !r->escaped && r->token_len + 2 < field->size) {
+            memcpy(dst, r->token - 1, r->token_len + 2);
+            dst[r->token_len + 2] = '\0';
+            return 1;
+        }
+        if (type == JSON_NUMBER && r->token_len < field->size) {
+            memcpy(dst, r->token, r->token_len);
+            dst[r->token_len] = '\0';
+            return 1;
+        }
+        return 0;
+    case JSON_BIND_OBJECTS: {
+        int *count = (int *)((char *)base + field->count_offset);
+        if (type != JSON_ARRAY_START) return 0;
+        *count = 0;
+        for (;;) {
+            type = json_next(r);
+            if (type == JSON_ARRAY_END) return 1;
+            if (type != JSON_OBJECT_START || *count >= field->max_count) return 0;
+            if (!json_bind_object(r, field->fields, field->field_count, dst + (size_t)*count * field->size)) {
+                return 0;
+            }
+            (*count)++;
+        }
+    }
+    }
+    return 0;
+}
+
+// Bind the members of an object whose '{' was just read. Unknown members
+// are skipped; duplicates, a bad value or a missing required member fail
+// with r->error_field naming the member.
+static int json_bind_object(json_reader_t *r, const json_field_t *fields, int field_count, void *base) {
+    unsigned int seen = 0;
+    for (;;) {
+        json_token_type_t type = json_next(r);
+        if (type == JSON_OBJECT_END) break;
+        if (type != JSON_KEY) return 0;
+
+        // Keys are short; one that does not fit matches no field
+        char key[32];
+        int match = -1;
+        if (json_string_copy(r, key, sizeof(key))) {
+            for (int i = 0; i < field_count && match < 0; i++) {
+                if (strcmp(fields[i].name, key) == 0) match = i;
+            }
+        }
+        if (match < 0) {
+            json_next(r);
+            if (!json_skip_value(r)) return 0;
+            continue;
+        }
+        r->error_field = fields[match].name;
+        if ((seen & (1U << match)) || !json_bind_field(r, &fields[match], base)) return 0;
+        seen |= 1U << match;
+        r->error_field = NULL;
+    }
+    for (int i = 0; i < field_count; i++) {
+        if (fields[i].required && !(seen & (1U << i))) {
+            r->error_field = fields[i].name;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Bind a whole document, which must be one object, into a request struct.
+// Returns 1 on success; on failure *error_field names the offending member,
+// or is NULL when the body is not valid JSON.
+static int json_bind(const char *json, size_t len, const json_field_t *fields, int field_count,
+                     void *base, const char **error_field) {
+    json_reader_t r;
+    json_reader_init(&r, json, len);
+    int ok = json_next(&r) == JSON_OBJECT_START && json_bind_object(&r, fields, field_count, base);
+    if (ok && json_next(&r) != JSON_END) {
+        r.error_field = NULL;
+        ok = 0;
+    }
+    *error_field = ok ? NULL : r.error_field;
+    return ok;
+}
+
+// ============================================================================
+// TIMER WHEEL
+// ============================================================================
+
+static unsigned long long timer_now_ticks(void) {
+    return monotonic_ns() / (TIMER_TICK_MS * 1000000ULL);
+}
+
+static void timer_unlink_locked(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    t->armed = 0;
+    g_wheel.armed--;
+}
+
+// Place a timer in the level whose range covers its remaining ticks
+static void timer_place_locked(wheel_timer_t *t) {
+    unsigned long long expires = t->expires < g_wheel.current ? g_wheel.current : t->expires;
+    unsigned long long delta = expires - g_wheel.current;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (level == TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS))) {
+        expires = g_wheel.current + (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    wheel_timer_t *head = &g_wheel.slots[level][(expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void timer_wheel_init(void) {
+    lock_init(&g_wheel.lock, "g_wheel.lock");
+    pthread_cond_init(&g_wheel.idle, NULL);
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        for (int i = 0; i < TIMER_SLOTS; i++) {
+            g_wheel.slots[l][i].next = g_wheel.slots[l][i].prev = &g_wheel.slots[l][i];
+        }
+    }
+    g_wheel.current = timer_now_ticks();
+}
+
+// Arm (or re-arm) a timer to fire once after timeout_ms; O(1)
+static void timer_arm(wheel_timer_t *t, unsigned int timeout_ms,
+                      void (*callback)(wheel_timer_t *), void *arg) {
+    lock_acquire(&g_wheel.lock);
+    if (t->armed) timer_unlink_locked(t);
+    t->callback = callback;
+    t->arg = arg;
+    t->expires = timer_now_ticks() + (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_place_locked(t);
+    t->armed = 1;
+    g_wheel.armed++;
+    lock_release(&g_wheel.lock);
+}
+
+// Disarm a timer; O(1). If its callback is running, wait for it to finish so
+// the owner can free the object afterwards.
+static void timer_cancel(wheel_timer_t *t) {
+    lock_acquire(&g_wheel.lock);
+    while (g_wheel.running == t) {
+        lock_cond_wait(&g_wheel.idle, &g_wheel.lock);
+    }
+    if (t->armed) timer_unlink_locked(t);
+    lock_release(&g_wheel.lock);
+}
+
+// Move every timer of a higher-level slot down; returns the slot index
+static int timer_cascade_locked(int level) {
+    int index = (int)((g_wheel.current >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1));
+    wheel_timer_t *head = &g_wheel.slots[level][index];
+    wheel_timer_t *t = head->next;
+
+    head->next = head->prev = head;
+    while (t != head) {
+        wheel_timer_t *next = t->next;
+        timer_place_locked(t);
+        t = next;
+    }
+    return index;
+}
+
+// Advance the wheel to now, running expired callbacks outside the lock
+static void timer_advance(void) {
+    unsigned long long now = timer_now_ticks();
+
+    lock_acquire(&g_wheel.lock);
+    while (g_wheel.current <= now) {
+        int index = (int)(g_wheel.current & (TIMER_SLOTS - 1));
+        if (index == 0) {
+            for (int level = 1; level < TIMER_LEVELS && timer_cascade_locked(level) == 0; level++) {
+            }
+        }
+
+        wheel_timer_t *head = &g_wheel.slots[0][index];
+        while (head->next != head) {
+            wheel_timer_t *t = head->next;
+            timer_unlink_locked(t);
+            g_wheel.running = t;
+            lock_release(&g_wheel.lock);
+
+            t->callback(t);
+
+            lock_acquire(&g_wheel.lock);
+            g_wheel.running = NULL;
+            pthread_cond_broadcast(&g_wheel.idle);
+        }
+        g_wheel.current++;
+    }
+    lock_release(&g_wheel.lock);
+}
+
+// Single thread driving every connection deadline and heartbeat
+void *timer_thread(void *arg) {
+    (void)arg;
+    while (g_running) {
+#ifdef PLATFORM_WINDOWS
+        Sleep(TIMER_TICK_MS);
+#else
+        struct timespec ts = {0, TIMER_TICK_MS * 1000000L};
+        nanosleep(&ts, NULL);
+#endif
+        timer_advance();
+    }
+    return NULL;
+}
+
+// ============================================================================
+// SIMULATED BACKEND
+// ============================================================================
+
+// Built-in population mix, worded the way `usbip list -l` prints it
+static const sim_model_t SIM_DEFAULT_MIX[] = {
+    {0x0bda, 0x8153, 4, "Realtek Semiconductor Corp. : RTL8153 Gigabit Ethernet Adapter"},
+    {0x046d, 0xc52b, 4, "Logitech, Inc. : Unifying Receiver"},
+    {0x0781, 0x5583, 3, "SanDisk Corp. : Ultra Fit"},
+    {0x0403, 0x6001, 3, "Future Technology Devices International, Ltd : FT232 Serial (UART) IC"},
+    {0x10c4, 0xea60, 2, "Silicon Labs : CP210x UART Bridge"},
+    {0x1a86, 0x7523, 2, "QinHeng Electronics : CH340 serial converter"},
+    {0x0483, 0x374b, 2, "STMicroelectronics : ST-LINK/V2.1"},
+    {0x1050, 0x0407, 1, "Yubico.com : Yubikey 4/5 OTP+U2F+CCID"},
+    {0x2341, 0x0043, 1, "Arduino SA : Uno R3 (CDC ACM)"},
+};
+#define SIM_DEFAULT_MIX_COUNT (int)(sizeof(SIM_DEFAULT_MIX) / sizeof(SIM_DEFAULT_MIX[0]))
+
+// Apply one --sim key=value setting; returns 0 for an unknown key
+static int sim_config_line(const char *line) {
+    if (strncmp(line, "devices=", 8) == 0) {
+        g_sim.devices = atoi(line + 8);
+    } else if (strncmp(line, "buses=", 6) == 0) {
+        g_sim.buses = atoi(line + 6);
+    } else if (strncmp(line, "ports=", 6) == 0) {
+        g_sim.ports = atoi(line + 6);
+    } else if (strncmp(line, "depth=", 6) == 0) {
+        g_sim.depth = atoi(line + 6);
+    } else if (strncmp(line, "churn=", 6) == 0) {
+        g_sim.churn = atof(line + 6);
+    } else if (strncmp(line, "latency_ms=", 11) == 0) {
+        g_sim.latency_ms = atof(line + 11);
+    } else if (strncmp(line, "latency_sigma=", 14) == 0) {
+        g_sim.latency_sigma = atof(line + 14);
+    } else if (strncmp(line, "fail_rate=", 10) == 0) {
+        g_sim.fail_rate = atof(line + 10);
+    } else if (strncmp(line, "hang_rate=", 10) == 0) {
+        g_sim.hang_rate = atof(line + 10);
+    } else if (strncmp(line, "seed=", 5) == 0) {
+        g_sim.seed = strtoull(line + 5, NULL, 10);
+    } else if (strncmp(line, "mix=", 4) == 0) {
+        size_t len = safe_strnlen(line + 4, sizeof(g_sim.mix_spec) - 1);
+        memcpy(g_sim.mix_spec, line + 4, len);
+        g_sim.mix_spec[len] = '\0';
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// xorshift64*, uniform in [0, 1); callers hold g_sim.lock
+static double sim_random_locked(void) {
+    g_sim.rng ^= g_sim.rng >> 12;
+    g_sim.rng ^= g_sim.rng << 25;
+    g_sim.rng ^= g_sim.rng >> 27;
+    return (double)((g_sim.rng * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static int sim_pick_locked(int n) {
+    int i = (int)(sim_random_locked() * n);
+    return i < n ? i : n - 1;
+}
+
+// Service time of one bind or unbind: log-normal around latency_ms
+static unsigned long long sim_latency_locked(void) {
+    double u1 = 1.0 - sim_random_locked(), u2 = sim_random_locked();
+    double z = sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+    double ms = g_sim.latency_ms * exp(g_sim.latency_sigma * z);
+    return ms > 0 ? (unsigned long long)(ms * 1e6) : 0;
+}
+
+// Outcome of one simulated command: 0 ok, 1 failed, 2 hung
+static int sim_fault_locked(void) {
+    double u = sim_random_locked();
+    if (u < g_sim.hang_rate) {
+        g_sim.hangs++;
+        return 2;
+    }
+    if (u < g_sim.hang_rate + g_sim.fail_rate) {
+        g_sim.failures++;
+        return 1;
+    }
+    return 0;
+}
+
+static void sim_sleep_ns(unsigned long long ns) {
+#ifdef PLATFORM_WINDOWS
+    Sleep((DWORD)(ns / 1000000ULL));
+#else
+    struct timespec ts = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+#endif
+}
+
+static sim_device_t *sim_find_locked(const char *busid) {
+    for (int i = 0; i < g_sim.count; i++) {
+        if (strcmp(g_sim.dev[i].busid, busid) == 0) return &g_sim.dev[i];
+    }
+    return NULL;
+}
+
+// A port holding a device cannot also lead to a hub, so a new busid must
+// neither equal nor prefix (or be prefixed by) a plugged-in one
+static int sim_port_free_locked(const char *busid) {
+    size_t len = strlen(busid);
+    for (int i = 0; i < g_sim.count; i++) {
+        const char *other = g_sim.dev[i].busid;
+        size_t other_len = strlen(other);
+        size_t n = len < other_len ? len : other_len;
+        if (strncmp(busid, other, n) != 0) continue;
+        if (len == other_len || (len < other_len ? other[n] : busid[n]) == '.') return 0;
+    }
+    return 1;
+}
+
+// Plug a device into a free port: a root port on one of the buses, then
+// down through up to `depth` tiers of external hubs
+static int sim_plug_locked(void) {
+    if (g_sim.count >= MAX_DEVICES || g_sim.mix_weight <= 0) return 0;
+    for (int attempt = 0; attempt < 32; attempt++) {
+        char busid[16];
+        int len = snprintf(busid, sizeof(busid), "%d-%d", 1 + sim_pick_locked(g_sim.buses),
+                           1 + sim_pick_locked(g_sim.ports));
+        for (int tier = 0; tier < g_sim.depth && sim_random_locked() < 0.5; tier++) {
+            len += snprintf(busid + len, sizeof(busid) - (size_t)len, ".%d", 1 + sim_pick_locked(g_sim.ports));
+        }
+        if (!sim_port_free_locked(busid)) continue;
+
+        int weight = sim_pick_locked(g_sim.mix_weight), model = 0;
+        while (model < g_sim.mix_count - 1 && weight >= g_sim.mix[model].weight) {
+            weight -= g_sim.mix[model++].weight;
+        }
+        sim_device_t *dev = &g_sim.dev[g_sim.count++];
+        memcpy(dev->busid, busid, (size_t)len + 1);
+        dev->model = model;
+        dev->bound = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static void sim_unplug_locked(void) {
+    if (g_sim.count == 0) return;
+    int i = sim_pick_locked(g_sim.count);
+    memmove(&g_sim.dev[i], &g_sim.dev[i + 1], (size_t)(g_sim.count - i - 1) * sizeof(sim_device_t));
+    g_sim.count--;
+}
+
+// Replay the hotplug events due by now. Arrivals are Poisson at `churn`
+// per minute; each plugs or unplugs with odds that pull the population
+// back towards `devices`.
+static void sim_churn_locked(unsigned long long now) {
+    if (g_sim.churn <= 0) return;
+    double mean_ns = 60e9 / g_sim.churn;
+    for (int events = 0; g_sim.next_event_ns <= now; events++) {
+        if (events == MAX_DEVICES * 4) {
+            g_sim.next_event_ns = now + (unsigned long long)mean_ns;
+            break;
+        }
+        double plug = g_sim.count ? (double)g_sim.devices / (double)(g_sim.devices + g_sim.count) : 1.0;
+        if (sim_random_locked() < plug) {
+            sim_plug_locked();
+        } else {
+            sim_unplug_locked();
+        }
+        g_sim.hotplugs++;
+        g_sim.next_event_ns += (unsigned long long)(-log(1.0 - sim_random_locked()) * mean_ns) + 1;
+    }
+}
+
+// Parse sim_mix, a comma-separated list of VID:PID[*WEIGHT]; IDs found in
+// the built-in mix keep their names, others list as unknown like usbip does
+static void sim_parse_mix(void) {
+    const char *p = g_sim.mix_spec;
+    g_sim.mix_count = 0;
+    while (*p && g_sim.mix_count < SIM_MIX_MAX) {
+        unsigned int vid, pid;
+        int used = 0;
+        if (sscanf(p, "%4x:%4x%n", &vid, &pid, &used) != 2) break;
+        p += used;
+        int weight = 1;
+        if (*p == '*') {
+            char *end;
+            weight = (int)strtol(p + 1, &end, 10);
+            p = end;
+        }
+        sim_model_t *model = &g_sim.mix[g_sim.mix_count++];
+        model->vid = (unsigned short)vid;
+        model->pid = (unsigned short)pid;
+        model->weight = weight > 0 ? weight : 1;
+        model->desc = NULL;
+        for (int i = 0; i < SIM_DEFAULT_MIX_COUNT; i++) {
+            if (SIM_DEFAULT_MIX[i].vid == vid && SIM_DEFAULT_MIX[i].pid == pid) model->desc = SIM_DEFAULT_MIX[i].desc;
+        }
+        while (*p == ',' || *p == ' ') p++;
+    }
+    if (g_sim.mix_spec[0] && *p) {
+        log_message("WARN", "Ignoring simulator mix from: %s", p);
+    }
+    if (g_sim.mix_count == 0) {
+        memcpy(g_sim.mix, SIM_DEFAULT_MIX, sizeof(SIM_DEFAULT_MIX));
+        g_sim.mix_count = SIM_DEFAULT_MIX_COUNT;
+    }
+    g_sim.mix_weight = 0;
+    for (int i = 0; i < g_sim.mix_count; i++) g_sim.mix_weight += g_sim.mix[i].weight;
+}
+
+// Clamp the settings and plug in the initial population
+static void sim_init(void) {
+    lock_init(&g_sim.lock, "g_sim.lock");
+    if (g_sim.devices < 0) g_sim.devices = 0;
+    if (g_sim.devices > MAX_DEVICES) g_sim.devices = MAX_DEVICES;
+    if (g_sim.buses < 1) g_sim.buses = 1;
+    if (g_sim.buses > SIM_BUSES_MAX) g_sim.buses = SIM_BUSES_MAX;
+    if (g_sim.ports < 1) g_sim.ports = 1;
+    if (g_sim.ports > SIM_PORTS_MAX) g_sim.ports = SIM_PORTS_MAX;
+    if (g_sim.depth < 0) g_sim.depth = 0;
+    if (g_sim.depth > SIM_DEPTH_MAX) g_sim.depth = SIM_DEPTH_MAX;
+    if (g_sim.latency_ms < 0) g_sim.latency_ms = 0;
+    if (g_sim.latency_sigma < 0) g_sim.latency_sigma = 0;
+    if (g_sim.fail_rate < 0) g_sim.fail_rate = 0;
+    if (g_sim.hang_rate < 0) g_sim.hang_rate = 0;
+
+    // Unseeded runs log the seed they drew so they can be replayed
+    unsigned long long seed = g_sim.seed ? g_sim.seed : monotonic_ns() ^ ((unsigned long long)time(NULL) << 20);
+    g_sim.rng = (seed * 0x9E3779B97F4A7C15ULL) | 1;
+    sim_parse_mix();
+
+    lock_acquire(&g_sim.lock);
+    while (g_sim.count < g_sim.devices && sim_plug_locked()) {}
+    if (g_sim.churn > 0) {
+        g_sim.next_event_ns = monotonic_ns() + (unsigned long long)(-log(1.0 - sim_random_locked()) * 60e9 / g_sim.churn);
+    }
+    int count = g_sim.count;
+    lock_release(&g_sim.lock);
+
+    log_message("INFO", "Simulated backend: %d devices on %d buses x %d ports, depth %d, %g hotplugs/min, seed %llu",
+                count, g_sim.buses, g_sim.ports, g_sim.depth, g_sim.churn, seed);
+}
+
+static int sim_is_bound(const char *busid) {
+    lock_acquire(&g_sim.lock);
+    const sim_device_t *dev = sim_find_locked(busid);
+    int bound = dev && dev->bound;
+    lock_release(&g_sim.lock);
+    return bound;
+}
+
+// Stand-in for `usbip list -l`: fills devices the way the parser does, or
+// returns -1 on an injected failure like a failed command
+static int sim_list_devices(usb_device_t *devices) {
+    int count = 0;
+    lock_acquire(&g_sim.lock);
+    sim_churn_locked(monotonic_ns());
+    int fault = sim_fault_locked();
+    if (!fault) {
+        for (int i = 0; i < g_sim.count; i++) {
+            const sim_device_t *dev = &g_sim.dev[i];
+            const sim_model_t *model = &g_sim.mix[dev->model];
+            usb_device_t *out = &devices[count++];
+            memcpy(out->busid, dev->busid, sizeof(out->busid));
+            snprintf(out->info, sizeof(out->info), "%s (%04x:%04x)",
+                     model->desc ? model->desc : "unknown vendor : unknown product", model->vid, model->pid);
+            out->bound = dev->bound;
+        }
+    }
+    lock_release(&g_sim.lock);
+
+    if (fault == 2) sim_sleep_ns(EXEC_TIMEOUT_SECONDS * 1000000000ULL);
+    return fault ? -1 : count;
+}
+
+// Stand-in for `usbip bind/unbind -b`: waits out a log-normal service time,
+// then fails like usbip would for an absent device or one already in the
+// requested state. A hang runs into the exec timeout and fails.
+static int sim_device_op(const char *busid, int bind) {
+    char label[96];
+    snprintf(label, sizeof(label), "sim %s -b %s", bind ? "bind" : "unbind", busid);
+    int inflight = exec_inflight_begin(label, 0);
+
+    lock_acquire(&g_sim.lock);
+    int fault = sim_fault_locked();
+    unsigned long long delay = fault == 2 ? EXEC_TIMEOUT_SECONDS * 1000000000ULL : sim_latency_locked();
+    lock_release(&g_sim.lock);
+    sim_sleep_ns(delay);
+
+    int result = 0;
+    if (!fault) {
+        lock_acquire(&g_sim.lock);
+        sim_churn_locked(monotonic_ns());
+        sim_device_t *dev = sim_find_locked(busid);
+        if (dev && dev->bound != bind) {
+            dev->bound = bind;
+            result = 1;
+        }
+        lock_release(&g_sim.lock);
+    }
+    exec_inflight_end(inflight);
+    return result;
+}
+
+// ============================================================================
+// USB/IP BACKEND FUNCTIONS
+// ============================================================================
+
+// Replace the device list in one step, so readers holding g_mutex never see
+// a half-filled one
+static void devices_publish(const usb_device_t *devices, int count) {
+    devices_lock();
+    memcpy(g_devices, devices, sizeof(usb_device_t) * (size_t)count);
+    g_device_count = count;
+    devices_unlock();
+}
+
+// Update bound devices configuration
+void update_bound_devices_config(void) {
+    devices_lock();
+    g_config.bound_devices_count = 0;
+    for (int i = 0; i < g_device_count; i++) {
+        if (g_devices[i].bound && g_config.bound_devices_count < MAX_DEVICES) {
+            size_t len = safe_strnlen(g_devices[i].busid, 15);
+            memcpy(g_config.bound_devices[g_config.bound_devices_count], 
+                   g_devices[i].busid, len);
+            g_config.bound_devices[g_config.bound_devices_count][len] = '\0';
+            g_config.bound_devices_count++;
+        }
+    }
+    devices_unlock();
+}
+
+// Restore bound devices
+void restore_bound_devices(void) {
+    log_message("INFO", "Restoring bound devices");
+
+    for (int i = 0; i < g_config.bound_devices_count; i++) {
+        if (strlen(g_config.bound_devices[i]) > 0) {
+            if (bind_device(g_config.bound_devices[i])) {
+                log_message("INFO", "Restored: %s", g_config.bound_devices[i]);
+            }
+        }
+    }
+}
+
+#ifndef PLATFORM_WINDOWS
+// Parse lsusb output (Linux only)
+static void parse_lsusb(const char *output) {
+    g_lsusb_count = 0;
     if (!output) return;
 
     char buf[8192];
@@ -794,7 +3103,16 @@ static void parse_lsusb(const char *output) {
 
 // List USB devices
 int list_usbip_devices(void) {
+    unsigned long long span = trace_begin();
     char output[4096];
+    usb_device_t devices[MAX_DEVICES];
+
+    if (g_sim.enabled) {
+        int count = sim_list_devices(devices);
+        if (count >= 0) devices_publish(devices, count);
+        trace_end("usb", "list_usbip_devices", span);
+        return count > 0 ? count : 0;
+    }
 
 #ifndef PLATFORM_WINDOWS
     // Step 1: Try to get lsusb data (Linux only)
@@ -835,10 +3153,11 @@ int list_usbip_devices(void) {
             log_message("ERROR", "Failed to execute usbip");
             g_usbip_error_shown = 1;
         }
+        trace_end("usb", "list_usbip_devices", span);
         return 0;
     }
 
-    g_device_count = 0;
+    int count = 0;
     char buf[4096];
     size_t len = safe_strnlen(output, sizeof(buf) - 1);
     memcpy(buf, output, len);
@@ -847,7 +3166,7 @@ int list_usbip_devices(void) {
     char *line = strtok(buf, "\n");
     usb_device_t *current = NULL;
 
-    while (line && g_device_count < MAX_DEVICES) {
+    while (line && count < MAX_DEVICES) {
         char *original_line = line;
         char *trimmed = line;
         while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
@@ -858,7 +3177,7 @@ int list_usbip_devices(void) {
         }
 
         if (strncmp(trimmed, "- busid", 7) == 0 || strncmp(trimmed, "BUSID", 5) == 0) {
-            current = &g_devices[g_device_count++];
+            current = &devices[count++];
             memset(current, 0, sizeof(usb_device_t));
 
             char *busid_start = strstr(trimmed, "busid ");
@@ -903,9 +3222,9 @@ int list_usbip_devices(void) {
 
 #ifndef PLATFORM_WINDOWS
     // Enhance with lsusb data on Linux
-    for (int i = 0; i < g_device_count; i++) {
-        if (strstr(g_devices[i].info, "unknown vendor")) {
-            char *paren = strchr(g_devices[i].info, '(');
+    for (int i = 0; i < count; i++) {
+        if (strstr(devices[i].info, "unknown vendor")) {
+            char *paren = strchr(devices[i].info, '(');
             if (paren) {
                 char vidpid[10] = {0};
                 size_t vidpid_len = safe_strnlen(paren + 1, 9);
@@ -917,9 +3236,9 @@ int list_usbip_devices(void) {
                 for (int j = 0; j < g_lsusb_count; j++) {
                     if (strcmp(g_lsusb_map[j].id, vidpid) == 0) {
                         size_t desc_len = safe_strnlen(g_lsusb_map[j].desc, 
-                                                       sizeof(g_devices[i].info) - 1);
-                        memcpy(g_devices[i].info, g_lsusb_map[j].desc, desc_len);
-                        g_devices[i].info[desc_len] = '\0';
+                                                       sizeof(devices[i].info) - 1);
+                        memcpy(devices[i].info, g_lsusb_map[j].desc, desc_len);
+                        devices[i].info[desc_len] = '\0';
                         break;
                     }
                 }
@@ -928,7 +3247,15 @@ int list_usbip_devices(void) {
     }
 #endif
 
-    return g_device_count;
+    devices_publish(devices, count);
+    trace_end("usb", "list_usbip_devices", span);
+    return count;
+}
+
+// Bind and unbind latency, by operation and outcome
+static void device_op_observe(int is_bind, int ok, unsigned long long ns) {
+    metrics_shard_t *shard = metrics_shard();
+    if (shard) histogram_observe(&shard->device_op_latency[is_bind ? 0 : 1][ok ? 0 : 1], ns);
 }
 
 // Bind USB device
@@ -953,7 +3280,14 @@ int bind_device(const char *busid) {
     }
 
     log_message("INFO", "Binding device: %s", busid);
-    int result = (secure_exec_command(cmd, output, sizeof(output)) == 0);
+    USBCTL_PROBE1(bind__start, busid);
+    unsigned long long start = monotonic_ns();
+    unsigned long long span = trace_begin();
+    int result = g_sim.enabled ? sim_device_op(busid, 1) : (secure_exec_command(cmd, output, sizeof(output)) == 0);
+    unsigned long long elapsed = monotonic_ns() - start;
+    USBCTL_PROBE3(bind__end, busid, result, elapsed);
+    device_op_observe(1, result, elapsed);
+    trace_end("usb", "bind_device", span);
     
     if (result) {
         log_message("INFO", "Successfully bound: %s", busid);
@@ -986,7 +3320,14 @@ int unbind_device(const char *busid) {
     }
 
     log_message("INFO", "Unbinding device: %s", busid);
-    int result = secure_exec_command(cmd, output, sizeof(output)) == 0;
+    USBCTL_PROBE1(unbind__start, busid);
+    unsigned long long start = monotonic_ns();
+    unsigned long long span = trace_begin();
+    int result = g_sim.enabled ? sim_device_op(busid, 0) : secure_exec_command(cmd, output, sizeof(output)) == 0;
+    unsigned long long elapsed = monotonic_ns() - start;
+    USBCTL_PROBE3(unbind__end, busid, result, elapsed);
+    device_op_observe(0, result, elapsed);
+    trace_end("usb", "unbind_device", span);
 
     if (result) {
         log_message("INFO", "Successfully unbound: %s", busid);
@@ -998,113 +3339,1022 @@ int unbind_device(const char *busid) {
 }
 
 // ============================================================================
-// HTTP SERVER FUNCTIONS
+// GZIP / DEFLATE ENCODER
 // ============================================================================
 
-// Generate HTML page
-void generate_html_page(char *buffer, size_t buffer_size) {
-    if (!buffer || buffer_size == 0) return;
-    
-    int ret = snprintf(buffer, buffer_size, EMBEDDED_HTML, 
-                      EMBEDDED_CSS, LOGO_SVG, EMBEDDED_JS);
-    if (ret < 0 || ret >= (int)buffer_size) {
-        log_message("WARN", "HTML page truncated");
+// Deflate length and distance code tables (RFC 1951, 3.2.5)
+static const unsigned short DEFLATE_LEN_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char DEFLATE_LEN_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short DEFLATE_DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char DEFLATE_DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Output cursor for the bit writer
+typedef struct {
+    unsigned char *buf;
+    size_t cap;
+    size_t len;
+    int overflow;
+} deflate_out_t;
+
+// Build CRC32 lookup table (called once from main)
+static void crc32_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        }
+        g_crc32_table[i] = c;
     }
 }
 
-// Send HTTP response
-void send_http_response(int client_socket, int status_code, const char *status_text,
-                       const char *content_type, const char *body) {
-    if (client_socket < 0) return;
-    
-    const char *safe_status_text = status_text ? status_text : "Unknown";
-    const char *safe_content_type = content_type ? content_type : "text/plain";
-    
-    char header[1024];
-    int body_len = body ? safe_strnlen(body, 1024*1024) : 0;
+static unsigned int crc32_update(unsigned int crc, const unsigned char *p, size_t n) {
+    crc = ~crc;
+    while (n--) {
+        crc = g_crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
 
-    int header_len = snprintf(header, sizeof(header),
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %d\r\n"
-        "Connection: close\r\n"
-        "X-Content-Type-Options: nosniff\r\n"
-        "X-Frame-Options: DENY\r\n"
-        "\r\n",
-        status_code, safe_status_text, safe_content_type, body_len);
+// Worst-case gzip output size for fixed-Huffman blocks
+static size_t gzip_bound(size_t len) {
+    return len + len / 8 + 64;
+}
 
-    if (header_len >= (int)sizeof(header)) return;
+static void deflate_init(deflate_stream_t *s) {
+    memset(s, 0, sizeof(*s));
+    memset(s->head, 0xFF, sizeof(s->head));
+    memset(s->prev, 0xFF, sizeof(s->prev));
+}
 
-    send(client_socket, header, header_len, 0);
-    if (body && body_len > 0) {
-        send(client_socket, body, body_len, 0);
+static void deflate_put_byte(deflate_out_t *out, unsigned char b) {
+    if (out->len < out->cap) {
+        out->buf[out->len++] = b;
+    } else {
+        out->overflow = 1;
     }
 }
 
-// Generate devices JSON
-void generate_devices_json(char *buffer, size_t buffer_size) {
-    if (buffer_size == 0) return;
-    
-    size_t pos = 0;
-    buffer[pos++] = '[';
-    
-    for (int i = 0; i < g_device_count && pos < buffer_size - 1; i++) {
-        // Sanitize info field
-        char info_sanitized[256];
-        size_t k = 0;
-        for (size_t j = 0; g_devices[i].info[j] && k < sizeof(info_sanitized) - 1; j++) {
-            unsigned char c = (unsigned char)g_devices[i].info[j];
-            if (c == '"' || c == '\\') {
-                if (k + 2 >= sizeof(info_sanitized) - 1) break;
-                info_sanitized[k++] = '\\';
-                info_sanitized[k++] = c;
-            } else if (c >= 32 && c < 127) {
-                info_sanitized[k++] = c;
-            }
-        }
-        info_sanitized[k] = '\0';
-
-        char device_json[384];
-        int written = snprintf(device_json, sizeof(device_json),
-            "%s{\"busid\":\"%s\",\"info\":\"%s\",\"bound\":%s}",
-            i > 0 ? "," : "", g_devices[i].busid, info_sanitized,
-            g_devices[i].bound ? "true" : "false");
-            
-        if (written > 0 && pos + written < buffer_size - 1) {
-            memcpy(buffer + pos, device_json, written);
-            pos += written;
-        }
+static void deflate_put_bits(deflate_stream_t *s, deflate_out_t *out, unsigned int value, int nbits) {
+    s->bitbuf |= value << s->bitcount;
+    s->bitcount += nbits;
+    while (s->bitcount >= 8) {
+        deflate_put_byte(out, (unsigned char)(s->bitbuf & 0xFF));
+        s->bitbuf >>= 8;
+        s->bitcount -= 8;
     }
-    
-    if (pos < buffer_size - 1) {
-        buffer[pos++] = ']';
+}
+
+static void deflate_align(deflate_stream_t *s, deflate_out_t *out) {
+    if (s->bitcount > 0) {
+        deflate_put_byte(out, (unsigned char)(s->bitbuf & 0xFF));
     }
-    buffer[pos] = '\0';
+    s->bitbuf = 0;
+    s->bitcount = 0;
 }
 
-// Send SSE message
-ssize_t send_sse_message(int client_socket, const char *data) {
-    char response[4096];
-    size_t data_len = safe_strnlen(data, sizeof(response) - 10);
-    
-    memcpy(response, "data: ", 6);
-    memcpy(response + 6, data, data_len);
-    response[6 + data_len] = '\n';
-    response[7 + data_len] = '\n';
-    response[8 + data_len] = '\0';
+// Huffman codes are packed MSB-first, so reverse before writing
+static void deflate_put_huff(deflate_stream_t *s, deflate_out_t *out, unsigned int code, int len) {
+    unsigned int rev = 0;
+    for (int i = 0; i < len; i++) {
+        rev = (rev << 1) | ((code >> i) & 1);
+    }
+    deflate_put_bits(s, out, rev, len);
+}
+
+// Emit a literal/length symbol with the fixed Huffman code
+static void deflate_put_symbol(deflate_stream_t *s, deflate_out_t *out, int sym) {
+    if (sym < 144) {
+        deflate_put_huff(s, out, 0x30 + sym, 8);
+    } else if (sym < 256) {
+        deflate_put_huff(s, out, 0x190 + sym - 144, 9);
+    } else if (sym < 280) {
+        deflate_put_huff(s, out, sym - 256, 7);
+    } else {
+        deflate_put_huff(s, out, 0xC0 + sym - 280, 8);
+    }
+}
+
+static void deflate_put_match(deflate_stream_t *s, deflate_out_t *out, int len, int dist) {
+    int lc = 28;
+    while (lc > 0 && DEFLATE_LEN_BASE[lc] > len) lc--;
+    deflate_put_symbol(s, out, 257 + lc);
+    if (DEFLATE_LEN_EXTRA[lc]) {
+        deflate_put_bits(s, out, len - DEFLATE_LEN_BASE[lc], DEFLATE_LEN_EXTRA[lc]);
+    }
+
+    int dc = 29;
+    while (dc > 0 && DEFLATE_DIST_BASE[dc] > dist) dc--;
+    deflate_put_huff(s, out, dc, 5);
+    if (DEFLATE_DIST_EXTRA[dc]) {
+        deflate_put_bits(s, out, dist - DEFLATE_DIST_BASE[dc], DEFLATE_DIST_EXTRA[dc]);
+    }
+}
+
+static unsigned int deflate_hash(const unsigned char *p) {
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (DEFLATE_HASH_SIZE - 1);
+}
+
+// Insert window positions into the hash chains up to (but excluding) limit
+static void deflate_insert(deflate_stream_t *s, int limit) {
+    while (s->hashed < limit && s->hashed + DEFLATE_MIN_MATCH <= s->win_len) {
+        unsigned int h = deflate_hash(s->window + s->hashed);
+        s->prev[s->hashed & (DEFLATE_WSIZE - 1)] = s->head[h];
+        s->head[h] = (short)s->hashed;
+        s->hashed++;
+    }
+}
+
+// Drop the oldest half of the window and rebase the hash chains
+static void deflate_slide(deflate_stream_t *s) {
+    memmove(s->window, s->window + DEFLATE_WSIZE, s->win_len - DEFLATE_WSIZE);
+    s->win_len -= DEFLATE_WSIZE;
+    s->hashed -= DEFLATE_WSIZE;
+    if (s->hashed < 0) s->hashed = 0;
+    for (int i = 0; i < DEFLATE_HASH_SIZE; i++) {
+        s->head[i] = s->head[i] >= DEFLATE_WSIZE ? (short)(s->head[i] - DEFLATE_WSIZE) : -1;
+    }
+    for (int i = 0; i < DEFLATE_WSIZE; i++) {
+        s->prev[i] = s->prev[i] >= DEFLATE_WSIZE ? (short)(s->prev[i] - DEFLATE_WSIZE) : -1;
+    }
+}
+
+// LZ77-compress the window range [start, win_len) into the current block
+static void deflate_compress_range(deflate_stream_t *s, deflate_out_t *out, int start) {
+    int pos = start;
+    deflate_insert(s, pos);
+
+    while (pos < s->win_len) {
+        int best_len = 0, best_dist = 0;
+        int avail = s->win_len - pos;
+
+        if (avail >= DEFLATE_MIN_MATCH) {
+            int max_len = avail < DEFLATE_MAX_MATCH ? avail : DEFLATE_MAX_MATCH;
+            int cand = s->head[deflate_hash(s->window + pos)];
+            int chain = DEFLATE_MAX_CHAIN;
+
+            while (cand >= 0 && cand < pos && pos - cand < DEFLATE_WSIZE && chain-- > 0) {
+                const unsigned char *a = s->window + cand, *b = s->window + pos;
+                if (a[best_len] == b[best_len]) {
+                    int l = 0;
+                    while (l < max_len && a[l] == b[l]) l++;
+                    if (l > best_len) {
+                        best_len = l;
+                        best_dist = pos - cand;
+                        if (l == max_len) break;
+                    }
+                }
+                int next = s->prev[cand & (DEFLATE_WSIZE - 1)];
+                if (next >= cand) break;
+                cand = next;
+            }
+        }
+
+        if (best_len >= DEFLATE_MIN_MATCH) {
+            deflate_put_match(s, out, best_len, best_dist);
+            pos += best_len;
+        } else {
+            deflate_put_symbol(s, out, s->window[pos]);
+            pos++;
+        }
+        deflate_insert(s, pos);
+    }
+}
+
+// Compress data as one fixed-Huffman block. When finish is set the block is
+// final and the gzip trailer follows; otherwise a sync flush aligns the output
+// so the receiver can decode everything sent so far.
+static size_t gzip_stream_write(deflate_stream_t *s, const void *data, size_t len, int finish,
+                                unsigned char *out_buf, size_t out_cap) {
+    deflate_out_t out = {out_buf, out_cap, 0, 0};
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (!s->header_sent) {
+        static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+        for (int i = 0; i < 10; i++) deflate_put_byte(&out, header[i]);
+        s->header_sent = 1;
+    }
+
+    deflate_put_bits(s, &out, finish ? 1 : 0, 1);
+    deflate_put_bits(s, &out, 1, 2);
+
+    size_t remaining = len;
+    while (remaining > 0) {
+        size_t chunk = remaining < DEFLATE_WSIZE ? remaining : DEFLATE_WSIZE;
+        if (s->win_len + (int)chunk > 2 * DEFLATE_WSIZE) {
+            deflate_slide(s);
+        }
+        int start = s->win_len;
+        memcpy(s->window + s->win_len, p, chunk);
+        s->win_len += (int)chunk;
+        deflate_compress_range(s, &out, start);
+        p += chunk;
+        remaining -= chunk;
+    }
+    deflate_put_symbol(s, &out, 256);
+
+    s->crc = crc32_update(s->crc, (const unsigned char *)data, len);
+    s->total_in += (unsigned int)len;
+
+    if (finish) {
+        deflate_align(s, &out);
+        for (int i = 0; i < 4; i++) deflate_put_byte(&out, (unsigned char)(s->crc >> (8 * i)));
+        for (int i = 0; i < 4; i++) deflate_put_byte(&out, (unsigned char)(s->total_in >> (8 * i)));
+    } else {
+        // Empty stored block: BFINAL=0, BTYPE=00, then LEN=0000 NLEN=FFFF
+        deflate_put_bits(s, &out, 0, 3);
+        deflate_align(s, &out);
+        deflate_put_byte(&out, 0x00);
+        deflate_put_byte(&out, 0x00);
+        deflate_put_byte(&out, 0xFF);
+        deflate_put_byte(&out, 0xFF);
+    }
+
+    return out.overflow ? 0 : out.len;
+}
+
+// One-shot gzip of a complete buffer, returns compressed length or 0
+static size_t gzip_compress(const void *data, size_t len, unsigned char *out, size_t out_cap) {
+    deflate_stream_t *s = malloc(sizeof(deflate_stream_t));
+    if (!s) return 0;
+
+    unsigned long long start = monotonic_ns();
+    deflate_init(s);
+    size_t out_len = gzip_stream_write(s, data, len, 1, out, out_cap);
+    free(s);
+
+    STAT_ADD(gzip_compress_ns, monotonic_ns() - start);
+    if (out_len > 0) {
+        STAT_ADD(gzip_responses, 1);
+        STAT_ADD(gzip_bytes_in, len);
+        STAT_ADD(gzip_bytes_out, out_len);
+    }
+    return out_len;
+}
+
+// ============================================================================
+// JSON BUILDER
+// ============================================================================
+
+// Growable JSON output, kept NUL-terminated; an allocation failure sticks
+// and the caller sees a NULL result
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+} json_writer_t;
+
+// Escape per byte: 0 copies it, a letter is the short escape after '\',
+// 'u' is \u00XX and 'U' starts a UTF-8 sequence to validate
+static const char JSON_ESCAPE[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+    'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U', 'U',
+};
+
+#define JSON_SWAR_ONES 0x0101010101010101ULL
+#define JSON_SWAR_HIGHS 0x8080808080808080ULL
+
+static int json_reserve(json_writer_t *w, size_t extra) {
+    if (w->failed) return 0;
+    if (w->len + extra + 1 <= w->cap) return 1;
+    size_t cap = w->cap ? w->cap : 1024;
+    while (cap < w->len + extra + 1) cap *= 2;
+    char *buf = realloc(w->buf, cap);
+    if (!buf) {
+        w->failed = 1;
+        return 0;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return 1;
+}
+
+static void json_raw(json_writer_t *w, const char *text, size_t len) {
+    if (!json_reserve(w, len)) return;
+    memcpy(w->buf + w->len, text, len);
+    w->len += len;
+    w->buf[w->len] = '\0';
+}
+
+static void json_lit(json_writer_t *w, const char *text) {
+    json_raw(w, text, strlen(text));
+}
+
+static void json_uint(json_writer_t *w, unsigned long long value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    if (!json_reserve(w, (size_t)n)) return;
+    while (n > 0) w->buf[w->len++] = digits[--n];
+    w->buf[w->len] = '\0';
+}
+
+// True when none of the eight bytes needs escaping or is non-ASCII: a byte
+// below 0x20, '"' or '\' sets its high bit in one of the zero-byte tests.
+// A borrow can only flag bytes above a real hit, so a clean result is exact.
+static int json_swar_clean(unsigned long long v) {
+    unsigned long long quote = v ^ (JSON_SWAR_ONES * '"');
+    unsigned long long backslash = v ^ (JSON_SWAR_ONES * '\\');
+    unsigned long long special = ((v - JSON_SWAR_ONES * 0x20) & ~v) | ((quote - JSON_SWAR_ONES) & ~quote) |
+                                 ((backslash - JSON_SWAR_ONES) & ~backslash) | v;
+    return (special & JSON_SWAR_HIGHS) == 0;
+}
+
+// Length of the well-formed UTF-8 sequence at s (RFC 3629: no overlong
+// forms, surrogates or code points past U+10FFFF), or 0
+static size_t json_utf8_len(const unsigned char *s, size_t left) {
+    unsigned char c = s[0];
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+        len = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        if (c == 0xe0) lo = 0xa0;
+        if (c == 0xed) hi = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        if (c == 0xf0) lo = 0x90;
+        if (c == 0xf4) hi = 0x8f;
+    } else {
+        return 0;
+    }
+    if (left < len || s[1] < lo || s[1] > hi) return 0;
+    for (size_t i = 2; i < len; i++) {
+        if (s[i] < 0x80 || s[i] > 0xbf) return 0;
+    }
+    return len;
+}
+
+// Write a quoted string. Runs of plain ASCII are copied eight bytes at a
+// time; valid UTF-8 passes through, invalid bytes become U+FFFD and
+// control characters \u00XX.
+static void json_string(json_writer_t *w, const char *text, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    if (!json_reserve(w, len * 6 + 2)) return;
+    char *out = w->buf + w->len;
+    const unsigned char *p = (const unsigned char *)text, *end = p + len;
+
+    *out++ = '"';
+    while (p < end) {
+        while (end - p >= 8) {
+            unsigned long long v;
+            memcpy(&v, p, 8);
+            if (!json_swar_clean(v)) break;
+            memcpy(out, p, 8);
+            out += 8;
+            p += 8;
+        }
+        if (p == end) break;
+
+        char escape = JSON_ESCAPE[*p];
+        if (!escape) {
+            *out++ = (char)*p++;
+        } else if (escape == 'U') {
+            size_t n = json_utf8_len(p, (size_t)(end - p));
+            if (n) {
+                memcpy(out, p, n);
+                out += n;
+                p += n;
+            } else {
+                memcpy(out, "\\ufffd", 6);
+                out += 6;
+                p++;
+            }
+        } else if (escape == 'u') {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[*p >> 4];
+            out[5] = hex[*p & 0xf];
+            out += 6;
+            p++;
+        } else {
+            *out++ = '\\';
+            *out++ = escape;
+            p++;
+        }
+    }
+    *out++ = '"';
+    w->len = (size_t)(out - w->buf);
+    w->buf[w->len] = '\0';
+}
+
+// ,"key":value for an object member after the first
+static void json_member_uint(json_writer_t *w, const char *key, unsigned long long value) {
+    json_lit(w, ",\"");
+    json_lit(w, key);
+    json_lit(w, "\":");
+    json_uint(w, value);
+}
+
+// One device as a JSON object
+static void json_device(json_writer_t *w, const usb_device_t *device) {
+    json_lit(w, "{\"busid\":");
+    json_string(w, device->busid, strlen(device->busid));
+    json_lit(w, ",\"info\":");
+    json_string(w, device->info, strlen(device->info));
+    json_lit(w, device->bound ? ",\"bound\":true}" : ",\"bound\":false}");
+}
+
+static void json_devices(json_writer_t *w, const usb_device_t *devices, int count) {
+    json_lit(w, "[");
+    for (int i = 0; i < count; i++) {
+        if (i > 0) json_lit(w, ",");
+        json_device(w, &devices[i]);
+    }
+    json_lit(w, "]");
+}
+
+// {"generation":N,"devices":[...]} as carried by snapshot events
+static void json_snapshot(json_writer_t *w, const usb_device_t *devices, int count,
+                          unsigned long long generation) {
+    json_lit(w, "{\"generation\":");
+    json_uint(w, generation);
+    json_lit(w, ",\"devices\":");
+    json_devices(w, devices, count);
+    json_lit(w, "}");
+}
+
+// Release the buffer of a failed writer; returns the output or NULL
+static char *json_finish(json_writer_t *w) {
+    if (w->failed || !w->buf) {
+        free(w->buf);
+        w->buf = NULL;
+        return NULL;
+    }
+    return w->buf;
+}
+
+// ============================================================================
+// TRACE EXPORT
+// ============================================================================
+
+// Microseconds with nanosecond precision, as trace-event timestamps are
+static void trace_json_us(json_writer_t *w, unsigned long long ns) {
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%llu.%03llu", ns / 1000ULL, ns % 1000ULL);
+    json_raw(w, text, (size_t)len);
+}
+
+// Write the spans that started in [from, to] from every thread's ring as
+// Chrome trace-event JSON. A slot the owner reused while it was being
+// copied is skipped rather than reported torn.
+static void trace_export(json_writer_t *w, unsigned long long from, unsigned long long to) {
+    int first = 1;
+    json_lit(w, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (metrics_shard_t *s = g_metrics_shards; s; s = s->next) {
+        trace_span_t *ring = __atomic_load_n(&s->trace, __ATOMIC_ACQUIRE);
+        if (!ring) continue;
+        unsigned long long head = __atomic_load_n(&s->trace_head, __ATOMIC_ACQUIRE);
+        for (unsigned long long i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i < head; i++) {
+            trace_span_t span = ring[i % TRACE_RING_SIZE];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->trace_head, __ATOMIC_RELAXED) >= i + TRACE_RING_SIZE) continue;
+            if (span.start_ns < from || span.start_ns > to) continue;
+
+            json_lit(w, first ? "{\"name\":" : ",{\"name\":");
+            first = 0;
+            json_string(w, span.name, strlen(span.name));
+            json_lit(w, ",\"cat\":");
+            json_string(w, span.cat, strlen(span.cat));
+            json_lit(w, ",\"ph\":\"X\",\"ts\":");
+            trace_json_us(w, span.start_ns - from);
+            json_lit(w, ",\"dur\":");
+            trace_json_us(w, span.dur_ns);
+            json_lit(w, ",\"pid\":1,\"tid\":");
+            json_uint(w, (unsigned long long)span.tid);
+            if (span.request) {
+                json_lit(w, ",\"args\":{\"request\":");
+                json_uint(w, span.request);
+                json_lit(w, "}");
+            }
+            json_lit(w, "}");
+        }
+    }
+    json_lit(w, "]}");
+}
+
+// ============================================================================
+// CBOR ENCODER
+// ============================================================================
+
+// Growable CBOR output (RFC 8949); an allocation failure sticks and the
+// caller sees a NULL result
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+} cbor_writer_t;
+
+static void cbor_reserve(cbor_writer_t *w, size_t extra) {
+    if (w->failed || w->len + extra <= w->cap) return;
+    size_t cap = w->cap ? w->cap : 256;
+    while (cap < w->len + extra) cap *= 2;
+    unsigned char *buf = realloc(w->buf, cap);
+    if (!buf) {
+        w->failed = 1;
+        return;
+    }
+    w->buf = buf;
+    w->cap = cap;
+}
+
+// Major type and argument in the shortest form
+static void cbor_head(cbor_writer_t *w, int major, unsigned long long value) {
+    cbor_reserve(w, 9);
+    if (w->failed) return;
+    unsigned char *out = w->buf + w->len;
+    int bytes = value < 24 ? 0 : value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffffULL ? 4 : 8;
+    out[0] = (unsigned char)(major << 5 | (bytes == 0 ? (int)value : bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27));
+    for (int i = 0; i < bytes; i++) {
+        out[1 + i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+    }
+    w->len += 1 + (size_t)bytes;
+}
+
+static void cbor_raw(cbor_writer_t *w, const void *data, size_t len) {
+    cbor_reserve(w, len);
+    if (w->failed) return;
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void cbor_text(cbor_writer_t *w, const char *text) {
+    size_t len = strlen(text);
+    cbor_head(w, 3, len);
+    cbor_raw(w, text, len);
+}
+
+static void cbor_bool(cbor_writer_t *w, int value) {
+    cbor_head(w, 7, value ? 21 : 20);
+}
+
+// A busid "B-P.P.P" packs into a byte string of its numbers (bus, then the
+// port chain); anything that does not fit that shape stays a text string
+static void cbor_busid(cbor_writer_t *w, const char *busid) {
+    unsigned char packed[16];
+    size_t count = 0;
+    const char *p = busid;
+    int valid = 1;
+    while (valid && *p) {
+        char *end;
+        unsigned long n = strtoul(p, &end, 10);
+        char sep = count == 0 ? '-' : '.';
+        valid = end != p && n <= 0xff && count < sizeof(packed) && (*end == '\0' || *end == sep);
+        packed[count++] = (unsigned char)n;
+        p = *end ? end + 1 : end;
+        if (*end && !*p) valid = 0;
+    }
+    if (valid && count >= 2) {
+        cbor_head(w, 2, count);
+        cbor_raw(w, packed, count);
+    } else {
+        cbor_text(w, busid);
+    }
+}
+
+// Device map: busid, numeric vid/pid when the info string carries them,
+// bound flag and the printable part of the description
+static void cbor_device(cbor_writer_t *w, const usb_device_t *device) {
+    int vid, pid;
+    device_vid_pid(device->info, &vid, &pid);
+
+    // Same text as json_string(): valid UTF-8 passes through and each
+    // invalid byte becomes U+FFFD, so both encodings agree
+    char info[sizeof(device->info) * 3];
+    const unsigned char *p = (const unsigned char *)device->info;
+    const unsigned char *end = p + safe_strnlen(device->info, sizeof(device->info) - 1);
+    size_t k = 0;
+    while (p < end) {
+        size_t n = *p < 0x80 ? 1 : json_utf8_len(p, (size_t)(end - p));
+        if (n) {
+            memcpy(info + k, p, n);
+            k += n;
+            p += n;
+        } else {
+            memcpy(info + k, "\xef\xbf\xbd", 3);
+            k += 3;
+            p++;
+        }
+    }
+    info[k] = '\0';
+
+    cbor_head(w, 5, vid >= 0 ? 5 : 3);
+    cbor_text(w, "busid");
+    cbor_busid(w, device->busid);
+    if (vid >= 0) {
+        cbor_text(w, "vid");
+        cbor_head(w, 0, (unsigned long long)vid);
+        cbor_text(w, "pid");
+        cbor_head(w, 0, (unsigned long long)pid);
+    }
+    cbor_text(w, "bound");
+    cbor_bool(w, device->bound);
+    cbor_text(w, "info");
+    cbor_text(w, info);
+}
+
+// {"generation":G,"devices":[...]}, the CBOR twin of a snapshot payload.
+// Returns a malloc'd buffer or NULL.
+static unsigned char *cbor_encode_snapshot(const usb_device_t *devices, int count,
+                                           unsigned long long generation, size_t *len) {
+    cbor_writer_t w = {NULL, 0, 0, 0};
+    cbor_head(&w, 5, 2);
+    cbor_text(&w, "generation");
+    cbor_head(&w, 0, generation);
+    cbor_text(&w, "devices");
+    cbor_head(&w, 4, (unsigned long long)count);
+    for (int i = 0; i < count; i++) {
+        cbor_device(&w, &devices[i]);
+    }
+    if (w.failed) {
+        free(w.buf);
+        return NULL;
+    }
+    *len = w.len;
+    return w.buf;
+}
+
+// {"status":..[,"error":..]} followed by the members of a snapshot map, for
+// bind/unbind responses. The snapshot's two members are spliced in after
+// its one-byte map header.
+static unsigned char *cbor_encode_status(const char *status, const char *error,
+                                         const unsigned char *snapshot, size_t snapshot_len,
+                                         size_t *len) {
+    int splice = snapshot && snapshot_len > 1 && snapshot[0] == 0xa2;
+    cbor_writer_t w = {NULL, 0, 0, 0};
+    cbor_head(&w, 5, 1 + (error ? 1 : 0) + (splice ? 2 : 0));
+    cbor_text(&w, "status");
+    cbor_text(&w, status);
+    if (error) {
+        cbor_text(&w, "error");
+        cbor_text(&w, error);
+    }
+    if (splice) cbor_raw(&w, snapshot + 1, snapshot_len - 1);
+    if (w.failed) {
+        free(w.buf);
+        return NULL;
+    }
+    *len = w.len;
+    return w.buf;
+}
+
+// {"generation":G,"device":{...}} or {"generation":G,"busid":..} for removals
+static unsigned char *cbor_encode_delta(const usb_device_t *device, int removed,
+                                        unsigned long long generation, size_t *len) {
+    cbor_writer_t w = {NULL, 0, 0, 0};
+    cbor_head(&w, 5, 2);
+    cbor_text(&w, "generation");
+    cbor_head(&w, 0, generation);
+    if (removed) {
+        cbor_text(&w, "busid");
+        cbor_busid(&w, device->busid);
+    } else {
+        cbor_text(&w, "device");
+        cbor_device(&w, device);
+    }
+    if (w.failed) {
+        free(w.buf);
+        return NULL;
+    }
+    *len = w.len;
+    return w.buf;
+}
+
+// ============================================================================
+// HTTP SERVER FUNCTIONS
+// ============================================================================
+
+// Generate HTML page
+void generate_html_page(char *buffer, size_t buffer_size) {
+    if (!buffer || buffer_size == 0) return;
     
-    return send(client_socket, response, 8 + data_len, MSG_NOSIGNAL);
+    int ret = snprintf(buffer, buffer_size, EMBEDDED_HTML, 
+                      EMBEDDED_CSS, LOGO_SVG, EMBEDDED_JS);
+    if (ret < 0 || ret >= (int)buffer_size) {
+        log_message("WARN", "HTML page truncated");
+    }
+}
+
+// Write every iovec piece, resuming after short writes. The socket is corked
+// while a partially written response is being completed so the tail does not
+// leave as a runt segment under TCP_NODELAY.
+static int send_iov_all(int socket, struct iovec *iov, int count) {
+#ifdef PLATFORM_WINDOWS
+    for (int i = 0; i < count; i++) {
+        const char *p = (const char *)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            int n = send(socket, p, (int)left, 0);
+            if (n <= 0) return -1;
+            p += n;
+            left -= (size_t)n;
+        }
+    }
+    return 0;
+#else
+    int corked = 0, result = 0;
+
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+#ifdef TCP_CORK
+            if (!corked) {
+                int on = 1;
+                setsockopt(socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+                corked = 1;
+            }
+#endif
+        }
+    }
+
+#ifdef TCP_CORK
+    if (corked) {
+        int off = 0;
+        setsockopt(socket, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    }
+#endif
+    return result;
+#endif
+}
+
+// Start a response: status line and Content-Type
+static void http_response_begin(http_response_t *res, http_conn_t *conn, int status_code,
+                                const char *status_text, const char *content_type) {
+    memset(res, 0, sizeof(*res));
+    res->socket = conn->socket;
+    res->conn = conn;
+    conn->status = status_code;
+    int len = snprintf(res->header, sizeof(res->header), "HTTP/1.1 %d %s\r\n",
+                       status_code, status_text ? status_text : "Unknown");
+    if (len > 0 && content_type && len < (int)sizeof(res->header)) {
+        len += snprintf(res->header + len, sizeof(res->header) - len,
+                        "Content-Type: %s\r\n", content_type);
+    }
+    if (len < 0 || len >= (int)sizeof(res->header)) {
+        res->overflow = 1;
+        return;
+    }
+    res->header_len = (size_t)len;
+}
+
+// Append a formatted header line (value is printf-style)
+static void http_response_header(http_response_t *res, const char *name, const char *format, ...) {
+    if (res->overflow) return;
+
+    size_t avail = sizeof(res->header) - res->header_len;
+    int len = snprintf(res->header + res->header_len, avail, "%s: ", name);
+    if (len < 0 || (size_t)len >= avail) {
+        res->overflow = 1;
+        return;
+    }
+    res->header_len += (size_t)len;
+    avail -= (size_t)len;
+
+    va_list args;
+    va_start(args, format);
+    len = vsnprintf(res->header + res->header_len, avail, format, args);
+    va_end(args);
+    if (len < 0 || (size_t)len + 2 >= avail) {
+        res->overflow = 1;
+        return;
+    }
+    res->header_len += (size_t)len;
+    memcpy(res->header + res->header_len, "\r\n", 2);
+    res->header_len += 2;
+}
+
+// Reference a body piece; the data must stay valid until http_response_send()
+static void http_response_body(http_response_t *res, const void *data, size_t len) {
+    if (!data || len == 0) return;
+    if (res->body_count >= HTTP_MAX_BODY_PIECES) {
+        res->overflow = 1;
+        return;
+    }
+    res->body[res->body_count].iov_base = (void *)data;
+    res->body[res->body_count].iov_len = len;
+    res->body_count++;
+    res->body_len += len;
+}
+
+// Finish the header block and send header and body pieces in one syscall.
+// Streaming responses omit Content-Length and keep the connection open;
+// head_only responses advertise the body length but do not send it.
+static int http_response_send(http_response_t *res) {
+    if (res->socket < 0) return -1;
+
+    if (res->upgrade) {
+        http_response_header(res, "Connection", "Upgrade");
+    } else if (res->stream) {
+        http_response_header(res, "Connection", "keep-alive");
+    } else {
+        http_response_header(res, "Content-Length", "%zu", res->body_len);
+        if (res->conn->keep_alive) {
+            http_response_header(res, "Connection", "keep-alive");
+            http_response_header(res, "Keep-Alive", "timeout=%d", g_config.keepalive_timeout);
+        } else {
+            http_response_header(res, "Connection", "close");
+        }
+    }
+    res->conn->responses++;
+    http_response_header(res, "X-Content-Type-Options", "nosniff");
+    http_response_header(res, "X-Frame-Options", "DENY");
+
+    if (res->overflow || res->header_len + 2 > sizeof(res->header)) {
+        log_message("WARN", "HTTP response header overflow");
+        return -1;
+    }
+#ifndef PLATFORM_WINDOWS
+    if (res->conn->h2) return h2_response_send(res);
+#endif
+    memcpy(res->header + res->header_len, "\r\n", 2);
+    res->header_len += 2;
+
+    struct iovec iov[HTTP_MAX_BODY_PIECES + 1];
+    int count = 0;
+    iov[count].iov_base = res->header;
+    iov[count].iov_len = res->header_len;
+    count++;
+    if (!res->head_only) {
+        for (int i = 0; i < res->body_count; i++) {
+            iov[count++] = res->body[i];
+        }
+    }
+    return send_iov_all(res->socket, iov, count);
+}
+
+// Send HTTP response with an explicit body length and optional Content-Encoding
+static void send_http_response_raw(http_conn_t *conn, int status_code, const char *status_text,
+                                   const char *content_type, const char *content_encoding,
+                                   const char *body, size_t body_len) {
+    http_response_t res;
+    http_response_begin(&res, conn, status_code, status_text, content_type);
+    if (content_encoding) {
+        http_response_header(&res, "Content-Encoding", "%s", content_encoding);
+    }
+    http_response_body(&res, body, body_len);
+    http_response_send(&res);
+}
+
+// Send HTTP response
+void send_http_response(http_conn_t *conn, int status_code, const char *status_text,
+                       const char *content_type, const char *body) {
+    size_t body_len = body ? safe_strnlen(body, 1024*1024) : 0;
+    send_http_response_raw(conn, status_code, status_text, content_type, NULL,
+                           body, body_len);
 }
 
-// Send SSE headers
-void send_sse_headers(int client_socket) {
-    const char *headers = "HTTP/1.1 200 OK\r\n"
-                          "Content-Type: text/event-stream\r\n"
-                          "Cache-Control: no-cache\r\n"
-                          "Connection: keep-alive\r\n"
-                          "Access-Control-Allow-Origin: *\r\n"
-                          "\r\n";
-    send(client_socket, headers, strlen(headers), MSG_NOSIGNAL);
+// Send HTTP response, gzip-encoded when the request accepts it and it pays off.
+// head_only still encodes, so HEAD reports the length GET would send.
+static void send_http_response_negotiated(http_conn_t *conn, int status_code,
+                                          const char *status_text, const char *content_type,
+                                          const char *body, int head_only) {
+    const char *request = conn->buffer;
+    size_t body_len = body ? safe_strnlen(body, 1024*1024) : 0;
+    unsigned char *gz = NULL;
+    size_t gz_len = 0;
+
+    if (body_len >= GZIP_MIN_SIZE && http_accepts_gzip(request)) {
+        size_t cap = gzip_bound(body_len);
+        gz = malloc(cap);
+        if (gz) {
+            gz_len = gzip_compress(body, body_len, gz, cap);
+        }
+    }
+
+    http_response_t res;
+    http_response_begin(&res, conn, status_code, status_text, content_type);
+    http_response_header(&res, "Vary", "Accept, Accept-Encoding");
+    if (gz_len > 0 && gz_len < body_len) {
+        http_response_header(&res, "Content-Encoding", "gzip");
+        http_response_body(&res, gz, gz_len);
+    } else {
+        http_response_body(&res, body, body_len);
+    }
+    res.head_only = head_only;
+    http_response_send(&res);
+    free(gz);
+}
+
+// Send a CBOR body (NULL when encoding failed)
+static void send_cbor_response(http_conn_t *conn, int status_code, const char *status_text,
+                               const unsigned char *body, size_t body_len, int head_only) {
+    if (!body) {
+        send_http_response(conn, 500, "Internal Server Error", "text/plain", "500 Encoding failed");
+        return;
+    }
+    http_response_t res;
+    http_response_begin(&res, conn, status_code, status_text, "application/cbor");
+    http_response_header(&res, "Vary", "Accept, Accept-Encoding");
+    http_response_body(&res, body, body_len);
+    res.head_only = head_only;
+    http_response_send(&res);
+    STAT_ADD(cbor_responses, 1);
+}
+
+// Encode an already framed SSE payload for a client. Returns the buffer to
+// free (NULL when the payload is sent as-is) and sets the bytes to write.
+static unsigned char *sse_encode_client(client_t *client, const char *payload, size_t len,
+                                        const void **out, size_t *out_len) {
+    *out = payload;
+    *out_len = len;
+    if (!client->gzip) return NULL;
+
+    size_t cap = gzip_bound(len);
+    unsigned char *gz = malloc(cap);
+    if (!gz) {
+        *out_len = 0;
+        return NULL;
+    }
+
+    unsigned long long start = monotonic_ns();
+    size_t gz_len = gzip_stream_write(client->gzip, payload, len, 0, gz, cap);
+    STAT_ADD(gzip_compress_ns, monotonic_ns() - start);
+    STAT_ADD(gzip_stream_events, 1);
+    STAT_ADD(gzip_bytes_in, len);
+    STAT_ADD(gzip_bytes_out, gz_len);
+
+    *out = gz;
+    *out_len = gz_len;
+    return gz;
+}
+
+// Frame JSON as a named SSE event carrying an event id (caller frees)
+static char *sse_frame_message(unsigned long long id, const char *event, const char *data,
+                               size_t data_len, size_t *frame_len) {
+    char *frame = malloc(data_len + 80);
+    if (!frame) return NULL;
+
+    int prefix = snprintf(frame, 80, "id: %llu\nevent: %s\ndata: ", id, event);
+    memcpy(frame + prefix, data, data_len);
+    frame[prefix + data_len] = '\n';
+    frame[prefix + data_len + 1] = '\n';
+    *frame_len = prefix + data_len + 2;
+    return frame;
+}
+
+// Send SSE headers together with the first events in a single write
+int send_sse_headers(http_conn_t *conn, client_t *client, const char *initial, size_t initial_len) {
+    const void *data = NULL;
+    size_t data_len = 0;
+    unsigned char *encoded = initial_len ? sse_encode_client(client, initial, initial_len, &data, &data_len) : NULL;
+
+    http_response_t res;
+    http_response_begin(&res, conn, 200, "OK", "text/event-stream");
+    http_response_header(&res, "Cache-Control", "no-cache");
+    if (client->gzip) {
+        http_response_header(&res, "Content-Encoding", "gzip");
+    }
+    http_response_header(&res, "Access-Control-Allow-Origin", "*");
+    res.stream = 1;
+    http_response_body(&res, data, data_len);
+    int result = http_response_send(&res);
+
+    free(encoded);
+    return result;
 }
 
 // Base64 decode
@@ -1139,60 +4389,4328 @@ static int base64_decode(const char *input, unsigned char *output, int max_len)
     return len;
 }
 
-// ============================================================================
-// CLIENT MANAGEMENT
-// ============================================================================
+// Base64 encode with padding; out_size must fit 4 * ceil(len / 3) + 1 bytes
+static void base64_encode(const unsigned char *input, size_t len, char *output, size_t out_size) {
+    const char *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t pos = 0;
+    for (size_t i = 0; i < len && pos + 4 < out_size; i += 3) {
+        unsigned int v = (unsigned int)input[i] << 16;
+        if (i + 1 < len) v |= (unsigned int)input[i + 1] << 8;
+        if (i + 2 < len) v |= input[i + 2];
+        output[pos++] = table[(v >> 18) & 0x3f];
+        output[pos++] = table[(v >> 12) & 0x3f];
+        output[pos++] = i + 1 < len ? table[(v >> 6) & 0x3f] : '=';
+        output[pos++] = i + 2 < len ? table[v & 0x3f] : '=';
+    }
+    output[pos] = '\0';
+}
+
+// Render the static page and decode the favicon once at startup
+static void init_static_assets(void) {
+    generate_html_page(g_html_page, sizeof(g_html_page));
+    g_html_page_len = strlen(g_html_page);
+    g_favicon_len = base64_decode(EMBEDDED_FAVICON, g_favicon, sizeof(g_favicon));
+}
+
+// Append formatted text to a bounded buffer
+static void buffer_appendf(char *buffer, size_t buffer_size, size_t *pos, const char *format, ...) {
+    if (*pos >= buffer_size) return;
+
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + *pos, buffer_size - *pos, format, args);
+    va_end(args);
+
+    if (written > 0) {
+        *pos += (size_t)written;
+        if (*pos >= buffer_size) *pos = buffer_size - 1;
+    }
+}
+
+static void metric_sum(unsigned long long *total, const unsigned long long *counters, size_t count) {
+    for (size_t i = 0; i < count; i++) total[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+}
+
+// Sum the shards of every thread that has recorded a metric
+static void metrics_collect(metrics_shard_t *total) {
+    memset(total, 0, sizeof(*total));
+    for (const metrics_shard_t *s = g_metrics_shards; s; s = s->next) {
+        metric_sum(&total->route_responses[0][0], &s->route_responses[0][0],
+                   (ROUTE_MAX + 1) * METRIC_STATUS_SLOTS);
+        for (int r = 0; r <= ROUTE_MAX; r++) histogram_merge(&total->route_latency[r], &s->route_latency[r]);
+        histogram_merge(&total->poll_cycle, &s->poll_cycle);
+        metric_sum(&total->poll_changed_cycles, &s->poll_changed_cycles, 1);
+        metric_sum(&total->poll_changes, &s->poll_changes, 1);
+        for (int k = 0; k < EXEC_KIND_COUNT; k++) histogram_merge(&total->exec_latency[k], &s->exec_latency[k]);
+        metric_sum(&total->exec_exits[0][0], &s->exec_exits[0][0], EXEC_KIND_COUNT * METRIC_EXIT_SLOTS);
+        metric_sum(total->exec_timeouts, s->exec_timeouts, EXEC_KIND_COUNT);
+        for (int op = 0; op < 2; op++) {
+            histogram_merge(&total->device_op_latency[op][0], &s->device_op_latency[op][0]);
+            histogram_merge(&total->device_op_latency[op][1], &s->device_op_latency[op][1]);
+        }
+        histogram_merge(&total->device_lock_wait, &s->device_lock_wait);
+    }
+}
+
+// Bucket, sum and count series of one histogram; labels may be empty
+static void histogram_append(char *buffer, size_t buffer_size, size_t *pos, const char *name,
+                             const char *labels, const histogram_t *h) {
+    const char *sep = labels[0] ? "," : "";
+    unsigned long long cumulative = 0;
+    for (int b = 0; b < METRIC_LATENCY_BUCKETS - 1; b++) {
+        cumulative += h->buckets[b];
+        buffer_appendf(buffer, buffer_size, pos, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+                       name, labels, sep, METRIC_LATENCY_BOUNDS_US[b] / 1e6, cumulative);
+    }
+    cumulative += h->buckets[METRIC_LATENCY_BUCKETS - 1];
+    buffer_appendf(buffer, buffer_size, pos,
+                   "%s_bucket{%s%sle=\"+Inf\"} %llu\n%s_sum%s%s%s %.6f\n%s_count%s%s%s %llu\n",
+                   name, labels, sep, cumulative,
+                   name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", h->sum_ns / 1e9,
+                   name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", cumulative);
+}
+
+// Resident set size and thread count, read from /proc (Linux only)
+static void process_metrics_append(char *buffer, size_t buffer_size, size_t *pos) {
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return;
+    char line[128];
+    unsigned long long rss_kb = 0;
+    int threads = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %llu", &rss_kb) == 1) continue;
+        sscanf(line, "Threads: %d", &threads);
+    }
+    fclose(f);
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP process_resident_memory_bytes Resident memory size in bytes.\n"
+        "# TYPE process_resident_memory_bytes gauge\n"
+        "process_resident_memory_bytes %llu\n"
+        "# HELP usbctl_process_threads OS threads in the process.\n"
+        "# TYPE usbctl_process_threads gauge\n"
+        "usbctl_process_threads %d\n",
+        rss_kb * 1024ULL, threads);
+#else
+    (void)buffer;
+    (void)buffer_size;
+    (void)pos;
+#endif
+}
+
+// Poll loop, usbip command, bind/unbind and device lock metrics
+static void backend_metrics_append(char *buffer, size_t buffer_size, size_t *pos,
+                                   const metrics_shard_t *total) {
+    static const char *const exit_codes[METRIC_EXIT_SLOTS] = {"0", "1", "2", "127", "other", "error"};
+    char labels[64];
+
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_poll_cycle_duration_seconds Time to enumerate devices and publish the changes.\n"
+        "# TYPE usbctl_poll_cycle_duration_seconds histogram\n");
+    histogram_append(buffer, buffer_size, pos, "usbctl_poll_cycle_duration_seconds", "", &total->poll_cycle);
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_poll_changed_cycles_total Poll cycles that found the device list changed.\n"
+        "# TYPE usbctl_poll_changed_cycles_total counter\n"
+        "usbctl_poll_changed_cycles_total %llu\n"
+        "# HELP usbctl_poll_changes_total Devices added, removed or updated between poll cycles.\n"
+        "# TYPE usbctl_poll_changes_total counter\n"
+        "usbctl_poll_changes_total %llu\n",
+        total->poll_changed_cycles, total->poll_changes);
+
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_exec_duration_seconds Fork to exit of external commands, by command.\n"
+        "# TYPE usbctl_exec_duration_seconds histogram\n");
+    for (int k = 0; k < EXEC_KIND_COUNT; k++) {
+        snprintf(labels, sizeof(labels), "command=\"%s\"", EXEC_KIND_NAMES[k]);
+        histogram_append(buffer, buffer_size, pos, "usbctl_exec_duration_seconds", labels,
+                         &total->exec_latency[k]);
+    }
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_exec_exits_total External commands finished, by command and exit code.\n"
+        "# TYPE usbctl_exec_exits_total counter\n");
+    for (int k = 0; k < EXEC_KIND_COUNT; k++) {
+        for (int slot = 0; slot < METRIC_EXIT_SLOTS; slot++) {
+            if (total->exec_exits[k][slot] == 0) continue;
+            buffer_appendf(buffer, buffer_size, pos, "usbctl_exec_exits_total{command=\"%s\",code=\"%s\"} %llu\n",
+                           EXEC_KIND_NAMES[k], exit_codes[slot], total->exec_exits[k][slot]);
+        }
+    }
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_exec_timeouts_total External commands killed after the timeout, by command.\n"
+        "# TYPE usbctl_exec_timeouts_total counter\n");
+    for (int k = 0; k < EXEC_KIND_COUNT; k++) {
+        buffer_appendf(buffer, buffer_size, pos, "usbctl_exec_timeouts_total{command=\"%s\"} %llu\n",
+                       EXEC_KIND_NAMES[k], total->exec_timeouts[k]);
+    }
+
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_device_op_duration_seconds Bind and unbind latency, by operation and result.\n"
+        "# TYPE usbctl_device_op_duration_seconds histogram\n");
+    for (int op = 0; op < 2; op++) {
+        for (int failed = 0; failed < 2; failed++) {
+            snprintf(labels, sizeof(labels), "op=\"%s\",result=\"%s\"", op ? "unbind" : "bind",
+                     failed ? "failure" : "success");
+            histogram_append(buffer, buffer_size, pos, "usbctl_device_op_duration_seconds", labels,
+                             &total->device_op_latency[op][failed]);
+        }
+    }
+
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_device_lock_wait_seconds Time spent waiting for the device list lock.\n"
+        "# TYPE usbctl_device_lock_wait_seconds histogram\n");
+    histogram_append(buffer, buffer_size, pos, "usbctl_device_lock_wait_seconds", "", &total->device_lock_wait);
+}
+
+#ifdef LOCK_STATS
+// Wait and hold histograms per named lock
+static void lock_metrics_append(char *buffer, size_t buffer_size, size_t *pos) {
+    int count = __atomic_load_n(&g_lock_class_count, __ATOMIC_ACQUIRE);
+    char labels[64];
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_lock_acquisitions_total Lock acquisitions, by lock.\n"
+        "# TYPE usbctl_lock_acquisitions_total counter\n");
+    for (int i = 0; i < count; i++) {
+        buffer_appendf(buffer, buffer_size, pos, "usbctl_lock_acquisitions_total{lock=\"%s\"} %llu\n",
+                       g_lock_classes[i].name, g_lock_classes[i].acquisitions);
+    }
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_lock_contended_total Lock acquisitions that had to wait, by lock.\n"
+        "# TYPE usbctl_lock_contended_total counter\n");
+    for (int i = 0; i < count; i++) {
+        buffer_appendf(buffer, buffer_size, pos, "usbctl_lock_contended_total{lock=\"%s\"} %llu\n",
+                       g_lock_classes[i].name, g_lock_classes[i].contended);
+    }
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_lock_wait_seconds Time waiting to acquire a lock, by lock.\n"
+        "# TYPE usbctl_lock_wait_seconds histogram\n");
+    for (int i = 0; i < count; i++) {
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", g_lock_classes[i].name);
+        histogram_append(buffer, buffer_size, pos, "usbctl_lock_wait_seconds", labels, &g_lock_classes[i].wait);
+    }
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_lock_hold_seconds Time a lock was held, by lock.\n"
+        "# TYPE usbctl_lock_hold_seconds histogram\n");
+    for (int i = 0; i < count; i++) {
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", g_lock_classes[i].name);
+        histogram_append(buffer, buffer_size, pos, "usbctl_lock_hold_seconds", labels, &g_lock_classes[i].hold);
+    }
+}
+#endif
+
+// Generate Prometheus text-format metrics
+void generate_metrics(char *buffer, size_t buffer_size) {
+    if (!buffer || buffer_size == 0) return;
+    size_t pos = 0;
+    buffer[0] = '\0';
+
+    unsigned long long in = g_stats.gzip_bytes_in, out = g_stats.gzip_bytes_out;
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_gzip_responses_total Responses sent with gzip content encoding.\n"
+        "# TYPE usbctl_gzip_responses_total counter\n"
+        "usbctl_gzip_responses_total %llu\n"
+        "# HELP usbctl_gzip_stream_events_total SSE events written through a gzip stream.\n"
+        "# TYPE usbctl_gzip_stream_events_total counter\n"
+        "usbctl_gzip_stream_events_total %llu\n"
+        "# HELP usbctl_gzip_bytes_in_total Uncompressed bytes fed to the deflate encoder.\n"
+        "# TYPE usbctl_gzip_bytes_in_total counter\n"
+        "usbctl_gzip_bytes_in_total %llu\n"
+        "# HELP usbctl_gzip_bytes_out_total Compressed bytes produced by the deflate encoder.\n"
+        "# TYPE usbctl_gzip_bytes_out_total counter\n"
+        "usbctl_gzip_bytes_out_total %llu\n"
+        "# HELP usbctl_gzip_compression_ratio Uncompressed over compressed bytes since start.\n"
+        "# TYPE usbctl_gzip_compression_ratio gauge\n"
+        "usbctl_gzip_compression_ratio %.3f\n"
+        "# HELP usbctl_gzip_compress_seconds_total Time spent compressing.\n"
+        "# TYPE usbctl_gzip_compress_seconds_total counter\n"
+        "usbctl_gzip_compress_seconds_total %.6f\n"
+        "# HELP usbctl_cbor_responses_total Responses sent as application/cbor.\n"
+        "# TYPE usbctl_cbor_responses_total counter\n"
+        "usbctl_cbor_responses_total %llu\n",
+        g_stats.gzip_responses, g_stats.gzip_stream_events, in, out,
+        out ? (double)in / (double)out : 0.0,
+        (double)g_stats.gzip_compress_ns / 1e9, g_stats.cbor_responses);
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_listener_connections_total Connections accepted per listener shard.\n"
+        "# TYPE usbctl_listener_connections_total counter\n");
+    for (int i = 0; i < g_shard_count; i++) {
+        buffer_appendf(buffer, buffer_size, &pos,
+            "usbctl_listener_connections_total{shard=\"%d\",cpu=\"%d\"} %llu\n",
+            i, g_shards[i].cpu, g_shards[i].connections);
+    }
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_listener_requests_total Requests parsed per listener shard.\n"
+        "# TYPE usbctl_listener_requests_total counter\n");
+    for (int i = 0; i < g_shard_count; i++) {
+        buffer_appendf(buffer, buffer_size, &pos,
+            "usbctl_listener_requests_total{shard=\"%d\",cpu=\"%d\"} %llu\n",
+            i, g_shards[i].cpu, g_shards[i].requests);
+    }
+    if (g_unix_listener.socket >= 0) {
+        buffer_appendf(buffer, buffer_size, &pos,
+            "usbctl_listener_connections_total{shard=\"unix\",cpu=\"-1\"} %llu\n"
+            "usbctl_listener_requests_total{shard=\"unix\",cpu=\"-1\"} %llu\n",
+            g_unix_listener.connections, g_unix_listener.requests);
+    }
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_admission_admitted_total Requests admitted per route class.\n"
+        "# TYPE usbctl_admission_admitted_total counter\n"
+        "usbctl_admission_admitted_total{class=\"cheap\"} %llu\n"
+        "usbctl_admission_admitted_total{class=\"expensive\"} %llu\n"
+        "# HELP usbctl_admission_rate_limited_total Requests rejected by the per-source token bucket.\n"
+        "# TYPE usbctl_admission_rate_limited_total counter\n"
+        "usbctl_admission_rate_limited_total{class=\"cheap\"} %llu\n"
+        "usbctl_admission_rate_limited_total{class=\"expensive\"} %llu\n"
+        "# HELP usbctl_admission_inflight_rejected_total Expensive requests rejected by the concurrency cap.\n"
+        "# TYPE usbctl_admission_inflight_rejected_total counter\n"
+        "usbctl_admission_inflight_rejected_total %llu\n"
+        "# HELP usbctl_admission_expensive_inflight Expensive operations currently running.\n"
+        "# TYPE usbctl_admission_expensive_inflight gauge\n"
+        "usbctl_admission_expensive_inflight %d\n"
+        "# HELP usbctl_admission_expensive_inflight_limit Concurrency cap on expensive operations.\n"
+        "# TYPE usbctl_admission_expensive_inflight_limit gauge\n"
+        "usbctl_admission_expensive_inflight_limit %d\n"
+        "# HELP usbctl_admission_tracked_sources Source addresses holding a token bucket.\n"
+        "# TYPE usbctl_admission_tracked_sources gauge\n"
+        "usbctl_admission_tracked_sources %d\n"
+        "# HELP usbctl_admission_source_evictions_total Buckets recycled for a new source.\n"
+        "# TYPE usbctl_admission_source_evictions_total counter\n"
+        "usbctl_admission_source_evictions_total %llu\n",
+        g_stats.admitted[RATE_CLASS_CHEAP], g_stats.admitted[RATE_CLASS_EXPENSIVE],
+        g_stats.rate_limited[RATE_CLASS_CHEAP], g_stats.rate_limited[RATE_CLASS_EXPENSIVE],
+        g_stats.inflight_rejected, g_expensive_inflight, g_config.max_expensive_inflight,
+        g_rate_sources, g_stats.rate_evictions);
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_connection_deadline_expired_total Timer wheel expirations by deadline kind.\n"
+        "# TYPE usbctl_connection_deadline_expired_total counter\n"
+        "usbctl_connection_deadline_expired_total{kind=\"header\"} %llu\n"
+        "usbctl_connection_deadline_expired_total{kind=\"body\"} %llu\n"
+        "usbctl_connection_deadline_expired_total{kind=\"idle\"} %llu\n"
+        "usbctl_connection_deadline_expired_total{kind=\"heartbeat\"} %llu\n"
+        "# HELP usbctl_connection_keepalive_reuses_total Requests served on an already open connection.\n"
+        "# TYPE usbctl_connection_keepalive_reuses_total counter\n"
+        "usbctl_connection_keepalive_reuses_total %llu\n"
+        "# HELP usbctl_timer_wheel_armed Timers currently armed in the wheel.\n"
+        "# TYPE usbctl_timer_wheel_armed gauge\n"
+        "usbctl_timer_wheel_armed %d\n",
+        g_stats.deadline_expired[DEADLINE_HEADER], g_stats.deadline_expired[DEADLINE_BODY],
+        g_stats.deadline_expired[DEADLINE_IDLE], g_stats.deadline_expired[DEADLINE_HEARTBEAT],
+        g_stats.keepalive_reuses, g_wheel.armed);
+
+    int queued = 0, deepest = 0;
+    for (int w = 0; w < g_sse_worker_count; w++) {
+        lock_acquire(&g_sse_workers[w].lock);
+        for (int i = 0; i < g_sse_workers[w].count; i++) {
+            int depth = g_sse_workers[w].clients[i]->queue_count;
+            queued += depth;
+            if (depth > deepest) deepest = depth;
+        }
+        lock_release(&g_sse_workers[w].lock);
+    }
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_sse_subscribers Connected SSE subscribers.\n"
+        "# TYPE usbctl_sse_subscribers gauge\n"
+        "usbctl_sse_subscribers %d\n"
+        "# HELP usbctl_sse_workers Fan-out worker threads.\n"
+        "# TYPE usbctl_sse_workers gauge\n"
+        "usbctl_sse_workers %d\n"
+        "# HELP usbctl_sse_queued_messages Frames waiting in subscriber queues.\n"
+        "# TYPE usbctl_sse_queued_messages gauge\n"
+        "usbctl_sse_queued_messages %d\n"
+        "# HELP usbctl_sse_queue_depth_max Frames waiting in the most backed-up subscriber queue.\n"
+        "# TYPE usbctl_sse_queue_depth_max gauge\n"
+        "usbctl_sse_queue_depth_max %d\n"
+        "# HELP usbctl_sse_subscribed_total Subscribers handed to the fan-out workers.\n"
+        "# TYPE usbctl_sse_subscribed_total counter\n"
+        "usbctl_sse_subscribed_total %llu\n"
+        "# HELP usbctl_sse_rejected_total Subscribers refused at the sse_max_clients cap.\n"
+        "# TYPE usbctl_sse_rejected_total counter\n"
+        "usbctl_sse_rejected_total %llu\n"
+        "# HELP usbctl_sse_disconnected_total Subscribers that hung up or failed a write.\n"
+        "# TYPE usbctl_sse_disconnected_total counter\n"
+        "usbctl_sse_disconnected_total %llu\n"
+        "# HELP usbctl_sse_evicted_total Subscribers evicted after stalling.\n"
+        "# TYPE usbctl_sse_evicted_total counter\n"
+        "usbctl_sse_evicted_total %llu\n"
+        "# HELP usbctl_sse_coalesced_total Backlogs collapsed to the latest snapshot.\n"
+        "# TYPE usbctl_sse_coalesced_total counter\n"
+        "usbctl_sse_coalesced_total %llu\n"
+        "# HELP usbctl_sse_messages_total Frames queued to subscribers.\n"
+        "# TYPE usbctl_sse_messages_total counter\n"
+        "usbctl_sse_messages_total %llu\n"
+        "# HELP usbctl_sse_bytes_sent_total Bytes written to subscribers by the workers.\n"
+        "# TYPE usbctl_sse_bytes_sent_total counter\n"
+        "usbctl_sse_bytes_sent_total %llu\n",
+        g_sse_subscribers, g_sse_worker_count, queued, deepest,
+        g_stats.sse_subscribed, g_stats.sse_rejected, g_stats.sse_disconnected,
+        g_stats.sse_evicted, g_stats.sse_coalesced, g_stats.sse_messages, g_stats.sse_bytes_sent);
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_sse_last_event_id Id of the most recent SSE event.\n"
+        "# TYPE usbctl_sse_last_event_id gauge\n"
+        "usbctl_sse_last_event_id %llu\n"
+        "# HELP usbctl_sse_replay_ring_events Events held for Last-Event-ID resume.\n"
+        "# TYPE usbctl_sse_replay_ring_events gauge\n"
+        "usbctl_sse_replay_ring_events %d\n"
+        "# HELP usbctl_sse_resumes_total Reconnects carrying Last-Event-ID, by outcome.\n"
+        "# TYPE usbctl_sse_resumes_total counter\n"
+        "usbctl_sse_resumes_total{result=\"replayed\"} %llu\n"
+        "usbctl_sse_resumes_total{result=\"snapshot\"} %llu\n"
+        "# HELP usbctl_sse_replayed_events_total Events replayed to resuming subscribers.\n"
+        "# TYPE usbctl_sse_replayed_events_total counter\n"
+        "usbctl_sse_replayed_events_total %llu\n",
+        g_sse_last_id, g_sse_ring_count,
+        g_stats.sse_resume_replayed, g_stats.sse_resume_snapshot, g_stats.sse_replayed_events);
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_sse_device_generation Generation of the published device list.\n"
+        "# TYPE usbctl_sse_device_generation gauge\n"
+        "usbctl_sse_device_generation %llu\n"
+        "# HELP usbctl_sse_events_total Events published, by type.\n"
+        "# TYPE usbctl_sse_events_total counter\n"
+        "usbctl_sse_events_total{type=\"snapshot\"} %llu\n"
+        "usbctl_sse_events_total{type=\"device-added\"} %llu\n"
+        "usbctl_sse_events_total{type=\"device-removed\"} %llu\n"
+        "usbctl_sse_events_total{type=\"device-updated\"} %llu\n"
+        "# HELP usbctl_sse_filters Distinct compiled /events filters in use.\n"
+        "# TYPE usbctl_sse_filters gauge\n"
+        "usbctl_sse_filters %d\n"
+        "# HELP usbctl_sse_filtered_out_total Deltas withheld from subscribers by their filter.\n"
+        "# TYPE usbctl_sse_filtered_out_total counter\n"
+        "usbctl_sse_filtered_out_total %llu\n",
+        g_sse_generation, g_stats.sse_events[SSE_EVENT_SNAPSHOT],
+        g_stats.sse_events[SSE_EVENT_DEVICE_ADDED], g_stats.sse_events[SSE_EVENT_DEVICE_REMOVED],
+        g_stats.sse_events[SSE_EVENT_DEVICE_UPDATED], g_sse_filter_count, g_stats.sse_filtered_out);
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_ws_connections_total WebSocket upgrades accepted.\n"
+        "# TYPE usbctl_ws_connections_total counter\n"
+        "usbctl_ws_connections_total %llu\n"
+        "# HELP usbctl_ws_commands_total WebSocket commands accepted, by op.\n"
+        "# TYPE usbctl_ws_commands_total counter\n"
+        "usbctl_ws_commands_total{op=\"bind\"} %llu\n"
+        "usbctl_ws_commands_total{op=\"unbind\"} %llu\n"
+        "usbctl_ws_commands_total{op=\"batch\"} %llu\n"
+        "usbctl_ws_commands_total{op=\"snapshot\"} %llu\n"
+        "# HELP usbctl_ws_replies_failed_total WebSocket replies that were not a full success.\n"
+        "# TYPE usbctl_ws_replies_failed_total counter\n"
+        "usbctl_ws_replies_failed_total %llu\n"
+        "# HELP usbctl_ws_protocol_errors_total WebSocket connections closed for protocol violations.\n"
+        "# TYPE usbctl_ws_protocol_errors_total counter\n"
+        "usbctl_ws_protocol_errors_total %llu\n"
+        "# HELP usbctl_ws_pings_received_total Ping frames answered.\n"
+        "# TYPE usbctl_ws_pings_received_total counter\n"
+        "usbctl_ws_pings_received_total %llu\n"
+        "# HELP usbctl_ws_ping_timeouts_total WebSocket clients dropped for not answering pings.\n"
+        "# TYPE usbctl_ws_ping_timeouts_total counter\n"
+        "usbctl_ws_ping_timeouts_total %llu\n",
+        g_stats.ws_connections, g_stats.ws_commands[WS_OP_BIND], g_stats.ws_commands[WS_OP_UNBIND],
+        g_stats.ws_commands[WS_OP_BATCH], g_stats.ws_commands[WS_OP_SNAPSHOT],
+        g_stats.ws_replies_failed, g_stats.ws_protocol_errors, g_stats.ws_pings_received,
+        g_stats.ws_ping_timeouts);
+
+    buffer_appendf(buffer, buffer_size, &pos,
+        "# HELP usbctl_h2_connections_total HTTP/2 connections, by how they started.\n"
+        "# TYPE usbctl_h2_connections_total counter\n"
+        "usbctl_h2_connections_total{mode=\"prior-knowledge\"} %llu\n"
+        "usbctl_h2_connections_total{mode=\"upgrade\"} %llu\n"
+        "# HELP usbctl_h2_streams_total HTTP/2 streams opened.\n"
+        "# TYPE usbctl_h2_streams_total counter\n"
+        "usbctl_h2_streams_total %llu\n"
+        "# HELP usbctl_h2_streams_refused_total HTTP/2 streams refused over the concurrency limit.\n"
+        "# TYPE usbctl_h2_streams_refused_total counter\n"
+        "usbctl_h2_streams_refused_total %llu\n"
+        "# HELP usbctl_h2_flow_waits_total HTTP/2 DATA writes that waited for flow-control credit.\n"
+        "# TYPE usbctl_h2_flow_waits_total counter\n"
+        "usbctl_h2_flow_waits_total %llu\n",
+        g_stats.h2_connections[0], g_stats.h2_connections[1], g_stats.h2_streams,
+        g_stats.h2_streams_refused, g_stats.h2_flow_waits);
+
+    metrics_shard_t total;
+    metrics_collect(&total);
+    route_metrics_append(buffer, buffer_size, &pos, &total);
+    backend_metrics_append(buffer, buffer_size, &pos, &total);
+    process_metrics_append(buffer, buffer_size, &pos);
+#ifdef LOCK_STATS
+    lock_metrics_append(buffer, buffer_size, &pos);
+#endif
+}
+
+// ============================================================================
+// CLIENT MANAGEMENT
+// ============================================================================
+
+// Build a shared SSE frame holding one reference for the caller
+static sse_msg_t *sse_msg_create(int kind, const char *frame, size_t len) {
+    sse_msg_t *msg = malloc(sizeof(sse_msg_t) + len);
+    if (!msg) return NULL;
+    memset(msg, 0, sizeof(sse_msg_t));
+    msg->refs = 1;
+    msg->kind = kind;
+    msg->len = len;
+    if (frame) memcpy(msg->data, frame, len);
+    return msg;
+}
+
+static void sse_msg_release(sse_msg_t *msg) {
+    if (msg && __sync_sub_and_fetch(&msg->refs, 1) == 0) {
+        free(msg->ws_frame);
+        free(msg->ws_cbor_frame);
+        free(msg->cbor);
+        free(msg);
+    }
+}
+
+static const char *const SSE_EVENT_NAMES[SSE_EVENT_TYPE_COUNT] = {"snapshot", "device-added", "device-removed", "device-updated"};
+
+// VID:PID of a device, taken from the "(vvvv:pppp)" usbip appends to its
+// description; -1 when absent
+static void device_vid_pid(const char *info, int *vid, int *pid) {
+    *vid = *pid = -1;
+    for (const char *p = strrchr(info, '('); p; p = NULL) {
+        unsigned int v, d;
+        char close;
+        if (sscanf(p, "(%4x:%4x%c", &v, &d, &close) == 3 && close == ')') {
+            *vid = (int)v;
+            *pid = (int)d;
+        }
+    }
+}
+
+// Attach the device an event is about, for filtering without re-parsing
+static void sse_msg_set_device(sse_msg_t *msg, int event, const usb_device_t *device,
+                               const usb_device_t *prev) {
+    msg->event = event;
+    memcpy(msg->busid, device->busid, sizeof(msg->busid));
+    device_vid_pid(device->info, &msg->vid, &msg->pid);
+    msg->bound = device->bound;
+    msg->prev_bound = prev ? prev->bound : device->bound;
+}
+
+static int sse_filter_match_device(const sse_filter_t *filter, const char *busid,
+                                   int vid, int pid, int bound) {
+    if (filter->busid_prefix_len && strncmp(busid, filter->busid_prefix, filter->busid_prefix_len) != 0) {
+        return 0;
+    }
+    if (filter->vid >= 0 && vid != filter->vid) return 0;
+    if (filter->pid >= 0 && pid != filter->pid) return 0;
+    return filter->bound < 0 || bound == filter->bound;
+}
+
+// Predicate for a delta event. An update matches when the device matched
+// before or after it, so a subscriber sees devices leave its view too.
+static int sse_filter_match(const sse_filter_t *filter, const sse_msg_t *msg) {
+    if (!(filter->type_mask & (1u << msg->event))) return 0;
+    return sse_filter_match_device(filter, msg->busid, msg->vid, msg->pid, msg->bound) ||
+           (msg->prev_bound != msg->bound &&
+            sse_filter_match_device(filter, msg->busid, msg->vid, msg->pid, msg->prev_bound));
+}
+
+// Compile /events query parameters: busid=<prefix>, device=<vid>[:<pid>]
+// (hex, '*' for any), bound=true|false and types=<event>[,<event>...].
+// Snapshots are always delivered so filtered subscribers can resync.
+// Returns 0 on a malformed value.
+static int sse_filter_compile(const char *query, sse_filter_t *filter) {
+    char value[64];
+    memset(filter, 0, sizeof(*filter));
+    filter->vid = filter->pid = filter->bound = -1;
+    filter->type_mask = ~0u;
+
+    if (http_query_param(query, "busid", value, sizeof(value))) {
+        size_t len = safe_strnlen(value, sizeof(filter->busid_prefix) - 1);
+        if (len != strlen(value)) return 0;
+        memcpy(filter->busid_prefix, value, len + 1);
+        filter->busid_prefix_len = len;
+    }
+    if (http_query_param(query, "device", value, sizeof(value))) {
+        char *colon = strchr(value, ':');
+        if (colon) *colon = '\0';
+        char *end;
+        if (strcmp(value, "*") != 0) {
+            filter->vid = (int)strtol(value, &end, 16);
+            if (end == value || *end || filter->vid > 0xffff) return 0;
+        }
+        if (colon && strcmp(colon + 1, "*") != 0) {
+            filter->pid = (int)strtol(colon + 1, &end, 16);
+            if (end == colon + 1 || *end || filter->pid > 0xffff) return 0;
+        }
+    }
+    if (http_query_param(query, "bound", value, sizeof(value))) {
+        if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+            filter->bound = 1;
+        } else if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+            filter->bound = 0;
+        } else {
+            return 0;
+        }
+    }
+    if (http_query_param(query, "types", value, sizeof(value))) {
+        filter->type_mask = 1u << SSE_EVENT_SNAPSHOT;
+        for (char *tok = value; *tok;) {
+            size_t len = strcspn(tok, ",");
+            int found = 0;
+            for (int i = 0; i < SSE_EVENT_TYPE_COUNT; i++) {
+                if (strlen(SSE_EVENT_NAMES[i]) == len && strncmp(tok, SSE_EVENT_NAMES[i], len) == 0) {
+                    filter->type_mask |= 1u << i;
+                    found = 1;
+                }
+            }
+            if (!found) return 0;
+            tok += len;
+            if (*tok == ',') tok++;
+        }
+    }
+
+    snprintf(filter->key, sizeof(filter->key), "%s|%d|%d|%d|%x", filter->busid_prefix,
+             filter->vid, filter->pid, filter->bound, filter->type_mask);
+    return 1;
+}
+
+// Share one compiled filter per distinct key (caller holds g_sse_ring_lock).
+// A filter that lets everything through compiles to NULL.
+static sse_filter_t *sse_filter_intern_locked(const sse_filter_t *compiled) {
+    if (!compiled->busid_prefix_len && compiled->vid < 0 && compiled->pid < 0 &&
+        compiled->bound < 0 && compiled->type_mask == ~0u) {
+        return NULL;
+    }
+    for (sse_filter_t *f = g_sse_filters; f; f = f->next) {
+        if (strcmp(f->key, compiled->key) == 0) {
+            f->refs++;
+            return f;
+        }
+    }
+    sse_filter_t *filter = malloc(sizeof(sse_filter_t));
+    if (!filter) return NULL;
+    *filter = *compiled;
+    filter->refs = 1;
+    filter->next = g_sse_filters;
+    g_sse_filters = filter;
+    g_sse_filter_count++;
+    return filter;
+}
+
+static void sse_filter_release(sse_filter_t *filter) {
+    if (!filter) return;
+    lock_acquire(&g_sse_ring_lock);
+    if (--filter->refs == 0) {
+        for (sse_filter_t **link = &g_sse_filters; *link; link = &(*link)->next) {
+            if (*link == filter) {
+                *link = filter->next;
+                break;
+            }
+        }
+        g_sse_filter_count--;
+        sse_msg_release(filter->snapshot);
+        free(filter);
+    }
+    lock_release(&g_sse_ring_lock);
+}
+
+// Snapshot of the published devices a filter lets through, with the id of
+// `base`; built once per filter and event id (caller holds g_sse_ring_lock)
+static sse_msg_t *sse_filter_snapshot_locked(sse_filter_t *filter, const sse_msg_t *base) {
+    if (filter->snapshot && filter->snapshot->id == base->id) {
+        STAT_ADD(cache_hits[CACHE_FILTER_SNAPSHOT], 1);
+        return filter->snapshot;
+    }
+    STAT_ADD(cache_misses[CACHE_FILTER_SNAPSHOT], 1);
+
+    usb_device_t devices[MAX_DEVICES];
+    int count = 0;
+    for (int i = 0; i < g_sse_published_count; i++) {
+        int vid, pid;
+        device_vid_pid(g_sse_published[i].info, &vid, &pid);
+        if (sse_filter_match_device(filter, g_sse_published[i].busid, vid, pid,
+                                    g_sse_published[i].bound)) {
+            devices[count++] = g_sse_published[i];
+        }
+    }
+
+    json_writer_t w = {0};
+    json_snapshot(&w, devices, count, g_sse_generation);
+    char *json = json_finish(&w);
+    char *frame = NULL;
+    size_t frame_len = 0;
+    if (json) {
+        frame = sse_frame_message(base->id, SSE_EVENT_NAMES[SSE_EVENT_SNAPSHOT], json, w.len, &frame_len);
+    }
+    sse_msg_t *msg = frame ? sse_msg_create(SSE_MSG_SNAPSHOT, frame, frame_len) : NULL;
+    free(frame);
+    free(json);
+    if (!msg) return NULL;
+
+    msg->id = base->id;
+    msg->event = SSE_EVENT_SNAPSHOT;
+    msg->cbor = cbor_encode_snapshot(devices, count, g_sse_generation, &msg->cbor_len);
+    sse_msg_release(filter->snapshot);
+    filter->snapshot = msg;
+    return msg;
+}
+
+// What a subscriber behind `filter` receives for an event: the event itself,
+// its own cut of a snapshot, or NULL when the predicate rejects it. Other
+// devices' deltas are never serialised or queued for that subscriber.
+// (caller holds g_sse_ring_lock)
+static sse_msg_t *sse_filter_view_locked(sse_filter_t *filter, sse_msg_t *msg) {
+    if (!filter) return msg;
+    if (msg->kind == SSE_MSG_SNAPSHOT) return sse_filter_snapshot_locked(filter, msg);
+    if (sse_filter_match(filter, msg)) return msg;
+    STAT_ADD(sse_filtered_out, 1);
+    return NULL;
+}
+
+static void sse_set_nonblocking(int socket) {
+#ifdef PLATFORM_WINDOWS
+    u_long mode = 1;
+    ioctlsocket(socket, FIONBIO, &mode);
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags >= 0) fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+// Wake a worker out of poll() after queueing work for it
+static void sse_worker_wake(sse_worker_t *worker) {
+#ifndef PLATFORM_WINDOWS
+    if (worker->wake_pipe[1] >= 0 && __sync_bool_compare_and_swap(&worker->wake_pending, 0, 1)) {
+        char byte = 1;
+        ssize_t ignored = write(worker->wake_pipe[1], &byte, 1);
+        (void)ignored;
+    }
+#else
+    (void)worker; // Windows workers poll on a short timeout instead
+#endif
+}
+
+// Queue a frame for a subscriber (caller holds the worker lock). A client
+// that has fallen SSE_QUEUE_LIMIT frames or SSE_QUEUE_BYTES behind has its
+// unsent backlog replaced by `snapshot`, the state after this event, and
+// skips any event that snapshot already covers. Heartbeats are only queued
+// for idle clients since any pending frame already keeps the stream alive.
+static void sse_client_enqueue_locked(client_t *client, sse_msg_t *msg, sse_msg_t *snapshot) {
+    int pending = client->queue_count > 0 || client->out_sent < client->out_len;
+    int is_event = msg->kind == SSE_MSG_SNAPSHOT || msg->kind == SSE_MSG_DELTA;
+    if (client->closing || client->close_after_flush) return;
+    if (msg->kind == SSE_MSG_HEARTBEAT && pending) return;
+    if (is_event && msg->id <= client->resync_id) return;
+
+    // Caller holds g_sse_ring_lock for events
+    if (client->filter && is_event) {
+        msg = sse_filter_view_locked(client->filter, msg);
+        if (!msg) return;
+        if (snapshot) snapshot = sse_filter_snapshot_locked(client->filter, snapshot);
+    }
+
+    if (client->queue_count == SSE_QUEUE_LIMIT ||
+        client->queued_bytes + msg->len > SSE_QUEUE_BYTES) {
+        if (msg->kind == SSE_MSG_CONTROL) {
+            snapshot = NULL;
+        } else if (!snapshot) {
+            return;
+        } else {
+            msg = snapshot;
+            client->resync_id = snapshot->id;
+        }
+
+        // Drop queued events but keep control frames (command replies, pongs)
+        int kept = 0;
+        client->queued_bytes = 0;
+        for (int i = 0; i < client->queue_count; i++) {
+            sse_msg_t *queued = client->queue[(client->queue_head + i) % SSE_QUEUE_LIMIT];
+            if (queued->kind == SSE_MSG_CONTROL) {
+                client->queue[(client->queue_head + kept++) % SSE_QUEUE_LIMIT] = queued;
+                client->queued_bytes += queued->len;
+            } else {
+                sse_msg_release(queued);
+            }
+        }
+        client->queue_count = kept;
+        if (snapshot) STAT_ADD(sse_coalesced, 1);
+
+        if (kept == SSE_QUEUE_LIMIT) {
+            // A peer that leaves this many replies unread is dropped
+            client->close_after_flush = 1;
+            shutdown(client->socket, SHUT_RDWR);
+            return;
+        }
+    }
+
+    if (!pending) client->pending_since = time(NULL);
+    __sync_fetch_and_add(&msg->refs, 1);
+    client->queue[(client->queue_head + client->queue_count) % SSE_QUEUE_LIMIT] = msg;
+    client->queue_count++;
+    client->queued_bytes += msg->len;
+    STAT_ADD(sse_messages, 1);
+}
+
+// Drop the frame currently being written (caller holds the worker lock)
+static void sse_client_release_out(client_t *client) {
+    free(client->out_encoded);
+    sse_msg_release(client->out_msg);
+    client->out_encoded = NULL;
+    client->out_msg = NULL;
+    client->out = NULL;
+    client->out_len = client->out_sent = 0;
+}
+
+// Write as much queued data as the socket accepts without blocking.
+// Returns 0 while the client is healthy, -1 when it must be dropped.
+static int sse_client_flush_locked(client_t *client, time_t now) {
+    for (;;) {
+        if (client->out_sent == client->out_len) {
+            sse_client_release_out(client);
+            if (client->queue_count == 0) return client->close_after_flush ? -1 : 0;
+
+            sse_msg_t *msg = client->queue[client->queue_head];
+            client->queue_head = (client->queue_head + 1) % SSE_QUEUE_LIMIT;
+            client->queue_count--;
+            client->queued_bytes -= msg->len;
+
+            const void *data;
+            size_t data_len;
+            client->out_msg = msg;
+            if (client->protocol == CLIENT_PROTO_WS) {
+                if (!ws_msg_frame(msg, client->binary, &data, &data_len)) return -1;
+            } else {
+                client->out_encoded = sse_encode_client(client, msg->data, msg->len, &data, &data_len);
+            }
+            if (data_len == 0) return -1;
+            client->out = data;
+            client->out_len = data_len;
+            client->out_sent = 0;
+        }
+
+        ssize_t n = send(client->socket, (const char *)client->out + client->out_sent,
+                         client->out_len - client->out_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            client->out_sent += (size_t)n;
+            client->pending_since = now;
+            client->last_send = now;
+            STAT_ADD(sse_bytes_sent, (unsigned long long)n);
+            continue;
+        }
+#ifdef PLATFORM_WINDOWS
+        if (n < 0 && WSAGetLastError() == WSAEWOULDBLOCK) return 0;
+#else
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+#endif
+        return -1;
+    }
+}
+
+// Heartbeat from the timer wheel: queue a comment for an idle SSE subscriber
+// or a ping for a WebSocket one. A WebSocket peer that has sent nothing,
+// not even a pong, for two intervals is shut down.
+static void sse_client_heartbeat(wheel_timer_t *timer) {
+    client_t *client = (client_t *)timer->arg;
+    sse_worker_t *worker = client->worker;
+
+    STAT_ADD(deadline_expired[DEADLINE_HEARTBEAT], 1);
+    lock_acquire(&worker->lock);
+    if (!client->closing) {
+        if (client->protocol == CLIENT_PROTO_WS &&
+            time(NULL) - client->last_recv > 2 * g_config.sse_heartbeat) {
+            STAT_ADD(ws_ping_timeouts, 1);
+            shutdown(client->socket, SHUT_RDWR);
+        } else {
+            sse_client_enqueue_locked(client, client->protocol == CLIENT_PROTO_WS ? g_ws_ping_msg
+                                                                                : g_sse_heartbeat_msg, NULL);
+            timer_arm(timer, (unsigned int)g_config.sse_heartbeat * 1000, sse_client_heartbeat, client);
+        }
+    }
+    lock_release(&worker->lock);
+    sse_worker_wake(worker);
+}
+
+// Unlink a subscriber from its worker (caller holds the worker lock); the
+// caller frees it with sse_client_free() once the lock is dropped
+static void sse_client_detach_locked(client_t *client) {
+    sse_worker_t *worker = client->worker;
+    client->closing = 1;
+    worker->clients[client->index] = worker->clients[worker->count - 1];
+    worker->clients[client->index]->index = client->index;
+    worker->count--;
+    __sync_sub_and_fetch(&g_sse_subscribers, 1);
+}
+
+// Drop a reference; the last one frees the client's memory
+static void sse_client_unref(client_t *client) {
+    if (__sync_sub_and_fetch(&client->refs, 1) == 0) {
+        free(client->in_buf);
+        free(client->msg_buf);
+        free(client->gzip);
+        free(client);
+    }
+}
+
+// Close a detached subscriber and release what it has queued; commands still
+// running for it keep the struct alive until they drop their reference
+static void sse_client_free(client_t *client) {
+    timer_cancel(&client->heartbeat);
+    while (client->queue_count > 0) {
+        sse_msg_release(client->queue[client->queue_head]);
+        client->queue_head = (client->queue_head + 1) % SSE_QUEUE_LIMIT;
+        client->queue_count--;
+    }
+    sse_client_release_out(client);
+    sse_filter_release(client->filter);
+    client->filter = NULL;
+    close(client->socket);
+    sse_client_unref(client);
+}
+
+// Fan-out worker: poll its subscribers, drain their queues, drop the ones
+// that hang up and evict the ones stalled for sse_stall_timeout seconds
+void *sse_worker_thread(void *arg) {
+    sse_worker_t *worker = (sse_worker_t *)arg;
+    struct pollfd *fds = NULL;
+    client_t **polled = NULL;
+    client_t **dropped = NULL;
+    int slots = 0;
+
+    while (g_running) {
+        lock_acquire(&worker->lock);
+        if (slots < worker->count + 1) {
+            int wanted = worker->capacity + 1;
+            struct pollfd *new_fds = realloc(fds, sizeof(*fds) * wanted);
+            if (new_fds) fds = new_fds;
+            client_t **new_polled = realloc(polled, sizeof(*polled) * wanted);
+            if (new_polled) polled = new_polled;
+            client_t **new_dropped = realloc(dropped, sizeof(*dropped) * wanted);
+            if (new_dropped) dropped = new_dropped;
+            if (new_fds && new_polled && new_dropped) slots = wanted;
+        }
+
+        int nfds = 0;
+#ifndef PLATFORM_WINDOWS
+        if (slots > 0) {
+            fds[nfds].fd = worker->wake_pipe[0];
+            fds[nfds].events = POLLIN;
+            polled[nfds++] = NULL;
+        }
+#endif
+        for (int i = 0; i < worker->count && nfds < slots; i++) {
+            client_t *client = worker->clients[i];
+            fds[nfds].fd = client->socket;
+            fds[nfds].events = POLLIN;
+            if (client->queue_count > 0 || client->out_sent < client->out_len) {
+                fds[nfds].events |= POLLOUT;
+            }
+            polled[nfds++] = client;
+        }
+        lock_release(&worker->lock);
+
+#ifdef PLATFORM_WINDOWS
+        int ready = nfds > 0 ? WSAPoll(fds, nfds, 50) : (Sleep(50), 0);
+#else
+        int ready = poll(fds, nfds, 1000);
+#endif
+        if (ready < 0 && errno != EINTR) {
+            log_message("ERROR", "SSE worker %d poll failed: %s", worker->id, strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        time_t now = time(NULL);
+        int drop_count = 0;
+
+        lock_acquire(&worker->lock);
+        for (int i = 0; i < nfds; i++) {
+            client_t *client = polled[i];
+            if (!client) {
+                if (fds[i].revents & POLLIN) {
+                    char drain[64];
+                    while (read(worker->wake_pipe[0], drain, sizeof(drain)) > 0) {
+                    }
+                    worker->wake_pending = 0;
+                }
+                continue;
+            }
+
+            int failed = (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+            if (!failed && (fds[i].revents & POLLIN) && client->protocol == CLIENT_PROTO_WS) {
+                failed = ws_client_read_locked(client, now) < 0;
+            } else if (!failed && (fds[i].revents & POLLIN)) {
+                char discard[256];
+                ssize_t n = recv(client->socket, discard, sizeof(discard), 0);
+                failed = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+            }
+            if (failed) {
+                STAT_ADD(sse_disconnected, 1);
+                sse_client_detach_locked(client);
+                dropped[drop_count++] = client;
+            }
+        }
+
+        // New frames may have been queued for clients that were idle when the
+        // poll set was built, so try every client that has anything pending
+        for (int i = worker->count - 1; i >= 0 && drop_count < slots; i--) {
+            client_t *client = worker->clients[i];
+            if (client->queue_count == 0 && client->out_sent == client->out_len) continue;
+
+            if (sse_client_flush_locked(client, now) < 0) {
+                STAT_ADD(sse_disconnected, 1);
+            } else if ((client->queue_count > 0 || client->out_sent < client->out_len) &&
+                       g_config.sse_stall_timeout > 0 &&
+                       now - client->pending_since >= g_config.sse_stall_timeout) {
+                STAT_ADD(sse_evicted, 1);
+                log_message("INFO", "Evicting stalled SSE client %s",
+                            inet_ntoa(client->addr.sin_addr));
+            } else {
+                continue;
+            }
+            sse_client_detach_locked(client);
+            dropped[drop_count++] = client;
+        }
+        lock_release(&worker->lock);
+
+        for (int i = 0; i < drop_count; i++) {
+            sse_client_free(dropped[i]);
+        }
+    }
+
+    lock_acquire(&worker->lock);
+    while (worker->count > 0) {
+        client_t *client = worker->clients[0];
+        sse_client_detach_locked(client);
+        lock_release(&worker->lock);
+        sse_client_free(client);
+        lock_acquire(&worker->lock);
+    }
+    lock_release(&worker->lock);
+
+    free(fds);
+    free(polled);
+    free(dropped);
+    return NULL;
+}
+
+// Start the fan-out workers; subscribers are spread over them at subscribe time
+static int sse_start_workers(void) {
+    const char heartbeat[] = ": heartbeat\n\n";
+    g_sse_heartbeat_msg = sse_msg_create(SSE_MSG_HEARTBEAT, heartbeat, sizeof(heartbeat) - 1);
+    if (!g_sse_heartbeat_msg) return 0;
+
+    // The startup enumeration is generation 0; deltas are relative to it
+    devices_lock();
+    memcpy(g_sse_published, g_devices, sizeof(usb_device_t) * g_device_count);
+    g_sse_published_count = g_device_count;
+    devices_unlock();
+    g_sse_generation_ns = monotonic_ns();
+
+    int count = g_config.sse_workers;
+    if (count < 1) count = 1;
+    if (count > MAX_SSE_WORKERS) count = MAX_SSE_WORKERS;
+
+    for (int i = 0; i < count; i++) {
+        sse_worker_t *worker = &g_sse_workers[i];
+        worker->id = i;
+        worker->wake_pipe[0] = worker->wake_pipe[1] = -1;
+        lock_init(&worker->lock, "sse_worker.lock");
+#ifndef PLATFORM_WINDOWS
+        if (pipe(worker->wake_pipe) == 0) {
+            fcntl(worker->wake_pipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(worker->wake_pipe[1], F_SETFL, O_NONBLOCK);
+        } else {
+            worker->wake_pipe[0] = worker->wake_pipe[1] = -1;
+        }
+#endif
+        if (pthread_create(&worker->thread, NULL, sse_worker_thread, worker) != 0) {
+            log_message("ERROR", "Failed to create SSE worker %d", i);
+            break;
+        }
+        g_sse_worker_count++;
+    }
+    return g_sse_worker_count > 0;
+}
+
+static void sse_stop_workers(void) {
+    for (int i = 0; i < g_sse_worker_count; i++) {
+        sse_worker_wake(&g_sse_workers[i]);
+        pthread_join(g_sse_workers[i].thread, NULL);
+    }
+}
+
+// Replay ring of recent events, oldest first (caller holds g_sse_ring_lock)
+static sse_msg_t *sse_ring_at_locked(int i) {
+    return g_sse_ring[(g_sse_ring_head + i) % SSE_REPLAY_SIZE];
+}
+
+static void sse_ring_record_locked(sse_msg_t *msg) {
+    if (g_sse_ring_count == SSE_REPLAY_SIZE) {
+        sse_msg_release(g_sse_ring[g_sse_ring_head]);
+        g_sse_ring_head = (g_sse_ring_head + 1) % SSE_REPLAY_SIZE;
+        g_sse_ring_count--;
+    }
+    __sync_fetch_and_add(&msg->refs, 1);
+    g_sse_ring[(g_sse_ring_head + g_sse_ring_count) % SSE_REPLAY_SIZE] = msg;
+    g_sse_ring_count++;
+}
+
+// Whether every event after `after` is still in the ring
+static int sse_ring_covers_locked(unsigned long long after) {
+    if (after == g_sse_last_id) return 1;
+    if (after > g_sse_last_id || g_sse_ring_count == 0) return 0;
+    return after + 1 >= sse_ring_at_locked(0)->id;
+}
+
+// Snapshot event of the published device list, tagged with the latest event
+// id and generation (caller holds g_sse_ring_lock so the id, generation and
+// device list belong together). It is encoded, as JSON and CBOR, once per
+// event id; callers get a new reference to the cached message.
+static sse_msg_t *sse_snapshot_locked(void) {
+    if (g_sse_snapshot && g_sse_snapshot->id == g_sse_last_id) {
+        STAT_ADD(cache_hits[CACHE_SNAPSHOT], 1);
+        __sync_fetch_and_add(&g_sse_snapshot->refs, 1);
+        return g_sse_snapshot;
+    }
+    STAT_ADD(cache_misses[CACHE_SNAPSHOT], 1);
+
+    json_writer_t w = {0};
+    json_snapshot(&w, g_sse_published, g_sse_published_count, g_sse_generation);
+    char *json = json_finish(&w);
+    if (!json) return NULL;
+
+    size_t frame_len;
+    char *frame = sse_frame_message(g_sse_last_id, "snapshot", json, w.len, &frame_len);
+    sse_msg_t *msg = frame ? sse_msg_create(SSE_MSG_SNAPSHOT, frame, frame_len) : NULL;
+    free(frame);
+    free(json);
+    if (!msg) return NULL;
+
+    msg->id = g_sse_last_id;
+    msg->cbor = cbor_encode_snapshot(g_sse_published, g_sse_published_count, g_sse_generation,
+                                     &msg->cbor_len);
+    sse_msg_release(g_sse_snapshot);
+    g_sse_snapshot = msg;
+    __sync_fetch_and_add(&msg->refs, 1);
+    return msg;
+}
+
+// Initial stream content for a new subscriber: the events after its
+// Last-Event-ID when the ring still holds them, otherwise a full snapshot,
+// rendered as SSE text or as WebSocket frames for the client's protocol.
+// Sets *resume_from to the id the content is current up to.
+static char *sse_initial_events(client_t *client, const char *last_event_id, size_t *len,
+                                unsigned long long *resume_from) {
+    // The retry field keeps the browser's own reconnect (which sends
+    // Last-Event-ID) on the 3 s cadence the UI used before
+    static const char retry[] = "retry: 3000\n\n";
+    int is_ws = client->protocol == CLIENT_PROTO_WS;
+    sse_msg_t *views[SSE_REPLAY_SIZE];
+    int view_count = 0;
+    sse_msg_t *snapshot = NULL;
+    char *initial = NULL;
+    *len = 0;
+
+    lock_acquire(&g_sse_ring_lock);
+    *resume_from = g_sse_last_id;
+
+    char *end = NULL;
+    unsigned long long after = last_event_id ? strtoull(last_event_id, &end, 10) : 0;
+    if (last_event_id && end != last_event_id && *end == '\0' && sse_ring_covers_locked(after)) {
+        for (int i = 0; i < g_sse_ring_count; i++) {
+            sse_msg_t *msg = sse_ring_at_locked(i);
+            if (msg->id <= after) continue;
+            msg = sse_filter_view_locked(client->filter, msg);
+            if (msg) views[view_count++] = msg;
+        }
+        STAT_ADD(sse_resume_replayed, 1);
+        STAT_ADD(sse_replayed_events, (unsigned long long)view_count);
+    } else {
+        if (last_event_id) STAT_ADD(sse_resume_snapshot, 1);
+        snapshot = sse_snapshot_locked();
+        sse_msg_t *view = snapshot ? sse_filter_view_locked(client->filter, snapshot) : NULL;
+        if (view) views[view_count++] = view;
+    }
+
+    size_t total = is_ws ? 0 : sizeof(retry) - 1;
+    for (int i = 0; i < view_count; i++) {
+        const void *frame;
+        size_t frame_len = views[i]->len;
+        if (is_ws && !ws_msg_frame(views[i], client->binary, &frame, &frame_len)) frame_len = 0;
+        total += frame_len;
+    }
+    initial = malloc(total + 1);
+    if (initial) {
+        if (!is_ws) {
+            memcpy(initial, retry, sizeof(retry) - 1);
+            *len = sizeof(retry) - 1;
+        }
+        for (int i = 0; i < view_count; i++) {
+            const void *frame = views[i]->data;
+            size_t frame_len = views[i]->len;
+            if (is_ws && !ws_msg_frame(views[i], client->binary, &frame, &frame_len)) continue;
+            memcpy(initial + *len, frame, frame_len);
+            *len += frame_len;
+        }
+    }
+    sse_msg_release(snapshot);
+    lock_release(&g_sse_ring_lock);
+    return initial;
+}
+
+// Send the stream headers and initial events from the connection thread,
+// then hand the socket over to the least loaded fan-out worker. A non-NULL
+// ws_accept upgrades the connection to a WebSocket instead of an SSE stream.
+// On success the worker owns the socket. Returns 0 when the subscriber was
+// refused. binary selects CBOR event frames; SSE is a text protocol, so
+// it only applies to WebSockets.
+int add_sse_client(http_conn_t *conn, struct sockaddr_in addr, int use_gzip, const char *last_event_id,
+                   const sse_filter_t *filter, const char *ws_accept, int binary) {
+    if (g_sse_worker_count == 0 ||
+        __sync_add_and_fetch(&g_sse_subscribers, 1) > g_config.sse_max_clients) {
+        if (g_sse_worker_count > 0) __sync_sub_and_fetch(&g_sse_subscribers, 1);
+        STAT_ADD(sse_rejected, 1);
+        return 0;
+    }
+
+    client_t *client = calloc(1, sizeof(client_t));
+    if (client && use_gzip && !ws_accept) {
+        client->gzip = malloc(sizeof(deflate_stream_t));
+        if (client->gzip) {
+            deflate_init(client->gzip);
+        } else {
+            free(client);
+            client = NULL;
+        }
+    }
+    if (!client) {
+        __sync_sub_and_fetch(&g_sse_subscribers, 1);
+        return 0;
+    }
+#ifndef PLATFORM_WINDOWS
+    // An HTTP/2 stream shares its connection, so the worker gets a
+    // socketpair that the connection thread frames into DATA
+    if (conn->h2 && !h2_stream_open_pipe(conn)) {
+        __sync_sub_and_fetch(&g_sse_subscribers, 1);
+        if (client->gzip) free(client->gzip);
+        free(client);
+        return 0;
+    }
+#endif
+    client->socket = conn->socket;
+    client->addr = addr;
+    client->refs = 1;
+    client->is_local = conn->is_local;
+    client->protocol = ws_accept ? CLIENT_PROTO_WS : CLIENT_PROTO_SSE;
+    client->binary = ws_accept && binary;
+    client->last_send = client->pending_since = client->last_recv = time(NULL);
+
+    // Frames a WebSocket client sent right behind its handshake
+    size_t early = conn->buffered - conn->request_len;
+    if (ws_accept && early > 0) {
+        client->in_buf = malloc(WS_MAX_MESSAGE + 16);
+        if (client->in_buf && early <= WS_MAX_MESSAGE + 16) {
+            memcpy(client->in_buf, conn->buffer + conn->request_len, early);
+            client->in_len = early;
+        }
+    }
+
+    // Headers go out with a blocking write like any other response; a client
+    // that cannot take them is simply closed by the connection thread
+    size_t initial_len;
+    unsigned long long resume_from;
+    lock_acquire(&g_sse_ring_lock);
+    client->filter = sse_filter_intern_locked(filter);
+    lock_release(&g_sse_ring_lock);
+    char *initial = sse_initial_events(client, last_event_id, &initial_len, &resume_from);
+    int sent = ws_accept ? ws_send_handshake(conn, ws_accept, initial, initial_len)
+                         : send_sse_headers(conn, client, initial, initial_len);
+    free(initial);
+    if (sent != 0) {
+        __sync_sub_and_fetch(&g_sse_subscribers, 1);
+        sse_filter_release(client->filter);
+        sse_client_unref(client);
+        return -1;
+    }
+    sse_set_nonblocking(client->socket);
+
+    sse_worker_t *worker = &g_sse_workers[0];
+    for (int i = 1; i < g_sse_worker_count; i++) {
+        if (g_sse_workers[i].count < worker->count) worker = &g_sse_workers[i];
+    }
+
+    // Register under the ring lock so nothing is published between catching
+    // up on events sent while the headers were in flight and joining the fan-out
+    lock_acquire(&g_sse_ring_lock);
+    lock_acquire(&worker->lock);
+    if (worker->count == worker->capacity) {
+        int capacity = worker->capacity ? worker->capacity * 2 : 64;
+        client_t **clients = realloc(worker->clients, sizeof(*clients) * capacity);
+        if (!clients) {
+            lock_release(&worker->lock);
+            lock_release(&g_sse_ring_lock);
+            __sync_sub_and_fetch(&g_sse_subscribers, 1);
+            sse_filter_release(client->filter);
+            sse_client_unref(client);
+            return -1;
+        }
+        worker->clients = clients;
+        worker->capacity = capacity;
+    }
+    client->worker = worker;
+    client->index = worker->count;
+    worker->clients[worker->count++] = client;
+
+    if (resume_from != g_sse_last_id) {
+        if (sse_ring_covers_locked(resume_from) &&
+            g_sse_last_id - resume_from < SSE_QUEUE_LIMIT) {
+            for (int i = 0; i < g_sse_ring_count; i++) {
+                if (sse_ring_at_locked(i)->id > resume_from) {
+                    sse_client_enqueue_locked(client, sse_ring_at_locked(i), NULL);
+                }
+            }
+        } else {
+            sse_msg_t *snapshot = sse_snapshot_locked();
+            if (snapshot) {
+                sse_client_enqueue_locked(client, snapshot, NULL);
+                sse_msg_release(snapshot);
+            }
+        }
+    }
+    if (client->in_len > 0) {
+        ws_client_process_locked(client);
+    }
+
+    if (g_config.sse_heartbeat > 0) {
+        timer_arm(&client->heartbeat, (unsigned int)g_config.sse_heartbeat * 1000,
+                  sse_client_heartbeat, client);
+    }
+    lock_release(&worker->lock);
+    lock_release(&g_sse_ring_lock);
+
+    conn->socket = -1;
+    STAT_ADD(sse_subscribed, 1);
+    if (ws_accept) STAT_ADD(ws_connections, 1);
+    sse_worker_wake(worker);
+    return 1;
+}
+
+// Queue one frame on every subscriber; only the worker threads touch sockets
+static void sse_publish(sse_msg_t *msg, sse_msg_t *snapshot) {
+    for (int w = 0; w < g_sse_worker_count; w++) {
+        sse_worker_t *worker = &g_sse_workers[w];
+        lock_acquire(&worker->lock);
+        for (int i = 0; i < worker->count; i++) {
+            sse_client_enqueue_locked(worker->clients[i], msg, snapshot);
+        }
+        int has_clients = worker->count > 0;
+        lock_release(&worker->lock);
+        if (has_clients) sse_worker_wake(worker);
+    }
+}
+
+// Assign the next id to a delta event, bump the generation and keep it in
+// the replay ring (caller holds g_sse_ring_lock)
+static sse_msg_t *sse_delta_locked(sse_event_type_t type, const usb_device_t *device,
+                                   const usb_device_t *prev) {
+    g_sse_last_id++;
+    g_sse_generation++;
+    g_sse_generation_ns = monotonic_ns();
+    json_writer_t w = {0};
+    json_lit(&w, "{\"generation\":");
+    json_uint(&w, g_sse_generation);
+    if (type == SSE_EVENT_DEVICE_REMOVED) {
+        json_lit(&w, ",\"busid\":");
+        json_string(&w, device->busid, strlen(device->busid));
+    } else {
+        json_lit(&w, ",\"device\":");
+        json_device(&w, device);
+    }
+    json_lit(&w, "}");
+    char *json = json_finish(&w);
+    if (!json) return NULL;
+
+    size_t frame_len;
+    char *frame = sse_frame_message(g_sse_last_id, SSE_EVENT_NAMES[type], json, w.len, &frame_len);
+    sse_msg_t *msg = frame ? sse_msg_create(SSE_MSG_DELTA, frame, frame_len) : NULL;
+    free(frame);
+    free(json);
+    if (!msg) return NULL;
+    msg->id = g_sse_last_id;
+    msg->cbor = cbor_encode_delta(device, type == SSE_EVENT_DEVICE_REMOVED, g_sse_generation, &msg->cbor_len);
+    sse_msg_set_device(msg, type, device, prev);
+    sse_ring_record_locked(msg);
+    STAT_ADD(sse_events[type], 1);
+    return msg;
+}
+
+static int sse_find_device(const usb_device_t *devices, int count, const char *busid) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(devices[i].busid, busid) == 0) return i;
+    }
+    return -1;
+}
+
+// Broadcast devices update as typed deltas against the last published
+// device list. Every event gets the next id and a place in the replay ring,
+// even with nobody subscribed, so reconnecting clients can resume from
+// their Last-Event-ID. Returns the number of deltas published.
+int broadcast_devices_update(void) {
+    unsigned long long span = trace_begin();
+    usb_device_t current[MAX_DEVICES];
+    devices_lock();
+    int count = g_device_count;
+    memcpy(current, g_devices, sizeof(usb_device_t) * count);
+    devices_unlock();
+
+    sse_msg_t *deltas[MAX_DEVICES * 2];
+    int delta_count = 0;
+
+    lock_acquire(&g_sse_ring_lock);
+    for (int i = 0; i < g_sse_published_count; i++) {
+        if (sse_find_device(current, count, g_sse_published[i].busid) < 0) {
+            deltas[delta_count++] = sse_delta_locked(SSE_EVENT_DEVICE_REMOVED, &g_sse_published[i], NULL);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int prev = sse_find_device(g_sse_published, g_sse_published_count, current[i].busid);
+        if (prev < 0) {
+            deltas[delta_count++] = sse_delta_locked(SSE_EVENT_DEVICE_ADDED, &current[i], NULL);
+        } else if (g_sse_published[prev].bound != current[i].bound ||
+                   strcmp(g_sse_published[prev].info, current[i].info) != 0) {
+            deltas[delta_count++] = sse_delta_locked(SSE_EVENT_DEVICE_UPDATED, &current[i], &g_sse_published[prev]);
+        }
+    }
+
+    if (delta_count > 0) {
+        memcpy(g_sse_published, current, sizeof(usb_device_t) * count);
+        g_sse_published_count = count;
+
+        // Subscribers that overflow fall back to the state after this batch
+        sse_msg_t *snapshot = sse_snapshot_locked();
+        for (int i = 0; i < delta_count; i++) {
+            if (deltas[i]) {
+                sse_publish(deltas[i], snapshot);
+                sse_msg_release(deltas[i]);
+            }
+        }
+        sse_msg_release(snapshot);
+    }
+    lock_release(&g_sse_ring_lock);
+    USBCTL_PROBE2(sse__broadcast, delta_count, count);
+    if (delta_count > 0) flight_record(FLIGHT_BROADCAST, NULL, delta_count, (unsigned long long)count);
+    trace_end("sse", "broadcast_devices_update", span);
+    return delta_count;
+}
+
+// Publish a full snapshot as its own event so subscribers can resynchronise
+void broadcast_devices_snapshot(void) {
+    lock_acquire(&g_sse_ring_lock);
+    g_sse_last_id++;
+    sse_msg_t *snapshot = sse_snapshot_locked();
+    if (snapshot) {
+        sse_ring_record_locked(snapshot);
+        sse_publish(snapshot, snapshot);
+        sse_msg_release(snapshot);
+        STAT_ADD(sse_events[SSE_EVENT_SNAPSHOT], 1);
+    }
+    lock_release(&g_sse_ring_lock);
+}
+
+// ============================================================================
+// ADMISSION CONTROL
+// ============================================================================
+
+static void rate_class_limits(rate_class_t cls, double *rate, double *burst) {
+    if (cls == RATE_CLASS_EXPENSIVE) {
+        *rate = g_config.rate_expensive;
+        *burst = g_config.rate_expensive_burst;
+    } else {
+        *rate = g_config.rate_cheap;
+        *burst = g_config.rate_cheap_burst;
+    }
+    if (*burst < 1.0) *burst = 1.0;
+}
+
+// Find or claim the bucket for a source (caller holds g_rate_mutex). The
+// table is open-addressed over a short probe window; when the window is full
+// the least recently used source is evicted.
+static rate_entry_t *rate_lookup_locked(unsigned int addr, unsigned long long now) {
+    unsigned int h = (addr * 2654435761U) % RATE_TABLE_SIZE;
+    rate_entry_t *victim = NULL;
+
+    for (int probe = 0; probe < 8; probe++) {
+        rate_entry_t *e = &g_rate_table[(h + probe) % RATE_TABLE_SIZE];
+        if (e->in_use && e->addr == addr) return e;
+        if (!e->in_use) {
+            if (!victim || victim->in_use) victim = e;
+        } else if (!victim || (victim->in_use && e->last_ns < victim->last_ns)) {
+            victim = e;
+        }
+    }
+
+    if (victim->in_use) {
+        STAT_ADD(rate_evictions, 1);
+    } else {
+        g_rate_sources++;
+    }
+    memset(victim, 0, sizeof(*victim));
+    victim->addr = addr;
+    victim->in_use = 1;
+    victim->last_ns = now;
+    for (int c = 0; c < RATE_CLASS_COUNT; c++) {
+        double rate, burst;
+        rate_class_limits((rate_class_t)c, &rate, &burst);
+        victim->tokens[c] = burst;
+    }
+    return victim;
+}
+
+// Take count tokens from the source's bucket, all or none. Returns 0 when
+// admitted, or the number of seconds until that many will be available.
+static int rate_take_tokens(unsigned int addr, rate_class_t cls, int count) {
+    double rate, burst;
+    rate_class_limits(cls, &rate, &burst);
+    if (rate <= 0.0) return 0;
+
+    unsigned long long now = monotonic_ns();
+    int retry_after = 0;
+
+    lock_acquire(&g_rate_mutex);
+    rate_entry_t *e = rate_lookup_locked(addr, now);
+    double elapsed = (double)(now - e->last_ns) / 1e9;
+    e->last_ns = now;
+
+    for (int c = 0; c < RATE_CLASS_COUNT; c++) {
+        double r, b;
+        rate_class_limits((rate_class_t)c, &r, &b);
+        e->tokens[c] += elapsed * r;
+        if (e->tokens[c] > b) e->tokens[c] = b;
+    }
+
+    if (e->tokens[cls] >= count) {
+        e->tokens[cls] -= count;
+    } else {
+        retry_after = (int)((count - e->tokens[cls]) / rate) + 1;
+    }
+    lock_release(&g_rate_mutex);
+    return retry_after;
+}
+
+// Reply 429 without touching the device layer
+static void send_rate_limited(http_conn_t *conn, int retry_after) {
+    http_response_t res;
+    http_response_begin(&res, conn, 429, "Too Many Requests", "application/json");
+    http_response_header(&res, "Retry-After", "%d", retry_after);
+    const char *body = "{\"status\":\"failed\",\"error\":\"Too many requests\"}";
+    http_response_body(&res, body, strlen(body));
+    http_response_send(&res);
+}
+
+// Claim one of the max_expensive_inflight slots for an expensive operation.
+// Returns 0 when all are taken; *holds_slot is set when there is a cap and
+// the slot must go back through admission_release().
+static int admission_slot_take(int *holds_slot) {
+    *holds_slot = 0;
+    if (g_config.max_expensive_inflight <= 0) return 1;
+    if (__sync_add_and_fetch(&g_expensive_inflight, 1) > g_config.max_expensive_inflight) {
+        __sync_sub_and_fetch(&g_expensive_inflight, 1);
+        STAT_ADD(inflight_rejected, 1);
+        return 0;
+    }
+    *holds_slot = 1;
+    return 1;
+}
+
+// Admit a request: per-source token bucket for its route's class, plus a
+// global cap on concurrent expensive operations (routes that fork usbip and
+// re-enumerate). Local (Unix socket) clients skip both. Returns 1 when
+// admitted; *holds_slot tells the caller to call admission_release() when done.
+static int admission_check(http_conn_t *conn, rate_class_t cls, int *holds_slot) {
+    *holds_slot = 0;
+    if (conn->is_local) {
+        STAT_ADD(admitted[cls], 1);
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    getpeername(conn->socket, (struct sockaddr *)&addr, &addr_len);
+
+    int retry_after = rate_take_tokens(addr.sin_addr.s_addr, cls, 1);
+    if (retry_after > 0) {
+        STAT_ADD(rate_limited[cls], 1);
+        send_rate_limited(conn, retry_after);
+        return 0;
+    }
+
+    if (cls == RATE_CLASS_EXPENSIVE && !admission_slot_take(holds_slot)) {
+        send_rate_limited(conn, 1);
+        return 0;
+    }
+
+    STAT_ADD(admitted[cls], 1);
+    return 1;
+}
+
+static void admission_release(int holds_slot) {
+    if (holds_slot) {
+        __sync_sub_and_fetch(&g_expensive_inflight, 1);
+    }
+}
+
+// ============================================================================
+// WEBSOCKET
+// ============================================================================
+
+// SHA-1 (FIPS 180-4); only used to derive Sec-WebSocket-Accept
+static void sha1_digest(const unsigned char *data, size_t len, unsigned char digest[20]) {
+    unsigned int h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned long long bits = (unsigned long long)len * 8;
+    size_t total = ((len + 8) / 64 + 1) * 64;
+
+    for (size_t offset = 0; offset < total; offset += 64) {
+        unsigned char block[64];
+        for (int i = 0; i < 64; i++) {
+            size_t at = offset + i;
+            if (at < len) {
+                block[i] = data[at];
+            } else if (at == len) {
+                block[i] = 0x80;
+            } else if (at >= total - 8) {
+                block[i] = (unsigned char)(bits >> (8 * (total - 1 - at)));
+            } else {
+                block[i] = 0;
+            }
+        }
+
+        unsigned int w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (unsigned int)block[4 * i] << 24 | (unsigned int)block[4 * i + 1] << 16 |
+                   (unsigned int)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            unsigned int x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (x << 1) | (x >> 31);
+        }
+
+        unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            unsigned int f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            unsigned int t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        digest[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+// Sec-WebSocket-Accept for a client key (RFC 6455, 4.2.2)
+static void ws_accept_key(const char *key, char accept[32]) {
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    unsigned char input[64 + sizeof(guid)];
+    unsigned char digest[20];
+    size_t key_len = safe_strnlen(key, 64);
+
+    memcpy(input, key, key_len);
+    memcpy(input + key_len, guid, sizeof(guid) - 1);
+    sha1_digest(input, key_len + sizeof(guid) - 1, digest);
+    base64_encode(digest, sizeof(digest), accept, 32);
+}
+
+// Write a server frame header (FIN set, never masked); returns its length
+static size_t ws_frame_header(unsigned char *out, int opcode, size_t len) {
+    out[0] = (unsigned char)(0x80 | opcode);
+    if (len < 126) {
+        out[1] = (unsigned char)len;
+        return 2;
+    }
+    if (len <= 0xffff) {
+        out[1] = 126;
+        out[2] = (unsigned char)(len >> 8);
+        out[3] = (unsigned char)len;
+        return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        out[2 + i] = (unsigned char)((unsigned long long)len >> (56 - 8 * i));
+    }
+    return 10;
+}
+
+// Build a shared frame ready to go on the wire (ping, pong, close, replies)
+static sse_msg_t *ws_frame_create(int opcode, const void *payload, size_t len) {
+    unsigned char header[10];
+    size_t header_len = ws_frame_header(header, opcode, len);
+    sse_msg_t *msg = sse_msg_create(SSE_MSG_CONTROL, NULL, header_len + len);
+    if (!msg) return NULL;
+    msg->raw_ws = 1;
+    memcpy(msg->data, header, header_len);
+    if (len) memcpy(msg->data + header_len, payload, len);
+    return msg;
+}
+
+// Render an event as the payload of a WebSocket message: a
+// {"type":"event","event":..,"id":..,"data":..} JSON text, or the same map
+// in CBOR around the message's cached CBOR data
+static unsigned char *ws_event_payload(const sse_msg_t *msg, int binary, size_t *len) {
+    if (binary) {
+        if (!msg->cbor) return NULL;
+        cbor_writer_t w = {NULL, 0, 0, 0};
+        cbor_head(&w, 5, 4);
+        cbor_text(&w, "type");
+        cbor_text(&w, "event");
+        cbor_text(&w, "event");
+        cbor_text(&w, SSE_EVENT_NAMES[msg->event]);
+        cbor_text(&w, "id");
+        cbor_head(&w, 0, msg->id);
+        cbor_text(&w, "data");
+        cbor_raw(&w, msg->cbor, msg->cbor_len);
+        if (w.failed) {
+            free(w.buf);
+            return NULL;
+        }
+        *len = w.len;
+        return w.buf;
+    }
+
+    // The SSE frame is "id: N\nevent: NAME\ndata: JSON\n\n"
+    const char *data = memchr(msg->data, '\n', msg->len);
+    data = data ? memchr(data + 1, '\n', msg->len - (size_t)(data + 1 - msg->data)) : NULL;
+    if (!data || msg->len < (size_t)(data - msg->data) + 8) return NULL;
+    data += 7;
+    size_t data_len = msg->len - (size_t)(data - msg->data) - 2;
+
+    char prefix[96];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "{\"type\":\"event\",\"event\":\"%s\",\"id\":%llu,\"data\":",
+                              SSE_EVENT_NAMES[msg->event], msg->id);
+    if (prefix_len < 0 || prefix_len >= (int)sizeof(prefix)) return NULL;
+    unsigned char *payload = malloc((size_t)prefix_len + data_len + 1);
+    if (!payload) return NULL;
+    memcpy(payload, prefix, (size_t)prefix_len);
+    memcpy(payload + prefix_len, data, data_len);
+    payload[prefix_len + data_len] = '}';
+    *len = (size_t)prefix_len + data_len + 1;
+    return payload;
+}
+
+// Wire bytes of a queued message for a WebSocket client. Events are framed
+// once per encoding (text JSON or binary CBOR) and cached on the shared
+// message.
+static int ws_msg_frame(sse_msg_t *msg, int binary, const void **frame, size_t *frame_len) {
+    if (msg->raw_ws) {
+        *frame = msg->data;
+        *frame_len = msg->len;
+        return 1;
+    }
+
+    unsigned char *volatile *slot = binary ? &msg->ws_cbor_frame : &msg->ws_frame;
+    size_t *slot_len = binary ? &msg->ws_cbor_len : &msg->ws_len;
+    unsigned char *cached = *slot;
+    STAT_ADD(cache_hits[CACHE_WS_FRAME], cached != NULL);
+    if (!cached) {
+        STAT_ADD(cache_misses[CACHE_WS_FRAME], 1);
+        size_t payload_len;
+        unsigned char *payload = ws_event_payload(msg, binary, &payload_len);
+        if (!payload) return 0;
+
+        unsigned char header[10];
+        size_t header_len = ws_frame_header(header, binary ? 0x2 : 0x1, payload_len);
+        unsigned char *built = malloc(header_len + payload_len);
+        if (!built) {
+            free(payload);
+            return 0;
+        }
+        memcpy(built, header, header_len);
+        memcpy(built + header_len, payload, payload_len);
+        free(payload);
+
+        // Every client renders the same bytes, so a lost race just frees its copy
+        *slot_len = header_len + payload_len;
+        if (__sync_bool_compare_and_swap(slot, NULL, built)) {
+            cached = built;
+        } else {
+            free(built);
+            cached = *slot;
+        }
+    }
+    __sync_synchronize();
+    *frame = cached;
+    *frame_len = *slot_len;
+    return 1;
+}
+
+// Queue a frame for a client (caller holds the worker lock)
+static void ws_client_send_locked(client_t *client, int opcode, const void *payload, size_t len) {
+    sse_msg_t *msg = ws_frame_create(opcode, payload, len);
+    if (msg) {
+        sse_client_enqueue_locked(client, msg, NULL);
+        sse_msg_release(msg);
+    }
+}
+
+// Send a close frame and drop the connection once it is flushed
+static void ws_client_close_locked(client_t *client, int code) {
+    unsigned char payload[2] = {(unsigned char)(code >> 8), (unsigned char)code};
+    if (code != 1000) STAT_ADD(ws_protocol_errors, 1);
+    ws_client_send_locked(client, 0x8, payload, sizeof(payload));
+    client->close_after_flush = 1;
+    client->in_len = 0;
+}
+
+// Queue a command reply; extra holds any members after "status"
+static void ws_client_reply_locked(client_t *client, const char *id, const char *status, const char *extra) {
+    char reply[2560];
+    int len = snprintf(reply, sizeof(reply), "{\"type\":\"reply\",\"id\":%s,\"status\":\"%s\"%s}",
+                       id, status, extra ? extra : "");
+    if (len < 0 || len >= (int)sizeof(reply)) return;
+    if (strcmp(status, "success") != 0) STAT_ADD(ws_replies_failed, 1);
+    ws_client_send_locked(client, 0x1, reply, (size_t)len);
+}
+
+static const json_field_t WS_DEVICE_OP_FIELDS[] = {
+    {"op", JSON_BIND_STRING, 1, offsetof(ws_device_op_t, op), JSON_FIELD_SIZE(ws_device_op_t, op), NULL, 0, 0, 0},
+    {"busid", JSON_BIND_STRING, 1, offsetof(ws_device_op_t, busid), JSON_FIELD_SIZE(ws_device_op_t, busid),
+     NULL, 0, 0, 0},
+};
+
+static const json_field_t WS_COMMAND_FIELDS[] = {
+    // Echoed back verbatim, so only plain strings and numbers are taken
+    {"id", JSON_BIND_SCALAR, 0, offsetof(ws_command_t, id), JSON_FIELD_SIZE(ws_command_t, id), NULL, 0, 0, 0},
+    {"op", JSON_BIND_STRING, 1, offsetof(ws_command_t, op), JSON_FIELD_SIZE(ws_command_t, op), NULL, 0, 0, 0},
+    {"busid", JSON_BIND_STRING, 0, offsetof(ws_command_t, busid), JSON_FIELD_SIZE(ws_command_t, busid),
+     NULL, 0, 0, 0},
+    {"ops", JSON_BIND_OBJECTS, 0, offsetof(ws_command_t, ops), sizeof(ws_device_op_t), WS_DEVICE_OP_FIELDS, 2,
+     offsetof(ws_command_t, op_count), WS_MAX_BATCH},
+};
+
+// Turn a bound bind/unbind operation into a job slot
+static int ws_parse_device_op(const char *op, const char *busid, int *is_bind, char *job_busid) {
+    if (strcmp(op, "bind") == 0) {
+        *is_bind = 1;
+    } else if (strcmp(op, "unbind") == 0) {
+        *is_bind = 0;
+    } else {
+        return 0;
+    }
+    if (!validate_busid(busid)) return 0;
+    strcpy(job_busid, busid);
+    return 1;
+}
+
+// Parse a text frame as a command and hand it to the command threads.
+// Malformed and refused commands are answered right away.
+static void ws_client_command_locked(client_t *client, const char *json, size_t len) {
+    ws_job_t job;
+    memset(&job, 0, sizeof(job));
+    strcpy(job.id, "null");
+
+    ws_command_t command;
+    const char *error_field;
+    memset(&command, 0, sizeof(command));
+    if (!json_bind(json, len, WS_COMMAND_FIELDS, 4, &command, &error_field)) {
+        // Name the member that failed; the id is echoed only once it parsed
+        if (command.id[0] && (!error_field || strcmp(error_field, "id") != 0)) strcpy(job.id, command.id);
+        const char *error = ",\"error\":\"Invalid JSON\"";
+        if (error_field && strcmp(error_field, "id") == 0) {
+            error = ",\"error\":\"Invalid id\"";
+        } else if (error_field && strcmp(error_field, "op") == 0) {
+            error = ",\"error\":\"Missing op\"";
+        } else if (error_field && strcmp(error_field, "ops") == 0) {
+            error = ",\"error\":\"Invalid ops\"";
+        } else if (error_field) {
+            error = ",\"error\":\"Invalid command\"";
+        }
+        ws_client_reply_locked(client, job.id, "failed", error);
+        return;
+    }
+    if (command.id[0]) strcpy(job.id, command.id);
+
+    if (strcmp(command.op, "snapshot") == 0) {
+        job.op = WS_OP_SNAPSHOT;
+    } else if (strcmp(command.op, "batch") == 0) {
+        job.op = WS_OP_BATCH;
+        for (int i = 0; i < command.op_count; i++) {
+            if (!ws_parse_device_op(command.ops[i].op, command.ops[i].busid, &job.ops[i].bind, job.ops[i].busid)) {
+                ws_client_reply_locked(client, job.id, "failed", ",\"error\":\"Invalid ops\"");
+                return;
+            }
+        }
+        job.count = command.op_count;
+        if (job.count == 0) {
+            ws_client_reply_locked(client, job.id, "failed", ",\"error\":\"Missing ops\"");
+            return;
+        }
+    } else if (ws_parse_device_op(command.op, command.busid, &job.ops[0].bind, job.ops[0].busid)) {
+        job.op = job.ops[0].bind ? WS_OP_BIND : WS_OP_UNBIND;
+        job.count = 1;
+    } else {
+        ws_client_reply_locked(client, job.id, "failed", ",\"error\":\"Invalid command\"");
+        return;
+    }
+    STAT_ADD(ws_commands[job.op], 1);
+
+    // Device commands are admitted like POST /bind, one token per operation.
+    // A batch larger than the burst could never be admitted.
+    if (job.op != WS_OP_SNAPSHOT && !client->is_local) {
+        double rate, burst;
+        rate_class_limits(RATE_CLASS_EXPENSIVE, &rate, &burst);
+        if (rate > 0.0 && job.count > burst) {
+            STAT_ADD(rate_limited[RATE_CLASS_EXPENSIVE], 1);
+            ws_client_reply_locked(client, job.id, "failed", ",\"error\":\"Batch exceeds rate limit burst\"");
+            return;
+        }
+        int retry_after = rate_take_tokens(client->addr.sin_addr.s_addr, RATE_CLASS_EXPENSIVE, job.count);
+        if (retry_after > 0) {
+            char extra[96];
+            STAT_ADD(rate_limited[RATE_CLASS_EXPENSIVE], 1);
+            snprintf(extra, sizeof(extra), ",\"error\":\"Too many requests\",\"retry_after\":%d", retry_after);
+            ws_client_reply_locked(client, job.id, "failed", extra);
+            return;
+        }
+        STAT_ADD(admitted[RATE_CLASS_EXPENSIVE], 1);
+    }
+    if (client->refs > WS_MAX_PENDING) {
+        ws_client_reply_locked(client, job.id, "failed", ",\"error\":\"Too many pending commands\"");
+        return;
+    }
+
+    ws_job_t *queued = malloc(sizeof(ws_job_t));
+    if (!queued) {
+        ws_client_reply_locked(client, job.id, "failed", ",\"error\":\"Out of memory\"");
+        return;
+    }
+    *queued = job;
+    queued->client = client;
+    __sync_fetch_and_add(&client->refs, 1);
+
+    lock_acquire(&g_ws_job_lock);
+    if (g_ws_jobs_tail) {
+        g_ws_jobs_tail->next = queued;
+    } else {
+        g_ws_jobs = queued;
+    }
+    g_ws_jobs_tail = queued;
+    pthread_cond_signal(&g_ws_job_cond);
+    lock_release(&g_ws_job_lock);
+}
+
+// Parse the complete frames in a client's input buffer (caller holds the
+// worker lock). Clients must mask, and messages are text of at most
+// WS_MAX_MESSAGE bytes, in one frame or reassembled from fragments (RFC 6455
+// 5.4); anything else closes the connection.
+static void ws_client_process_locked(client_t *client) {
+    unsigned char *buf = client->in_buf;
+    while (!client->close_after_flush && client->in_len >= 2) {
+        int opcode = buf[0] & 0x0f;
+        size_t len = buf[1] & 0x7f;
+        size_t header_len = 6;
+
+        if ((buf[0] & 0x70) || !(buf[1] & 0x80)) {
+            ws_client_close_locked(client, 1002);
+            return;
+        }
+        if (len == 127) {
+            ws_client_close_locked(client, 1009);
+            return;
+        }
+        if (len == 126) {
+            if (client->in_len < 4) return;
+            len = (size_t)buf[2] << 8 | buf[3];
+            header_len = 8;
+        }
+        if (len > WS_MAX_MESSAGE) {
+            ws_client_close_locked(client, 1009);
+            return;
+        }
+        if ((opcode & 0x8) && (len > 125 || !(buf[0] & 0x80))) {
+            ws_client_close_locked(client, 1002);
+            return;
+        }
+        if (client->in_len < header_len + len) return;
+
+        unsigned char *mask = buf + header_len - 4;
+        unsigned char *payload = buf + header_len;
+        for (size_t i = 0; i < len; i++) {
+            payload[i] ^= mask[i & 3];
+        }
+
+        switch (opcode) {
+        case 0x1:
+            // A new data frame while a fragmented message is open
+            if (client->msg_fragmented) {
+                ws_client_close_locked(client, 1002);
+                return;
+            }
+            if (buf[0] & 0x80) {
+                ws_client_command_locked(client, (const char *)payload, len);
+                break;
+            }
+            if (!client->msg_buf && !(client->msg_buf = malloc(WS_MAX_MESSAGE))) {
+                ws_client_close_locked(client, 1011);
+                return;
+            }
+            memcpy(client->msg_buf, payload, len);
+            client->msg_len = len;
+            client->msg_fragmented = 1;
+            break;
+        case 0x0:
+            if (!client->msg_fragmented) {
+                ws_client_close_locked(client, 1002);
+                return;
+            }
+            if (client->msg_len + len > WS_MAX_MESSAGE) {
+                ws_client_close_locked(client, 1009);
+                return;
+            }
+            memcpy(client->msg_buf + client->msg_len, payload, len);
+            client->msg_len += len;
+            if (buf[0] & 0x80) {
+                client->msg_fragmented = 0;
+                ws_client_command_locked(client, (const char *)client->msg_buf, client->msg_len);
+            }
+            break;
+        case 0x8:
+            ws_client_send_locked(client, 0x8, payload, len >= 2 ? 2 : 0);
+            client->close_after_flush = 1;
+            client->in_len = 0;
+            return;
+        case 0x9:
+            STAT_ADD(ws_pings_received, 1);
+            ws_client_send_locked(client, 0xA, payload, len);
+            break;
+        case 0xA:
+            break;
+        case 0x2:
+            // Binary messages are not part of the protocol
+            ws_client_close_locked(client, 1003);
+            return;
+        default:
+            ws_client_close_locked(client, 1002);
+            return;
+        }
+
+        client->in_len -= header_len + len;
+        memmove(buf, buf + header_len + len, client->in_len);
+    }
+}
+
+// Read what a WebSocket client sent and act on every complete frame.
+// Returns -1 when the connection is gone.
+static int ws_client_read_locked(client_t *client, time_t now) {
+    size_t capacity = WS_MAX_MESSAGE + 16;
+    if (!client->in_buf) {
+        client->in_buf = malloc(capacity);
+        if (!client->in_buf) return -1;
+    }
+
+    unsigned char discard[256];
+    int closing = client->close_after_flush;
+    unsigned char *target = closing ? discard : client->in_buf + client->in_len;
+    size_t space = closing ? sizeof(discard) : capacity - client->in_len;
+
+    ssize_t n = recv(client->socket, (char *)target, space, 0);
+    if (n == 0) return -1;
+    if (n < 0) {
+#ifdef PLATFORM_WINDOWS
+        return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+#else
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+#endif
+    }
+    client->last_recv = now;
+    if (!closing) {
+        client->in_len += (size_t)n;
+        ws_client_process_locked(client);
+    }
+    return 0;
+}
+
+// Run one command on a command thread and queue its reply. Device changes
+// are published to every subscriber before the reply goes out, so a client
+// sees the resulting events ahead of the reply.
+static void ws_run_job(ws_job_t *job) {
+    client_t *client = job->client;
+    sse_worker_t *worker = client->worker;
+
+    if (job->op == WS_OP_SNAPSHOT) {
+        lock_acquire(&g_sse_ring_lock);
+        sse_msg_t *snapshot = sse_snapshot_locked();
+        lock_acquire(&worker->lock);
+        if (snapshot) {
+            // Asked for explicitly, so it goes out even if a coalesced one did
+            unsigned long long resync_id = client->resync_id;
+            client->resync_id = 0;
+            sse_client_enqueue_locked(client, snapshot, NULL);
+            if (client->resync_id < resync_id) client->resync_id = resync_id;
+        }
+        ws_client_reply_locked(client, job->id, snapshot ? "success" : "failed", NULL);
+        lock_release(&worker->lock);
+        lock_release(&g_sse_ring_lock);
+        sse_msg_release(snapshot);
+        sse_worker_wake(worker);
+        return;
+    }
+
+    // Each bind/unbind and the refresh after them take an expensive-class
+    // slot like an HTTP request would; a refused refresh is left to the poll
+    char results[2048];
+    size_t pos = 0;
+    int succeeded = 0, refused = 0, holds_slot = 0;
+    results[0] = '\0';
+    for (int i = 0; i < job->count; i++) {
+        int ok = 0, admitted = client->is_local || admission_slot_take(&holds_slot);
+        if (admitted) {
+            ok = job->ops[i].bind ? bind_device(job->ops[i].busid) : unbind_device(job->ops[i].busid);
+            admission_release(holds_slot);
+        }
+        succeeded += ok;
+        refused += !admitted;
+        buffer_appendf(results, sizeof(results), &pos, "%s{\"op\":\"%s\",\"busid\":\"%s\",\"status\":\"%s\"%s}",
+                       i ? "," : "", job->ops[i].bind ? "bind" : "unbind", job->ops[i].busid,
+                       ok ? "success" : "failed", admitted ? "" : ",\"error\":\"Too many operations in flight\"");
+    }
+    if (succeeded > 0 && (client->is_local || admission_slot_take(&holds_slot))) {
+        list_usbip_devices();
+        save_config();
+        broadcast_devices_update();
+        admission_release(holds_slot);
+    }
+
+    const char *status = succeeded == job->count ? "success" : succeeded > 0 ? "partial" : "failed";
+    char extra[2080];
+    if (job->op == WS_OP_BATCH) {
+        snprintf(extra, sizeof(extra), ",\"results\":[%s]", results);
+    } else {
+        snprintf(extra, sizeof(extra), "%s", succeeded ? "" : refused ? ",\"error\":\"Too many operations in flight\""
+                                                                     : ",\"error\":\"Operation failed\"");
+    }
+
+    lock_acquire(&worker->lock);
+    ws_client_reply_locked(client, job->id, status, extra);
+    lock_release(&worker->lock);
+    sse_worker_wake(worker);
+}
+
+// Command thread: bind/unbind fork usbip, so they run here rather than on
+// the fan-out workers
+void *ws_command_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        lock_acquire(&g_ws_job_lock);
+        while (g_running && !g_ws_jobs) {
+            lock_cond_wait(&g_ws_job_cond, &g_ws_job_lock);
+        }
+        ws_job_t *job = g_running ? g_ws_jobs : NULL;
+        if (job) {
+            g_ws_jobs = job->next;
+            if (!g_ws_jobs) g_ws_jobs_tail = NULL;
+        }
+        lock_release(&g_ws_job_lock);
+        if (!job) break;
+
+        trace_request_begin();
+        unsigned long long span = trace_begin();
+        ws_run_job(job);
+        trace_end("ws", "ws_command", span);
+        sse_client_unref(job->client);
+        free(job);
+    }
+    return NULL;
+}
+
+static int ws_start_commands(void) {
+    // Heartbeat pings are skipped for clients with output pending, like
+    // the SSE heartbeat comment
+    g_ws_ping_msg = ws_frame_create(0x9, NULL, 0);
+    if (!g_ws_ping_msg) return 0;
+    g_ws_ping_msg->kind = SSE_MSG_HEARTBEAT;
+
+    lock_init(&g_ws_job_lock, "g_ws_job_lock");
+    pthread_cond_init(&g_ws_job_cond, NULL);
+    for (int i = 0; i < WS_COMMAND_THREADS; i++) {
+        if (pthread_create(&g_ws_command_threads[i], NULL, ws_command_thread, NULL) != 0) {
+            log_message("ERROR", "Failed to create WebSocket command thread %d", i);
+            break;
+        }
+        g_ws_command_count++;
+    }
+    return g_ws_command_count > 0;
+}
+
+// Wake the command threads and drop the commands nobody will run
+static void ws_stop_commands(void) {
+    lock_acquire(&g_ws_job_lock);
+    pthread_cond_broadcast(&g_ws_job_cond);
+    lock_release(&g_ws_job_lock);
+    for (int i = 0; i < g_ws_command_count; i++) {
+        pthread_join(g_ws_command_threads[i], NULL);
+    }
+    while (g_ws_jobs) {
+        ws_job_t *job = g_ws_jobs;
+        g_ws_jobs = job->next;
+        sse_client_unref(job->client);
+        free(job);
+    }
+    g_ws_jobs_tail = NULL;
+}
+
+// Switch the connection to WebSocket, sending the initial event frames in
+// the same write as the 101 response
+static int ws_send_handshake(http_conn_t *conn, const char *accept, const char *initial, size_t initial_len) {
+    http_response_t res;
+    http_response_begin(&res, conn, 101, "Switching Protocols", NULL);
+    http_response_header(&res, "Upgrade", "websocket");
+    http_response_header(&res, "Sec-WebSocket-Accept", "%s", accept);
+    res.upgrade = 1;
+    http_response_body(&res, initial, initial_len);
+    return http_response_send(&res);
+}
+
+// ============================================================================
+// HTTP/2 (h2c)
+// ============================================================================
+
+#ifndef PLATFORM_WINDOWS
+
+// Frame types, flags and error codes (RFC 9113, 6 and 7)
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+#define H2_CLOSE_QUIETLY (-1)
+
+// Stream states as seen by the server
+#define H2_STATE_OPEN 0
+#define H2_STATE_HALF_CLOSED 1
+#define H2_STATE_CLOSED 2
+
+static const char H2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// HPACK Huffman code (RFC 7541, Appendix B): code and bit length per symbol,
+// 256 being EOS
+static const unsigned int HPACK_HUFFMAN_CODES[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff
+};
+static const unsigned char HPACK_HUFFMAN_BITS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+// HPACK static table (RFC 7541, Appendix A); index i + 1
+static const char *const HPACK_STATIC[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+
+// Huffman decoding tree: node 0 is the root (never a child, so 0 also
+// means "no child"); negative children are leaves holding -(symbol + 1)
+static short g_hpack_tree[2 * 257][2];
+
+// Build the decoding tree once from the code table (called from main)
+static void hpack_init(void) {
+    int nodes = 1;
+    memset(g_hpack_tree, 0, sizeof(g_hpack_tree));
+    for (int sym = 0; sym < 257; sym++) {
+        int node = 0;
+        for (int bit = HPACK_HUFFMAN_BITS[sym] - 1; bit >= 0; bit--) {
+            int b = (HPACK_HUFFMAN_CODES[sym] >> bit) & 1;
+            if (bit == 0) {
+                g_hpack_tree[node][b] = (short)-(sym + 1);
+            } else {
+                if (g_hpack_tree[node][b] == 0) g_hpack_tree[node][b] = (short)nodes++;
+                node = g_hpack_tree[node][b];
+            }
+        }
+    }
+}
+
+// Decode a prefixed integer (RFC 7541, 5.1)
+static int hpack_int(const unsigned char **p, const unsigned char *end, int prefix, size_t *value) {
+    if (*p >= end) return 0;
+    size_t max = ((size_t)1 << prefix) - 1;
+    size_t v = **p & max;
+    (*p)++;
+    if (v < max) {
+        *value = v;
+        return 1;
+    }
+    for (int shift = 0; shift < 28; shift += 7) {
+        if (*p >= end) return 0;
+        unsigned char b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Decode a string literal, Huffman-coded or raw, into out (NUL-terminated,
+// truncated to fit). *out_len is the full decoded length, so callers can
+// tell a truncated string from a complete one.
+static int hpack_string(const unsigned char **p, const unsigned char *end, char *out, size_t out_size,
+                        size_t *out_len) {
+    if (*p >= end) return 0;
+    int huffman = **p & 0x80;
+    size_t len;
+    if (!hpack_int(p, end, 7, &len) || len > (size_t)(end - *p)) return 0;
+    const unsigned char *s = *p;
+    *p += len;
+
+    size_t n = 0;
+    if (!huffman) {
+        for (size_t i = 0; i < len; i++, n++) {
+            if (n < out_size - 1) out[n] = (char)s[i];
+        }
+    } else {
+        int node = 0, depth = 0, ones = 1;
+        for (size_t i = 0; i < len; i++) {
+            for (int bit = 7; bit >= 0; bit--) {
+                int b = (s[i] >> bit) & 1;
+                int next = g_hpack_tree[node][b];
+                if (next == 0) return 0;
+                if (next > 0) {
+                    node = next;
+                    depth++;
+                    ones &= b;
+                    continue;
+                }
+                if (next == -257) return 0;
+                if (n < out_size - 1) out[n] = (char)(-next - 1);
+                n++;
+                node = depth = 0;
+                ones = 1;
+            }
+        }
+        // Padding is a prefix of EOS: at most 7 bits, all ones
+        if (depth > 7 || !ones) return 0;
+    }
+    out[n < out_size - 1 ? n : out_size - 1] = '\0';
+    *out_len = n;
+    return 1;
+}
+
+// Drop the oldest entries until the table fits max
+static void hpack_evict(hpack_table_t *table, size_t max) {
+    while (table->count > 0 && table->size > max) {
+        int last = (table->head + table->count - 1) % HPACK_MAX_ENTRIES;
+        table->size -= table->sizes[last];
+        free(table->names[last]);
+        free(table->values[last]);
+        table->count--;
+    }
+}
+
+// Add an entry; one larger than the whole table just empties it (RFC 7541, 4.4)
+static int hpack_insert(hpack_table_t *table, const char *name, size_t name_len,
+                        const char *value, size_t value_len) {
+    size_t size = name_len + value_len + 32;
+    if (size > table->max_size) {
+        hpack_evict(table, 0);
+        return 1;
+    }
+    hpack_evict(table, table->max_size - size);
+
+    char *n = malloc(name_len + 1);
+    char *v = malloc(value_len + 1);
+    if (!n || !v) {
+        free(n);
+        free(v);
+        return 0;
+    }
+    memcpy(n, name, name_len + 1);
+    memcpy(v, value, value_len + 1);
+    table->head = (table->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    table->names[table->head] = n;
+    table->values[table->head] = v;
+    table->sizes[table->head] = size;
+    table->count++;
+    table->size += size;
+    return 1;
+}
+
+static int hpack_lookup(const hpack_table_t *table, size_t index, const char **name, const char **value) {
+    if (index == 0) return 0;
+    if (index <= 61) {
+        *name = HPACK_STATIC[index - 1][0];
+        *value = HPACK_STATIC[index - 1][1];
+        return 1;
+    }
+    index -= 62;
+    if (index >= (size_t)table->count) return 0;
+    int slot = (table->head + (int)index) % HPACK_MAX_ENTRIES;
+    *name = table->names[slot];
+    *value = table->values[slot];
+    return 1;
+}
+
+// Take one decoded field into the request. Values end up in HTTP/1.1 text,
+// so CR, LF and NUL anywhere make the request malformed.
+static void h2_request_field(h2_request_t *req, const char *name, size_t name_len,
+                             const char *value, size_t value_len) {
+    if (strlen(name) != name_len || strlen(value) != value_len ||
+        strpbrk(name, "\r\n") || strpbrk(value, "\r\n")) {
+        req->malformed = 1;
+        return;
+    }
+
+    if (name[0] == ':') {
+        char *dst = NULL;
+        size_t size = 0;
+        if (req->lines_len > 0) req->malformed = 1;
+        if (strcmp(name, ":method") == 0) {
+            dst = req->method;
+            size = sizeof(req->method);
+        } else if (strcmp(name, ":path") == 0) {
+            dst = req->path;
+            size = sizeof(req->path);
+        } else if (strcmp(name, ":authority") == 0) {
+            dst = req->authority;
+            size = sizeof(req->authority);
+        } else if (strcmp(name, ":scheme") != 0) {
+            req->malformed = 1;
+        }
+        if (dst && (value_len >= size || strchr(value, ' '))) {
+            req->overflow = 1;
+        } else if (dst) {
+            memcpy(dst, value, value_len + 1);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < name_len; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') req->malformed = 1;
+    }
+    // Connection-specific headers have no meaning here; the body length
+    // comes from the DATA frames
+    if (strcmp(name, "connection") == 0 || strcmp(name, "keep-alive") == 0 ||
+        strcmp(name, "transfer-encoding") == 0 || strcmp(name, "upgrade") == 0 ||
+        strcmp(name, "content-length") == 0) {
+        return;
+    }
+    int n = snprintf(req->lines + req->lines_len, sizeof(req->lines) - req->lines_len, "%s: %s\r\n", name, value);
+    if (n < 0 || (size_t)n >= sizeof(req->lines) - req->lines_len) {
+        req->overflow = 1;
+        return;
+    }
+    req->lines_len += (size_t)n;
+}
+
+// Decode a complete header block (RFC 7541, 6). Returns 0 on a compression
+// error, which is fatal for the connection since the table is out of step.
+static int hpack_decode_block(hpack_table_t *table, const unsigned char *p, size_t len, h2_request_t *req) {
+    const unsigned char *end = p + len;
+    char name[HPACK_TABLE_SIZE + 1];
+    char value[BUFFER_SIZE];
+    size_t name_len, value_len;
+
+    while (p < end) {
+        unsigned char b = *p;
+        size_t index;
+        const char *entry_name, *entry_value;
+
+        if (b & 0x80) {
+            if (!hpack_int(&p, end, 7, &index) || !hpack_lookup(table, index, &entry_name, &entry_value)) return 0;
+            h2_request_field(req, entry_name, strlen(entry_name), entry_value, strlen(entry_value));
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {
+            if (!hpack_int(&p, end, 5, &index) || index > HPACK_TABLE_SIZE) return 0;
+            table->max_size = index;
+            hpack_evict(table, index);
+            continue;
+        }
+
+        int indexing = (b & 0xc0) == 0x40;
+        if (!hpack_int(&p, end, indexing ? 6 : 4, &index)) return 0;
+        if (index) {
+            if (!hpack_lookup(table, index, &entry_name, &entry_value)) return 0;
+            name_len = strlen(entry_name);
+            memcpy(name, entry_name, name_len + 1);
+        } else if (!hpack_string(&p, end, name, sizeof(name), &name_len)) {
+            return 0;
+        }
+        if (!hpack_string(&p, end, value, sizeof(value), &value_len)) return 0;
+
+        // Anything truncated here is larger than the table, so inserting
+        // the truncated copy evicts exactly as the peer's encoder did
+        if (indexing && !hpack_insert(table, name, name_len < sizeof(name) ? name_len : sizeof(name) - 1,
+                                      value, value_len < sizeof(value) ? value_len : sizeof(value) - 1)) {
+            return 0;
+        }
+        if (name_len >= sizeof(name) || value_len >= sizeof(value)) {
+            req->overflow = 1;
+        } else {
+            h2_request_field(req, name, name_len, value, value_len);
+        }
+    }
+    return 1;
+}
+
+static void hpack_put_int(unsigned char *out, size_t cap, size_t *pos, unsigned char flags, int prefix,
+                          size_t value) {
+    size_t max = ((size_t)1 << prefix) - 1;
+    if (*pos >= cap) {
+        *pos = cap + 1;
+        return;
+    }
+    if (value < max) {
+        out[(*pos)++] = (unsigned char)(flags | value);
+        return;
+    }
+    out[(*pos)++] = (unsigned char)(flags | max);
+    value -= max;
+    while (*pos < cap) {
+        out[(*pos)++] = (unsigned char)((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+        if (value < 0x80) return;
+        value >>= 7;
+    }
+    *pos = cap + 1;
+}
+
+static void hpack_put_string(unsigned char *out, size_t cap, size_t *pos, const char *s, size_t len) {
+    hpack_put_int(out, cap, pos, 0x00, 7, len);
+    if (*pos + len > cap) {
+        *pos = cap + 1;
+        return;
+    }
+    memcpy(out + *pos, s, len);
+    *pos += len;
+}
+
+// Encode a response field. Only the static table is used, as an indexed
+// field or a literal without indexing, so the encoder keeps no state and
+// streams on different threads never share one.
+static void hpack_put_field(unsigned char *out, size_t cap, size_t *pos, const char *name,
+                            const char *value, size_t value_len) {
+    int name_index = 0;
+    for (int i = 0; i < 61; i++) {
+        if (strcmp(HPACK_STATIC[i][0], name) != 0) continue;
+        if (strlen(HPACK_STATIC[i][1]) == value_len && memcmp(HPACK_STATIC[i][1], value, value_len) == 0) {
+            hpack_put_int(out, cap, pos, 0x80, 7, (size_t)i + 1);
+            return;
+        }
+        if (!name_index) name_index = i + 1;
+    }
+    hpack_put_int(out, cap, pos, 0x00, 4, (size_t)name_index);
+    if (!name_index) hpack_put_string(out, cap, pos, name, strlen(name));
+    hpack_put_string(out, cap, pos, value, value_len);
+}
+
+
+// Write one frame; write_lock keeps concurrent streams from interleaving
+static int h2_write_frame(h2_session_t *s, int type, int flags, unsigned int stream_id,
+                          const void *payload, size_t len) {
+    unsigned char header[H2_FRAME_HEADER] = {
+        (unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len,
+        (unsigned char)type, (unsigned char)flags,
+        (unsigned char)((stream_id >> 24) & 0x7f), (unsigned char)(stream_id >> 16),
+        (unsigned char)(stream_id >> 8), (unsigned char)stream_id};
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+
+    lock_acquire(&s->write_lock);
+    int result = s->dead ? -1 : send_iov_all(s->socket, iov, len ? 2 : 1);
+    if (result != 0) s->dead = 1;
+    lock_release(&s->write_lock);
+    return result;
+}
+
+static void h2_write_u32(unsigned char *out, unsigned int value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+static unsigned int h2_read_u32(const unsigned char *in) {
+    return (unsigned int)in[0] << 24 | (unsigned int)in[1] << 16 | (unsigned int)in[2] << 8 | in[3];
+}
+
+static void h2_rst_stream(h2_session_t *s, unsigned int stream_id, unsigned int code) {
+    unsigned char payload[4];
+    h2_write_u32(payload, code);
+    h2_write_frame(s, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void h2_goaway(h2_session_t *s, unsigned int code) {
+    unsigned char payload[8];
+    h2_write_u32(payload, s->last_stream_id);
+    h2_write_u32(payload + 4, code);
+    h2_write_frame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+static void h2_window_update(h2_session_t *s, unsigned int stream_id, size_t increment) {
+    unsigned char payload[4];
+    h2_write_u32(payload, (unsigned int)increment);
+    h2_write_frame(s, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void h2_session_wake(h2_session_t *s) {
+    char byte = 1;
+    if (write(s->wake_pipe[1], &byte, 1) < 0) {
+        // Pipe full: the connection thread is waking up anyway
+    }
+}
+
+// Send a response built by handle_request() as HEADERS and DATA frames.
+// Hop-by-hop headers are dropped; DATA waits for flow-control credit, and a
+// streaming (SSE) response leaves the stream open.
+static int h2_response_send(http_response_t *res) {
+    h2_stream_t *stream = res->conn->h2;
+    h2_session_t *s = stream->session;
+    unsigned char block[HTTP_HEADER_SIZE * 2];
+    size_t len = 0;
+
+    const char *end = res->header + res->header_len;
+    const char *line = memchr(res->header, '\n', res->header_len);
+    if (res->header_len < 12 || !line) return -1;
+    hpack_put_field(block, sizeof(block), &len, ":status", res->header + 9, 3);
+
+    for (line++; line < end;) {
+        const char *eol = memchr(line, '\r', (size_t)(end - line));
+        const char *colon = eol ? memchr(line, ':', (size_t)(eol - line)) : NULL;
+        if (!colon) break;
+
+        char name[64];
+        size_t name_len = (size_t)(colon - line);
+        if (name_len >= sizeof(name)) return -1;
+        for (size_t i = 0; i < name_len; i++) {
+            name[i] = (char)tolower((unsigned char)line[i]);
+        }
+        name[name_len] = '\0';
+        const char *value = colon + 1;
+        while (value < eol && *value == ' ') value++;
+
+        if (strcmp(name, "connection") != 0 && strcmp(name, "keep-alive") != 0 &&
+            strcmp(name, "upgrade") != 0 && strcmp(name, "transfer-encoding") != 0) {
+            hpack_put_field(block, sizeof(block), &len, name, value, (size_t)(eol - value));
+        }
+        line = eol + 2;
+    }
+    if (len > sizeof(block)) return -1;
+
+    int has_body = !res->head_only && res->body_len > 0;
+    if (stream->reset) return -1;
+    stream->streaming = res->stream;
+    if (h2_write_frame(s, H2_HEADERS, H2_FLAG_END_HEADERS | (has_body || res->stream ? 0 : H2_FLAG_END_STREAM),
+                       stream->id, block, len) != 0) {
+        return -1;
+    }
+    if (!has_body) return 0;
+
+    size_t remaining = res->body_len;
+    for (int i = 0; i < res->body_count; i++) {
+        const unsigned char *data = (const unsigned char *)res->body[i].iov_base;
+        size_t left = res->body[i].iov_len;
+        while (left > 0) {
+            lock_acquire(&s->lock);
+            if (stream->send_window <= 0 || s->send_window <= 0) STAT_ADD(h2_flow_waits, 1);
+            while (!stream->reset && !s->dead && (stream->send_window <= 0 || s->send_window <= 0)) {
+                lock_cond_wait(&s->changed, &s->lock);
+            }
+            if (stream->reset || s->dead) {
+                lock_release(&s->lock);
+                return -1;
+            }
+            size_t n = left;
+            if ((long long)n > stream->send_window) n = (size_t)stream->send_window;
+            if ((long long)n > s->send_window) n = (size_t)s->send_window;
+            if (n > s->peer_max_frame) n = s->peer_max_frame;
+            stream->send_window -= (long long)n;
+            s->send_window -= (long long)n;
+            lock_release(&s->lock);
+
+            remaining -= n;
+            int last = remaining == 0 && !res->stream;
+            if (h2_write_frame(s, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id, data, n) != 0) {
+                return -1;
+            }
+            data += n;
+            left -= n;
+        }
+    }
+    return 0;
+}
+
+// Give an SSE stream a socketpair: its fan-out worker writes the event
+// stream into conn->socket and the connection thread frames what arrives
+// on the other end
+static int h2_stream_open_pipe(http_conn_t *conn) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 0;
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    conn->h2->pipe = sv[1];
+    conn->socket = sv[0];
+    return 1;
+}
+
+// Request thread: one per stream, like handle_client() is per connection
+static void *h2_stream_thread(void *arg) {
+    h2_stream_t *stream = (h2_stream_t *)arg;
+    h2_session_t *s = stream->session;
+    http_conn_t *conn = &stream->conn;
+
+    if (stream->too_large) {
+        send_http_response(conn, 413, "Payload Too Large", "text/plain", "413 Payload Too Large");
+    } else if (stream->conn.header_len == 0) {
+        send_http_response(conn, 431, "Request Header Fields Too Large", "text/plain",
+                           "431 Request Header Fields Too Large");
+    } else {
+        conn->buffer[conn->request_len] = '\0';
+        handle_request(conn);
+    }
+
+    // A handed-over socketpair end means a worker now feeds this stream
+    int forwarding = stream->streaming && stream->pipe >= 0 && conn->socket < 0;
+    if (conn->socket >= 0 && conn->socket != s->socket) close(conn->socket);
+    if (stream->streaming && !forwarding && !stream->reset) {
+        h2_write_frame(s, H2_DATA, H2_FLAG_END_STREAM, stream->id, NULL, 0);
+    }
+
+    lock_acquire(&s->lock);
+    if (!forwarding) {
+        if (stream->pipe >= 0) close(stream->pipe);
+        stream->pipe = -1;
+        stream->state = H2_STATE_CLOSED;
+    }
+    stream->running = 0;
+    // Wake the connection thread before dropping the count: once threads
+    // reaches zero and the lock is released, h2_serve() may free s
+    h2_session_wake(s);
+    s->threads--;
+    pthread_cond_broadcast(&s->changed);
+    lock_release(&s->lock);
+    metrics_thread_exit();
+    return NULL;
+}
+
+// Start serving a complete request (caller holds s->lock)
+static void h2_stream_dispatch_locked(h2_session_t *s, h2_stream_t *stream) {
+    stream->state = H2_STATE_HALF_CLOSED;
+    stream->running = 1;
+    s->threads++;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, h2_stream_thread, stream) != 0) {
+        log_message("ERROR", "Failed to create HTTP/2 stream thread");
+        stream->running = 0;
+        stream->state = H2_STATE_CLOSED;
+        s->threads--;
+        h2_rst_stream(s, stream->id, H2_REFUSED_STREAM);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static h2_stream_t *h2_stream_find_locked(h2_session_t *s, unsigned int id) {
+    for (int i = 0; i < s->stream_count; i++) {
+        if (s->streams[i]->id == id) return s->streams[i];
+    }
+    return NULL;
+}
+
+static h2_stream_t *h2_stream_create_locked(h2_session_t *s, unsigned int id) {
+    h2_stream_t *stream = calloc(1, sizeof(h2_stream_t));
+    if (!stream) return NULL;
+    stream->session = s;
+    stream->id = id;
+    stream->pipe = -1;
+    stream->send_window = s->peer_initial_window;
+    stream->conn.socket = s->socket;
+    stream->conn.is_local = s->is_local;
+    stream->conn.shard = s->shard;
+    stream->conn.h2 = stream;
+    s->streams[s->stream_count++] = stream;
+    STAT_ADD(h2_streams, 1);
+    return stream;
+}
+
+// Free streams that are closed and whose thread has finished
+static void h2_reap_locked(h2_session_t *s) {
+    for (int i = s->stream_count - 1; i >= 0; i--) {
+        h2_stream_t *stream = s->streams[i];
+        if (stream->state != H2_STATE_CLOSED || stream->running) continue;
+        if (stream->pipe >= 0) close(stream->pipe);
+        s->streams[i] = s->streams[--s->stream_count];
+        free(stream);
+    }
+}
+
+// Render the decoded request as HTTP/1.1 text in the stream's buffer; the
+// body, if any, is appended as DATA frames arrive
+static void h2_stream_set_request(h2_stream_t *stream, const h2_request_t *req) {
+    http_conn_t *conn = &stream->conn;
+    int n = snprintf(conn->buffer, sizeof(conn->buffer) - 1, "%s %s HTTP/2.0\r\nHost: %s\r\n%.*s\r\n",
+                     req->method, req->path, req->authority, (int)req->lines_len, req->lines);
+    if (req->overflow || n < 0 || (size_t)n >= sizeof(conn->buffer) - 1) {
+        // Answered with 431 once the request is complete
+        conn->header_len = conn->request_len = 0;
+        return;
+    }
+    conn->header_len = conn->request_len = conn->buffered = (size_t)n;
+}
+
+// A header block is complete: decode it and open the stream
+static int h2_headers_complete(h2_session_t *s) {
+    h2_request_t *req = &s->request;
+    req->method[0] = req->path[0] = req->authority[0] = req->lines[0] = '\0';
+    req->lines_len = 0;
+    req->overflow = req->malformed = 0;
+    int decoded = hpack_decode_block(&s->decoder, s->block, s->block_len, req);
+    free(s->block);
+    s->block = NULL;
+    if (!decoded) return H2_COMPRESSION_ERROR;
+
+    unsigned int id = s->block_stream;
+    lock_acquire(&s->lock);
+    h2_stream_t *stream = h2_stream_find_locked(s, id);
+    if (stream) {
+        // Trailers: only meaningful as the end of a request body
+        if (stream->state == H2_STATE_OPEN && s->block_end_stream) {
+            h2_stream_dispatch_locked(s, stream);
+        } else if (stream->state != H2_STATE_OPEN) {
+            lock_release(&s->lock);
+            h2_rst_stream(s, id, H2_STREAM_CLOSED);
+            return 0;
+        }
+        lock_release(&s->lock);
+        return 0;
+    }
+    if (id <= s->last_stream_id) {
+        lock_release(&s->lock);
+        return H2_PROTOCOL_ERROR;
+    }
+    s->last_stream_id = id;
+
+    unsigned int refuse = 0;
+    if (req->malformed || !req->method[0] || !req->path[0]) {
+        refuse = H2_PROTOCOL_ERROR;
+    } else if (s->stream_count >= H2_MAX_STREAMS || !g_running) {
+        refuse = H2_REFUSED_STREAM;
+        STAT_ADD(h2_streams_refused, 1);
+    } else if ((stream = h2_stream_create_locked(s, id)) == NULL) {
+        refuse = H2_REFUSED_STREAM;
+    }
+    if (!refuse) {
+        h2_stream_set_request(stream, req);
+        if (s->block_end_stream) h2_stream_dispatch_locked(s, stream);
+    }
+    lock_release(&s->lock);
+    if (refuse) h2_rst_stream(s, id, refuse);
+    return 0;
+}
+
+// Apply a SETTINGS payload from the peer
+static int h2_apply_settings(h2_session_t *s, const unsigned char *p, size_t len) {
+    int error = 0;
+    lock_acquire(&s->lock);
+    for (size_t i = 0; i + 6 <= len && !error; i += 6) {
+        unsigned int id = (unsigned int)p[i] << 8 | p[i + 1];
+        unsigned int value = h2_read_u32(p + i + 2);
+        if (id == 0x4) {
+            // SETTINGS_INITIAL_WINDOW_SIZE moves every open stream's window
+            if (value > 0x7fffffff) {
+                error = H2_FLOW_CONTROL_ERROR;
+                break;
+            }
+            long long delta = (long long)value - s->peer_initial_window;
+            for (int j = 0; j < s->stream_count; j++) {
+                s->streams[j]->send_window += delta;
+            }
+            s->peer_initial_window = value;
+        } else if (id == 0x5) {
+            if (value < 16384 || value > 16777215) {
+                error = H2_PROTOCOL_ERROR;
+                break;
+            }
+            s->peer_max_frame = value < H2_MAX_FRAME ? value : H2_MAX_FRAME;
+        }
+    }
+    pthread_cond_broadcast(&s->changed);
+    lock_release(&s->lock);
+    return error;
+}
+
+// Handle one frame. Returns 0, an error code that ends the connection with
+// GOAWAY, or H2_CLOSE_QUIETLY once the peer has said goodbye.
+static int h2_handle_frame(h2_session_t *s, int type, int flags, unsigned int id,
+                           const unsigned char *payload, size_t len) {
+    if (s->block && type != H2_CONTINUATION) return H2_PROTOCOL_ERROR;
+
+    switch (type) {
+    case H2_DATA: {
+        if (id == 0) return H2_PROTOCOL_ERROR;
+        size_t pad = 0, offset = 0;
+        if (flags & H2_FLAG_PADDED) {
+            if (len < 1 || (size_t)payload[0] >= len) return H2_PROTOCOL_ERROR;
+            pad = payload[0];
+            offset = 1;
+        }
+        // Credit is returned as soon as a frame is consumed
+        if (len > 0) h2_window_update(s, 0, len);
+
+        lock_acquire(&s->lock);
+        h2_stream_t *stream = h2_stream_find_locked(s, id);
+        if (!stream || stream->state != H2_STATE_OPEN) {
+            lock_release(&s->lock);
+            if (id > s->last_stream_id) return H2_PROTOCOL_ERROR;
+            h2_rst_stream(s, id, H2_STREAM_CLOSED);
+            return 0;
+        }
+        http_conn_t *conn = &stream->conn;
+        size_t data_len = len - offset - pad;
+        if (conn->header_len == 0 || stream->too_large ||
+            conn->request_len + data_len > sizeof(conn->buffer) - 1) {
+            stream->too_large = conn->header_len != 0;
+        } else {
+            memcpy(conn->buffer + conn->request_len, payload + offset, data_len);
+            conn->request_len += data_len;
+            conn->buffered = conn->request_len;
+        }
+        if (flags & H2_FLAG_END_STREAM) {
+            h2_stream_dispatch_locked(s, stream);
+        }
+        lock_release(&s->lock);
+        if (len > 0 && !(flags & H2_FLAG_END_STREAM)) h2_window_update(s, id, len);
+        return 0;
+    }
+    case H2_HEADERS: {
+        if (id == 0 || (id & 1) == 0) return H2_PROTOCOL_ERROR;
+        size_t pad = 0, offset = 0;
+        if (flags & H2_FLAG_PADDED) {
+            if (len < 1) return H2_PROTOCOL_ERROR;
+            pad = payload[0];
+            offset = 1;
+        }
+        if (flags & H2_FLAG_PRIORITY) offset += 5;
+        if (offset + pad > len) return H2_PROTOCOL_ERROR;
+
+        s->block_len = len - offset - pad;
+        s->block = malloc(s->block_len + 1);
+        if (!s->block) return H2_ENHANCE_YOUR_CALM;
+        memcpy(s->block, payload + offset, s->block_len);
+        s->block_stream = id;
+        s->block_end_stream = flags & H2_FLAG_END_STREAM;
+        return (flags & H2_FLAG_END_HEADERS) ? h2_headers_complete(s) : 0;
+    }
+    case H2_CONTINUATION: {
+        if (!s->block || id != s->block_stream) return H2_PROTOCOL_ERROR;
+        if (s->block_len + len > H2_MAX_HEADER_BLOCK) return H2_ENHANCE_YOUR_CALM;
+        unsigned char *block = realloc(s->block, s->block_len + len + 1);
+        if (!block) return H2_ENHANCE_YOUR_CALM;
+        memcpy(block + s->block_len, payload, len);
+        s->block = block;
+        s->block_len += len;
+        return (flags & H2_FLAG_END_HEADERS) ? h2_headers_complete(s) : 0;
+    }
+    case H2_RST_STREAM: {
+        if (id == 0 || len != 4) return H2_PROTOCOL_ERROR;
+        lock_acquire(&s->lock);
+        h2_stream_t *stream = h2_stream_find_locked(s, id);
+        if (stream) {
+            // Closing our end of an SSE socketpair drops the subscriber
+            stream->reset = 1;
+            stream->state = H2_STATE_CLOSED;
+            if (stream->pipe >= 0 && !stream->running) {
+                close(stream->pipe);
+                stream->pipe = -1;
+            }
+            pthread_cond_broadcast(&s->changed);
+        }
+        lock_release(&s->lock);
+        return 0;
+    }
+    case H2_SETTINGS: {
+        if (id != 0) return H2_PROTOCOL_ERROR;
+        if (flags & H2_FLAG_ACK) return len == 0 ? 0 : H2_FRAME_SIZE_ERROR;
+        if (len % 6 != 0) return H2_FRAME_SIZE_ERROR;
+        int error = h2_apply_settings(s, payload, len);
+        if (error) return error;
+        h2_write_frame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        return 0;
+    }
+    case H2_PING:
+        if (id != 0) return H2_PROTOCOL_ERROR;
+        if (len != 8) return H2_FRAME_SIZE_ERROR;
+        if (!(flags & H2_FLAG_ACK)) h2_write_frame(s, H2_PING, H2_FLAG_ACK, 0, payload, len);
+        return 0;
+    case H2_GOAWAY:
+        return H2_CLOSE_QUIETLY;
+    case H2_WINDOW_UPDATE: {
+        if (len != 4) return H2_FRAME_SIZE_ERROR;
+        long long increment = h2_read_u32(payload) & 0x7fffffff;
+        if (increment == 0) {
+            if (id == 0) return H2_PROTOCOL_ERROR;
+            h2_rst_stream(s, id, H2_PROTOCOL_ERROR);
+            return 0;
+        }
+        int error = 0;
+        lock_acquire(&s->lock);
+        if (id == 0) {
+            s->send_window += increment;
+            if (s->send_window > 0x7fffffff) error = H2_FLOW_CONTROL_ERROR;
+        } else {
+            h2_stream_t *stream = h2_stream_find_locked(s, id);
+            if (stream) stream->send_window += increment;
+        }
+        pthread_cond_broadcast(&s->changed);
+        lock_release(&s->lock);
+        return error;
+    }
+    case H2_PRIORITY:
+        return len == 5 ? 0 : H2_FRAME_SIZE_ERROR;
+    case H2_PUSH_PROMISE:
+        return H2_PROTOCOL_ERROR;
+    default:
+        // Unknown frame types are ignored (RFC 9113, 4.1)
+        return 0;
+    }
+}
+
+// Move what a fan-out worker wrote for an SSE stream into DATA frames, as
+// far as the flow-control windows allow. A closed socketpair means the
+// worker dropped the subscriber, which ends the stream.
+static void h2_forward_stream(h2_session_t *s, h2_stream_t *stream) {
+    unsigned char buf[H2_MAX_FRAME];
+    ssize_t n = -1;
+    int gone = 0;
+
+    lock_acquire(&s->lock);
+    long long allow = stream->send_window < s->send_window ? stream->send_window : s->send_window;
+    if (allow > (long long)s->peer_max_frame) allow = (long long)s->peer_max_frame;
+    if (allow > 0 && stream->pipe >= 0) {
+        n = read(stream->pipe, buf, (size_t)allow);
+        if (n > 0) {
+            stream->send_window -= n;
+            s->send_window -= n;
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close(stream->pipe);
+            stream->pipe = -1;
+            stream->state = H2_STATE_CLOSED;
+            gone = 1;
+        }
+    }
+    lock_release(&s->lock);
+
+    if (n > 0) {
+        h2_write_frame(s, H2_DATA, 0, stream->id, buf, (size_t)n);
+    } else if (gone) {
+        h2_write_frame(s, H2_DATA, H2_FLAG_END_STREAM, stream->id, NULL, 0);
+    }
+}
+
+// Whether an HTTP/1.1 request asks to upgrade to h2c. Requests with a body
+// stay on HTTP/1.1 rather than buffering it across the switch.
+static int h2_upgrade_requested(http_conn_t *conn) {
+    char settings[128];
+    return conn->request_len == conn->header_len &&
+           http_header_accepts(conn->buffer, "Upgrade", "h2c") &&
+           http_get_header(conn->buffer, "HTTP2-Settings", settings, sizeof(settings));
+}
+
+// Serve an HTTP/2 connection until it closes. conn holds either the start
+// of the prior-knowledge preface ("PRI * HTTP/2.0\r\n\r\n" parsed as a
+// request) or, when upgraded, an HTTP/1.1 request that becomes stream 1.
+static void h2_serve(http_conn_t *conn, int upgraded) {
+    h2_session_t *s = calloc(1, sizeof(h2_session_t));
+    if (!s) return;
+    s->socket = conn->socket;
+    s->is_local = conn->is_local;
+    s->shard = conn->shard;
+    s->send_window = s->peer_initial_window = 65535;
+    s->peer_max_frame = H2_MAX_FRAME;
+    s->decoder.max_size = HPACK_TABLE_SIZE;
+    lock_init(&s->lock, "h2_session.lock");
+    lock_init(&s->write_lock, "h2_session.write_lock");
+    pthread_cond_init(&s->changed, NULL);
+    if (pipe(s->wake_pipe) != 0) {
+        free(s);
+        return;
+    }
+    fcntl(s->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    STAT_ADD(h2_connections[upgraded ? 1 : 0], 1);
+
+    const char *preface = H2_PREFACE;
+    size_t preface_left = sizeof(H2_PREFACE) - 1;
+    h2_stream_t *first = NULL;
+    if (upgraded) {
+        // The request becomes stream 1; HTTP2-Settings carries the client's
+        // SETTINGS payload in base64url
+        char settings[128];
+        unsigned char decoded[96];
+        http_get_header(conn->buffer, "HTTP2-Settings", settings, sizeof(settings));
+        for (char *c = settings; *c; c++) {
+            if (*c == '-') *c = '+';
+            if (*c == '_') *c = '/';
+        }
+        int decoded_len = base64_decode(settings, decoded, sizeof(decoded));
+        h2_apply_settings(s, decoded, (size_t)decoded_len - (size_t)decoded_len % 6);
+
+        http_response_t res;
+        http_response_begin(&res, conn, 101, "Switching Protocols", NULL);
+        http_response_header(&res, "Upgrade", "h2c");
+        res.upgrade = 1;
+        if (http_response_send(&res) != 0) {
+            close(s->wake_pipe[0]);
+            close(s->wake_pipe[1]);
+            free(s);
+            return;
+        }
+
+        s->last_stream_id = 1;
+        first = h2_stream_create_locked(s, 1);
+        if (first) {
+            memcpy(first->conn.buffer, conn->buffer, conn->request_len);
+            first->conn.header_len = first->conn.request_len = first->conn.buffered = conn->request_len;
+        }
+    } else {
+        preface += conn->request_len;
+        preface_left -= conn->request_len;
+    }
+    s->in_len = conn->buffered - conn->request_len;
+    memcpy(s->in, conn->buffer + conn->request_len, s->in_len);
+
+    // Our SETTINGS is the first frame either way
+    unsigned char settings[18];
+    settings[0] = 0;
+    settings[1] = 0x3;
+    h2_write_u32(settings + 2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = 0x1;
+    h2_write_u32(settings + 8, HPACK_TABLE_SIZE);
+    settings[12] = 0;
+    settings[13] = 0x6;
+    h2_write_u32(settings + 14, BUFFER_SIZE);
+    h2_write_frame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    if (first) {
+        lock_acquire(&s->lock);
+        h2_stream_dispatch_locked(s, first);
+        lock_release(&s->lock);
+    }
+
+    struct pollfd fds[2 + H2_MAX_STREAMS];
+    h2_stream_t *polled[2 + H2_MAX_STREAMS];
+    time_t last_active = time(NULL);
+    int error = 0;
+
+    while (!error && !s->dead) {
+        // Frames already buffered
+        if (preface_left > 0) {
+            size_t n = s->in_len < preface_left ? s->in_len : preface_left;
+            if (memcmp(s->in, preface, n) != 0) break;
+            memmove(s->in, s->in + n, s->in_len - n);
+            s->in_len -= n;
+            preface += n;
+            preface_left -= n;
+        }
+        while (!error && preface_left == 0 && s->in_len >= H2_FRAME_HEADER) {
+            size_t len = (size_t)s->in[0] << 16 | (size_t)s->in[1] << 8 | s->in[2];
+            if (len > H2_MAX_FRAME) {
+                error = H2_FRAME_SIZE_ERROR;
+                break;
+            }
+            if (s->in_len < H2_FRAME_HEADER + len) break;
+            error = h2_handle_frame(s, s->in[3], s->in[4], h2_read_u32(s->in + 5) & 0x7fffffff,
+                                    s->in + H2_FRAME_HEADER, len);
+            memmove(s->in, s->in + H2_FRAME_HEADER + len, s->in_len - H2_FRAME_HEADER - len);
+            s->in_len -= H2_FRAME_HEADER + len;
+        }
+        if (error) break;
+
+        time_t now = time(NULL);
+        int nfds = 0;
+        lock_acquire(&s->lock);
+        h2_reap_locked(s);
+        int idle = s->stream_count == 0 && now - last_active >= g_config.keepalive_timeout;
+        fds[nfds].fd = s->socket;
+        fds[nfds].events = POLLIN;
+        polled[nfds++] = NULL;
+        fds[nfds].fd = s->wake_pipe[0];
+        fds[nfds].events = POLLIN;
+        polled[nfds++] = NULL;
+        for (int i = 0; i < s->stream_count; i++) {
+            h2_stream_t *stream = s->streams[i];
+            if (stream->running || stream->pipe < 0 || stream->send_window <= 0 || s->send_window <= 0) continue;
+            fds[nfds].fd = stream->pipe;
+            fds[nfds].events = POLLIN;
+            polled[nfds++] = stream;
+        }
+        lock_release(&s->lock);
+        if (idle || !g_running) {
+            h2_goaway(s, H2_NO_ERROR);
+            break;
+        }
+
+        int ready = poll(fds, nfds, 1000);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready <= 0) continue;
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(s->wake_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        for (int i = 2; i < nfds; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) h2_forward_stream(s, polled[i]);
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(s->socket, s->in + s->in_len, sizeof(s->in) - s->in_len, 0);
+            if (n <= 0 && !(n < 0 && errno == EINTR)) break;
+            if (n > 0) {
+                s->in_len += (size_t)n;
+                last_active = time(NULL);
+            }
+        }
+    }
+    if (error > 0) h2_goaway(s, (unsigned int)error);
+
+    // Stop the request threads: writes fail from here on and window waiters
+    // give up. Closing the socketpairs drops the SSE subscribers.
+    shutdown(s->socket, SHUT_RDWR);
+    lock_acquire(&s->lock);
+    s->dead = 1;
+    pthread_cond_broadcast(&s->changed);
+    while (s->threads > 0) {
+        lock_cond_wait(&s->changed, &s->lock);
+    }
+    for (int i = 0; i < s->stream_count; i++) {
+        if (s->streams[i]->pipe >= 0) close(s->streams[i]->pipe);
+        free(s->streams[i]);
+    }
+    s->stream_count = 0;
+    lock_release(&s->lock);
+
+    hpack_evict(&s->decoder, 0);
+    free(s->block);
+    close(s->wake_pipe[0]);
+    close(s->wake_pipe[1]);
+    lock_destroy(&s->lock);
+    lock_destroy(&s->write_lock);
+    pthread_cond_destroy(&s->changed);
+    free(s);
+}
+
+#endif
+
+// ============================================================================
+// SAMPLING PROFILER
+// ============================================================================
+
+#ifdef HAVE_PROFILER
+#if __SIZEOF_POINTER__ == 8
+typedef Elf64_Ehdr elf_ehdr_t;
+typedef Elf64_Shdr elf_shdr_t;
+typedef Elf64_Sym elf_sym_t;
+#define ELF_SYM_TYPE ELF64_ST_TYPE
+#else
+typedef Elf32_Ehdr elf_ehdr_t;
+typedef Elf32_Shdr elf_shdr_t;
+typedef Elf32_Sym elf_sym_t;
+#define ELF_SYM_TYPE ELF32_ST_TYPE
+#endif
+
+// Function symbol of our own binary, sorted by address
+typedef struct {
+    unsigned long addr;
+    unsigned long size;
+    const char *name;
+} profile_symbol_t;
+
+int main(int argc, char *argv[]);
+
+// Profiler state; only one profile runs at a time (busy). The signal
+// handler touches nothing but frames, depths and the counters.
+static struct {
+    volatile int busy;
+    volatile int running;
+    volatile int in_handler;
+    volatile int next;
+    void **frames;
+    int *depths;
+    profile_symbol_t *symbols;
+    int symbol_count;
+    char *names;
+    unsigned long bias;
+} g_profile;
+
+// SIGPROF: record the interrupted thread's stack in the next free slot
+static void profile_signal(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    __sync_fetch_and_add(&g_profile.in_handler, 1);
+    if (g_profile.running) {
+        int slot = __sync_fetch_and_add(&g_profile.next, 1);
+        if (slot < PROFILE_MAX_SAMPLES) {
+            g_profile.depths[slot] = backtrace(g_profile.frames + (size_t)slot * PROFILE_STRIDE, PROFILE_STRIDE);
+        }
+    }
+    __sync_fetch_and_sub(&g_profile.in_handler, 1);
+    errno = saved_errno;
+}
+
+static int profile_read_at(FILE *f, unsigned long offset, void *buf, size_t size) {
+    return fseek(f, (long)offset, SEEK_SET) == 0 && fread(buf, 1, size, f) == size;
+}
+
+static int profile_symbol_compare(const void *a, const void *b) {
+    const profile_symbol_t *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// Load the function symbols of /proc/self/exe (.symtab, else .dynsym) once.
+// The load bias is taken from main(), so PIE builds resolve too.
+static int profile_load_symbols(void) {
+    if (g_profile.symbols) return 1;
+    FILE *f = fopen("/proc/self/exe", "rb");
+    if (!f) return 0;
+
+    elf_ehdr_t eh;
+    elf_shdr_t *sections = NULL;
+    elf_sym_t *syms = NULL;
+    char *names = NULL;
+    size_t sym_count = 0, names_size = 0;
+    if (profile_read_at(f, 0, &eh, sizeof(eh)) && memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0 &&
+        eh.e_shentsize == sizeof(elf_shdr_t) && eh.e_shnum > 0 &&
+        (sections = calloc(eh.e_shnum, sizeof(elf_shdr_t))) != NULL &&
+        profile_read_at(f, eh.e_shoff, sections, eh.e_shnum * sizeof(elf_shdr_t))) {
+        int table = -1;
+        for (int i = 0; i < eh.e_shnum; i++) {
+            if (sections[i].sh_type == SHT_SYMTAB) table = i;
+            if (sections[i].sh_type == SHT_DYNSYM && table < 0) table = i;
+        }
+        if (table >= 0 && sections[table].sh_link < eh.e_shnum) {
+            const elf_shdr_t *symtab = &sections[table], *strtab = &sections[symtab->sh_link];
+            syms = malloc(symtab->sh_size);
+            names = malloc(strtab->sh_size + 1);
+            if (syms && names && profile_read_at(f, symtab->sh_offset, syms, symtab->sh_size) &&
+                profile_read_at(f, strtab->sh_offset, names, strtab->sh_size)) {
+                names[strtab->sh_size] = '\0';
+                names_size = strtab->sh_size;
+                sym_count = symtab->sh_size / sizeof(elf_sym_t);
+            }
+        }
+    }
+    fclose(f);
+    free(sections);
+
+    profile_symbol_t *symbols = sym_count ? calloc(sym_count, sizeof(profile_symbol_t)) : NULL;
+    int count = 0;
+    for (size_t i = 0; symbols && i < sym_count; i++) {
+        if (ELF_SYM_TYPE(syms[i].st_info) != STT_FUNC || syms[i].st_value == 0) continue;
+        if (syms[i].st_name >= names_size) continue;
+        symbols[count].addr = (unsigned long)syms[i].st_value;
+        symbols[count].size = (unsigned long)syms[i].st_size;
+        symbols[count].name = names + syms[i].st_name;
+        if (strcmp(symbols[count].name, "main") == 0) {
+            g_profile.bias = (unsigned long)main - symbols[count].addr;
+        }
+        count++;
+    }
+    free(syms);
+    if (count == 0) {
+        free(symbols);
+        free(names);
+        return 0;
+    }
+    qsort(symbols, (size_t)count, sizeof(profile_symbol_t), profile_symbol_compare);
+    g_profile.names = names;
+    g_profile.symbol_count = count;
+    g_profile.symbols = symbols;
+    return 1;
+}
+
+// Name of the function holding pc, or NULL
+static const char *profile_symbol_name(unsigned long pc) {
+    unsigned long addr = pc - g_profile.bias;
+    int lo = 0, hi = g_profile.symbol_count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (g_profile.symbols[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (found < 0) return NULL;
+    const profile_symbol_t *sym = &g_profile.symbols[found];
+    return sym->size == 0 || addr < sym->addr + sym->size ? sym->name : NULL;
+}
+
+static int profile_stack_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Fold the captured stacks into "outer;...;inner count" lines. Return
+// addresses are looked up one byte back so they land inside the call.
+static void profile_fold(json_writer_t *out, int samples) {
+    char **stacks = calloc(samples > 0 ? (size_t)samples : 1, sizeof(char *));
+    if (!stacks) return;
+    int n = 0;
+    for (int i = 0; i < samples; i++) {
+        void **frames = g_profile.frames + (size_t)i * PROFILE_STRIDE;
+        char line[PROFILE_MAX_DEPTH * 48];
+        size_t pos = 0;
+        line[0] = '\0';
+        for (int d = g_profile.depths[i] - 1; d >= PROFILE_SKIP; d--) {
+            unsigned long pc = (unsigned long)frames[d] - (d > PROFILE_SKIP ? 1 : 0);
+            const char *name = profile_symbol_name(pc);
+            if (name) {
+                buffer_appendf(line, sizeof(line), &pos, "%s%s", pos ? ";" : "", name);
+            } else {
+                buffer_appendf(line, sizeof(line), &pos, "%s0x%lx", pos ? ";" : "", pc);
+            }
+        }
+        if (pos > 0 && (stacks[n] = strdup(line)) != NULL) n++;
+    }
+
+    qsort(stacks, (size_t)n, sizeof(char *), profile_stack_compare);
+    for (int i = 0; i < n;) {
+        int j = i;
+        while (j < n && strcmp(stacks[j], stacks[i]) == 0) j++;
+        char count[16];
+        int len = snprintf(count, sizeof(count), " %d\n", j - i);
+        json_raw(out, stacks[i], strlen(stacks[i]));
+        json_raw(out, count, (size_t)len);
+        i = j;
+    }
+    for (int i = 0; i < n; i++) free(stacks[i]);
+    free(stacks);
+}
+
+// Sample the process with ITIMER_PROF at hz for the given seconds and fold
+// the stacks into out. Nothing is installed outside a profile, so the
+// profiler costs nothing until asked for.
+static int profile_run(int seconds, int hz, json_writer_t *out, int *samples, int *dropped) {
+    if (!profile_load_symbols()) {
+        log_message("WARN", "No symbol table in /proc/self/exe; profile has raw addresses");
+    }
+    g_profile.frames = calloc((size_t)PROFILE_MAX_SAMPLES * PROFILE_STRIDE, sizeof(void *));
+    g_profile.depths = calloc(PROFILE_MAX_SAMPLES, sizeof(int));
+    if (!g_profile.frames || !g_profile.depths) {
+        free(g_profile.frames);
+        free(g_profile.depths);
+        g_profile.frames = NULL;
+        g_profile.depths = NULL;
+        return 0;
+    }
+
+    // glibc sets its unwinder up on first use; keep that out of the handler
+    void *warm[4];
+    backtrace(warm, 4);
+
+    g_profile.next = 0;
+    g_profile.running = 1;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    long interval_us = 1000000L / hz;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000L;
+    timer.it_interval.tv_usec = interval_us % 1000000L;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    unsigned long long end = monotonic_ns() + (unsigned long long)seconds * 1000000000ULL;
+    while (g_running && monotonic_ns() < end) usleep(100000);
+
+    // Disarm, then ignore (not default: a late SIGPROF would kill us) and
+    // wait out any handler still writing before the buffers go
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    g_profile.running = 0;
+    signal(SIGPROF, SIG_IGN);
+    while (g_profile.in_handler) usleep(1000);
+
+    int taken = g_profile.next;
+    *samples = taken < PROFILE_MAX_SAMPLES ? taken : PROFILE_MAX_SAMPLES;
+    *dropped = taken - *samples;
+    profile_fold(out, *samples);
+
+    free(g_profile.frames);
+    free(g_profile.depths);
+    g_profile.frames = NULL;
+    g_profile.depths = NULL;
+    return 1;
+}
+#endif
+
+// ============================================================================
+// ROUTER
+// ============================================================================
+
+// Value of a {name} path parameter captured by the matched route
+static const char *http_path_param(const http_request_t *req, const char *name) {
+    for (int i = 0; i < req->param_count; i++) {
+        if (strcmp(req->params[i].name, name) == 0) return req->params[i].value;
+    }
+    return NULL;
+}
+
+// WebSocket endpoint: the /events stream plus bind/unbind commands on
+// one connection. Browsers cannot set Last-Event-ID on a WebSocket, so
+// the resume point comes from the query string.
+static void route_ws(http_conn_t *conn, http_request_t *req) {
+    char upgrade[32] = "", key[64] = "", ws_version[8] = "";
+    http_get_header(conn->buffer, "Upgrade", upgrade, sizeof(upgrade));
+    http_get_header(conn->buffer, "Sec-WebSocket-Key", key, sizeof(key));
+    http_get_header(conn->buffer, "Sec-WebSocket-Version", ws_version, sizeof(ws_version));
+
+    sse_filter_t filter;
+    char last_event_id[32];
+    if (strncasecmp_compat(upgrade, "websocket", 9) != 0 || strlen(key) != 24) {
+        send_http_response(conn, 400, "Bad Request", "text/plain", "400 WebSocket upgrade required");
+    } else if (strcmp(ws_version, "13") != 0) {
+        http_response_t res;
+        http_response_begin(&res, conn, 426, "Upgrade Required", "text/plain");
+        http_response_header(&res, "Sec-WebSocket-Version", "13");
+        http_response_send(&res);
+    } else if (!sse_filter_compile(req->query, &filter)) {
+        send_http_response(conn, 400, "Bad Request", "text/plain", "400 Invalid event filter");
+    } else {
+        conn->keep_alive = 0;
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        getpeername(conn->socket, (struct sockaddr *)&addr, &addr_len);
+
+        char accept[32];
+        ws_accept_key(key, accept);
+        int resuming = http_query_param(req->query, "last_event_id", last_event_id, sizeof(last_event_id));
+        char format[8] = "";
+        http_query_param(req->query, "format", format, sizeof(format));
+        int binary = http_accepts_cbor(conn->buffer) || strcmp(format, "cbor") == 0;
+        if (add_sse_client(conn, addr, 0, resuming ? last_event_id : NULL, &filter, accept, binary) == 0) {
+            send_http_response(conn, 503, "Service Unavailable", "text/plain",
+                               "503 Too many event subscribers");
+        }
+    }
+}
+
+// SSE events endpoint
+static void route_events(http_conn_t *conn, http_request_t *req) {
+    conn->keep_alive = 0;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    getpeername(conn->socket, (struct sockaddr *)&addr, &addr_len);
+
+#ifdef PLATFORM_WINDOWS
+    // Windows: timeout in milliseconds
+    DWORD timeout = 10000; // 10 seconds
+    setsockopt(conn->socket, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+#else
+    // Unix: timeout as struct timeval. An HTTP/2 stream shares the
+    // connection's socket, which keeps its own settings.
+    struct timeval tv;
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    if (!conn->h2) setsockopt(conn->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+
+    // A reconnecting EventSource names the last event it saw so only the
+    // events after it are replayed. On success a fan-out worker owns the
+    // socket from here on and this thread is free to exit.
+    sse_filter_t filter;
+    if (!sse_filter_compile(req->query, &filter)) {
+        send_http_response(conn, 400, "Bad Request", "text/plain", "400 Invalid event filter");
+        return;
+    }
+    char last_event_id[32];
+    int resuming = http_get_header(conn->buffer, "Last-Event-ID", last_event_id, sizeof(last_event_id));
+    int registered = add_sse_client(conn, addr, http_accepts_gzip(conn->buffer),
+                                    resuming ? last_event_id : NULL, &filter, NULL, 0);
+
+    if (registered == 0) {
+        send_http_response(conn, 503, "Service Unavailable", "text/plain",
+                           "503 Too many event subscribers");
+    }
+}
+
+static void route_index(http_conn_t *conn, http_request_t *req) {
+    http_response_t res;
+    http_response_begin(&res, conn, 200, "OK", "text/html");
+    http_response_body(&res, g_html_page, g_html_page_len);
+    res.head_only = req->is_head;
+    http_response_send(&res);
+}
+
+static void route_favicon(http_conn_t *conn, http_request_t *req) {
+    http_response_t res;
+    http_response_begin(&res, conn, 200, "OK", "image/x-icon");
+    http_response_header(&res, "Cache-Control", "public, max-age=86400");
+    http_response_body(&res, g_favicon, (size_t)g_favicon_len);
+    res.head_only = req->is_head;
+    http_response_send(&res);
+}
+
+static void route_devices(http_conn_t *conn, http_request_t *req) {
+    if (http_accepts_cbor(conn->buffer)) {
+        // The published list with its generation, encoded once per event id
+        lock_acquire(&g_sse_ring_lock);
+        sse_msg_t *snapshot = sse_snapshot_locked();
+        lock_release(&g_sse_ring_lock);
+        send_cbor_response(conn, 200, "OK", snapshot ? snapshot->cbor : NULL,
+                           snapshot ? snapshot->cbor_len : 0, req->is_head);
+        sse_msg_release(snapshot);
+    } else {
+        json_writer_t w = {0};
+        devices_lock();
+        json_devices(&w, g_devices, g_device_count);
+        devices_unlock();
+        char *json = json_finish(&w);
+        if (json) {
+            send_http_response_negotiated(conn, 200, "OK", "application/json", json, req->is_head);
+            free(json);
+        }
+    }
+}
+
+// One device by bus id
+static void route_device(http_conn_t *conn, http_request_t *req) {
+    const char *busid = http_path_param(req, "busid");
+    json_writer_t w = {0};
+    devices_lock();
+    for (int i = 0; i < g_device_count && !w.buf; i++) {
+        if (strcmp(g_devices[i].busid, busid) == 0) json_device(&w, &g_devices[i]);
+    }
+    devices_unlock();
+    if (!w.buf) {
+        send_http_response(conn, 404, "Not Found", "application/json",
+                           "{\"status\":\"failed\",\"error\":\"No such device\"}");
+        return;
+    }
+    char *json = json_finish(&w);
+    if (json) {
+        http_response_t res;
+        http_response_begin(&res, conn, 200, "OK", "application/json");
+        http_response_body(&res, json, strlen(json));
+        res.head_only = req->is_head;
+        http_response_send(&res);
+        free(json);
+    }
+}
+
+static void route_metrics(http_conn_t *conn, http_request_t *req) {
+    char *metrics = malloc(METRICS_BUFFER_SIZE);
+    if (metrics) {
+        generate_metrics(metrics, METRICS_BUFFER_SIZE);
+        http_response_t res;
+        http_response_begin(&res, conn, 200, "OK", "text/plain; version=0.0.4");
+        http_response_body(&res, metrics, strlen(metrics));
+        res.head_only = req->is_head;
+        http_response_send(&res);
+        free(metrics);
+    }
+}
+
+// GET /debug/trace?seconds=N: record spans for N seconds, then return them as
+// Chrome trace-event JSON for Perfetto or chrome://tracing
+static void route_debug_trace(http_conn_t *conn, http_request_t *req) {
+    char value[16];
+    int seconds = 5;
+    if (http_query_param(req->query, "seconds", value, sizeof(value))) seconds = atoi(value);
+    if (seconds < 1 || seconds > TRACE_MAX_SECONDS) {
+        send_http_response(conn, 400, "Bad Request", "text/plain", "400 Bad Request: seconds must be 1-60");
+        return;
+    }
+
+    unsigned long long from = monotonic_ns();
+    __sync_fetch_and_add(&g_trace_capturing, 1);
+    for (int i = 0; i < seconds && g_running; i++) sleep(1);
+    __sync_fetch_and_sub(&g_trace_capturing, 1);
+
+    json_writer_t w = {0};
+    trace_export(&w, from, monotonic_ns());
+    char *json = json_finish(&w);
+    if (json) {
+        send_http_response_negotiated(conn, 200, "OK", "application/json", json, req->is_head);
+        free(json);
+    }
+}
+
+// GET /debug/profile?seconds=N&hz=M: sample CPU stacks and return them as
+// folded stacks (one "outer;...;inner count" line each) for flame graphs
+static void route_debug_profile(http_conn_t *conn, http_request_t *req) {
+#ifdef HAVE_PROFILER
+    char value[16];
+    int seconds = 10, hz = 99;
+    if (http_query_param(req->query, "seconds", value, sizeof(value))) seconds = atoi(value);
+    if (http_query_param(req->query, "hz", value, sizeof(value))) hz = atoi(value);
+    if (seconds < 1 || seconds > PROFILE_MAX_SECONDS || hz < 1 || hz > PROFILE_MAX_HZ) {
+        send_http_response(conn, 400, "Bad Request", "text/plain",
+                           "400 Bad Request: seconds must be 1-60 and hz 1-1000");
+        return;
+    }
+    if (!__sync_bool_compare_and_swap(&g_profile.busy, 0, 1)) {
+        send_http_response(conn, 409, "Conflict", "text/plain", "409 Conflict: a profile is already running");
+        return;
+    }
+
+    json_writer_t w = {0};
+    int samples = 0, dropped = 0;
+    int ok = profile_run(seconds, hz, &w, &samples, &dropped);
+    __sync_lock_release(&g_profile.busy);
+    if (!ok || w.failed) {
+        free(w.buf);
+        send_http_response(conn, 500, "Internal Server Error", "text/plain", "500 Internal Server Error");
+        return;
+    }
+
+    http_response_t res;
+    http_response_begin(&res, conn, 200, "OK", "text/plain");
+    http_response_header(&res, "X-Profile-Samples", "%d", samples);
+    http_response_header(&res, "X-Profile-Dropped", "%d", dropped);
+    if (w.buf) http_response_body(&res, w.buf, w.len);
+    res.head_only = req->is_head;
+    http_response_send(&res);
+    free(w.buf);
+#else
+    (void)req;
+    send_http_response(conn, 501, "Not Implemented", "text/plain",
+                       "501 Not Implemented: profiling needs Linux with glibc");
+#endif
+}
+
+// GET /debug/locks: wait and hold totals per lock and per call site. Only
+// builds with LOCK_STATS collect them.
+static void route_debug_locks(http_conn_t *conn, http_request_t *req) {
+    json_writer_t w = {0};
+#ifdef LOCK_STATS
+    json_lit(&w, "{\"enabled\":true,\"locks\":[");
+    int count = __atomic_load_n(&g_lock_class_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        const lock_class_t *cls = &g_lock_classes[i];
+        json_lit(&w, i ? ",{\"name\":" : "{\"name\":");
+        json_string(&w, cls->name, strlen(cls->name));
+        json_lit(&w, ",\"acquisitions\":");
+        json_uint(&w, cls->acquisitions);
+        json_lit(&w, ",\"contended\":");
+        json_uint(&w, cls->contended);
+        json_lit(&w, ",\"wait_ns\":");
+        json_uint(&w, cls->wait.sum_ns);
+        json_lit(&w, ",\"hold_ns\":");
+        json_uint(&w, cls->hold.sum_ns);
+        json_lit(&w, ",\"sites\":[");
+        int first = 1;
+        for (const lock_site_t *site = g_lock_sites; site; site = site->next) {
+            if (site->cls != cls) continue;
+            json_lit(&w, first ? "{\"function\":" : ",{\"function\":");
+            first = 0;
+            json_string(&w, site->func, strlen(site->func));
+            json_lit(&w, ",\"line\":");
+            json_uint(&w, (unsigned long long)site->line);
+            json_lit(&w, ",\"acquisitions\":");
+            json_uint(&w, site->acquisitions);
+            json_lit(&w, ",\"contended\":");
+            json_uint(&w, site->contended);
+            json_lit(&w, ",\"wait_ns\":");
+            json_uint(&w, site->wait_ns);
+            json_lit(&w, ",\"hold_ns\":");
+            json_uint(&w, site->hold_ns);
+            json_lit(&w, ",\"max_hold_ns\":");
+            json_uint(&w, site->max_hold_ns);
+            json_lit(&w, "}");
+        }
+        json_lit(&w, "]}");
+    }
+    json_lit(&w, "]}");
+#else
+    json_lit(&w, "{\"enabled\":false,\"locks\":[]}");
+#endif
+    char *json = json_finish(&w);
+    if (json) {
+        send_http_response_negotiated(conn, 200, "OK", "application/json", json, req->is_head);
+        free(json);
+    }
+}
+
+static const char *const CACHE_NAMES[CACHE_KIND_COUNT] = {"snapshot", "filter_snapshot", "ws_frame"};
+
+// GET /debug/state: what the process is doing right now. Each section is
+// copied under the lock that guards it, so it is self-consistent; sections
+// are taken one after another, never nested.
+static void route_debug_state(http_conn_t *conn, http_request_t *req) {
+    json_writer_t w = {0};
+    unsigned long long now = monotonic_ns();
+    time_t wall = time(NULL);
+    char text[64];
+
+    lock_acquire(&g_sse_ring_lock);
+    json_lit(&w, "{\"snapshot\":{\"generation\":");
+    json_uint(&w, g_sse_generation);
+    json_member_uint(&w, "last_event_id", g_sse_last_id);
+    json_member_uint(&w, "devices", (unsigned long long)g_sse_published_count);
+    json_member_uint(&w, "age_ms", (now - g_sse_generation_ns) / 1000000ULL);
+    json_member_uint(&w, "replay_events", (unsigned long long)g_sse_ring_count);
+    lock_release(&g_sse_ring_lock);
+
+    json_lit(&w, "},\"poll\":{\"interval_seconds\":");
+    json_uint(&w, (unsigned long long)g_config.poll_interval);
+    json_member_uint(&w, "cycles", g_poll.cycles);
+    json_lit(&w, g_poll.running ? ",\"running\":true" : ",\"running\":false");
+    if (g_poll.cycles > 0) {
+        json_member_uint(&w, "last_devices", (unsigned long long)g_poll.devices);
+        json_member_uint(&w, "last_changes", (unsigned long long)g_poll.changes);
+        unsigned long long started = g_poll.started_ns, finished = g_poll.finished_ns;
+        json_member_uint(&w, "last_duration_ms", finished > started ? (finished - started) / 1000000ULL : 0);
+        json_member_uint(&w, "since_last_ms", (now - finished) / 1000000ULL);
+    }
+    if (g_poll.running) {
+        json_member_uint(&w, "running_for_ms", (now - g_poll.started_ns) / 1000000ULL);
+    } else if (g_poll.next_ns) {
+        json_member_uint(&w, "next_in_ms", g_poll.next_ns > now ? (g_poll.next_ns - now) / 1000000ULL : 0);
+    }
+
+    json_lit(&w, "},\"commands\":[");
+    int first = 1;
+    for (int i = 0; i < EXEC_INFLIGHT_SLOTS; i++) {
+        const exec_inflight_t *slot = &g_exec_inflight[i];
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != 2) continue;
+        int pid = slot->pid;
+        unsigned long long start = slot->start_ns;
+        size_t len = safe_strnlen(slot->cmd, sizeof(slot->cmd) - 1);
+        memcpy(text, slot->cmd, len);
+        text[len] = '\0';
+        json_lit(&w, first ? "{\"pid\":" : ",{\"pid\":");
+        first = 0;
+        json_uint(&w, (unsigned long long)pid);
+        json_lit(&w, ",\"command\":");
+        json_string(&w, text, len);
+        json_member_uint(&w, "elapsed_ms", now > start ? (now - start) / 1000000ULL : 0);
+        json_lit(&w, "}");
+    }
+
+    lock_acquire(&g_ws_job_lock);
+    int jobs = 0;
+    for (const ws_job_t *job = g_ws_jobs; job; job = job->next) jobs++;
+    lock_release(&g_ws_job_lock);
+    lock_acquire(&g_wheel.lock);
+    int timers = g_wheel.armed;
+    lock_release(&g_wheel.lock);
+    json_lit(&w, "],\"workers\":{\"ws_command_threads\":");
+    json_uint(&w, (unsigned long long)g_ws_command_count);
+    json_member_uint(&w, "ws_jobs_queued", (unsigned long long)jobs);
+    json_member_uint(&w, "expensive_inflight", (unsigned long long)g_expensive_inflight);
+    json_member_uint(&w, "max_expensive_inflight", (unsigned long long)g_config.max_expensive_inflight);
+    json_member_uint(&w, "timers_armed", (unsigned long long)timers);
+    json_member_uint(&w, "sse_subscribers", (unsigned long long)g_sse_subscribers);
+    json_lit(&w, ",\"sse\":[");
+    for (int i = 0; i < g_sse_worker_count; i++) {
+        sse_worker_t *worker = &g_sse_workers[i];
+        lock_acquire(&worker->lock);
+        json_lit(&w, i ? ",{\"id\":" : "{\"id\":");
+        json_uint(&w, (unsigned long long)worker->id);
+        json_member_uint(&w, "clients", (unsigned long long)worker->count);
+        json_member_uint(&w, "capacity", (unsigned long long)worker->capacity);
+        json_lit(&w, ",\"subscribers\":[");
+        for (int j = 0; j < worker->count; j++) {
+            const client_t *client = worker->clients[j];
+            json_lit(&w, j ? ",{\"protocol\":" : "{\"protocol\":");
+            json_lit(&w, client->protocol == CLIENT_PROTO_WS ? (client->binary ? "\"ws-cbor\"" : "\"ws\"") : "\"sse\"");
+            if (client->is_local) {
+                snprintf(text, sizeof(text), "unix");
+            } else if (!inet_ntop(AF_INET, &client->addr.sin_addr, text, sizeof(text))) {
+                text[0] = '\0';
+            }
+            json_lit(&w, ",\"remote\":");
+            json_string(&w, text, strlen(text));
+            if (client->filter) {
+                json_lit(&w, ",\"filter\":");
+                json_string(&w, client->filter->key, strlen(client->filter->key));
+            }
+            json_member_uint(&w, "queue_depth", (unsigned long long)client->queue_count);
+            json_member_uint(&w, "queued_bytes", client->queued_bytes);
+            json_member_uint(&w, "last_send_seconds_ago",
+                             client->last_send && wall > client->last_send ? (unsigned long long)(wall - client->last_send) : 0);
+            if (client->queue_count > 0 || client->out_sent < client->out_len) {
+                json_member_uint(&w, "stalled_seconds",
+                                 wall > client->pending_since ? (unsigned long long)(wall - client->pending_since) : 0);
+            }
+            if (client->closing) json_lit(&w, ",\"closing\":true");
+            json_lit(&w, "}");
+        }
+        json_lit(&w, "]}");
+        lock_release(&worker->lock);
+    }
+
+    // Dirty: the bound devices no longer match the ones last saved
+    devices_lock();
+    int bound = 0, dirty = 0;
+    for (int i = 0; i < g_device_count; i++) {
+        if (!g_devices[i].bound) continue;
+        int saved = 0;
+        for (int j = 0; j < g_config.bound_devices_count && !saved; j++) {
+            saved = strcmp(g_config.bound_devices[j], g_devices[i].busid) == 0;
+        }
+        dirty |= !saved;
+        bound++;
+    }
+    dirty |= bound != g_config.bound_devices_count;
+    int saved_count = g_config.bound_devices_count;
+    devices_unlock();
+    json_lit(&w, "]},\"config\":{\"path\":");
+    json_string(&w, g_config.config_path, strlen(g_config.config_path));
+    json_lit(&w, dirty ? ",\"dirty\":true" : ",\"dirty\":false");
+    json_member_uint(&w, "bound_devices", (unsigned long long)bound);
+    json_member_uint(&w, "saved_bound_devices", (unsigned long long)saved_count);
+    time_t saved_at = g_config_saved_at;
+    if (saved_at) {
+        json_member_uint(&w, "saved_seconds_ago", wall > saved_at ? (unsigned long long)(wall - saved_at) : 0);
+    }
+
+    if (g_sim.enabled) {
+        lock_acquire(&g_sim.lock);
+        int sim_bound = 0;
+        for (int i = 0; i < g_sim.count; i++) sim_bound += g_sim.dev[i].bound;
+        json_lit(&w, "},\"backend\":{\"name\":\"sim\"");
+        json_member_uint(&w, "devices", (unsigned long long)g_sim.count);
+        json_member_uint(&w, "bound", (unsigned long long)sim_bound);
+        json_member_uint(&w, "hotplug_events", g_sim.hotplugs);
+        json_member_uint(&w, "injected_failures", g_sim.failures);
+        json_member_uint(&w, "injected_hangs", g_sim.hangs);
+        lock_release(&g_sim.lock);
+    } else {
+        json_lit(&w, "},\"backend\":{\"name\":\"usbip\"");
+    }
+
+    json_lit(&w, "},\"caches\":[");
+    for (int i = 0; i < CACHE_KIND_COUNT; i++) {
+        unsigned long long hits = g_stats.cache_hits[i], misses = g_stats.cache_misses[i];
+        json_lit(&w, i ? ",{\"name\":\"" : "{\"name\":\"");
+        json_lit(&w, CACHE_NAMES[i]);
+        json_lit(&w, "\"");
+        json_member_uint(&w, "hits", hits);
+        json_member_uint(&w, "misses", misses);
+        if (hits + misses > 0) {
+            int len = snprintf(text, sizeof(text), ",\"hit_rate\":%.4f", (double)hits / (double)(hits + misses));
+            json_raw(&w, text, (size_t)len);
+        }
+        json_lit(&w, "}");
+    }
+    json_lit(&w, "]}");
+
+    char *json = json_finish(&w);
+    if (json) {
+        send_http_response_negotiated(conn, 200, "OK", "application/json", json, req->is_head);
+        free(json);
+    }
+}
+
+// Bind or unbind, then answer with the updated device list
+static void device_op_respond(http_conn_t *conn, const char *busid, int is_bind) {
+    int result = is_bind ? bind_device(busid) : unbind_device(busid);
+    int cbor = http_accepts_cbor(conn->buffer);
+
+    if (result && cbor) {
+        list_usbip_devices();
+        save_config();
+        broadcast_devices_update();
+
+        // Published right above, so the snapshot is the post-bind state
+        size_t len = 0;
+        lock_acquire(&g_sse_ring_lock);
+        sse_msg_t *snapshot = sse_snapshot_locked();
+        lock_release(&g_sse_ring_lock);
+        unsigned char *body = snapshot ? cbor_encode_status("success", NULL, snapshot->cbor,
+                                                            snapshot->cbor_len, &len) : NULL;
+        send_cbor_response(conn, 200, "OK", body, len, 0);
+        free(body);
+        sse_msg_release(snapshot);
+    } else if (!result && cbor) {
+        size_t len = 0;
+        unsigned char *body = cbor_encode_status("failed", "Operation failed", NULL, 0, &len);
+        send_cbor_response(conn, 500, "Internal Server Error", body, len, 0);
+        free(body);
+    } else if (result) {
+        list_usbip_devices();
+        save_config();
+
+        json_writer_t w = {0};
+        json_lit(&w, "{\"status\":\"success\",\"devices\":");
+        devices_lock();
+        json_devices(&w, g_devices, g_device_count);
+        devices_unlock();
+        json_lit(&w, "}");
+        char *response_json = json_finish(&w);
+        if (response_json) {
+            send_http_response_negotiated(conn, 200, "OK", "application/json", response_json, 0);
+            free(response_json);
+        }
+        broadcast_devices_update();
+    } else {
+        send_http_response(conn, 500, "Internal Server Error",
+                         "application/json",
+                         "{\"status\":\"failed\",\"error\":\"Operation failed\"}");
+    }
+}
+
+static const json_field_t BIND_REQUEST_FIELDS[] = {
+    {"busid", JSON_BIND_STRING, 1, offsetof(bind_request_t, busid), JSON_FIELD_SIZE(bind_request_t, busid),
+     NULL, 0, 0, 0},
+};
+
+// POST /bind and /unbind with {"busid":"..."} in the body
+static void device_op_body(http_conn_t *conn, int is_bind) {
+    const char *body = conn->buffer + conn->header_len;
+    size_t body_len = conn->request_len - conn->header_len;
+    bind_request_t request;
+    const char *error_field = NULL;
+
+    if (body_len == 0 || body_len > JSON_MAX_BODY ||
+        !json_bind(body, body_len, BIND_REQUEST_FIELDS, 1, &request, &error_field)) {
+        send_http_response(conn, 400, "Bad Request", "application/json",
+                           body_len > 0 && body_len <= JSON_MAX_BODY && error_field
+                               ? "{\"status\":\"failed\",\"error\":\"Invalid busid\"}"
+                               : "{\"status\":\"failed\",\"error\":\"Invalid request body\"}");
+        return;
+    }
+    device_op_respond(conn, request.busid, is_bind);
+}
+
+static void route_bind(http_conn_t *conn, http_request_t *req) {
+    (void)req;
+    device_op_body(conn, 1);
+}
+
+static void route_unbind(http_conn_t *conn, http_request_t *req) {
+    (void)req;
+    device_op_body(conn, 0);
+}
+
+// POST /api/devices/{busid}/bind and /unbind: the bus id is in the path
+static void device_op_path(http_conn_t *conn, http_request_t *req, int is_bind) {
+    const char *busid = http_path_param(req, "busid");
+    if (strlen(busid) >= sizeof(((bind_request_t *)0)->busid) || !validate_busid(busid)) {
+        send_http_response(conn, 400, "Bad Request", "application/json",
+                           "{\"status\":\"failed\",\"error\":\"Invalid busid\"}");
+        return;
+    }
+    device_op_respond(conn, busid, is_bind);
+}
+
+static void route_device_bind(http_conn_t *conn, http_request_t *req) {
+    device_op_path(conn, req, 1);
+}
+
+static void route_device_unbind(http_conn_t *conn, http_request_t *req) {
+    device_op_path(conn, req, 0);
+}
+
+// The route table. HEAD is served by the GET route with the body left out.
+static const route_t g_routes[] = {
+    {HTTP_METHOD_GET, "/", RATE_CLASS_CHEAP, route_index, 0},
+    {HTTP_METHOD_GET, "/favicon.ico", RATE_CLASS_CHEAP, route_favicon, 0},
+    {HTTP_METHOD_GET, "/api/devices", RATE_CLASS_CHEAP, route_devices, 0},
+    {HTTP_METHOD_GET, "/api/devices/{busid}", RATE_CLASS_CHEAP, route_device, 0},
+    {HTTP_METHOD_POST, "/api/devices/{busid}/bind", RATE_CLASS_EXPENSIVE, route_device_bind, 0},
+    {HTTP_METHOD_POST, "/api/devices/{busid}/unbind", RATE_CLASS_EXPENSIVE, route_device_unbind, 0},
+    {HTTP_METHOD_GET, "/metrics", RATE_CLASS_CHEAP, route_metrics, 0},
+    {HTTP_METHOD_GET, "/events", RATE_CLASS_CHEAP, route_events, 0},
+    {HTTP_METHOD_GET, "/ws", RATE_CLASS_CHEAP, route_ws, 0},
+    {HTTP_METHOD_GET, "/debug/trace", RATE_CLASS_EXPENSIVE, route_debug_trace, 1},
+    {HTTP_METHOD_GET, "/debug/profile", RATE_CLASS_EXPENSIVE, route_debug_profile, 1},
+    {HTTP_METHOD_GET, "/debug/locks", RATE_CLASS_EXPENSIVE, route_debug_locks, 1},
+    {HTTP_METHOD_GET, "/debug/state", RATE_CLASS_EXPENSIVE, route_debug_state, 1},
+    {HTTP_METHOD_POST, "/bind", RATE_CLASS_EXPENSIVE, route_bind, 0},
+    {HTTP_METHOD_POST, "/unbind", RATE_CLASS_EXPENSIVE, route_unbind, 0},
+};
+
+#define ROUTE_COUNT ((int)(sizeof(g_routes) / sizeof(g_routes[0])))
+
+static const char *const HTTP_METHOD_NAMES[HTTP_METHOD_COUNT] = {"GET", "POST"};
+
+// Route metrics are kept in fixed arrays of ROUTE_MAX + 1 slots
+typedef char route_table_fits[ROUTE_COUNT <= ROUTE_MAX ? 1 : -1];
+
+static route_node_t g_route_trie[ROUTE_TRIE_NODES];
+static int g_route_node_count = 0;
+
+static int route_node_new(const char *segment, size_t len, int is_param) {
+    if (g_route_node_count >= ROUTE_TRIE_NODES || len >= ROUTE_SEGMENT_SIZE) return -1;
+    route_node_t *node = &g_route_trie[g_route_node_count];
+    memcpy(node->segment, segment, len);
+    node->segment[len] = '\0';
+    node->is_param = is_param;
+    node->child = node->sibling = node->param_child = -1;
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) node->routes[m] = -1;
+    return g_route_node_count++;
+}
+
+// Build the segment trie from the route table (called from main)
+static void router_init(void) {
+    g_route_node_count = 0;
+    route_node_new("", 0, 0);
+
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        int node = 0;
+        for (const char *p = g_routes[r].pattern; node >= 0 && *p;) {
+            while (*p == '/') p++;
+            size_t len = strcspn(p, "/");
+            if (len == 0) break;
+
+            int next;
+            if (p[0] == '{') {
+                next = g_route_trie[node].param_child;
+                if (next < 0) {
+                    next = route_node_new(p + 1, len - 2, 1);
+                    g_route_trie[node].param_child = next;
+                }
+            } else {
+                for (next = g_route_trie[node].child; next >= 0; next = g_route_trie[next].sibling) {
+                    if (strlen(g_route_trie[next].segment) == len &&
+                        memcmp(g_route_trie[next].segment, p, len) == 0) {
+                        break;
+                    }
+                }
+                if (next < 0 && (next = route_node_new(p, len, 0)) >= 0) {
+                    g_route_trie[next].sibling = g_route_trie[node].child;
+                    g_route_trie[node].child = next;
+                }
+            }
+            node = next;
+            p += len;
+        }
+        if (node < 0) {
+            log_message("ERROR", "Route table does not fit the trie: %s", g_routes[r].pattern);
+            continue;
+        }
+        g_route_trie[node].routes[g_routes[r].method] = r;
+    }
+}
+
+static int route_node_has_routes(int node) {
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+        if (g_route_trie[node].routes[m] >= 0) return 1;
+    }
+    return 0;
+}
+
+// Match the rest of a path below node, capturing parameters into req.
+// Literal segments win over a parameter; returns the node or -1.
+static int route_walk(int node, const char *p, http_request_t *req) {
+    while (*p == '/') p++;
+    if (!*p) return route_node_has_routes(node) ? node : -1;
+
+    size_t len = strcspn(p, "/");
+    for (int child = g_route_trie[node].child; child >= 0; child = g_route_trie[child].sibling) {
+        if (strlen(g_route_trie[child].segment) == len && memcmp(g_route_trie[child].segment, p, len) == 0) {
+            int found = route_walk(child, p + len, req);
+            if (found >= 0) return found;
+            break;
+        }
+    }
+
+    int param = g_route_trie[node].param_child;
+    if (param < 0 || req->param_count >= ROUTE_MAX_PARAMS) return -1;
+    int slot = req->param_count++;
+    req->params[slot].name = g_route_trie[param].segment;
+    if (!http_url_decode(p, len, 0, req->params[slot].value, sizeof(req->params[slot].value))) {
+        req->param_count = slot;
+        return -1;
+    }
+    int found = route_walk(param, p + len, req);
+    if (found < 0) req->param_count = slot;
+    return found;
+}
+
+// Find the route for a request. Returns the route index, or -1 with *node
+// set to the matching path's trie node when only the method is wrong, or
+// to -1 when nothing has this path.
+static int route_match(http_request_t *req, int *node) {
+    *node = route_walk(0, req->path, req);
+    if (*node < 0) return -1;
+    if (strcmp(req->method, "HEAD") == 0) {
+        req->is_head = 1;
+        return g_route_trie[*node].routes[HTTP_METHOD_GET];
+    }
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+        if (strcmp(req->method, HTTP_METHOD_NAMES[m]) == 0) return g_route_trie[*node].routes[m];
+    }
+    return -1;
+}
+
+// Answer a request whose path exists under other methods
+static void route_method_not_allowed(http_conn_t *conn, int node) {
+    char allow[64] = "";
+    size_t pos = 0;
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+        if (g_route_trie[node].routes[m] < 0) continue;
+        buffer_appendf(allow, sizeof(allow), &pos, "%s%s%s", pos ? ", " : "", HTTP_METHOD_NAMES[m],
+                       m == HTTP_METHOD_GET ? ", HEAD" : "");
+    }
+    http_response_t res;
+    http_response_begin(&res, conn, 405, "Method Not Allowed", "text/plain");
+    http_response_header(&res, "Allow", "%s", allow);
+    http_response_body(&res, "405 Method Not Allowed", 22);
+    http_response_send(&res);
+}
 
-// Add SSE client
-void add_sse_client(int socket, struct sockaddr_in addr) {
-    pthread_mutex_lock(&g_mutex);
-    if (g_client_count < MAX_CLIENTS) {
-        g_clients[g_client_count].socket = socket;
-        g_clients[g_client_count].is_sse = 1;
-        g_clients[g_client_count].addr = addr;
-        g_clients[g_client_count].last_heartbeat = time(NULL);
-        g_client_count++;
-    }
-    pthread_mutex_unlock(&g_mutex);
-}
-
-// Remove client
-void remove_client(int socket) {
-    pthread_mutex_lock(&g_mutex);
-    for (int i = 0; i < g_client_count; i++) {
-        if (g_clients[i].socket == socket) {
-            g_clients[i] = g_clients[g_client_count - 1];
-            g_client_count--;
-            break;
-        }
+// Count a response against its route (-1 for unmatched) and status, with
+// its latency, in the calling thread's shard; also fires request__end and
+// leaves a flight recorder event
+static void route_record(int route, int status, unsigned long long ns) {
+    const char *pattern = route >= 0 ? g_routes[route].pattern : "unmatched";
+    USBCTL_PROBE3(request__end, pattern, status, ns);
+    flight_record(FLIGHT_ROUTE, pattern, status, ns);
+    metrics_shard_t *shard = metrics_shard();
+    if (!shard) return;
+    int r = route >= 0 ? route : ROUTE_COUNT;
+    int slot = METRIC_STATUS_SLOTS - 1;
+    for (int i = 0; i < METRIC_STATUS_SLOTS - 1; i++) {
+        if (status == METRIC_STATUS_CODES[i]) slot = i;
     }
-    pthread_mutex_unlock(&g_mutex);
+    metric_add(&shard->route_responses[r][slot], 1);
+    histogram_observe(&shard->route_latency[r], ns);
 }
 
-// Broadcast devices update
-void broadcast_devices_update(void) {
-    char *json = malloc(JSON_BUFFER_SIZE);
-    if (!json) return;
-    
-    generate_devices_json(json, JSON_BUFFER_SIZE);
-
-    pthread_mutex_lock(&g_mutex);
-    for (int i = g_client_count - 1; i >= 0; i--) {
-        if (g_clients[i].is_sse) {
-            ssize_t result = send_sse_message(g_clients[i].socket, json);
-            if (result <= 0) {
-                close(g_clients[i].socket);
-                if (i < g_client_count - 1) {
-                    g_clients[i] = g_clients[g_client_count - 1];
-                }
-                g_client_count--;
+// Per-route response counts and latency histograms for /metrics; the
+// extra slot collects requests no route matched
+static void route_metrics_append(char *buffer, size_t buffer_size, size_t *pos,
+                                 const metrics_shard_t *total) {
+    char labels[96];
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_http_route_requests_total Requests answered, by route and status code.\n"
+        "# TYPE usbctl_http_route_requests_total counter\n");
+    for (int r = 0; r <= ROUTE_COUNT; r++) {
+        for (int slot = 0; slot < METRIC_STATUS_SLOTS; slot++) {
+            unsigned long long n = total->route_responses[r][slot];
+            if (n == 0) continue;
+            char code[8];
+            if (slot < METRIC_STATUS_SLOTS - 1) {
+                snprintf(code, sizeof(code), "%d", METRIC_STATUS_CODES[slot]);
             } else {
-                g_clients[i].last_heartbeat = time(NULL);
+                memcpy(code, "other", 6);
             }
+            buffer_appendf(buffer, buffer_size, pos,
+                "usbctl_http_route_requests_total{method=\"%s\",route=\"%s\",code=\"%s\"} %llu\n",
+                r < ROUTE_COUNT ? HTTP_METHOD_NAMES[g_routes[r].method] : "",
+                r < ROUTE_COUNT ? g_routes[r].pattern : "unmatched", code, n);
         }
     }
-    pthread_mutex_unlock(&g_mutex);
-    free(json);
+
+    buffer_appendf(buffer, buffer_size, pos,
+        "# HELP usbctl_http_route_duration_seconds Time from parsed request to answer, by route.\n"
+        "# TYPE usbctl_http_route_duration_seconds histogram\n");
+    for (int r = 0; r <= ROUTE_COUNT; r++) {
+        snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"",
+                 r < ROUTE_COUNT ? HTTP_METHOD_NAMES[g_routes[r].method] : "",
+                 r < ROUTE_COUNT ? g_routes[r].pattern : "unmatched");
+        histogram_append(buffer, buffer_size, pos, "usbctl_http_route_duration_seconds", labels,
+                         &total->route_latency[r]);
+    }
 }
 
 // ============================================================================
@@ -1202,258 +8720,292 @@ void broadcast_devices_update(void) {
 // Device polling thread
 void *device_poll_thread(void *arg) {
     (void)arg;
-    usb_device_t prev_devices[MAX_DEVICES];
-    int prev_count = 0;
+    time_t last_snapshot = time(NULL);
 
     while (g_running) {
-        pthread_mutex_lock(&g_mutex);
-        memcpy(prev_devices, g_devices, sizeof(prev_devices));
-        prev_count = g_device_count;
-        pthread_mutex_unlock(&g_mutex);
-
-        list_usbip_devices();
-
-        int changed = 0;
-        if (prev_count != g_device_count) {
-            changed = 1;
-        } else {
-            for (int i = 0; i < g_device_count; i++) {
-                if (strcmp(prev_devices[i].busid, g_devices[i].busid) != 0 ||
-                    prev_devices[i].bound != g_devices[i].bound) {
-                    changed = 1;
-                    break;
-                }
+        trace_request_begin();
+        unsigned long long start = monotonic_ns();
+        unsigned long long span = trace_begin();
+        USBCTL_PROBE0(poll__start);
+        g_poll.started_ns = start;
+        g_poll.running = 1;
+        int count = list_usbip_devices();
+
+        // Publishes one delta per added, removed or changed device, if any
+        int changes = broadcast_devices_update();
+        unsigned long long elapsed = monotonic_ns() - start;
+        USBCTL_PROBE3(poll__end, count, changes, elapsed);
+        flight_record(FLIGHT_POLL, NULL, changes, elapsed);
+
+        metrics_shard_t *shard = metrics_shard();
+        if (shard) {
+            histogram_observe(&shard->poll_cycle, elapsed);
+            if (changes > 0) {
+                metric_add(&shard->poll_changed_cycles, 1);
+                metric_add(&shard->poll_changes, (unsigned long long)changes);
             }
         }
-
-        if (changed) {
-            broadcast_devices_update();
+        trace_end("poll", "poll_cycle", span);
+        g_poll.devices = count;
+        g_poll.changes = changes;
+        g_poll.finished_ns = monotonic_ns();
+        g_poll.cycles++;
+        g_poll.running = 0;
+
+        if (g_config.sse_snapshot_interval > 0 &&
+            time(NULL) - last_snapshot >= g_config.sse_snapshot_interval) {
+            broadcast_devices_snapshot();
+            last_snapshot = time(NULL);
         }
 
+        g_poll.next_ns = monotonic_ns() + (unsigned long long)g_config.poll_interval * 1000000000ULL;
         sleep(g_config.poll_interval);
     }
     return NULL;
 }
 
-// Handle client request
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
-
-    char buffer[BUFFER_SIZE];
-    ssize_t received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-
-    if (received <= 0) {
-        close(client_socket);
-        return NULL;
-    }
+// Connection deadline expired: flag it and shut the socket down so the
+// blocked recv() in the client thread returns
+static void conn_deadline_expired(wheel_timer_t *timer) {
+    http_conn_t *conn = (http_conn_t *)timer->arg;
+    conn->timed_out = 1;
+    STAT_ADD(deadline_expired[conn->deadline_kind], 1);
+    shutdown(conn->socket, SHUT_RDWR);
+}
 
-    buffer[received] = '\0';
+// Arm the header, body or keep-alive idle deadline of a connection
+static void conn_arm_deadline(http_conn_t *conn, deadline_kind_t kind) {
+    int seconds = g_config.header_timeout;
+    if (kind == DEADLINE_BODY) seconds = g_config.body_timeout;
+    if (kind == DEADLINE_IDLE) seconds = g_config.keepalive_timeout;
 
-    // Parse HTTP request
-    char method[16], path[256], version[16];
-    if (sscanf(buffer, "%15s %255s %15s", method, path, version) != 3) {
-        close(client_socket);
-        return NULL;
+    conn->deadline_kind = kind;
+    if (seconds > 0) {
+        timer_arm(&conn->deadline, (unsigned int)seconds * 1000, conn_deadline_expired, conn);
+    } else {
+        timer_cancel(&conn->deadline);
     }
+}
 
-    // Handle SSE events endpoint
-    if (strcmp(path, "/events") == 0 && strcmp(method, "GET") == 0) {
-        send_sse_headers(client_socket);
-
-        struct sockaddr_in addr;
-        socklen_t addr_len = sizeof(addr);
-        getpeername(client_socket, (struct sockaddr *)&addr, &addr_len);
-        add_sse_client(client_socket, addr);
+// Read one complete request (headers plus Content-Length body) into the
+// connection buffer under the idle, header and body deadlines.
+// Returns 1 when a request is ready, 0 when the connection should close.
+static int http_read_request(http_conn_t *conn) {
+    deadline_kind_t phase = (conn->requests > 0 && conn->buffered == 0) ? DEADLINE_IDLE : DEADLINE_HEADER;
+    conn_arm_deadline(conn, phase);
+
+    char *header_end;
+    while (!(header_end = strstr(conn->buffer, "\r\n\r\n"))) {
+        if (conn->buffered >= sizeof(conn->buffer) - 1) {
+            timer_cancel(&conn->deadline);
+            conn->keep_alive = 0;
+            send_http_response(conn, 431, "Request Header Fields Too Large", "text/plain",
+                               "431 Request Header Fields Too Large");
+            return 0;
+        }
 
-        char *json = malloc(JSON_BUFFER_SIZE);
-        if (!json) {
-            close(client_socket);
-            return NULL;
+        ssize_t n = recv(conn->socket, conn->buffer + conn->buffered,
+                         sizeof(conn->buffer) - 1 - conn->buffered, 0);
+        if (n < 0 && errno == EINTR && !conn->timed_out) continue;
+        if (n <= 0) {
+            timer_cancel(&conn->deadline);
+            return 0;
         }
-        generate_devices_json(json, JSON_BUFFER_SIZE);
-        send_sse_message(client_socket, json);
-        free(json);
+        conn->buffered += (size_t)n;
+        conn->buffer[conn->buffered] = '\0';
 
-#ifdef PLATFORM_WINDOWS
-        // Windows: timeout in milliseconds
-        DWORD timeout = 30000; // 30 seconds
-        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
-#else
-        // Unix: timeout as struct timeval
-        struct timeval tv;
-        tv.tv_sec = 30;
-        tv.tv_usec = 0;
-        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-#endif
-
-        while (g_running) {
-            char dummy_buffer[64];
-            ssize_t bytes = recv(client_socket, dummy_buffer, sizeof(dummy_buffer), 0);
-            if (bytes <= 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    send(client_socket, ": heartbeat\n\n", 13, MSG_NOSIGNAL);
-                    continue;
-                }
-                break;
-            }
+        if (phase == DEADLINE_IDLE) {
+            phase = DEADLINE_HEADER;
+            conn_arm_deadline(conn, phase);
         }
-        remove_client(client_socket);
-        close(client_socket);
-        return NULL;
+    }
+    conn->header_len = (size_t)(header_end - conn->buffer) + 4;
+
+    char value[64];
+    size_t content_length = 0;
+    if (http_get_header(conn->buffer, "Transfer-Encoding", value, sizeof(value))) {
+        timer_cancel(&conn->deadline);
+        conn->keep_alive = 0;
+        send_http_response(conn, 411, "Length Required", "text/plain", "411 Length Required");
+        return 0;
+    }
+    if (http_get_header(conn->buffer, "Content-Length", value, sizeof(value)) &&
+        (strlen(value) >= sizeof(value) - 1 ||
+         !http_parse_content_length(value, sizeof(conn->buffer), &content_length))) {
+        timer_cancel(&conn->deadline);
+        conn->keep_alive = 0;
+        send_http_response(conn, 400, "Bad Request", "text/plain", "400 Bad Request");
+        return 0;
+    }
+    if (content_length > sizeof(conn->buffer) - 1 - conn->header_len) {
+        timer_cancel(&conn->deadline);
+        conn->keep_alive = 0;
+        send_http_response(conn, 413, "Payload Too Large", "text/plain", "413 Payload Too Large");
+        return 0;
     }
 
-    // Handle HTTP routes
-    if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
-        int is_head = strcmp(method, "HEAD") == 0;
-        
-        if (strcmp(path, "/") == 0) {
-            if (is_head) {
-                send_http_response(client_socket, 200, "OK", "text/html", "");
-            } else {
-                char *html = malloc(16384);
-                if (html) {
-                    generate_html_page(html, 16384);
-                    send_http_response(client_socket, 200, "OK", "text/html", html);
-                    free(html);
-                }
-            }
-        } else if (strcmp(path, "/favicon.ico") == 0) {
-            static unsigned char decoded_favicon[2048];
-            static int favicon_len = -1;
-
-            if (favicon_len == -1) {
-                favicon_len = base64_decode(EMBEDDED_FAVICON, decoded_favicon, sizeof(decoded_favicon));
-            }
-
-            if (is_head) {
-                char response_header[512];
-                int header_len = snprintf(response_header, sizeof(response_header),
-                    "HTTP/1.1 200 OK\r\n"
-                    "Content-Type: image/x-icon\r\n"
-                    "Content-Length: %d\r\n"
-                    "Cache-Control: public, max-age=86400\r\n"
-                    "\r\n", favicon_len);
-                
-                if (header_len > 0 && header_len < (int)sizeof(response_header)) {
-                    send(client_socket, response_header, header_len, 0);
-                }
-            } else {
-                char response_header[256];
-                int header_len = snprintf(response_header, sizeof(response_header),
-                    "HTTP/1.1 200 OK\r\n"
-                    "Content-Type: image/x-icon\r\n"
-                    "Content-Length: %d\r\n"
-                    "Cache-Control: public, max-age=86400\r\n"
-                    "\r\n", favicon_len);
-                    
-                if (header_len > 0 && header_len < (int)sizeof(response_header)) {
-                    send(client_socket, response_header, header_len, 0);
-                    send(client_socket, (const char *)decoded_favicon, favicon_len, 0);
-                }
-            }
-        } else if (strcmp(path, "/api/devices") == 0) {
-            if (!is_head) {
-                char *json = malloc(JSON_BUFFER_SIZE);
-                if (json) {
-                    generate_devices_json(json, JSON_BUFFER_SIZE);
-                    send_http_response(client_socket, 200, "OK", "application/json", json);
-                    free(json);
-                }
-            } else {
-                send_http_response(client_socket, 200, "OK", "application/json", "");
-            }
-        } else {
-            send_http_response(client_socket, 404, "Not Found", "text/plain", "404 Not Found");
-        }
-    } else if (strcmp(method, "POST") == 0) {
-        char *body = strstr(buffer, "\r\n\r\n");
-        if (body && (body - buffer < (ssize_t)strlen(buffer) - 4)) {
-            body += 4;
-            size_t body_len = safe_strnlen(body, 4096);
-            
-            if (body_len > 0 && body_len < 4096) {
-                if (strcmp(path, "/bind") == 0 || strcmp(path, "/unbind") == 0) {
-                    char *busid_start = strstr(body, "\"busid\":\"");
-                    if (busid_start) {
-                        busid_start += 9;
-                        char *busid_end = strchr(busid_start, '"');
-                        if (busid_end && busid_end - busid_start < 16) {
-                            char busid[16];
-                            size_t busid_len = busid_end - busid_start;
-                            memcpy(busid, busid_start, busid_len);
-                            busid[busid_len] = '\0';
-                            
-                            int is_bind = strcmp(path, "/bind") == 0;
-                            int result = is_bind ? bind_device(busid) : unbind_device(busid);
-                            
-                            if (result) {
-                                list_usbip_devices();
-                                save_config();
-                                
-                                char *response_json = malloc(8192);
-                                if (response_json) {
-                                    char *devices_json = malloc(4096);
-                                    if (devices_json) {
-                                        generate_devices_json(devices_json, 4096);
-                                        snprintf(response_json, 8192, 
-                                                "{\"status\":\"success\",\"devices\":%s}", 
-                                                devices_json);
-                                        send_http_response(client_socket, 200, "OK", 
-                                                         "application/json", response_json);
-                                        free(devices_json);
-                                    }
-                                    free(response_json);
-                                }
-                                broadcast_devices_update();
-                            } else {
-                                send_http_response(client_socket, 500, "Internal Server Error",
-                                                 "application/json", 
-                                                 "{\"status\":\"failed\",\"error\":\"Operation failed\"}");
-                            }
-                        }
-                    }
-                } else {
-                    send_http_response(client_socket, 404, "Not Found", "text/plain", "404 Not Found");
-                }
+    conn->request_len = conn->header_len + content_length;
+    if (conn->buffered < conn->request_len) {
+        conn_arm_deadline(conn, DEADLINE_BODY);
+        while (conn->buffered < conn->request_len) {
+            ssize_t n = recv(conn->socket, conn->buffer + conn->buffered,
+                             sizeof(conn->buffer) - 1 - conn->buffered, 0);
+            if (n < 0 && errno == EINTR && !conn->timed_out) continue;
+            if (n <= 0) {
+                timer_cancel(&conn->deadline);
+                return 0;
             }
+            conn->buffered += (size_t)n;
+            conn->buffer[conn->buffered] = '\0';
         }
+    }
+
+    timer_cancel(&conn->deadline);
+    return 1;
+}
+
+// Handle one request; returns 1 when the connection may serve another
+int handle_request(http_conn_t *conn) {
+    // Parse HTTP request
+    http_request_t req;
+    memset(&req, 0, sizeof(req));
+    if (sscanf(conn->buffer, "%15s %255s %15s", req.method, req.path, req.version) != 3) {
+        conn->keep_alive = 0;
+        send_http_response(conn, 400, "Bad Request", "text/plain", "400 Bad Request");
+        return 0;
+    }
+    if (conn->shard) __sync_fetch_and_add(&conn->shard->requests, 1ULL);
+    unsigned long long start = monotonic_ns();
+    trace_request_begin();
+    unsigned long long span = trace_begin();
+
+    // Routes match on the path alone; the query string is handed to the
+    // routes that take parameters
+    char *query = strchr(req.path, '?');
+    if (query) *query++ = '\0';
+    req.query = query;
+    USBCTL_PROBE2(request__start, req.method, req.path);
+
+    char connection[32] = "";
+    http_get_header(conn->buffer, "Connection", connection, sizeof(connection));
+    if (strcmp(req.version, "HTTP/1.1") == 0) {
+        conn->keep_alive = strncasecmp_compat(connection, "close", 5) != 0;
     } else {
-        send_http_response(client_socket, 405, "Method Not Allowed", "text/plain", 
-                          "405 Method Not Allowed");
+        conn->keep_alive = strncasecmp_compat(connection, "keep-alive", 10) == 0;
+    }
+    if (++conn->requests >= MAX_KEEPALIVE_REQUESTS || !g_running) {
+        conn->keep_alive = 0;
+    }
+    if (conn->requests > 1) {
+        STAT_ADD(keepalive_reuses, 1);
+    }
+    int responses_before = conn->responses;
+    conn->status = 0;
+
+    int node;
+    int route = route_match(&req, &node);
+    int holds_slot = 0;
+    if (route >= 0 && g_routes[route].local_only && !conn->is_local && !g_config.debug_remote) {
+        send_http_response(conn, 403, "Forbidden", "text/plain", "403 Forbidden");
+        route_record(route, conn->status, monotonic_ns() - start);
+        trace_end("http", g_routes[route].pattern, span);
+        return conn->keep_alive;
+    }
+    if (!admission_check(conn, route >= 0 ? g_routes[route].rate_class : RATE_CLASS_CHEAP, &holds_slot)) {
+        route_record(route, conn->status, monotonic_ns() - start);
+        trace_end("http", route >= 0 ? g_routes[route].pattern : "unmatched", span);
+        return conn->keep_alive;
     }
 
-    close(client_socket);
-    return NULL;
+    if (route >= 0) {
+        g_routes[route].handler(conn, &req);
+    } else if (node >= 0) {
+        route_method_not_allowed(conn, node);
+    } else {
+        send_http_response(conn, 404, "Not Found", "text/plain", "404 Not Found");
+    }
+
+    // Every request gets an answer now that the connection may stay open
+    if (conn->responses == responses_before) {
+        send_http_response(conn, 400, "Bad Request", "text/plain", "400 Bad Request");
+    }
+
+    admission_release(holds_slot);
+    route_record(route, conn->status, monotonic_ns() - start);
+    trace_end("http", route >= 0 ? g_routes[route].pattern : "unmatched", span);
+    return conn->keep_alive;
 }
 
-// Main server loop
-void *server_thread(void *arg) {
-    (void)arg;
-    
-#ifdef PLATFORM_WINDOWS
-    // Initialize Windows Sockets
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        fprintf(stderr, "WSAStartup failed\n");
+// Handle client connection: serve requests until it closes, times out or
+// opts out of keep-alive
+void *handle_client(void *arg) {
+    connection_t *accepted = (connection_t *)arg;
+    http_conn_t *conn = calloc(1, sizeof(http_conn_t));
+    if (!conn) {
+        close(accepted->socket);
+        free(accepted);
         return NULL;
     }
+    conn->socket = accepted->socket;
+    conn->is_local = accepted->is_local;
+    conn->shard = accepted->shard;
+    free(accepted);
+
+    while (g_running && http_read_request(conn)) {
+        // Terminate the request so string helpers stop at its end, then
+        // restore the first byte of any pipelined request behind it
+        char saved = conn->buffer[conn->request_len];
+        conn->buffer[conn->request_len] = '\0';
+#ifndef PLATFORM_WINDOWS
+        // HTTP/2 by prior knowledge (the preface parses as a request line)
+        // or by upgrade; either way this thread now serves frames
+        int h2 = conn->requests == 0 && strcmp(conn->buffer, "PRI * HTTP/2.0\r\n\r\n") == 0;
+        int h2_upgrade = !h2 && h2_upgrade_requested(conn);
+        if (h2 || h2_upgrade) {
+            conn->buffer[conn->request_len] = saved;
+            h2_serve(conn, h2_upgrade);
+            break;
+        }
 #endif
-    
+        int keep_alive = handle_request(conn);
+        conn->buffer[conn->request_len] = saved;
+        if (!keep_alive || conn->timed_out) break;
+
+        conn->buffered -= conn->request_len;
+        memmove(conn->buffer, conn->buffer + conn->request_len, conn->buffered);
+        conn->buffer[conn->buffered] = '\0';
+        conn->header_len = 0;
+        conn->request_len = 0;
+    }
+
+    timer_cancel(&conn->deadline);
+    if (conn->socket >= 0) close(conn->socket);
+    free(conn);
+    metrics_thread_exit();
+    return NULL;
+}
+
+// Open one listening socket; reuse_port lets several sockets share the port
+static int open_listen_socket(int reuse_port) {
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
         perror("Socket creation failed");
-#ifdef PLATFORM_WINDOWS
-        WSACleanup();
-#endif
-        exit(1);
+        return -1;
     }
 
     int opt = 1;
 #ifdef PLATFORM_WINDOWS
+    (void)reuse_port;
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
 #else
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT failed");
+        close(server_socket);
+        return -1;
+    }
+#endif
 #endif
 
     struct sockaddr_in server_addr;
@@ -1465,25 +9017,93 @@ void *server_thread(void *arg) {
     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
         close(server_socket);
-#ifdef PLATFORM_WINDOWS
-        WSACleanup();
-#endif
-        exit(1);
+        return -1;
     }
 
-    if (listen(server_socket, 10) < 0) {
+    if (listen(server_socket, SOMAXCONN) < 0) {
         perror("Listen failed");
         close(server_socket);
-#ifdef PLATFORM_WINDOWS
-        WSACleanup();
+        return -1;
+    }
+    return server_socket;
+}
+
+#ifndef PLATFORM_WINDOWS
+// Open the AF_UNIX listener for local agents; access is controlled by the
+// socket file's mode
+static int open_unix_socket(const char *path, int mode) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+
+    // Replace a stale socket left by a previous run, never a regular file
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Refusing to replace non-socket %s\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Unix socket creation failed");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    mode_t old_umask = umask(0177);
+    int ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (ret < 0) {
+        perror("Unix socket bind failed");
+        close(sock);
+        return -1;
+    }
+
+    if (chmod(path, (mode_t)mode) < 0 || listen(sock, SOMAXCONN) < 0) {
+        perror("Unix socket setup failed");
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+    return sock;
+}
 #endif
-        exit(1);
+
+// Pin the calling accept loop to one CPU (Linux only)
+static void pin_shard_to_cpu(listener_shard_t *shard) {
+#if defined(__linux__)
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 1) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    shard->cpu = shard->id % (int)ncpu;
+    CPU_SET(shard->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        log_message("WARN", "Cannot pin listener shard %d to CPU %d", shard->id, shard->cpu);
+        shard->cpu = -1;
     }
+#else
+    (void)shard;
+#endif
+}
 
-    char *local_ip = get_local_ip();
-    printf("\nServer started on %s:%d\n", g_config.bind_address, g_config.port);
-    printf("Web interface: http://%s:%d\n", local_ip, g_config.port);
-    printf("Press Ctrl+C to stop\n\n");
+// Accept loop for one listener shard
+static void *shard_accept_loop(void *arg) {
+    listener_shard_t *shard = (listener_shard_t *)arg;
+    int server_socket = shard->socket;
+
+    if (g_shard_count > 1 && !shard->is_unix) {
+        pin_shard_to_cpu(shard);
+    }
 
     while (g_running) {
         fd_set readfds;
@@ -1509,7 +9129,7 @@ void *server_thread(void *arg) {
         if (ready == 0) continue;
         if (!FD_ISSET(server_socket, &readfds)) continue;
 
-        struct sockaddr_in client_addr;
+        struct sockaddr_storage client_addr;
         socklen_t client_len = sizeof(client_addr);
         int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
 
@@ -1518,24 +9138,114 @@ void *server_thread(void *arg) {
             continue;
         }
 
+        // Every response leaves as one complete write, so Nagle only adds latency
+        if (!shard->is_unix) {
+            int nodelay = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+        }
+        __sync_fetch_and_add(&shard->connections, 1ULL);
+        flight_record(FLIGHT_ACCEPT, shard->is_unix ? "unix" : "tcp", client_socket, 0);
+
         pthread_t client_thread;
-        int *socket_ptr = malloc(sizeof(int));
-        if (!socket_ptr) {
+        connection_t *conn = malloc(sizeof(connection_t));
+        if (!conn) {
             close(client_socket);
             continue;
         }
-        *socket_ptr = client_socket;
+        conn->socket = client_socket;
+        conn->is_local = shard->is_unix;
+        conn->shard = shard;
 
-        if (pthread_create(&client_thread, NULL, handle_client, socket_ptr) != 0) {
+        if (pthread_create(&client_thread, NULL, handle_client, conn) != 0) {
             perror("Thread creation failed");
             close(client_socket);
-            free(socket_ptr);
+            free(conn);
         } else {
             pthread_detach(client_thread);
         }
     }
 
     close(server_socket);
+    return NULL;
+}
+
+// Main server loop
+void *server_thread(void *arg) {
+    (void)arg;
+    
+#ifdef PLATFORM_WINDOWS
+    // Initialize Windows Sockets
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return NULL;
+    }
+#endif
+
+    int shards = g_config.listen_shards;
+#if defined(PLATFORM_WINDOWS) || !defined(SO_REUSEPORT)
+    if (shards > 1) {
+        fprintf(stderr, "[WARN] SO_REUSEPORT not supported, using a single listener\n");
+        shards = 1;
+    }
+#endif
+    if (shards < 1) shards = 1;
+    if (shards > MAX_LISTEN_SHARDS) shards = MAX_LISTEN_SHARDS;
+
+    // Open every socket before accepting so a bind failure is reported up front
+    for (int i = 0; i < shards; i++) {
+        g_shards[i].id = i;
+        g_shards[i].cpu = -1;
+        g_shards[i].socket = open_listen_socket(shards > 1);
+        if (g_shards[i].socket < 0) {
+            for (int j = 0; j < i; j++) close(g_shards[j].socket);
+#ifdef PLATFORM_WINDOWS
+            WSACleanup();
+#endif
+            exit(1);
+        }
+    }
+    g_shard_count = shards;
+
+    char *local_ip = get_local_ip();
+    printf("\nServer started on %s:%d", g_config.bind_address, g_config.port);
+    if (shards > 1) printf(" (%d SO_REUSEPORT listeners)", shards);
+    printf("\nWeb interface: http://%s:%d\n", local_ip, g_config.port);
+    printf("Press Ctrl+C to stop\n\n");
+
+#ifndef PLATFORM_WINDOWS
+    if (g_config.unix_socket[0]) {
+        g_unix_listener.socket = open_unix_socket(g_config.unix_socket, g_config.unix_mode);
+        if (g_unix_listener.socket >= 0 &&
+            pthread_create(&g_unix_listener.thread, NULL, shard_accept_loop, &g_unix_listener) == 0) {
+            printf("Local socket: %s (mode %04o)\n", g_config.unix_socket, g_config.unix_mode);
+        } else {
+            log_message("ERROR", "Unix socket listener disabled");
+            if (g_unix_listener.socket >= 0) close(g_unix_listener.socket);
+            g_unix_listener.socket = -1;
+        }
+    }
+#endif
+
+    for (int i = 1; i < shards; i++) {
+        if (pthread_create(&g_shards[i].thread, NULL, shard_accept_loop, &g_shards[i]) != 0) {
+            log_message("ERROR", "Failed to start listener shard %d", i);
+            close(g_shards[i].socket);
+            g_shards[i].socket = -1;
+        }
+    }
+
+    shard_accept_loop(&g_shards[0]);
+
+    for (int i = 1; i < shards; i++) {
+        if (g_shards[i].socket >= 0) pthread_join(g_shards[i].thread, NULL);
+    }
+#ifndef PLATFORM_WINDOWS
+    if (g_unix_listener.socket >= 0) {
+        pthread_join(g_unix_listener.thread, NULL);
+        unlink(g_config.unix_socket);
+    }
+#endif
     
 #ifdef PLATFORM_WINDOWS
     WSACleanup();
@@ -1544,6 +9254,163 @@ void *server_thread(void *arg) {
     return NULL;
 }
 
+// ============================================================================
+// FLIGHT RECORDER
+// ============================================================================
+
+static const char *const FLIGHT_KIND_NAMES[FLIGHT_KIND_COUNT] = {
+    "?", "accept", "route", "spawn", "exit", "poll", "broadcast", "lock_wait"
+};
+
+// Dumps go next to the log file: /var/log/usbctl.log -> /var/log/usbctl.flight
+static void flight_init(void) {
+    size_t len = safe_strnlen(g_config.log_file, sizeof(g_config.log_file) - 1);
+    memcpy(g_flight_path, g_config.log_file, len);
+    g_flight_path[len] = '\0';
+    char *dot = strrchr(g_flight_path, '.');
+    if (dot && !strchr(dot, '/') && !strchr(dot, '\\')) *dot = '\0';
+    strcat(g_flight_path, ".flight");
+}
+
+#ifndef PLATFORM_WINDOWS
+static void flight_write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+// Write the ring to g_flight_path. Runs in signal handlers, so it sticks to
+// async-signal-safe calls and copes with other threads still recording.
+static void flight_dump(int sig) {
+    if (!g_flight_path[0] || __sync_lock_test_and_set(&g_flight_dumping, 1)) return;
+    int fd = open(g_flight_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        flight_header_t header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "USBCTLFR", 8);
+        header.version = FLIGHT_VERSION;
+        header.event_size = sizeof(flight_event_t);
+        header.capacity = FLIGHT_RING_SIZE;
+        header.signal = sig;
+        header.head = g_flight_head;
+        header.mono_ns = monotonic_ns();
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        header.wall_ns = (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+        flight_write_all(fd, &header, sizeof(header));
+        flight_write_all(fd, g_flight, sizeof(g_flight));
+        close(fd);
+    }
+    __sync_lock_release(&g_flight_dumping);
+}
+
+static void flight_dump_signal(int sig) {
+    int saved_errno = errno;
+    flight_dump(sig);
+    errno = saved_errno;
+}
+
+// The handler was reset on entry, so re-raising dies the way the crash
+// would have, core dump included
+static void flight_fatal_signal(int sig) {
+    flight_dump(sig);
+    raise(sig);
+}
+
+static void flight_install_signals(void) {
+    static const int fatal[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = flight_dump_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = flight_fatal_signal;
+    sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+        sigaction(fatal[i], &sa, NULL);
+    }
+}
+#endif
+
+// usbctl --decode-flight FILE: print a dump, oldest event first
+static int flight_decode(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    flight_header_t header;
+    flight_event_t *events = NULL;
+    int valid = fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, "USBCTLFR", 8) == 0 &&
+                header.version == FLIGHT_VERSION && header.event_size == sizeof(flight_event_t) &&
+                header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0;
+    if (valid) {
+        events = calloc(header.capacity, sizeof(flight_event_t));
+        valid = events && fread(events, sizeof(flight_event_t), header.capacity, fp) == header.capacity;
+    }
+    fclose(fp);
+    if (!valid) {
+        fprintf(stderr, "%s: not a usbctl flight recorder dump\n", path);
+        free(events);
+        return 1;
+    }
+
+    printf("# %llu events recorded, last %u kept, dumped on signal %d\n", header.head, header.capacity,
+           header.signal);
+    unsigned long long first = header.head > header.capacity ? header.head - header.capacity : 0;
+    for (unsigned long long i = first; i < header.head; i++) {
+        const flight_event_t *e = &events[i & (header.capacity - 1)];
+        if (e->seq != i + 1) continue;
+
+        char text[sizeof(e->text)];
+        memcpy(text, e->text, sizeof(text));
+        text[sizeof(text) - 1] = '\0';
+        unsigned long long wall = header.wall_ns - (header.mono_ns - e->ts_ns);
+        time_t secs = (time_t)(wall / 1000000000ULL);
+        char stamp[32] = "?";
+        struct tm *tm = localtime(&secs);
+        if (tm) strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", tm);
+        const char *name = e->kind < FLIGHT_KIND_COUNT ? FLIGHT_KIND_NAMES[e->kind] : "?";
+        double ms = e->value / 1e6;
+
+        printf("%s.%06llu tid %-6d %-9s ", stamp, (wall % 1000000000ULL) / 1000ULL, e->tid, name);
+        switch (e->kind) {
+        case FLIGHT_ACCEPT:
+            printf("%s socket=%d\n", text, e->arg);
+            break;
+        case FLIGHT_ROUTE:
+            printf("%s status=%d %.3fms\n", text, e->arg, ms);
+            break;
+        case FLIGHT_EXEC_SPAWN:
+            printf("%s pid=%d\n", text, e->arg);
+            break;
+        case FLIGHT_EXEC_EXIT:
+            printf("%s code=%d %.3fms\n", text, e->arg, ms);
+            break;
+        case FLIGHT_POLL:
+            printf("changes=%d %.3fms\n", e->arg, ms);
+            break;
+        case FLIGHT_BROADCAST:
+            printf("deltas=%d devices=%llu\n", e->arg, e->value);
+            break;
+        case FLIGHT_LOCK_WAIT:
+            printf("%s %.3fms\n", text, ms);
+            break;
+        default:
+            printf("%s arg=%d value=%llu\n", text, e->arg, e->value);
+            break;
+        }
+    }
+    free(events);
+    return 0;
+}
+
 // ============================================================================
 // MAIN
 // ============================================================================
@@ -1557,13 +9424,25 @@ void print_usage(void) {
     printf("  -b, --bind ADDRESS     Bind address (default: %s)\n", DEFAULT_BIND);
     printf("  -i, --interval SEC     Polling interval (default: 3)\n");
     printf("  -c, --config PATH      Configuration file path\n");
+    printf("  -s, --shards N         SO_REUSEPORT listeners, one accept loop per core (default: 1)\n");
+    printf("  -u, --unix PATH        Also listen on a Unix domain socket for local tools\n");
+    printf("                         (the /debug routes answer only there by default)\n");
+    printf("  --unix-mode MODE       Unix socket permissions, octal (default: 0660)\n");
     printf("  -v, --verbose          Enable verbose logging\n");
+    printf("  --backend NAME         Device backend: usbip (default) or sim\n");
+    printf("  --sim KEY=VALUE        Simulated backend setting: devices, buses, ports, depth,\n");
+    printf("                         churn (hotplugs/min), latency_ms, latency_sigma,\n");
+    printf("                         fail_rate, hang_rate, seed, mix (VID:PID[*WEIGHT],...)\n");
+    printf("  --decode-flight FILE   Print a flight recorder dump and exit\n");
     printf("  --version              Show version\n");
     printf("  --help                 Show this help\n\n");
     printf("Examples:\n");
     printf("  usbctl                 # Start web server\n");
     printf("  usbctl -p 8080         # Start on port 8080\n");
     printf("  usbctl -v              # Start with verbose logging\n");
+    printf("  usbctl -u /run/usbctl.sock   # Serve local agents over a Unix socket\n");
+    printf("  usbctl --backend sim --sim devices=24 --sim churn=30 -c /tmp/usbctl.conf\n");
+    printf("                         # Hardware-free run with 24 virtual devices\n");
 }
 
 void signal_handler(int sig) {
@@ -1574,14 +9453,15 @@ void signal_handler(int sig) {
     if (shutdown_count == 1) {
         printf("\nShutting down gracefully...\n");
         g_running = 0;
-        
-        for (int i = 0; i < g_client_count; i++) {
-            if (g_clients[i].socket > 0) {
-                close(g_clients[i].socket);
-                g_clients[i].socket = -1;
-            }
+
+        // Subscriber sockets belong to the fan-out workers and are closed
+        // by exit() below; taking their locks here is not signal-safe
+
+#ifndef PLATFORM_WINDOWS
+        if (g_unix_listener.socket >= 0) {
+            unlink(g_config.unix_socket);
         }
-        g_client_count = 0;
+#endif
         
         printf("Server stopped\n");
         fflush(stdout);
@@ -1594,11 +9474,27 @@ void signal_handler(int sig) {
 
 int main(int argc, char *argv[]) {
 #ifdef PLATFORM_WINDOWS
-    // Initialize critical section for Windows
-    InitializeCriticalSection(&g_mutex);
+    // Initialize critical sections for Windows
+    lock_init(&g_mutex, "g_mutex");
+    lock_init(&g_rate_mutex, "g_rate_mutex");
+    lock_init(&g_sse_ring_lock, "g_sse_ring_lock");
 #endif
     
+    crc32_init();
+#ifndef PLATFORM_WINDOWS
+    hpack_init();
+#endif
+    init_static_assets();
+    router_init();
     init_config();
+    // --config picks the file the rest of the command line overrides
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--config") == 0 || strcmp(argv[i], "-c") == 0) {
+            size_t len = safe_strnlen(argv[i + 1], sizeof(g_config.config_path) - 1);
+            memcpy(g_config.config_path, argv[i + 1], len);
+            g_config.config_path[len] = '\0';
+        }
+    }
     load_config();
 
     for (int i = 1; i < argc; i++) {
@@ -1608,6 +9504,10 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "--version") == 0) {
             printf("usbctl version %s\n", VERSION);
             return 0;
+        } else if (strcmp(argv[i], "--decode-flight") == 0) {
+            if (++i < argc) return flight_decode(argv[i]);
+            print_usage();
+            return 1;
         } else if (strcmp(argv[i], "--verbose") == 0 || strcmp(argv[i], "-v") == 0) {
             g_config.verbose_logging = 1;
         } else if (strcmp(argv[i], "--port") == 0 || strcmp(argv[i], "-p") == 0) {
@@ -1620,6 +9520,28 @@ int main(int argc, char *argv[]) {
             }
         } else if (strcmp(argv[i], "--interval") == 0 || strcmp(argv[i], "-i") == 0) {
             if (++i < argc) g_config.poll_interval = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--shards") == 0 || strcmp(argv[i], "-s") == 0) {
+            if (++i < argc) g_config.listen_shards = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--unix") == 0 || strcmp(argv[i], "-u") == 0) {
+            if (++i < argc) {
+                size_t len = safe_strnlen(argv[i], sizeof(g_config.unix_socket) - 1);
+                memcpy(g_config.unix_socket, argv[i], len);
+                g_config.unix_socket[len] = '\0';
+            }
+        } else if (strcmp(argv[i], "--backend") == 0 || strncmp(argv[i], "--backend=", 10) == 0) {
+            const char *name = argv[i][9] == '=' ? argv[i] + 10 : ++i < argc ? argv[i] : "";
+            if (strcmp(name, "sim") != 0 && strcmp(name, "usbip") != 0) {
+                fprintf(stderr, "Unknown backend: %s\n", name);
+                return 1;
+            }
+            g_sim.enabled = strcmp(name, "sim") == 0;
+        } else if (strcmp(argv[i], "--sim") == 0) {
+            if (++i < argc && !sim_config_line(argv[i])) {
+                fprintf(stderr, "Unknown simulator setting: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--unix-mode") == 0) {
+            if (++i < argc) g_config.unix_mode = (int)strtol(argv[i], NULL, 8);
         } else if (strcmp(argv[i], "--config") == 0 || strcmp(argv[i], "-c") == 0) {
             if (++i < argc) {
                 size_t len = safe_strnlen(argv[i], sizeof(g_config.config_path) - 1);
@@ -1635,10 +9557,12 @@ int main(int argc, char *argv[]) {
     }
 
     log_message("INFO", "Starting usbctl v%s", VERSION);
+    flight_init();
+    if (g_sim.enabled) sim_init();
 
     list_usbip_devices();
 
-    if (g_config.bound_devices_count > 0) {
+    if (g_config.bound_devices_count > 0 && !g_sim.enabled) {
         restore_bound_devices();
         list_usbip_devices();
     }
@@ -1651,6 +9575,7 @@ int main(int argc, char *argv[]) {
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
     signal(SIGPIPE, SIG_IGN);
+    flight_install_signals();
 #else
     signal_compat(SIGINT, signal_handler);
     signal_compat(SIGTERM, signal_handler);
@@ -1658,6 +9583,25 @@ int main(int argc, char *argv[]) {
 
     g_server_started = 1;
 
+    timer_wheel_init();
+    pthread_t wheel_thread;
+    if (pthread_create(&wheel_thread, NULL, timer_thread, NULL) != 0) {
+        log_message("ERROR", "Failed to create timer thread");
+        return 1;
+    }
+
+    // Event ids start from the clock so a Last-Event-ID left over from an
+    // earlier run never matches an event of this one
+    g_sse_last_id = (unsigned long long)time(NULL) * 1000ULL;
+    if (!sse_start_workers()) {
+        log_message("ERROR", "Failed to start SSE fan-out workers");
+        return 1;
+    }
+    if (!ws_start_commands()) {
+        log_message("ERROR", "Failed to start WebSocket command threads");
+        return 1;
+    }
+
     pthread_t poll_thread;
     if (pthread_create(&poll_thread, NULL, device_poll_thread, NULL) != 0) {
         log_message("ERROR", "Failed to create polling thread");
@@ -1667,9 +9611,12 @@ int main(int argc, char *argv[]) {
     server_thread(NULL);
 
     pthread_join(poll_thread, NULL);
+    ws_stop_commands();
+    sse_stop_workers();
+    pthread_join(wheel_thread, NULL);
 
 #ifdef PLATFORM_WINDOWS
-    DeleteCriticalSection(&g_mutex);
+    DeleteCriticalSection(&g_mutex.mutex);
 #endif
 
     return 0;